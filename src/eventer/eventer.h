@@ -39,6 +39,7 @@
 #include "mtev_atomic.h"
 #include <sys/time.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 #define EVENTER_READ             0x01
 #define EVENTER_WRITE            0x02
@@ -68,6 +69,13 @@ typedef int (*eventer_fd_write_t)
             (int, const void *, size_t, int *mask, void *closure);
 typedef int (*eventer_fd_close_t)
             (int, int *mask, void *closure);
+/* Optional; callers fall back to write if an opset leaves it NULL. */
+typedef int (*eventer_fd_writev_t)
+            (int, const struct iovec *, int, int *mask, void *closure);
+/* Optional; copies len bytes at offset of the file in_fd to the fd. */
+typedef int (*eventer_fd_sendfile_t)
+            (int, int in_fd, off_t offset, size_t len, int *mask,
+             void *closure);
 
 typedef struct _fd_opset {
   eventer_fd_accept_t accept;
@@ -75,6 +83,8 @@ typedef struct _fd_opset {
   eventer_fd_write_t  write;
   eventer_fd_close_t  close;
   const char *name;
+  eventer_fd_writev_t writev;
+  eventer_fd_sendfile_t sendfile;
 } *eventer_fd_opset_t;
 
 typedef struct _event *eventer_t;
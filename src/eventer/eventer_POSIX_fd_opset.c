@@ -37,6 +37,9 @@
 
 #include <sys/socket.h>
 #include <unistd.h>
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
 
 static int
 POSIX_accept(int fd, struct sockaddr *addr, socklen_t *len,
@@ -71,6 +74,24 @@ POSIX_write(int fd, const void *buffer, size_t len,
   return rv;
 }
 
+static int
+POSIX_writev(int fd, const struct iovec *iov, int iovcnt,
+             int *mask, void *closure) {
+  *mask = EVENTER_WRITE | EVENTER_EXCEPTION;
+  return writev(fd, iov, iovcnt);
+}
+
+#ifdef HAVE_SYS_SENDFILE_H
+static int
+POSIX_sendfile(int fd, int in_fd, off_t offset, size_t len,
+               int *mask, void *closure) {
+  *mask = EVENTER_WRITE | EVENTER_EXCEPTION;
+  return sendfile(fd, in_fd, &offset, len);
+}
+#else
+#define POSIX_sendfile NULL
+#endif
+
 static int
 POSIX_close(int fd,
             int *mask, void *closure) {
@@ -87,7 +108,9 @@ struct _fd_opset _eventer_POSIX_fd_opset = {
   POSIX_read,
   POSIX_write,
   POSIX_close,
-  "POSIX"
+  "POSIX",
+  POSIX_writev,
+  POSIX_sendfile
 };
 
 eventer_fd_opset_t eventer_POSIX_fd_opset = &_eventer_POSIX_fd_opset;
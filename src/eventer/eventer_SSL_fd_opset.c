@@ -88,6 +88,8 @@ struct eventer_ssl_ctx_t {
   void    *verify_cb_closure;
   unsigned no_more_negotiations:1;
   unsigned renegotiated:1;
+  unsigned char *alpn;    /* protocols we'll agree to, in wire format */
+  unsigned int alpn_len;
 };
 
 #define ssl_ctx ssl_ctx_cn->internal_ssl_ctx
@@ -276,6 +278,16 @@ eventer_ssl_get_session(eventer_ssl_ctx_t *ctx) {
   return SSL_get1_session(ctx->ssl);
 }
 
+void
+eventer_ssl_ctx_set_session(eventer_ssl_ctx_t *ctx, SSL_SESSION *session) {
+  if(session) SSL_set_session(ctx->ssl, session);
+}
+
+int
+eventer_ssl_session_reused(eventer_ssl_ctx_t *ctx) {
+  return SSL_session_reused(ctx->ssl);
+}
+
 int
 eventer_ssl_get_san_values(eventer_ssl_ctx_t *ctx,
                         X509_STORE_CTX *x509ctx) {
@@ -527,6 +539,7 @@ eventer_ssl_ctx_free(eventer_ssl_ctx_t *ctx) {
   if(ctx->cert_error) free(ctx->cert_error);
   if(ctx->last_error) free(ctx->last_error);
   if(ctx->san_list) free(ctx->san_list);
+  if(ctx->alpn) free(ctx->alpn);
   free(ctx);
 }
 
@@ -599,6 +612,22 @@ ssl_ctx_cache_set(ssl_ctx_cache_node *node) {
   return node;
 }
 
+#ifdef TLSEXT_TYPE_application_layer_protocol_negotiation
+/* The first of our protocols that the client also offers, if any. */
+static int
+eventer_ssl_alpn_select(SSL *ssl, const unsigned char **out,
+                        unsigned char *outlen, const unsigned char *in,
+                        unsigned int inlen, void *arg) {
+  eventer_ssl_ctx_t *ctx = SSL_get_eventer_ssl_ctx(ssl);
+  if(!ctx || !ctx->alpn) return SSL_TLSEXT_ERR_NOACK;
+  if(SSL_select_next_proto((unsigned char **)out, outlen,
+                           ctx->alpn, ctx->alpn_len,
+                           in, inlen) != OPENSSL_NPN_NEGOTIATED)
+    return SSL_TLSEXT_ERR_NOACK;
+  return SSL_TLSEXT_ERR_OK;
+}
+#endif
+
 eventer_ssl_ctx_t *
 eventer_ssl_ctx_new(eventer_ssl_orientation_t type,
                     const char *layer,
@@ -754,6 +783,10 @@ eventer_ssl_ctx_new(eventer_ssl_orientation_t type,
     }
     SSL_CTX_set_cipher_list(ctx->ssl_ctx, ciphers ? ciphers : "DEFAULT");
     SSL_CTX_set_verify(ctx->ssl_ctx, SSL_VERIFY_PEER, verify_cb);
+#ifdef TLSEXT_TYPE_application_layer_protocol_negotiation
+    if(type == SSL_SERVER)
+      SSL_CTX_set_alpn_select_cb(ctx->ssl_ctx, eventer_ssl_alpn_select, NULL);
+#endif
     existing_ctx_cn = ssl_ctx_cache_set(ctx->ssl_ctx_cn);
     if(existing_ctx_cn != ctx->ssl_ctx_cn) {
       ssl_ctx_cache_node_free(ctx->ssl_ctx_cn);
@@ -834,6 +867,38 @@ eventer_ssl_ctx_set_sni(eventer_ssl_ctx_t *ctx, const char *snivalue) {
 #endif
 }
 
+void
+eventer_ssl_ctx_set_alpn(eventer_ssl_ctx_t *ctx, const char *protocols) {
+  const char *cp, *end;
+  unsigned char *wire;
+  free(ctx->alpn);
+  ctx->alpn = NULL;
+  ctx->alpn_len = 0;
+  if(!protocols || !*protocols) return;
+  /* "h2,http/1.1" becomes "\x02h2\x08http/1.1" */
+  wire = malloc(strlen(protocols) + 1);
+  for(cp = protocols; *cp; cp = *end ? end + 1 : end) {
+    end = strchr(cp, ',');
+    if(!end) end = cp + strlen(cp);
+    if(end - cp == 0 || end - cp > 255) continue;
+    wire[ctx->alpn_len++] = end - cp;
+    memcpy(wire + ctx->alpn_len, cp, end - cp);
+    ctx->alpn_len += end - cp;
+  }
+  if(ctx->alpn_len) ctx->alpn = wire;
+  else free(wire);
+}
+
+const char *
+eventer_ssl_get_alpn_selected(eventer_ssl_ctx_t *ctx, unsigned int *len) {
+  const unsigned char *proto = NULL;
+  *len = 0;
+#ifdef TLSEXT_TYPE_application_layer_protocol_negotiation
+  if(ctx->ssl) SSL_get0_alpn_selected(ctx->ssl, &proto, len);
+#endif
+  return (const char *)proto;
+}
+
 void
 eventer_ssl_ctx_set_verify(eventer_ssl_ctx_t *ctx,
                            eventer_ssl_verify_func_t f, void *c) {
@@ -854,6 +919,7 @@ static int
 eventer_SSL_setup(eventer_ssl_ctx_t *ctx) {
   X509 *peer = NULL;
   SSL_set_mode(ctx->ssl, SSL_MODE_ENABLE_PARTIAL_WRITE);
+  SSL_set_mode(ctx->ssl, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
   peer = SSL_get_peer_certificate(ctx->ssl);
 
   /* If have no peer, or the peer cert isn't okay, our
@@ -997,6 +1063,30 @@ eventer_SSL_write(int fd, const void *buffer, size_t len, int *mask,
   return rv;
 }
 
+/* There is no gathering SSL_write, so coalesce up to one record's worth
+ * into a single write.  A retry after WANT_WRITE may gather the same bytes
+ * into a different buffer (or more of them), which is why the session is
+ * in ACCEPT_MOVING_WRITE_BUFFER mode.
+ */
+#define SSL_WRITEV_COALESCE 16384
+static int
+eventer_SSL_writev(int fd, const struct iovec *iov, int iovcnt, int *mask,
+                   void *closure) {
+  char buffer[SSL_WRITEV_COALESCE];
+  size_t len = 0;
+  int i;
+
+  if(iovcnt == 1 || iov[0].iov_len >= sizeof(buffer))
+    return eventer_SSL_write(fd, iov[0].iov_base, iov[0].iov_len,
+                             mask, closure);
+  for(i=0; i<iovcnt && len < sizeof(buffer); i++) {
+    size_t part = MIN(iov[i].iov_len, sizeof(buffer) - len);
+    memcpy(buffer + len, iov[i].iov_base, part);
+    len += part;
+  }
+  return eventer_SSL_write(fd, buffer, len, mask, closure);
+}
+
 /* Close simply shuts down the SSL site and closes the file descriptor. */
 static int
 eventer_SSL_close(int fd, int *mask, void *closure) {
@@ -1018,7 +1108,8 @@ struct _fd_opset _eventer_SSL_fd_opset = {
   eventer_SSL_read,
   eventer_SSL_write,
   eventer_SSL_close,
-  "SSL"
+  "SSL",
+  eventer_SSL_writev
 };
 
 eventer_fd_opset_t eventer_SSL_fd_opset = &_eventer_SSL_fd_opset;
@@ -82,6 +82,24 @@ API_EXPORT(void)
 API_EXPORT(void)
   eventer_ssl_ctx_set_sni(eventer_ssl_ctx_t *ctx, const char *snivalue);
 
+/* protocols is a comma separated list in order of our preference,
+ * e.g. "h2,http/1.1"; servers only. */
+API_EXPORT(void)
+  eventer_ssl_ctx_set_alpn(eventer_ssl_ctx_t *ctx, const char *protocols);
+
+/* The negotiated protocol (not NUL terminated) or NULL. */
+API_EXPORT(const char *)
+  eventer_ssl_get_alpn_selected(eventer_ssl_ctx_t *ctx, unsigned int *len);
+
+/* Offer a session saved from an earlier connection (clients only);
+ * the ctx takes its own reference. */
+API_EXPORT(void)
+  eventer_ssl_ctx_set_session(eventer_ssl_ctx_t *ctx, SSL_SESSION *session);
+
+/* Did the handshake resume the offered session? */
+API_EXPORT(int)
+  eventer_ssl_session_reused(eventer_ssl_ctx_t *ctx);
+
 API_EXPORT(void)
   eventer_ssl_ctx_set_verify(eventer_ssl_ctx_t *ctx,
                              eventer_ssl_verify_func_t f, void *c);
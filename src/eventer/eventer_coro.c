@@ -0,0 +1,378 @@
+/*
+ * Copyright (c) 2014-2015, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *    * Neither the name Circonus, Inc. nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "mtev_defines.h"
+#include "mtev_log.h"
+#include "eventer/eventer.h"
+#include "eventer/eventer_coro.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef HAVE_UCONTEXT_H
+#include <ucontext.h>
+#endif
+#include <sys/mman.h>
+
+#ifndef MAP_ANON
+#define MAP_ANON MAP_ANONYMOUS
+#endif
+
+#define EVENTER_CORO_DEFAULT_STACK (64*1024)
+#define EVENTER_CORO_POOL_MAX 64
+
+static size_t coro_stack_size = EVENTER_CORO_DEFAULT_STACK;
+
+#ifdef HAVE_UCONTEXT_H
+
+struct eventer_coro {
+  ucontext_t          ctx;
+  ucontext_t         *caller;   /* where to go when we yield */
+  void               *stack;    /* mapping, guard page first */
+  size_t              stack_len;
+  eventer_coro_func_t func;
+  void               *closure;
+  int                 done;
+  int                 fired;    /* result of the current await */
+  eventer_t           proxy;    /* fd event we're waiting on */
+  eventer_t           timer;    /* timeout or sleep */
+  struct eventer_coro *next;    /* pool */
+};
+
+/* Coroutines never leave the thread that spawned them, so both the
+ * notion of "current" and the pool of stacks are per-thread.
+ */
+static __thread eventer_coro_t *coro_current;
+static __thread eventer_coro_t *coro_pool;
+static __thread int coro_pool_len;
+
+static size_t
+eventer_coro_pagesize() {
+  static size_t pagesize;
+  if(!pagesize) pagesize = sysconf(_SC_PAGESIZE);
+  return pagesize;
+}
+
+static size_t
+eventer_coro_mapping_len() {
+  size_t pagesize = eventer_coro_pagesize();
+  return ((coro_stack_size + pagesize - 1) & ~(pagesize - 1)) + pagesize;
+}
+
+static void
+eventer_coro_destroy(eventer_coro_t *co) {
+  munmap(co->stack, co->stack_len);
+  free(co);
+}
+
+static eventer_coro_t *
+eventer_coro_alloc() {
+  eventer_coro_t *co;
+  void *stack;
+  size_t len = eventer_coro_mapping_len();
+
+  while((co = coro_pool) != NULL) {
+    coro_pool = co->next;
+    coro_pool_len--;
+    if(co->stack_len == len) {
+      stack = co->stack;
+      memset(co, 0, sizeof(*co));
+      co->stack = stack;
+      co->stack_len = len;
+      return co;
+    }
+    /* The stack size was changed since this was pooled. */
+    eventer_coro_destroy(co);
+  }
+
+  stack = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
+  if(stack == MAP_FAILED) {
+    mtevL(eventer_err, "coro: cannot map %llu byte stack: %s\n",
+          (unsigned long long)len, strerror(errno));
+    return NULL;
+  }
+  /* Stacks grow down on everything we run on; an overrun faults here
+   * instead of quietly scribbling on whatever was mapped below. */
+  if(mprotect(stack, eventer_coro_pagesize(), PROT_NONE) != 0) {
+    mtevL(eventer_err, "coro: cannot protect stack guard: %s\n",
+          strerror(errno));
+    munmap(stack, len);
+    return NULL;
+  }
+  co = calloc(1, sizeof(*co));
+  co->stack = stack;
+  co->stack_len = len;
+  return co;
+}
+
+static void
+eventer_coro_release(eventer_coro_t *co) {
+  if(coro_pool_len >= EVENTER_CORO_POOL_MAX) {
+    eventer_coro_destroy(co);
+    return;
+  }
+  co->next = coro_pool;
+  coro_pool = co;
+  coro_pool_len++;
+}
+
+static void
+eventer_coro_main() {
+  eventer_coro_t *co = coro_current;
+  co->func(co->closure);
+  co->done = 1;
+  /* Never resumed; the stack is recycled by eventer_coro_resume. */
+  swapcontext(&co->ctx, co->caller);
+  abort();
+}
+
+static void
+eventer_coro_resume(eventer_coro_t *co) {
+  eventer_coro_t *prev = coro_current;
+  ucontext_t here;
+
+  co->caller = &here;
+  coro_current = co;
+  swapcontext(&here, &co->ctx);
+  coro_current = prev;
+  if(co->done) eventer_coro_release(co);
+}
+
+static void
+eventer_coro_yield(eventer_coro_t *co) {
+  swapcontext(&co->ctx, co->caller);
+}
+
+int
+eventer_coro_spawn(eventer_coro_func_t f, void *closure) {
+  eventer_coro_t *co;
+
+  if((co = eventer_coro_alloc()) == NULL) return -1;
+  co->func = f;
+  co->closure = closure;
+  if(getcontext(&co->ctx) != 0) {
+    eventer_coro_release(co);
+    return -1;
+  }
+  co->ctx.uc_link = NULL;
+  co->ctx.uc_stack.ss_sp = (char *)co->stack + eventer_coro_pagesize();
+  co->ctx.uc_stack.ss_size = co->stack_len - eventer_coro_pagesize();
+  makecontext(&co->ctx, eventer_coro_main, 0);
+  eventer_coro_resume(co);
+  return 0;
+}
+
+eventer_coro_t *
+eventer_coro_self() {
+  return coro_current;
+}
+
+static void
+eventer_coro_disarm(eventer_coro_t *co) {
+  if(co->timer) {
+    if(eventer_remove(co->timer)) eventer_free(co->timer);
+    co->timer = NULL;
+  }
+}
+
+static int
+eventer_coro_timeout(eventer_t e, int mask, void *closure,
+                     struct timeval *now) {
+  eventer_coro_t *co = closure;
+  co->timer = NULL;
+  if(co->proxy) {
+    if(eventer_find_fd(co->proxy->fd) == co->proxy)
+      eventer_remove_fd(co->proxy->fd);
+    eventer_free(co->proxy);
+    co->proxy = NULL;
+  }
+  co->fired = 0;
+  eventer_coro_resume(co);
+  return 0;
+}
+
+static void
+eventer_coro_arm(eventer_coro_t *co, struct timeval *rel) {
+  struct timeval now;
+  co->timer = eventer_alloc();
+  gettimeofday(&now, NULL);
+  add_timeval(now, *rel, &co->timer->whence);
+  co->timer->mask = EVENTER_TIMER;
+  co->timer->callback = eventer_coro_timeout;
+  co->timer->closure = co;
+  eventer_add(co->timer);
+}
+
+/* The proxy is taken out of the loop before the coroutine runs: it is free
+ * to close the fd, or to await it again (which schedules a new proxy).
+ */
+static int
+eventer_coro_fd_ready(eventer_t e, int mask, void *closure,
+                      struct timeval *now) {
+  eventer_coro_t *co = closure;
+  if(eventer_find_fd(e->fd) == e) eventer_remove_fd(e->fd);
+  co->proxy = NULL;
+  eventer_coro_disarm(co);
+  co->fired = mask;
+  eventer_coro_resume(co);
+  return 0;
+}
+
+int
+eventer_coro_await_fd(eventer_t e, int mask, struct timeval *timeout) {
+  eventer_coro_t *co = coro_current;
+  eventer_t proxy;
+
+  assert(co);
+  assert(mask & (EVENTER_READ|EVENTER_WRITE|EVENTER_EXCEPTION));
+  proxy = eventer_alloc();
+  proxy->fd = e->fd;
+  proxy->opset = e->opset;
+  proxy->opset_ctx = e->opset_ctx;
+  proxy->mask = mask;
+  proxy->callback = eventer_coro_fd_ready;
+  proxy->closure = co;
+  co->proxy = proxy;
+  co->fired = 0;
+  eventer_add(proxy);
+  if(timeout) eventer_coro_arm(co, timeout);
+  eventer_coro_yield(co);
+  return co->fired;
+}
+
+int
+eventer_coro_read(eventer_t e, void *buf, size_t len,
+                  struct timeval *timeout) {
+  int rv, mask;
+  while(1) {
+    rv = e->opset->read(e->fd, buf, len, &mask, e);
+    if(rv >= 0 || errno != EAGAIN) return rv;
+    if(!eventer_coro_await_fd(e, mask | EVENTER_EXCEPTION, timeout)) {
+      errno = ETIMEDOUT;
+      return -1;
+    }
+  }
+}
+
+int
+eventer_coro_write(eventer_t e, const void *buf, size_t len,
+                   struct timeval *timeout) {
+  int rv, mask;
+  while(1) {
+    rv = e->opset->write(e->fd, buf, len, &mask, e);
+    if(rv >= 0 || errno != EAGAIN) return rv;
+    if(!eventer_coro_await_fd(e, mask | EVENTER_EXCEPTION, timeout)) {
+      errno = ETIMEDOUT;
+      return -1;
+    }
+  }
+}
+
+void
+eventer_coro_sleep(struct timeval *delay) {
+  eventer_coro_t *co = coro_current;
+  assert(co);
+  eventer_coro_arm(co, delay);
+  eventer_coro_yield(co);
+}
+
+struct coro_asynch {
+  eventer_coro_t *co;
+  void (*work)(void *);
+  void *closure;
+  int completed;
+};
+
+static int
+eventer_coro_asynch_cb(eventer_t e, int mask, void *closure,
+                       struct timeval *now) {
+  struct coro_asynch *a = closure;
+  if(mask == EVENTER_ASYNCH_WORK) {
+    a->work(a->closure);
+    a->completed = 1;
+  }
+  if(mask == EVENTER_ASYNCH) eventer_coro_resume(a->co);
+  return 0;
+}
+
+int
+eventer_coro_asynch(eventer_jobq_t *q, void (*work)(void *), void *closure,
+                    struct timeval *deadline) {
+  /* This lives on our stack, which is parked until the job comes back. */
+  struct coro_asynch a = { coro_current, work, closure, 0 };
+  eventer_t e;
+
+  assert(a.co);
+  e = eventer_alloc();
+  e->mask = EVENTER_ASYNCH;
+  e->callback = eventer_coro_asynch_cb;
+  e->closure = &a;
+  if(deadline) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    add_timeval(now, *deadline, &e->whence);
+  }
+  eventer_add_asynch(q, e);
+  eventer_coro_yield(a.co);
+  return a.completed ? 0 : -1;
+}
+
+#else
+
+int
+eventer_coro_spawn(eventer_coro_func_t f, void *closure) {
+  mtevL(eventer_err, "coro: not supported on this platform\n");
+  return -1;
+}
+eventer_coro_t *eventer_coro_self() { return NULL; }
+int eventer_coro_await_fd(eventer_t e, int mask, struct timeval *t) {
+  abort();
+}
+int eventer_coro_read(eventer_t e, void *b, size_t l, struct timeval *t) {
+  abort();
+}
+int eventer_coro_write(eventer_t e, const void *b, size_t l,
+                       struct timeval *t) {
+  abort();
+}
+void eventer_coro_sleep(struct timeval *d) { abort(); }
+int eventer_coro_asynch(eventer_jobq_t *q, void (*w)(void *), void *c,
+                        struct timeval *d) {
+  abort();
+}
+
+#endif
+
+void
+eventer_coro_set_stack_size(size_t size) {
+  coro_stack_size = size;
+}
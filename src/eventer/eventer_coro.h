@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2014-2015, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *    * Neither the name Circonus, Inc. nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _EVENTER_EVENTER_CORO_H
+#define _EVENTER_EVENTER_CORO_H
+
+#include "mtev_defines.h"
+#include "eventer/eventer.h"
+#include <sys/time.h>
+
+/* Coroutines run on the eventer loop thread that spawned them.  Each has
+ * its own (pooled, guard-paged) stack and may block in any of the await
+ * calls below; blocking yields back to the loop, which resumes the
+ * coroutine when the awaited condition fires.  There is no preemption:
+ * between awaits a coroutine has the loop to itself, just as a callback
+ * would.
+ *
+ * The await calls may only be made from within a coroutine.
+ */
+
+typedef struct eventer_coro eventer_coro_t;
+typedef void (*eventer_coro_func_t)(void *closure);
+
+/* Start f(closure) on the calling loop thread.  It runs immediately until
+ * its first await (or completion) and eventer_coro_spawn returns then.
+ * Returns -1 if coroutines are not supported or no stack is available.
+ */
+API_EXPORT(int) eventer_coro_spawn(eventer_coro_func_t f, void *closure);
+
+/* The running coroutine, or NULL if called from plain callback context. */
+API_EXPORT(eventer_coro_t *) eventer_coro_self();
+
+/* Wait for mask (EVENTER_READ|WRITE|EXCEPTION) on e->fd.  e itself is not
+ * scheduled; it need only carry the fd (and opset).  Returns the mask that
+ * fired, or 0 if timeout (relative, NULL for none) elapsed first.
+ */
+API_EXPORT(int) eventer_coro_await_fd(eventer_t e, int mask,
+                                      struct timeval *timeout);
+
+/* Read/write through e's opset, awaiting as the opset requests whenever it
+ * would block.  Return as the opset does; on timeout, -1 with ETIMEDOUT.
+ */
+API_EXPORT(int) eventer_coro_read(eventer_t e, void *buf, size_t len,
+                                  struct timeval *timeout);
+API_EXPORT(int) eventer_coro_write(eventer_t e, const void *buf, size_t len,
+                                   struct timeval *timeout);
+
+/* Sleep for the relative time given. */
+API_EXPORT(void) eventer_coro_sleep(struct timeval *delay);
+
+/* Run work(closure) on jobq q (NULL for the default queue) and await its
+ * completion.  deadline, if given, is relative and handled by the jobq as
+ * with any asynch event.  Returns 0 if the work ran to completion and -1
+ * if it was aborted.
+ */
+API_EXPORT(int) eventer_coro_asynch(eventer_jobq_t *q,
+                                    void (*work)(void *), void *closure,
+                                    struct timeval *deadline);
+
+/* Set the usable stack size of coroutines spawned hereafter. */
+API_EXPORT(void) eventer_coro_set_stack_size(size_t size);
+
+#endif
@@ -0,0 +1,402 @@
+/*
+ * Copyright (c) 2014-2015, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *    * Neither the name Circonus, Inc. nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "mtev_defines.h"
+#include "mtev_log.h"
+#include "mtev_atomic.h"
+#include "eventer/eventer.h"
+#include "eventer/eventer_future.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct future_waiter;
+typedef void (*future_notify_t)(eventer_future_t *, struct future_waiter *);
+
+struct future_waiter {
+  future_notify_t          notify;
+  eventer_future_t        *target;   /* derived future, referenced */
+  union {
+    eventer_future_then_t    then;
+    eventer_future_settled_t settled;
+    eventer_future_work_t    work;
+  } cb;
+  void                    *closure;
+  eventer_jobq_t          *jobq;
+  struct future_waiter    *next;
+};
+
+struct eventer_future {
+  int                     refcnt;
+  eventer_future_state_t  state;
+  mtev_atomic32_t         cancelled;
+  void                   *result;
+  pthread_t               owner;
+  struct timeval          deadline;
+  eventer_t               timer;
+  struct future_waiter   *waiters;
+  /* fan-in */
+  eventer_future_t      **inputs;
+  int                     ninputs;
+  int                     remaining;
+};
+
+struct future_job {
+  eventer_future_t       *f;
+  eventer_future_work_t   work;
+  void                   *input;
+  void                   *closure;
+  void                   *result;
+  int                     ran;
+};
+
+#define HAS_DEADLINE(f) ((f)->deadline.tv_sec || (f)->deadline.tv_usec)
+
+static void eventer_future_settle(eventer_future_t *, eventer_future_state_t,
+                                  void *);
+
+static void
+eventer_future_assert_owner(eventer_future_t *f) {
+  assert(pthread_equal(f->owner, pthread_self()));
+}
+
+static int
+eventer_future_deadline_cb(eventer_t e, int mask, void *closure,
+                           struct timeval *now) {
+  eventer_future_t *f = closure;
+  f->timer = NULL;
+  mtev_atomic_inc32(&f->cancelled);
+  eventer_future_settle(f, EVENTER_FUTURE_TIMEDOUT, NULL);
+  return 0;
+}
+
+/* Adopt deadline (absolute) if it is earlier than what f has. */
+static void
+eventer_future_tighten(eventer_future_t *f, struct timeval *deadline) {
+  if(!deadline || !(deadline->tv_sec || deadline->tv_usec)) return;
+  if(HAS_DEADLINE(f) && compare_timeval(*deadline, f->deadline) >= 0) return;
+  f->deadline = *deadline;
+  if(f->timer) {
+    if(eventer_remove(f->timer)) eventer_free(f->timer);
+    f->timer = NULL;
+  }
+  f->timer = eventer_alloc();
+  f->timer->mask = EVENTER_TIMER;
+  f->timer->whence = f->deadline;
+  f->timer->callback = eventer_future_deadline_cb;
+  f->timer->closure = f;
+  eventer_add(f->timer);
+}
+
+static void
+eventer_future_tighten_rel(eventer_future_t *f, struct timeval *rel) {
+  struct timeval now, deadline;
+  if(!rel) return;
+  gettimeofday(&now, NULL);
+  add_timeval(now, *rel, &deadline);
+  eventer_future_tighten(f, &deadline);
+}
+
+/* The new future's first reference is the caller's, the second is held
+ * on its own behalf until it settles.
+ */
+static eventer_future_t *
+eventer_future_alloc() {
+  eventer_future_t *f = calloc(1, sizeof(*f));
+  f->refcnt = 2;
+  f->owner = pthread_self();
+  return f;
+}
+
+static void
+eventer_future_ref(eventer_future_t *f) {
+  f->refcnt++;
+}
+
+void
+eventer_future_release(eventer_future_t *f) {
+  int i;
+  eventer_future_assert_owner(f);
+  if(--f->refcnt > 0) return;
+  assert(f->state != EVENTER_FUTURE_PENDING);
+  for(i=0; i<f->ninputs; i++) eventer_future_release(f->inputs[i]);
+  free(f->inputs);
+  free(f);
+}
+
+static void
+eventer_future_settle(eventer_future_t *f, eventer_future_state_t state,
+                      void *result) {
+  struct future_waiter *w, *list = NULL;
+  if(f->state != EVENTER_FUTURE_PENDING) return;
+  f->state = state;
+  f->result = result;
+  if(f->timer) {
+    if(eventer_remove(f->timer)) eventer_free(f->timer);
+    f->timer = NULL;
+  }
+  /* waiters were pushed; notify in the order they were added */
+  while((w = f->waiters) != NULL) {
+    f->waiters = w->next;
+    w->next = list;
+    list = w;
+  }
+  while((w = list) != NULL) {
+    list = w->next;
+    w->notify(f, w);
+    if(w->target) eventer_future_release(w->target);
+    free(w);
+  }
+  if(state == EVENTER_FUTURE_CANCELLED) {
+    int i;
+    for(i=0; i<f->ninputs; i++) eventer_future_cancel(f->inputs[i]);
+  }
+  eventer_future_release(f);
+}
+
+static void
+eventer_future_wait(eventer_future_t *f, struct future_waiter *w) {
+  if(w->target) eventer_future_ref(w->target);
+  if(f->state != EVENTER_FUTURE_PENDING) {
+    w->notify(f, w);
+    if(w->target) eventer_future_release(w->target);
+    free(w);
+    return;
+  }
+  w->next = f->waiters;
+  f->waiters = w;
+}
+
+static int
+eventer_future_asynch_cb(eventer_t e, int mask, void *closure,
+                         struct timeval *now) {
+  struct future_job *job = closure;
+  eventer_future_t *f = job->f;
+
+  if(mask == EVENTER_ASYNCH_WORK) {
+    if(!eventer_future_is_cancelled(f)) {
+      job->result = job->work(f, job->input, job->closure);
+      job->ran = 1;
+    }
+  }
+  if(mask == EVENTER_ASYNCH) {
+    /* If this settled early (deadline, cancel) this is a no-op. */
+    eventer_future_settle(f, job->ran ? EVENTER_FUTURE_RESOLVED
+                                      : EVENTER_FUTURE_TIMEDOUT,
+                          job->result);
+    eventer_future_release(f);
+    free(job);
+  }
+  return 0;
+}
+
+static void
+eventer_future_launch(eventer_future_t *f, eventer_jobq_t *q,
+                      eventer_future_work_t work, void *closure,
+                      void *input) {
+  struct future_job *job;
+  eventer_t e;
+
+  job = calloc(1, sizeof(*job));
+  job->f = f;
+  job->work = work;
+  job->closure = closure;
+  job->input = input;
+  eventer_future_ref(f);
+
+  e = eventer_alloc();
+  e->mask = EVENTER_ASYNCH;
+  e->callback = eventer_future_asynch_cb;
+  e->closure = job;
+  e->whence = f->deadline;
+  e->thr_owner = f->owner;
+  eventer_add_asynch(q, e);
+}
+
+eventer_future_t *
+eventer_future_run(eventer_jobq_t *q, eventer_future_work_t work,
+                   void *closure, struct timeval *deadline) {
+  eventer_future_t *f = eventer_future_alloc();
+  eventer_future_tighten_rel(f, deadline);
+  eventer_future_launch(f, q, work, closure, NULL);
+  return f;
+}
+
+static void
+eventer_future_then_notify(eventer_future_t *src, struct future_waiter *w) {
+  if(w->target->state != EVENTER_FUTURE_PENDING) return;
+  if(src->state != EVENTER_FUTURE_RESOLVED) {
+    eventer_future_settle(w->target, src->state, NULL);
+    return;
+  }
+  eventer_future_settle(w->target, EVENTER_FUTURE_RESOLVED,
+                        w->cb.then(src->result, w->closure));
+}
+
+eventer_future_t *
+eventer_future_then(eventer_future_t *f, eventer_future_then_t cb,
+                    void *closure) {
+  eventer_future_t *d;
+  struct future_waiter *w;
+
+  eventer_future_assert_owner(f);
+  d = eventer_future_alloc();
+  eventer_future_tighten(d, &f->deadline);
+  w = calloc(1, sizeof(*w));
+  w->notify = eventer_future_then_notify;
+  w->target = d;
+  w->cb.then = cb;
+  w->closure = closure;
+  eventer_future_wait(f, w);
+  return d;
+}
+
+static void
+eventer_future_then_asynch_notify(eventer_future_t *src,
+                                  struct future_waiter *w) {
+  if(w->target->state != EVENTER_FUTURE_PENDING) return;
+  if(src->state != EVENTER_FUTURE_RESOLVED) {
+    eventer_future_settle(w->target, src->state, NULL);
+    return;
+  }
+  eventer_future_launch(w->target, w->jobq, w->cb.work, w->closure,
+                        src->result);
+}
+
+eventer_future_t *
+eventer_future_then_asynch(eventer_future_t *f, eventer_jobq_t *q,
+                           eventer_future_work_t work, void *closure,
+                           struct timeval *deadline) {
+  eventer_future_t *d;
+  struct future_waiter *w;
+
+  eventer_future_assert_owner(f);
+  d = eventer_future_alloc();
+  eventer_future_tighten(d, &f->deadline);
+  eventer_future_tighten_rel(d, deadline);
+  w = calloc(1, sizeof(*w));
+  w->notify = eventer_future_then_asynch_notify;
+  w->target = d;
+  w->cb.work = work;
+  w->closure = closure;
+  w->jobq = q;
+  eventer_future_wait(f, w);
+  return d;
+}
+
+static void
+eventer_future_all_notify(eventer_future_t *src, struct future_waiter *w) {
+  eventer_future_t *d = w->target;
+  int i;
+  if(d->state != EVENTER_FUTURE_PENDING) return;
+  if(src->state != EVENTER_FUTURE_RESOLVED) {
+    eventer_future_settle(d, src->state, NULL);
+    /* the others can no longer matter */
+    for(i=0; i<d->ninputs; i++) eventer_future_cancel(d->inputs[i]);
+    return;
+  }
+  if(--d->remaining == 0)
+    eventer_future_settle(d, EVENTER_FUTURE_RESOLVED, NULL);
+}
+
+eventer_future_t *
+eventer_future_all(eventer_future_t **fs, int n) {
+  eventer_future_t *d;
+  int i;
+
+  d = eventer_future_alloc();
+  d->inputs = calloc(n ? n : 1, sizeof(*d->inputs));
+  d->ninputs = n;
+  d->remaining = n;
+  for(i=0; i<n; i++) {
+    eventer_future_assert_owner(fs[i]);
+    eventer_future_ref(fs[i]);
+    d->inputs[i] = fs[i];
+    eventer_future_tighten(d, &fs[i]->deadline);
+  }
+  if(n == 0) {
+    eventer_future_settle(d, EVENTER_FUTURE_RESOLVED, NULL);
+    return d;
+  }
+  for(i=0; i<n && d->state == EVENTER_FUTURE_PENDING; i++) {
+    struct future_waiter *w = calloc(1, sizeof(*w));
+    w->notify = eventer_future_all_notify;
+    w->target = d;
+    eventer_future_wait(fs[i], w);
+  }
+  return d;
+}
+
+static void
+eventer_future_settled_notify(eventer_future_t *src,
+                              struct future_waiter *w) {
+  w->cb.settled(src, w->closure);
+}
+
+void
+eventer_future_on_settled(eventer_future_t *f, eventer_future_settled_t cb,
+                          void *closure) {
+  struct future_waiter *w;
+  eventer_future_assert_owner(f);
+  w = calloc(1, sizeof(*w));
+  w->notify = eventer_future_settled_notify;
+  w->cb.settled = cb;
+  w->closure = closure;
+  eventer_future_wait(f, w);
+}
+
+void
+eventer_future_cancel(eventer_future_t *f) {
+  eventer_future_assert_owner(f);
+  if(f->state != EVENTER_FUTURE_PENDING) return;
+  mtev_atomic_inc32(&f->cancelled);
+  eventer_future_settle(f, EVENTER_FUTURE_CANCELLED, NULL);
+}
+
+eventer_future_state_t
+eventer_future_state(eventer_future_t *f) {
+  return f->state;
+}
+
+void *
+eventer_future_result(eventer_future_t *f) {
+  return f->result;
+}
+
+int
+eventer_future_is_cancelled(eventer_future_t *f) {
+  return f->cancelled != 0;
+}
+
+void
+eventer_future_deadline(eventer_future_t *f, struct timeval *deadline) {
+  *deadline = f->deadline;
+}
@@ -0,0 +1,122 @@
+/*
+ * Copyright (c) 2014-2015, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *    * Neither the name Circonus, Inc. nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _EVENTER_EVENTER_FUTURE_H
+#define _EVENTER_EVENTER_FUTURE_H
+
+#include "mtev_defines.h"
+#include "eventer/eventer.h"
+#include <sys/time.h>
+
+/* A future is the eventual result of work run on a jobq.  Futures belong
+ * to the loop thread that created them: every call here must be made on
+ * that thread, and every continuation runs there.  Only the work function
+ * itself runs on the jobq (and may poll eventer_future_is_cancelled).
+ *
+ * Each call returning a future hands the caller one reference, dropped
+ * with eventer_future_release.  A future stays alive, regardless, until
+ * it has settled.
+ *
+ * Deadlines are absolute and propagate: a future derived from others is
+ * bounded by the earliest of their deadlines, and work started for it is
+ * given that deadline on its jobq.  A future that reaches its deadline
+ * settles as TIMEDOUT.
+ */
+
+typedef enum {
+  EVENTER_FUTURE_PENDING = 0,
+  EVENTER_FUTURE_RESOLVED,
+  EVENTER_FUTURE_TIMEDOUT,
+  EVENTER_FUTURE_CANCELLED
+} eventer_future_state_t;
+
+typedef struct eventer_future eventer_future_t;
+
+/* Runs on a jobq.  input is the result of the future this one continues
+ * (NULL for eventer_future_run); the return value is the result.
+ */
+typedef void *(*eventer_future_work_t)(eventer_future_t *f, void *input,
+                                       void *closure);
+/* Runs on the owning loop once the source future has resolved; the return
+ * value is the result of the derived future.
+ */
+typedef void *(*eventer_future_then_t)(void *result, void *closure);
+/* Runs on the owning loop once the future has settled, in any state. */
+typedef void (*eventer_future_settled_t)(eventer_future_t *f, void *closure);
+
+/* Run work on q (NULL for the default queue).  deadline is relative, or
+ * NULL for none.
+ */
+API_EXPORT(eventer_future_t *)
+  eventer_future_run(eventer_jobq_t *q, eventer_future_work_t work,
+                     void *closure, struct timeval *deadline);
+
+/* Continue f on the loop.  If f does not resolve, neither is cb called;
+ * the derived future settles as f did.
+ */
+API_EXPORT(eventer_future_t *)
+  eventer_future_then(eventer_future_t *f, eventer_future_then_t cb,
+                      void *closure);
+
+/* Continue f with more work on q, fed f's result.  deadline, relative, may
+ * only tighten the one inherited from f.
+ */
+API_EXPORT(eventer_future_t *)
+  eventer_future_then_asynch(eventer_future_t *f, eventer_jobq_t *q,
+                             eventer_future_work_t work, void *closure,
+                             struct timeval *deadline);
+
+/* Fan-in: resolves (with a NULL result) once all n futures have resolved.
+ * If any of them does not, the rest are cancelled and this settles as
+ * that one did.  Read the individual results from the inputs.
+ */
+API_EXPORT(eventer_future_t *)
+  eventer_future_all(eventer_future_t **fs, int n);
+
+/* Observe settlement.  Called immediately if f has already settled. */
+API_EXPORT(void)
+  eventer_future_on_settled(eventer_future_t *f, eventer_future_settled_t cb,
+                            void *closure);
+
+/* Settle a pending future as CANCELLED.  Work not yet started is skipped;
+ * work in progress runs on but its result is dropped.  Futures derived
+ * from f settle CANCELLED in turn; the inputs of an eventer_future_all
+ * are cancelled as well.
+ */
+API_EXPORT(void) eventer_future_cancel(eventer_future_t *f);
+
+API_EXPORT(eventer_future_state_t) eventer_future_state(eventer_future_t *f);
+API_EXPORT(void *) eventer_future_result(eventer_future_t *f);
+API_EXPORT(int) eventer_future_is_cancelled(eventer_future_t *f);
+API_EXPORT(void) eventer_future_deadline(eventer_future_t *f,
+                                         struct timeval *deadline);
+API_EXPORT(void) eventer_future_release(eventer_future_t *f);
+
+#endif
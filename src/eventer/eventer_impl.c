@@ -33,6 +33,7 @@
 
 #include "mtev_defines.h"
 #include "eventer/eventer.h"
+#include "eventer/eventer_coro.h"
 #include "mtev_memory.h"
 #include "mtev_log.h"
 #include "mtev_skiplist.h"
@@ -101,6 +102,7 @@ mtev_log_stream_t eventer_err = NULL;
 mtev_log_stream_t eventer_deb = NULL;
 
 static int __default_queue_threads = 5;
+static int __shared_queue_threads = 0;
 static int __loop_concurrency = 0;
 static mtev_atomic32_t __loops_started = 0;
 static eventer_jobq_t __default_jobq;
@@ -177,6 +179,23 @@ int eventer_impl_propset(const char *key, const char *value) {
     }
     return 0;
   }
+  else if(!strcasecmp(key, "shared_queue_threads")) {
+    __shared_queue_threads = atoi(value);
+    if(__shared_queue_threads < 1) {
+      mtevL(mtev_error, "shared_queue_threads must be >= 1\n");
+      return -1;
+    }
+    return 0;
+  }
+  else if(!strcasecmp(key, "coroutine_stack_size")) {
+    int size = atoi(value);
+    if(size < 16384) {
+      mtevL(mtev_error, "coroutine_stack_size must be >= 16384\n");
+      return -1;
+    }
+    eventer_coro_set_stack_size(size);
+    return 0;
+  }
   else if(!strcasecmp(key, "rlim_nofiles")) {
     desired_nofiles = atoi(value);
     if(desired_nofiles < 256) {
@@ -384,6 +403,9 @@ int eventer_impl_init() {
   if(!eventer_deb) eventer_deb = mtev_debug;
 
   eventer_jobq_init(&__default_jobq, "default_queue");
+  /* Workers for queues marked shared; spawned only as such work arrives */
+  if(__shared_queue_threads <= 0) __shared_queue_threads = __loop_concurrency;
+  eventer_jobq_set_shared_threads(__shared_queue_threads);
   for(i=0; i<__default_queue_threads; i++)
     eventer_jobq_increase_concurrency(&__default_jobq);
 
@@ -400,21 +422,13 @@ void eventer_add_asynch(eventer_jobq_t *q, eventer_t e) {
   eventer_job_t *job;
   /* always use 0, if unspecified */
   if(!eventer_is_loop(e->thr_owner)) e->thr_owner = eventer_impl_tls_data[0].tid;
-  job = calloc(1, sizeof(*job));
+  job = eventer_jobq_job_alloc();
   job->fd_event = e;
   job->jobq = q ? q : &__default_jobq;
   job->create_hrtime = eventer_gethrtime();
   /* If we're debugging the eventer, these cross thread timeouts will
    * make it impossible for us to slowly trace an asynch job. */
-  if(e->whence.tv_sec) {
-    job->timeout_event = eventer_alloc();
-    job->timeout_event->thr_owner = e->thr_owner;
-    memcpy(&job->timeout_event->whence, &e->whence, sizeof(e->whence));
-    job->timeout_event->mask = EVENTER_TIMER;
-    job->timeout_event->closure = job;
-    job->timeout_event->callback = eventer_jobq_execute_timeout;
-    eventer_add(job->timeout_event);
-  }
+  if(e->whence.tv_sec) eventer_jobq_deadline_add(job->jobq, job);
   eventer_jobq_enqueue(q ? q : &__default_jobq, job);
 }
 
@@ -54,21 +54,153 @@ static sigset_t alarm_mask;
 static mtev_hash_table all_queues = MTEV_HASH_EMPTY;
 pthread_mutex_t all_queues_lock;
 
+/* The shared pool.
+ *
+ * Queues marked shared have no threads of their own.  Instead, their
+ * desired_concurrency is a cap on how many pool workers may be running
+ * their jobs at once and concurrency counts those workers.  Every enqueue
+ * onto a shared queue posts the pool semaphore; a woken worker claims the
+ * first shared queue (round-robin) with backlog that is under its cap.
+ * If all backlogged queues are at their caps the wakeup is dropped, and
+ * whichever worker next releases a slot on a backlogged queue re-posts.
+ *
+ * A worker adopts the queue's thread-specific state for the duration of
+ * each job, so EVENTER_EVIL_BRUTAL (siglongjmp) and EVENTER_CANCEL
+ * (pthread_cancel) jobs behave as they would on a dedicated thread.  A
+ * cancelled worker is replaced on the next enqueue.
+ */
+static struct {
+  pthread_mutex_t   lock;
+  sem_t             semaphore;
+  mtev_atomic32_t   threads;
+  mtev_atomic32_t   desired_threads;
+  mtev_atomic32_t   pending_cancels;
+  eventer_jobq_t  **queues;
+  int               nqueues;
+  int               cursor;
+} shared_pool;
+
+static void eventer_jobq_shared_maybe_spawn();
+static void *eventer_jobq_shared_consumer(void *);
+
+/* Jobs are allocated on the thread calling eventer_add_asynch and freed on
+ * the owning loop (when the backq is drained), which is almost always the
+ * same thread; so a small per-thread freelist avoids the allocator here.
+ */
+#define EVENTER_JOB_FREELIST_MAX 1024
+static __thread eventer_job_t *job_freelist;
+static __thread int job_freelist_len;
+static __thread int job_freelist_registered;
+static pthread_key_t job_freelist_key;
+static pthread_once_t job_freelist_once = PTHREAD_ONCE_INIT;
+
+static void
+job_freelist_drain(void *unused) {
+  eventer_job_t *job;
+  while(NULL != (job = job_freelist)) {
+    job_freelist = job->next;
+    free(job);
+  }
+  job_freelist_len = 0;
+  job_freelist_registered = 0;
+}
+static void
+job_freelist_key_create() {
+  pthread_key_create(&job_freelist_key, job_freelist_drain);
+}
+
+eventer_job_t *
+eventer_jobq_job_alloc() {
+  eventer_job_t *job = job_freelist;
+  if(!job) {
+    job = calloc(1, sizeof(*job));
+    if(job) job->refcnt = 1;
+    return job;
+  }
+  job_freelist = job->next;
+  job_freelist_len--;
+  memset(job, 0, sizeof(*job));
+  job->refcnt = 1;
+  return job;
+}
+
+void
+eventer_jobq_job_free(eventer_job_t *job) {
+  if(job_freelist_len >= EVENTER_JOB_FREELIST_MAX) {
+    free(job);
+    return;
+  }
+  if(!job_freelist_registered) {
+    /* so a departing worker gives its cache back */
+    pthread_once(&job_freelist_once, job_freelist_key_create);
+    pthread_setspecific(job_freelist_key, (void *)1);
+    job_freelist_registered = 1;
+  }
+  job->next = job_freelist;
+  job_freelist = job;
+  job_freelist_len++;
+}
+
+/* The owning loop holds the reference taken at alloc; the deadline timer
+ * takes another for each job it expires, as the worker may finish and the
+ * owner free the job while the timeout is still being handled.
+ */
+static void
+eventer_jobq_job_release(eventer_job_t *job) {
+  if(mtev_atomic_dec32(&job->refcnt) == 0) eventer_jobq_job_free(job);
+}
+
+static void
+eventer_jobq_shard_release(void *vshard) {
+  eventer_jobq_shard_t *shard = vshard;
+  shard->in_use = 0;
+}
+
+static eventer_jobq_shard_t *
+eventer_jobq_shard(eventer_jobq_t *jobq) {
+  eventer_jobq_shard_t *shard;
+
+  shard = pthread_getspecific(jobq->threadshard);
+  if(shard) return shard;
+
+  /* Adopt a shard abandoned by an exited thread, if any */
+  for(shard = jobq->shards; shard; shard = shard->next)
+    if(mtev_atomic_cas32(&shard->in_use, 1, 0) == 0) break;
+
+  if(!shard) {
+    void *curr;
+    shard = calloc(1, sizeof(*shard));
+    shard->in_use = 1;
+    do {
+      curr = (void *)jobq->shards;
+      shard->next = curr;
+    } while(mtev_atomic_casptr((volatile void **)&jobq->shards,
+                               shard, curr) != curr);
+  }
+  pthread_setspecific(jobq->threadshard, shard);
+  return shard;
+}
+
 static void
 eventer_jobq_finished_job(eventer_jobq_t *jobq, eventer_job_t *job) {
+  eventer_jobq_shard_t *shard = eventer_jobq_shard(jobq);
   eventer_hrtime_t wait_time = job->start_hrtime - job->create_hrtime;
   eventer_hrtime_t run_time = job->finish_hrtime - job->start_hrtime;
   mtev_atomic_dec32(&jobq->inflight);
   if(job->timeout_triggered) mtev_atomic_inc64(&jobq->timeouts);
-  while(1) {
-    eventer_hrtime_t newv = jobq->avg_wait_ns * 0.8 + wait_time * 0.2;
-    if(mtev_atomic_cas64(&jobq->avg_wait_ns, newv, jobq->avg_wait_ns) == jobq->avg_wait_ns)
-      break;
-  }
-  while(1) {
-    eventer_hrtime_t newv = jobq->avg_run_ns * 0.8 + run_time * 0.2;
-    if(mtev_atomic_cas64(&jobq->avg_run_ns, newv, jobq->avg_run_ns) == jobq->avg_run_ns)
-      break;
+  mtev_hist_record(&shard->wait_ns, wait_time);
+  mtev_hist_record(&shard->run_ns, run_time);
+}
+
+void
+eventer_jobq_latency(eventer_jobq_t *jobq,
+                     mtev_hist_t *wait_ns, mtev_hist_t *run_ns) {
+  eventer_jobq_shard_t *shard;
+  if(wait_ns) mtev_hist_clear(wait_ns);
+  if(run_ns) mtev_hist_clear(run_ns);
+  for(shard = jobq->shards; shard; shard = shard->next) {
+    if(wait_ns) mtev_hist_merge(wait_ns, &shard->wait_ns);
+    if(run_ns) mtev_hist_merge(run_ns, &shard->run_ns);
   }
 }
 
@@ -80,7 +212,8 @@ eventer_jobq_handler(int signo)
   sigjmp_buf *env;
 
   jobq = pthread_getspecific(threads_jobq);
-  assert(jobq);
+  /* shared pool workers only carry a jobq while running one of its jobs */
+  if(!jobq) return;
   env = pthread_getspecific(jobq->threadenv);
   job = pthread_getspecific(jobq->activejob);
   if(env && job && job->fd_event && job->fd_event->mask & EVENTER_EVIL_BRUTAL)
@@ -117,6 +250,16 @@ eventer_jobq_init(eventer_jobq_t *jobq, const char *queue_name) {
             strerror(errno));
       return -1;
     }
+    if(pthread_mutex_init(&shared_pool.lock, NULL)) {
+      mtevL(mtev_error, "Cannot initialize shared pool mutex: %s\n",
+            strerror(errno));
+      return -1;
+    }
+    if(sem_init(&shared_pool.semaphore, 0, 0) != 0) {
+      mtevL(mtev_error, "Cannot initialize shared pool semaphore: %s\n",
+            strerror(errno));
+      return -1;
+    }
   }
 
   memset(jobq, 0, sizeof(*jobq));
@@ -129,6 +272,10 @@ eventer_jobq_init(eventer_jobq_t *jobq, const char *queue_name) {
     mtevL(mtev_error, "Cannot initialize lock\n");
     return -1;
   }
+  if(pthread_mutex_init(&jobq->deadline_lock, &mutexattr) != 0) {
+    mtevL(mtev_error, "Cannot initialize deadline lock\n");
+    return -1;
+  }
   if(sem_init(&jobq->semaphore, 0, 0) != 0) {
     mtevL(mtev_error, "Cannot initialize semaphore: %s\n",
           strerror(errno));
@@ -144,11 +291,24 @@ eventer_jobq_init(eventer_jobq_t *jobq, const char *queue_name) {
           strerror(errno));
     return -1;
   }
+  if(pthread_key_create(&jobq->threadshard, eventer_jobq_shard_release)) {
+    mtevL(mtev_error, "Cannot initialize thread-specific latency shard: %s\n",
+          strerror(errno));
+    return -1;
+  }
   pthread_mutex_lock(&all_queues_lock);
   if(mtev_hash_store(&all_queues, jobq->queue_name, strlen(jobq->queue_name),
                      jobq) == 0) {
     mtevL(mtev_error, "Duplicate queue name!\n");
     pthread_mutex_unlock(&all_queues_lock);
+    pthread_key_delete(jobq->threadshard);
+    pthread_key_delete(jobq->activejob);
+    pthread_key_delete(jobq->threadenv);
+    pthread_mutex_destroy(&jobq->lock);
+    pthread_mutex_destroy(&jobq->deadline_lock);
+    sem_destroy(&jobq->semaphore);
+    free((void *)jobq->queue_name);
+    jobq->queue_name = NULL;
     return -1;
   }
   pthread_mutex_unlock(&all_queues_lock);
@@ -172,6 +332,10 @@ eventer_jobq_consumer_pthreadentry(void *vp) {
 static void
 eventer_jobq_maybe_spawn(eventer_jobq_t *jobq) {
   int32_t current = jobq->concurrency;
+  if(jobq->shared) {
+    eventer_jobq_shared_maybe_spawn();
+    return;
+  }
   /* if we've no desired concurrency, this doesn't apply to us */
   if(jobq->desired_concurrency == 0) return;
   /* See if we need to launch one */
@@ -218,6 +382,7 @@ eventer_jobq_enqueue(eventer_jobq_t *jobq, eventer_job_t *job) {
 
   /* Signal consumers */
   sem_post(&jobq->semaphore);
+  if(jobq->shared) sem_post(&shared_pool.semaphore);
 }
 
 static eventer_job_t *
@@ -260,15 +425,52 @@ eventer_jobq_dequeue_nowait(eventer_jobq_t *jobq) {
 
 void
 eventer_jobq_destroy(eventer_jobq_t *jobq) {
+  eventer_jobq_shard_t *shard;
+  int i;
+
+  if(jobq->shared) {
+    pthread_mutex_lock(&shared_pool.lock);
+    for(i=0; i<shared_pool.nqueues; i++) {
+      if(shared_pool.queues[i] != jobq) continue;
+      memmove(&shared_pool.queues[i], &shared_pool.queues[i+1],
+              (shared_pool.nqueues - i - 1) * sizeof(*shared_pool.queues));
+      shared_pool.nqueues--;
+      break;
+    }
+    if(shared_pool.cursor >= shared_pool.nqueues) shared_pool.cursor = 0;
+    pthread_mutex_unlock(&shared_pool.lock);
+  }
+
+  pthread_mutex_lock(&all_queues_lock);
+  mtev_hash_delete(&all_queues, jobq->queue_name, strlen(jobq->queue_name),
+                   NULL, NULL);
+  pthread_mutex_unlock(&all_queues_lock);
+
+  /* The deadline timer's closure is this queue; it mustn't outlive it. */
+  pthread_mutex_lock(&jobq->deadline_lock);
+  if(jobq->deadline_event && eventer_remove(jobq->deadline_event))
+    eventer_free(jobq->deadline_event);
+  jobq->deadline_event = NULL;
+  pthread_mutex_unlock(&jobq->deadline_lock);
+
   pthread_mutex_destroy(&jobq->lock);
+  pthread_mutex_destroy(&jobq->deadline_lock);
   sem_destroy(&jobq->semaphore);
+  free(jobq->deadlines);
+  /* Keys are finite (PTHREAD_KEYS_MAX); deleting one runs no destructors,
+   * so the shards are reclaimed here whether or not a thread still holds
+   * one. */
+  pthread_key_delete(jobq->threadshard);
+  pthread_key_delete(jobq->activejob);
+  pthread_key_delete(jobq->threadenv);
+  while((shard = jobq->shards) != NULL) {
+    jobq->shards = shard->next;
+    free(shard);
+  }
+  free((void *)jobq->queue_name);
 }
-int
-eventer_jobq_execute_timeout(eventer_t e, int mask, void *closure,
-                             struct timeval *now) {
-  eventer_job_t *job = closure;
-  job->timeout_triggered = 1;
-  job->timeout_event = NULL;
+static void
+eventer_jobq_timeout_job(eventer_job_t *job) {
   mtevL(eventer_deb, "%p jobq -> timeout job [%p]\n", pthread_self_ptr(), job);
   if(job->inflight) {
     eventer_job_t *jobcopy;
@@ -279,6 +481,7 @@ eventer_jobq_execute_timeout(eventer_t e, int mask, void *closure,
       job->fd_event = NULL;
       mtevL(eventer_deb, "[inline] timeout cancelling job\n");
       mtev_atomic_inc32(&job->jobq->pending_cancels);
+      if(job->jobq->shared) mtev_atomic_inc32(&shared_pool.pending_cancels);
       pthread_cancel(job->executor);
       /* complete on it ourselves */
       if(mtev_atomic_cas32(&job->has_cleanedup, 1, 0) == 0) {
@@ -303,11 +506,14 @@ eventer_jobq_execute_timeout(eventer_t e, int mask, void *closure,
           LIBMTEV_EVENTER_CALLBACK_RETURN((void *)my_precious, (void *)my_precious->callback, NULL, -1);
         }
       }
-      jobcopy = malloc(sizeof(*jobcopy));
+      jobcopy = eventer_jobq_job_alloc();
       memcpy(jobcopy, job, sizeof(*jobcopy));
-      free(job);
+      jobcopy->refcnt = 1;
+      /* The cancelled worker will never hand the original to its owner;
+       * drop that reference here (ours is dropped by our caller). */
+      eventer_jobq_job_release(job);
       jobcopy->fd_event = my_precious;
-      job->finish_hrtime = eventer_gethrtime();
+      jobcopy->finish_hrtime = eventer_gethrtime();
       eventer_jobq_maybe_spawn(jobcopy->jobq);
       eventer_jobq_finished_job(jobcopy->jobq, jobcopy);
       memcpy(&wakeupcopy, jobcopy->fd_event, sizeof(wakeupcopy));
@@ -317,6 +523,144 @@ eventer_jobq_execute_timeout(eventer_t e, int mask, void *closure,
     else
       pthread_kill(job->executor, JOBQ_SIGNAL);
   }
+}
+
+#define DEADLINE_LT(a,b) (compare_timeval((a)->whence, (b)->whence) < 0)
+static void
+eventer_jobq_deadline_swap(eventer_jobq_t *jobq, int i, int j) {
+  eventer_job_t *tmp = jobq->deadlines[i];
+  jobq->deadlines[i] = jobq->deadlines[j];
+  jobq->deadlines[j] = tmp;
+  jobq->deadlines[i]->deadline_idx = i;
+  jobq->deadlines[j]->deadline_idx = j;
+}
+static void
+eventer_jobq_deadline_up(eventer_jobq_t *jobq, int i) {
+  while(i > 1 && DEADLINE_LT(jobq->deadlines[i], jobq->deadlines[i/2])) {
+    eventer_jobq_deadline_swap(jobq, i, i/2);
+    i /= 2;
+  }
+}
+static void
+eventer_jobq_deadline_down(eventer_jobq_t *jobq, int i) {
+  while(1) {
+    int l = i*2, r = l+1, m = i;
+    if(l <= jobq->ndeadlines && DEADLINE_LT(jobq->deadlines[l], jobq->deadlines[m])) m = l;
+    if(r <= jobq->ndeadlines && DEADLINE_LT(jobq->deadlines[r], jobq->deadlines[m])) m = r;
+    if(m == i) break;
+    eventer_jobq_deadline_swap(jobq, i, m);
+    i = m;
+  }
+}
+static void
+eventer_jobq_deadline_unlink(eventer_jobq_t *jobq, eventer_job_t *job) {
+  int i = job->deadline_idx;
+  eventer_job_t *last;
+  if(i == 0) return;
+  job->deadline_idx = 0;
+  last = jobq->deadlines[jobq->ndeadlines--];
+  if(last == job) return;
+  jobq->deadlines[i] = last;
+  last->deadline_idx = i;
+  eventer_jobq_deadline_up(jobq, i);
+  eventer_jobq_deadline_down(jobq, last->deadline_idx);
+}
+/* Must hold deadline_lock. */
+static void
+eventer_jobq_deadline_arm(eventer_jobq_t *jobq, pthread_t owner) {
+  eventer_job_t *first;
+  if(jobq->ndeadlines == 0) return;
+  first = jobq->deadlines[1];
+  if(jobq->deadline_event) {
+    if(compare_timeval(first->whence, jobq->deadline_event->whence) >= 0)
+      return;
+    /* If it isn't scheduled, it is firing right now and will rearm
+     * under this lock once it has collected what has expired. */
+    if(!eventer_remove(jobq->deadline_event)) return;
+  }
+  else {
+    jobq->deadline_event = eventer_alloc();
+    jobq->deadline_event->mask = EVENTER_TIMER;
+    jobq->deadline_event->callback = eventer_jobq_execute_timeout;
+    jobq->deadline_event->closure = jobq;
+    jobq->deadline_event->thr_owner = owner;
+  }
+  memcpy(&jobq->deadline_event->whence, &first->whence, sizeof(first->whence));
+  eventer_add(jobq->deadline_event);
+}
+void
+eventer_jobq_deadline_add(eventer_jobq_t *jobq, eventer_job_t *job) {
+  memcpy(&job->whence, &job->fd_event->whence, sizeof(job->whence));
+  job->deadline_owner = job->fd_event->thr_owner;
+  pthread_mutex_lock(&jobq->deadline_lock);
+  if(jobq->ndeadlines + 1 >= jobq->deadlines_alloc) {
+    int newalloc = jobq->deadlines_alloc ? jobq->deadlines_alloc * 2 : 64;
+    jobq->deadlines = realloc(jobq->deadlines,
+                              newalloc * sizeof(*jobq->deadlines));
+    assert(jobq->deadlines);
+    jobq->deadlines_alloc = newalloc;
+  }
+  jobq->deadlines[++jobq->ndeadlines] = job;
+  job->deadline_idx = jobq->ndeadlines;
+  eventer_jobq_deadline_up(jobq, job->deadline_idx);
+  eventer_jobq_deadline_arm(jobq, job->fd_event->thr_owner);
+  pthread_mutex_unlock(&jobq->deadline_lock);
+}
+static void
+eventer_jobq_deadline_remove(eventer_jobq_t *jobq, eventer_job_t *job) {
+  if(job->deadline_idx == 0) return;
+  pthread_mutex_lock(&jobq->deadline_lock);
+  /* The timer is left alone; if it fires early it just rearms. */
+  eventer_jobq_deadline_unlink(jobq, job);
+  pthread_mutex_unlock(&jobq->deadline_lock);
+}
+/* A job submitted from another loop is timed out on that loop, as its
+ * cleanup callback may be run synchronously from here. */
+static int
+eventer_jobq_timeout_on_owner(eventer_t e, int mask, void *closure,
+                              struct timeval *now) {
+  eventer_job_t *job = closure;
+  eventer_jobq_timeout_job(job);
+  eventer_jobq_job_release(job);
+  return 0;
+}
+int
+eventer_jobq_execute_timeout(eventer_t e, int mask, void *closure,
+                             struct timeval *now) {
+  eventer_jobq_t *jobq = closure;
+  eventer_job_t *job, *expired = NULL;
+
+  pthread_mutex_lock(&jobq->deadline_lock);
+  if(jobq->deadline_event == e) jobq->deadline_event = NULL;
+  while(jobq->ndeadlines > 0 &&
+        compare_timeval(jobq->deadlines[1]->whence, *now) <= 0) {
+    job = jobq->deadlines[1];
+    eventer_jobq_deadline_unlink(jobq, job);
+    job->timeout_triggered = 1;
+    mtev_atomic_inc32(&job->refcnt);
+    job->deadline_next = expired;
+    expired = job;
+  }
+  eventer_jobq_deadline_arm(jobq, e->thr_owner);
+  pthread_mutex_unlock(&jobq->deadline_lock);
+
+  while(expired) {
+    job = expired;
+    expired = job->deadline_next;
+    if(!pthread_equal(job->deadline_owner, e->thr_owner)) {
+      eventer_t newe = eventer_alloc();
+      newe->mask = EVENTER_TIMER;
+      newe->callback = eventer_jobq_timeout_on_owner;
+      newe->closure = job;
+      newe->thr_owner = job->deadline_owner;
+      memcpy(&newe->whence, now, sizeof(*now));
+      eventer_add(newe);
+      continue;
+    }
+    eventer_jobq_timeout_job(job);
+    eventer_jobq_job_release(job);
+  }
+  /* This event is spent, a fresh one is armed as needed. */
   return 0;
 }
 int
@@ -348,9 +692,9 @@ eventer_jobq_consume_available(eventer_t e, int mask, void *closure,
       }
       job->fd_event = NULL;
     }
-    assert(job->timeout_event == NULL);
+    assert(job->deadline_idx == 0);
     mtev_atomic_dec32(&jobq->inflight);
-    free(job);
+    eventer_jobq_job_release(job);
   }
   return EVENTER_RECURRENT;
 }
@@ -360,6 +704,135 @@ eventer_jobq_cancel_cleanup(void *vp) {
   mtev_atomic_dec32(&jobq->pending_cancels);
   mtev_atomic_dec32(&jobq->concurrency);
 }
+static void
+eventer_jobq_run_job(eventer_jobq_t *jobq, eventer_job_t *job,
+                     sigjmp_buf *env) {
+  struct _event wakeupcopy;
+
+  pthread_setspecific(jobq->activejob, job);
+  mtevL(eventer_deb, "%p jobq[%s] -> running job [%p]\n", pthread_self_ptr(),
+        jobq->queue_name, job);
+
+  /* Mark our commencement */
+  job->start_hrtime = eventer_gethrtime();
+
+  /* Check and handle if we've timed out while in queue */
+  if(job->timeout_triggered) {
+    struct timeval diff, diff2;
+    eventer_hrtime_t udiff2;
+    /* This happens if the timeout occurred before we even had the change
+     * to pull the job off the queue.  We must be in bad shape here.
+     */
+    mtevL(eventer_deb, "%p jobq[%s] -> timeout before start [%p]\n",
+          pthread_self_ptr(), jobq->queue_name, job);
+    gettimeofday(&job->finish_time, NULL); /* We're done */
+    job->finish_hrtime = eventer_gethrtime();
+    sub_timeval(job->finish_time, job->fd_event->whence, &diff);
+    udiff2 = (job->finish_hrtime - job->create_hrtime)/1000;
+    diff2.tv_sec = udiff2/1000000;
+    diff2.tv_usec = udiff2%1000000;
+    mtevL(eventer_deb, "%p jobq[%s] -> timeout before start [%p] -%0.6f (%0.6f)\n",
+          pthread_self_ptr(), jobq->queue_name, job,
+          (float)diff.tv_sec + (float)diff.tv_usec/1000000.0,
+          (float)diff2.tv_sec + (float)diff2.tv_usec/1000000.0);
+    LIBMTEV_EVENTER_CALLBACK_ENTRY((void *)job->fd_event,
+                           (void *)job->fd_event->callback, NULL,
+                           job->fd_event->fd, job->fd_event->mask,
+                           EVENTER_ASYNCH_CLEANUP);
+    job->fd_event->callback(job->fd_event, EVENTER_ASYNCH_CLEANUP,
+                            job->fd_event->closure, &job->finish_time);
+    LIBMTEV_EVENTER_CALLBACK_RETURN((void *)job->fd_event,
+                            (void *)job->fd_event->callback, NULL, -1);
+    eventer_jobq_finished_job(jobq, job);
+    memcpy(&wakeupcopy, job->fd_event, sizeof(wakeupcopy));
+    eventer_jobq_enqueue(eventer_default_backq(job->fd_event), job);
+    eventer_wakeup(&wakeupcopy);
+    return;
+  }
+
+  /* Run the job, if we timeout, will be killed with a JOBQ_SIGNAL from
+   * the master thread.  We handle the alarm by longjmp'd out back here.
+   */
+  job->executor = pthread_self();
+  if(0 == (job->fd_event->mask & EVENTER_EVIL_BRUTAL) ||
+     sigsetjmp(*env, 1) == 0) {
+    /* We could get hit right here... (timeout and terminated from
+     * another thread.  inflight isn't yet set (next line), so it
+     * won't longjmp.  But timeout_triggered will be set... so we
+     * should recheck that after we mark ourselves inflight.
+     */
+    if(mtev_atomic_cas32(&job->inflight, 1, 0) == 0) {
+      if(!job->timeout_triggered) {
+        mtevL(eventer_deb, "%p jobq[%s] -> executing [%p]\n",
+              pthread_self_ptr(), jobq->queue_name, job);
+        /* Choose the right cancellation policy (or none) */
+        if(job->fd_event->mask & EVENTER_CANCEL_ASYNCH) {
+          mtevL(eventer_deb, "PTHREAD_CANCEL_ASYNCHRONOUS\n");
+          pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+          pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+        }
+        else if(job->fd_event->mask & EVENTER_CANCEL_DEFERRED) {
+          mtevL(eventer_deb, "PTHREAD_CANCEL_DEFERRED\n");
+          pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+          pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, NULL);
+        }
+        else {
+          mtevL(eventer_deb, "PTHREAD_CANCEL_DISABLE\n");
+          pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        }
+        /* run the job */
+        struct timeval start_time;
+        gettimeofday(&start_time, NULL);
+        mtevL(eventer_deb, "jobq[%s] -> dispatch BEGIN\n", jobq->queue_name);
+        LIBMTEV_EVENTER_CALLBACK_ENTRY((void *)job->fd_event,
+                               (void *)job->fd_event->callback, NULL,
+                               job->fd_event->fd, job->fd_event->mask,
+                               EVENTER_ASYNCH_WORK);
+        job->fd_event->callback(job->fd_event, EVENTER_ASYNCH_WORK,
+                                job->fd_event->closure, &start_time);
+        LIBMTEV_EVENTER_CALLBACK_RETURN((void *)job->fd_event,
+                                (void *)job->fd_event->callback, NULL, -1);
+        mtevL(eventer_deb, "jobq[%s] -> dispatch END\n", jobq->queue_name);
+        if(job->fd_event && job->fd_event->mask & EVENTER_CANCEL)
+          pthread_testcancel();
+        /* reset the cancellation policy */
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, NULL);
+      }
+    }
+  }
+
+  job->inflight = 0;
+  mtevL(eventer_deb, "%p jobq[%s] -> finished [%p]\n", pthread_self_ptr(),
+        jobq->queue_name, job);
+  /* No we know we won't have siglongjmp called on us */
+
+  gettimeofday(&job->finish_time, NULL);
+  eventer_jobq_deadline_remove(jobq, job);
+
+  if(mtev_atomic_cas32(&job->has_cleanedup, 1, 0) == 0) {
+    /* We need to cleanup... we haven't done it yet. */
+    mtevL(eventer_deb, "%p jobq[%s] -> cleanup [%p]\n", pthread_self_ptr(),
+          jobq->queue_name, job);
+    /* threaded issue, need to recheck. */
+    /* coverity[check_after_deref] */
+    if(job->fd_event) {
+      LIBMTEV_EVENTER_CALLBACK_ENTRY((void *)job->fd_event,
+                             (void *)job->fd_event->callback, NULL,
+                             job->fd_event->fd, job->fd_event->mask,
+                             EVENTER_ASYNCH_CLEANUP);
+      job->fd_event->callback(job->fd_event, EVENTER_ASYNCH_CLEANUP,
+                              job->fd_event->closure, &job->finish_time);
+      LIBMTEV_EVENTER_CALLBACK_RETURN((void *)job->fd_event,
+                              (void *)job->fd_event->callback, NULL, -1);
+    }
+  }
+  job->finish_hrtime = eventer_gethrtime();
+  eventer_jobq_finished_job(jobq, job);
+  memcpy(&wakeupcopy, job->fd_event, sizeof(wakeupcopy));
+  eventer_jobq_enqueue(eventer_default_backq(job->fd_event), job);
+  eventer_wakeup(&wakeupcopy);
+}
 void *
 eventer_jobq_consumer(eventer_jobq_t *jobq) {
   eventer_job_t *job;
@@ -382,7 +855,6 @@ eventer_jobq_consumer(eventer_jobq_t *jobq) {
 
   mtev_memory_begin();
   while(1) {
-    struct _event wakeupcopy;
     pthread_setspecific(jobq->activejob, NULL);
     mtev_memory_end();
     mtev_memory_maintenance();
@@ -393,153 +865,184 @@ eventer_jobq_consumer(eventer_jobq_t *jobq) {
       free(job);
       break;
     }
-    pthread_setspecific(jobq->activejob, job);
-    mtevL(eventer_deb, "%p jobq[%s] -> running job [%p]\n", pthread_self_ptr(),
-          jobq->queue_name, job);
+    eventer_jobq_run_job(jobq, job, &env);
+  }
+  mtev_memory_end();
+  mtev_memory_maintenance();
+  pthread_cleanup_pop(0);
+  mtev_atomic_dec32(&jobq->inflight);
+  mtev_atomic_dec32(&jobq->concurrency);
+  pthread_exit(NULL);
+  return NULL;
+}
 
-    /* Mark our commencement */
-    job->start_hrtime = eventer_gethrtime();
-
-    /* Safely check and handle if we've timed out while in queue */
-    pthread_mutex_lock(&job->lock);
-    if(job->timeout_triggered) {
-      struct timeval diff, diff2;
-      eventer_hrtime_t udiff2;
-      /* This happens if the timeout occurred before we even had the change
-       * to pull the job off the queue.  We must be in bad shape here.
-       */
-      mtevL(eventer_deb, "%p jobq[%s] -> timeout before start [%p]\n",
-            pthread_self_ptr(), jobq->queue_name, job);
-      gettimeofday(&job->finish_time, NULL); /* We're done */
-      job->finish_hrtime = eventer_gethrtime();
-      sub_timeval(job->finish_time, job->fd_event->whence, &diff);
-      udiff2 = (job->finish_hrtime - job->create_hrtime)/1000;
-      diff2.tv_sec = udiff2/1000000;
-      diff2.tv_usec = udiff2%1000000;
-      mtevL(eventer_deb, "%p jobq[%s] -> timeout before start [%p] -%0.6f (%0.6f)\n",
-            pthread_self_ptr(), jobq->queue_name, job,
-            (float)diff.tv_sec + (float)diff.tv_usec/1000000.0,
-            (float)diff2.tv_sec + (float)diff2.tv_usec/1000000.0);
-      pthread_mutex_unlock(&job->lock);
-      LIBMTEV_EVENTER_CALLBACK_ENTRY((void *)job->fd_event,
-                             (void *)job->fd_event->callback, NULL,
-                             job->fd_event->fd, job->fd_event->mask,
-                             EVENTER_ASYNCH_CLEANUP);
-      job->fd_event->callback(job->fd_event, EVENTER_ASYNCH_CLEANUP,
-                              job->fd_event->closure, &job->finish_time);
-      LIBMTEV_EVENTER_CALLBACK_RETURN((void *)job->fd_event,
-                              (void *)job->fd_event->callback, NULL, -1);
-      eventer_jobq_finished_job(jobq, job);
-      memcpy(&wakeupcopy, job->fd_event, sizeof(wakeupcopy));
-      eventer_jobq_enqueue(eventer_default_backq(job->fd_event), job);
-      eventer_wakeup(&wakeupcopy);
-      continue;
-    }
-    pthread_mutex_unlock(&job->lock);
 
-    /* Run the job, if we timeout, will be killed with a JOBQ_SIGNAL from
-     * the master thread.  We handle the alarm by longjmp'd out back here.
-     */
-    job->executor = pthread_self();
-    if(0 == (job->fd_event->mask & EVENTER_EVIL_BRUTAL) ||
-       sigsetjmp(env, 1) == 0) {
-      /* We could get hit right here... (timeout and terminated from
-       * another thread.  inflight isn't yet set (next line), so it
-       * won't longjmp.  But timeout_triggered will be set... so we
-       * should recheck that after we mark ourselves inflight.
-       */
-      if(mtev_atomic_cas32(&job->inflight, 1, 0) == 0) {
-        if(!job->timeout_triggered) {
-          mtevL(eventer_deb, "%p jobq[%s] -> executing [%p]\n",
-                pthread_self_ptr(), jobq->queue_name, job);
-          /* Choose the right cancellation policy (or none) */
-          if(job->fd_event->mask & EVENTER_CANCEL_ASYNCH) {
-            mtevL(eventer_deb, "PTHREAD_CANCEL_ASYNCHRONOUS\n");
-            pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-            pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
-          }
-          else if(job->fd_event->mask & EVENTER_CANCEL_DEFERRED) {
-            mtevL(eventer_deb, "PTHREAD_CANCEL_DEFERRED\n");
-            pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-            pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, NULL);
-          }
-          else {
-            mtevL(eventer_deb, "PTHREAD_CANCEL_DISABLE\n");
-            pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-          }
-          /* run the job */
-          struct timeval start_time;
-          gettimeofday(&start_time, NULL);
-          mtevL(eventer_deb, "jobq[%s] -> dispatch BEGIN\n", jobq->queue_name);
-          LIBMTEV_EVENTER_CALLBACK_ENTRY((void *)job->fd_event,
-                                 (void *)job->fd_event->callback, NULL,
-                                 job->fd_event->fd, job->fd_event->mask,
-                                 EVENTER_ASYNCH_WORK);
-          job->fd_event->callback(job->fd_event, EVENTER_ASYNCH_WORK,
-                                  job->fd_event->closure, &start_time);
-          LIBMTEV_EVENTER_CALLBACK_RETURN((void *)job->fd_event,
-                                  (void *)job->fd_event->callback, NULL, -1);
-          mtevL(eventer_deb, "jobq[%s] -> dispatch END\n", jobq->queue_name);
-          if(job->fd_event && job->fd_event->mask & EVENTER_CANCEL)
-            pthread_testcancel();
-          /* reset the cancellation policy */
-          pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-          pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, NULL);
-        }
-      }
-    }
 
-    job->inflight = 0;
-    mtevL(eventer_deb, "%p jobq[%s] -> finished [%p]\n", pthread_self_ptr(),
-          jobq->queue_name, job);
-    /* No we know we won't have siglongjmp called on us */
+static void
+eventer_jobq_shared_maybe_spawn() {
+  pthread_t tid;
+  pthread_attr_t tattr;
+  if(shared_pool.threads - shared_pool.pending_cancels >=
+     shared_pool.desired_threads) return;
+  /* Like eventer_jobq_maybe_spawn, this races; the new thread rechecks. */
+  mtevL(eventer_deb, "Starting shared jobq thread now at %d\n",
+        shared_pool.threads);
+  pthread_attr_init(&tattr);
+  pthread_attr_setdetachstate(&tattr, PTHREAD_CREATE_DETACHED);
+  pthread_create(&tid, &tattr, eventer_jobq_shared_consumer, NULL);
+}
 
-    gettimeofday(&job->finish_time, NULL);
-    if(job->timeout_event) {
-      if(eventer_remove(job->timeout_event)) {
-        eventer_free(job->timeout_event);
-      }
-    }
-    job->timeout_event = NULL;
-
-    if(mtev_atomic_cas32(&job->has_cleanedup, 1, 0) == 0) {
-      /* We need to cleanup... we haven't done it yet. */
-      mtevL(eventer_deb, "%p jobq[%s] -> cleanup [%p]\n", pthread_self_ptr(),
-            jobq->queue_name, job);
-      /* threaded issue, need to recheck. */
-      /* coverity[check_after_deref] */
-      if(job->fd_event) {
-        LIBMTEV_EVENTER_CALLBACK_ENTRY((void *)job->fd_event,
-                               (void *)job->fd_event->callback, NULL,
-                               job->fd_event->fd, job->fd_event->mask,
-                               EVENTER_ASYNCH_CLEANUP);
-        job->fd_event->callback(job->fd_event, EVENTER_ASYNCH_CLEANUP,
-                                job->fd_event->closure, &job->finish_time);
-        LIBMTEV_EVENTER_CALLBACK_RETURN((void *)job->fd_event,
-                                (void *)job->fd_event->callback, NULL, -1);
-      }
+static void
+eventer_jobq_shared_release(eventer_jobq_t *jobq) {
+  mtev_atomic_dec32(&jobq->concurrency);
+  /* We may have been the reason a wakeup was dropped */
+  if(jobq->backlog > 0) sem_post(&shared_pool.semaphore);
+}
+
+static eventer_job_t *
+eventer_jobq_shared_claim(eventer_jobq_t **jobqp) {
+  int i;
+  eventer_job_t *job;
+  eventer_jobq_t *jobq;
+
+  pthread_mutex_lock(&shared_pool.lock);
+  for(i=0; i<shared_pool.nqueues; i++) {
+    jobq = shared_pool.queues[(shared_pool.cursor + i) % shared_pool.nqueues];
+    if(jobq->backlog <= 0) continue;
+    if(jobq->concurrency >= jobq->desired_concurrency) continue;
+    mtev_atomic_inc32(&jobq->concurrency);
+    pthread_mutex_unlock(&shared_pool.lock);
+    job = eventer_jobq_dequeue_nowait(jobq);
+    pthread_mutex_lock(&shared_pool.lock);
+    if(job) {
+      shared_pool.cursor = (shared_pool.cursor + i + 1) % shared_pool.nqueues;
+      pthread_mutex_unlock(&shared_pool.lock);
+      *jobqp = jobq;
+      return job;
     }
-    job->finish_hrtime = eventer_gethrtime();
-    eventer_jobq_finished_job(jobq, job);
-    memcpy(&wakeupcopy, job->fd_event, sizeof(wakeupcopy));
-    eventer_jobq_enqueue(eventer_default_backq(job->fd_event), job);
-    eventer_wakeup(&wakeupcopy);
+    /* Another worker beat us to it. */
+    mtev_atomic_dec32(&jobq->concurrency);
+  }
+  pthread_mutex_unlock(&shared_pool.lock);
+  return NULL;
+}
+
+static void
+eventer_jobq_shared_cancel_cleanup(void *vp) {
+  eventer_jobq_t *jobq = pthread_getspecific(threads_jobq);
+  mtev_atomic_dec32(&shared_pool.pending_cancels);
+  mtev_atomic_dec32(&shared_pool.threads);
+  if(jobq) {
+    mtev_atomic_dec32(&jobq->pending_cancels);
+    eventer_jobq_shared_release(jobq);
+  }
+}
+
+static void *
+eventer_jobq_shared_consumer(void *unused) {
+  eventer_jobq_t *jobq;
+  eventer_job_t *job;
+  int32_t current_count;
+  sigjmp_buf env;
+
+  mtev_memory_init_thread();
+  current_count = mtev_atomic_inc32(&shared_pool.threads);
+  mtevL(eventer_deb, "shared jobq -> %d\n", current_count);
+  if(current_count - shared_pool.pending_cancels >
+     shared_pool.desired_threads) {
+    mtevL(eventer_deb, "shared jobq over provisioned, backing out.\n");
+    mtev_atomic_dec32(&shared_pool.threads);
+    pthread_exit(NULL);
+    return NULL;
+  }
+  pthread_cleanup_push(eventer_jobq_shared_cancel_cleanup, NULL);
+
+  mtev_memory_begin();
+  while(1) {
+    pthread_setspecific(threads_jobq, NULL);
+    mtev_memory_end();
+    mtev_memory_maintenance();
+    while(sem_wait(&shared_pool.semaphore) && errno == EINTR);
+    mtev_memory_begin();
+    jobq = NULL;
+    job = eventer_jobq_shared_claim(&jobq);
+    if(!job) continue;
+    pthread_setspecific(threads_jobq, jobq);
+    pthread_setspecific(jobq->threadenv, &env);
+    eventer_jobq_run_job(jobq, job, &env);
+    pthread_setspecific(jobq->activejob, NULL);
+    pthread_setspecific(jobq->threadenv, NULL);
+    eventer_jobq_shared_release(jobq);
   }
   mtev_memory_end();
-  mtev_memory_maintenance();
   pthread_cleanup_pop(0);
-  mtev_atomic_dec32(&jobq->inflight);
-  mtev_atomic_dec32(&jobq->concurrency);
-  pthread_exit(NULL);
   return NULL;
 }
 
+int
+eventer_jobq_set_shared(eventer_jobq_t *jobq, int max_concurrency) {
+  eventer_jobq_t **newqueues;
+  if(max_concurrency < 1) return -1;
+  if(jobq->shared) return -1;
+  if(jobq->concurrency != 0 || jobq->desired_concurrency != 0) {
+    mtevL(mtev_error, "jobq[%s] already has dedicated threads\n",
+          jobq->queue_name);
+    return -1;
+  }
+  pthread_mutex_lock(&shared_pool.lock);
+  newqueues = realloc(shared_pool.queues,
+                      (shared_pool.nqueues + 1) * sizeof(*newqueues));
+  if(!newqueues) {
+    pthread_mutex_unlock(&shared_pool.lock);
+    return -1;
+  }
+  shared_pool.queues = newqueues;
+  shared_pool.queues[shared_pool.nqueues++] = jobq;
+  jobq->desired_concurrency = max_concurrency;
+  jobq->shared = 1;
+  pthread_mutex_unlock(&shared_pool.lock);
+  return 0;
+}
+
+eventer_jobq_t *
+eventer_jobq_create(const char *queue_name, int concurrency, int shared) {
+  eventer_jobq_t *jobq;
+  if(concurrency < 1) {
+    mtevL(mtev_error, "jobq[%s] concurrency must be >= 1\n", queue_name);
+    return NULL;
+  }
+  jobq = calloc(1, sizeof(*jobq));
+  if(eventer_jobq_init(jobq, queue_name) != 0) {
+    free(jobq);
+    return NULL;
+  }
+  if(shared) {
+    if(eventer_jobq_set_shared(jobq, concurrency) != 0) {
+      eventer_jobq_destroy(jobq);
+      free(jobq);
+      return NULL;
+    }
+  }
+  else
+    while(concurrency-- > 0) eventer_jobq_increase_concurrency(jobq);
+  return jobq;
+}
+
+void
+eventer_jobq_set_shared_threads(int nthreads) {
+  shared_pool.desired_threads = nthreads;
+}
+
 void eventer_jobq_increase_concurrency(eventer_jobq_t *jobq) {
   mtev_atomic_inc32(&jobq->desired_concurrency);
+  /* A higher cap may unblock backlog that no worker is awake for. */
+  if(jobq->shared && jobq->backlog > 0) sem_post(&shared_pool.semaphore);
 }
 void eventer_jobq_decrease_concurrency(eventer_jobq_t *jobq) {
   eventer_job_t *job;
   mtev_atomic_dec32(&jobq->desired_concurrency);
+  /* Shared queues own no threads, so there is nothing to retire. */
+  if(jobq->shared) return;
   job = calloc(1, sizeof(*job));
   eventer_jobq_enqueue(jobq, job);
 }
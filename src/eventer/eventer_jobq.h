@@ -38,6 +38,7 @@
 #include "eventer/eventer.h"
 #include "mtev_atomic.h"
 #include "mtev_sem.h"
+#include "mtev_hist.h"
 
 #include <pthread.h>
 #include <setjmp.h>
@@ -47,22 +48,37 @@
  */
 
 typedef struct _eventer_job_t {
-  pthread_mutex_t         lock;
   eventer_hrtime_t        create_hrtime;
   eventer_hrtime_t        start_hrtime;
   eventer_hrtime_t        finish_hrtime;
   struct timeval          finish_time;
   pthread_t               executor;
-  eventer_t               timeout_event;
+  struct timeval          whence;        /* deadline, if deadline_idx */
+  int                     deadline_idx;  /* slot in jobq->deadlines or 0 */
+  struct _eventer_job_t  *deadline_next; /* expired list while timing out */
+  pthread_t               deadline_owner; /* loop its timeout runs on */
   eventer_t               fd_event;
   int                     timeout_triggered; /* set, if it expires in-flight */
   mtev_atomic32_t         inflight;
   mtev_atomic32_t         has_cleanedup;
+  mtev_atomic32_t         refcnt;        /* owner, plus timer while expiring */
   void                  (*cleanup)(struct _eventer_job_t *);
   struct _eventer_job_t  *next;
   struct _eventer_jobq_t *jobq;
 } eventer_job_t;
 
+/* Latency is recorded into per-thread shards (no shared cache lines on the
+ * job completion path) and merged on read.  Shards are never freed while
+ * the queue exists; a shard is released when its thread exits and is
+ * adopted by the next thread that needs one.
+ */
+typedef struct _eventer_jobq_shard_t {
+  mtev_atomic32_t               in_use;
+  mtev_hist_t                   wait_ns;
+  mtev_hist_t                   run_ns;
+  struct _eventer_jobq_shard_t *next;
+} eventer_jobq_shard_t;
+
 typedef struct _eventer_jobq_t {
   const char             *queue_name;
   pthread_mutex_t         lock;
@@ -70,6 +86,7 @@ typedef struct _eventer_jobq_t {
   mtev_atomic32_t         concurrency;
   mtev_atomic32_t         desired_concurrency;
   mtev_atomic32_t         pending_cancels;
+  int                     shared; /* served by the shared pool */
   eventer_job_t          *headq;
   eventer_job_t          *tailq;
   pthread_key_t           threadenv;
@@ -78,11 +95,22 @@ typedef struct _eventer_jobq_t {
   mtev_atomic32_t         inflight;
   mtev_atomic64_t         total_jobs;
   mtev_atomic64_t         timeouts;
-  mtev_atomic64_t         avg_wait_ns; /* smoother alpha = 0.8 */
-  mtev_atomic64_t         avg_run_ns; /* smoother alpha = 0.8 */
+  pthread_key_t           threadshard;
+  eventer_jobq_shard_t   *shards;
+  /* Jobs with a deadline sit in a binary min-heap (1-based) on whence.
+   * A single timer per queue is armed for the earliest of them; it hands
+   * each expired job to the loop that submitted it to be timed out. */
+  pthread_mutex_t         deadline_lock;
+  eventer_job_t         **deadlines;
+  int                     ndeadlines;
+  int                     deadlines_alloc;
+  eventer_t               deadline_event;
 } eventer_jobq_t;
 
 int eventer_jobq_init(eventer_jobq_t *jobq, const char *queue_name);
+eventer_job_t *eventer_jobq_job_alloc();
+void eventer_jobq_job_free(eventer_job_t *job);
+void eventer_jobq_deadline_add(eventer_jobq_t *jobq, eventer_job_t *job);
 eventer_jobq_t *eventer_jobq_retrieve(const char *name);
 void eventer_jobq_enqueue(eventer_jobq_t *jobq, eventer_job_t *job);
 eventer_job_t *eventer_jobq_dequeue(eventer_jobq_t *jobq);
@@ -95,6 +123,17 @@ int eventer_jobq_consume_available(eventer_t e, int mask, void *closure,
 void eventer_jobq_increase_concurrency(eventer_jobq_t *jobq);
 void eventer_jobq_decrease_concurrency(eventer_jobq_t *jobq);
 void *eventer_jobq_consumer(eventer_jobq_t *jobq);
+/* Serve this queue from the shared worker pool rather than from dedicated
+ * threads, with at most max_concurrency of its jobs running at once.  Must
+ * be called before the queue is given any concurrency. */
+int eventer_jobq_set_shared(eventer_jobq_t *jobq, int max_concurrency);
+/* A new named queue with concurrency dedicated threads or, if shared, at
+ * most concurrency shared pool workers.  NULL if the name is taken. */
+eventer_jobq_t *eventer_jobq_create(const char *queue_name, int concurrency,
+                                    int shared);
+void eventer_jobq_set_shared_threads(int nthreads);
 void eventer_jobq_process_each(void (*func)(eventer_jobq_t *, void *), void *);
+void eventer_jobq_latency(eventer_jobq_t *jobq,
+                          mtev_hist_t *wait_ns, mtev_hist_t *run_ns);
 
 #endif
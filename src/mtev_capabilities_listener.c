@@ -81,6 +81,9 @@ mtev_capabilities_listener_init() {
                                  mtev_capabilities_handler);
   assert(mtev_http_rest_register("GET", "/", "capa(\\.json)?",
                                  mtev_capabilities_rest) == 0);
+  /* it doubles as the health check */
+  assert(mtev_http_rest_set_priority("GET", "/", "capa(\\.json)?",
+                                     MTEV_REST_PRIORITY_CRITICAL) == 0);
 }
 
 void
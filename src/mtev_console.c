@@ -74,6 +74,7 @@
 #include "mtev_listener.h"
 #include "mtev_console.h"
 #include "mtev_tokenizer.h"
+#include "mtev_http.h"
 
 #include "noitedit/sys.h"
 #include "noitedit/el.h"
@@ -83,9 +84,10 @@
 static void
 nc_telnet_cooker(mtev_console_closure_t ncct) {
   char *tmpbuf, *p, *n;
-  int r;
+  int r, tmpbuf_allocd;
 
   tmpbuf = ncct->outbuf;
+  tmpbuf_allocd = ncct->outbuf_allocd;
   if(ncct->outbuf_len == 0) return;
 
   p = ncct->outbuf + ncct->outbuf_completed;
@@ -112,7 +114,7 @@ nc_telnet_cooker(mtev_console_closure_t ncct) {
   } while(n);
   nc_write(ncct, p, r);
   ncct->outbuf_cooked = ncct->outbuf_len;
-  free(tmpbuf);
+  mtev_http_buffer_free(tmpbuf, tmpbuf_allocd);
 }
 int
 nc_printf(mtev_console_closure_t ncct, const char *fmt, ...) {
@@ -131,9 +133,10 @@ nc_vprintf(mtev_console_closure_t ncct, const char *fmt, va_list arg) {
   int lenwanted;
   
   if(!ncct->outbuf_allocd) {
-    ncct->outbuf = malloc(4096);
+    size_t allocd;
+    ncct->outbuf = mtev_http_buffer_alloc(4096, &allocd);
     if(!ncct->outbuf) return 0;
-    ncct->outbuf_allocd = 4096;
+    ncct->outbuf_allocd = allocd;
   }
   while(1) {
     char *newbuf;
@@ -172,15 +175,17 @@ int
 nc_write(mtev_console_closure_t ncct, const void *buf, int len) {
   if(len == 0) return 0;
   if(!ncct->outbuf_allocd) {
-    ncct->outbuf = malloc(len);
+    size_t allocd;
+    ncct->outbuf = mtev_http_buffer_alloc(len, &allocd);
     if(!ncct->outbuf) return 0;
-    ncct->outbuf_allocd = len;
+    ncct->outbuf_allocd = allocd;
   }
   else if(ncct->outbuf_allocd < ncct->outbuf_len + len) {
     char *newbuf;
     newbuf = realloc(ncct->outbuf, ncct->outbuf_len + len);
     if(!newbuf) return 0;
     ncct->outbuf = newbuf;
+    ncct->outbuf_allocd = ncct->outbuf_len + len;
   }
   memcpy(ncct->outbuf + ncct->outbuf_len, buf, len);
   ncct->outbuf_len += len;
@@ -210,7 +215,7 @@ mtev_console_closure_free(void *vncct) {
   }
   if(ncct->pty_master >= 0) close(ncct->pty_master);
   if(ncct->pty_slave >= 0) close(ncct->pty_slave);
-  if(ncct->outbuf) free(ncct->outbuf);
+  if(ncct->outbuf) mtev_http_buffer_free(ncct->outbuf, ncct->outbuf_allocd);
   if(ncct->telnet) mtev_console_telnet_free(ncct->telnet);
   mtev_hash_destroy(&ncct->userdata, NULL, mtev_console_userdata_free);
   while(ncct->state_stack) {
@@ -282,7 +287,7 @@ mtev_console_continue_sending(mtev_console_closure_t ncct,
     ncct->outbuf_completed += len;
   }
   len = ncct->outbuf_len;
-  free(ncct->outbuf);
+  mtev_http_buffer_free(ncct->outbuf, ncct->outbuf_allocd);
   ncct->outbuf = NULL;
   ncct->outbuf_allocd = ncct->outbuf_len =
     ncct->outbuf_completed = ncct->outbuf_cooked = 0;
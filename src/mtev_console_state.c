@@ -85,18 +85,32 @@ mtev_console_spit_event(eventer_t e, void *c) {
             cname ? cname : funcptr, e->closure);
 }
 static void
+mtev_console_spit_hist_ms(mtev_console_closure_t ncct, const char *name,
+                          mtev_hist_t *h) {
+  nc_printf(ncct, " %s: p50 %f, p99 %f, p99.9 %f, max %f (n=%llu)\n", name,
+            (double)mtev_hist_quantile(h, 0.5)/1000000.0,
+            (double)mtev_hist_quantile(h, 0.99)/1000000.0,
+            (double)mtev_hist_quantile(h, 0.999)/1000000.0,
+            (double)h->max/1000000.0, (unsigned long long)h->count);
+}
+static void
 mtev_console_spit_jobq(eventer_jobq_t *jobq, void *c) {
   mtev_console_closure_t ncct = c;
+  mtev_hist_t wait_ns, run_ns;
   int qlen = 0;
   nc_printf(ncct, "=== %s ===\n", jobq->queue_name);
-  nc_printf(ncct, " concurrency: %d/%d\n", jobq->concurrency, jobq->desired_concurrency);
+  nc_printf(ncct, " concurrency: %d/%d%s\n", jobq->concurrency, jobq->desired_concurrency,
+            jobq->shared ? " (shared pool)" : "");
   sem_getvalue(&jobq->semaphore, &qlen);
   nc_printf(ncct, " total jobs: %lld\n", (long long int)jobq->total_jobs);
   nc_printf(ncct, " backlog: %d\n", jobq->backlog);
   nc_printf(ncct, " inflight: %d\n", jobq->inflight);
   nc_printf(ncct, " timeouts: %lld\n", (long long int)jobq->timeouts);
-  nc_printf(ncct, " avg_wait_ms: %f\n", (double)jobq->avg_wait_ns/1000000.0);
-  nc_printf(ncct, " avg_run_ms: %f\n", (double)jobq->avg_run_ns/1000000.0);
+  eventer_jobq_latency(jobq, &wait_ns, &run_ns);
+  nc_printf(ncct, " avg_wait_ms: %f\n", mtev_hist_mean(&wait_ns)/1000000.0);
+  nc_printf(ncct, " avg_run_ms: %f\n", mtev_hist_mean(&run_ns)/1000000.0);
+  mtev_console_spit_hist_ms(ncct, "wait_ms", &wait_ns);
+  mtev_console_spit_hist_ms(ncct, "run_ms", &run_ns);
 }
 static int
 mtev_console_eventer_timers(mtev_console_closure_t ncct, int argc, char **argv,
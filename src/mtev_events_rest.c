@@ -120,12 +120,27 @@ json_spit_event(eventer_t e, void *closure) {
 
   json_object_array_add(doc, eo);
 }
+static struct json_object *
+json_spit_hist_ms(mtev_hist_t *h) {
+  struct json_object *ho = json_object_new_object();
+  struct json_object *li = json_object_new_int(0);
+  json_object_set_int_overflow(li, json_overflow_uint64);
+  json_object_set_uint64(li, h->count);
+  json_object_object_add(ho, "count", li);
+  json_object_object_add(ho, "p50", json_object_new_double((double)mtev_hist_quantile(h, 0.5)/1000000.0));
+  json_object_object_add(ho, "p99", json_object_new_double((double)mtev_hist_quantile(h, 0.99)/1000000.0));
+  json_object_object_add(ho, "p99.9", json_object_new_double((double)mtev_hist_quantile(h, 0.999)/1000000.0));
+  json_object_object_add(ho, "max", json_object_new_double((double)h->max/1000000.0));
+  return ho;
+}
 static void
 json_spit_jobq(eventer_jobq_t *jobq, void *closure) {
+  mtev_hist_t wait_ns, run_ns;
   struct json_object *doc = closure;
   struct json_object *jo = json_object_new_object();
   json_object_object_add(jo, "concurrency", json_object_new_int(jobq->concurrency));
   json_object_object_add(jo, "desired_concurrency", json_object_new_int(jobq->desired_concurrency));
+  json_object_object_add(jo, "shared", json_object_new_boolean(jobq->shared));
   struct json_object *li = json_object_new_int(0);
   json_object_set_int_overflow(li, json_overflow_int64);
   json_object_set_int64(li, (long long int)jobq->total_jobs);
@@ -136,8 +151,11 @@ json_spit_jobq(eventer_jobq_t *jobq, void *closure) {
   json_object_set_int_overflow(li, json_overflow_int64);
   json_object_set_int64(li, (long long int)jobq->timeouts);
   json_object_object_add(jo, "timeouts", li);
-  json_object_object_add(jo, "avg_wait_ms", json_object_new_double((double)jobq->avg_wait_ns/1000000.0));
-  json_object_object_add(jo, "avg_run_ms", json_object_new_double((double)jobq->avg_run_ns/1000000.0));
+  eventer_jobq_latency(jobq, &wait_ns, &run_ns);
+  json_object_object_add(jo, "avg_wait_ms", json_object_new_double(mtev_hist_mean(&wait_ns)/1000000.0));
+  json_object_object_add(jo, "avg_run_ms", json_object_new_double(mtev_hist_mean(&run_ns)/1000000.0));
+  json_object_object_add(jo, "wait_ms", json_spit_hist_ms(&wait_ns));
+  json_object_object_add(jo, "run_ms", json_spit_hist_ms(&run_ns));
   json_object_object_add(doc, jobq->queue_name, jo);
 }
 
@@ -187,6 +205,92 @@ mtev_rest_eventer_jobq(mtev_http_rest_closure_t *restc, int n, char **p) {
   return 0;
 }
 
+static void
+json_add_counter(struct json_object *o, const char *name, int64_t v) {
+  struct json_object *wo;
+  wo = json_object_new_int(v);
+  json_object_set_int_overflow(wo, json_overflow_int64);
+  json_object_set_int64(wo, v);
+  json_object_object_add(o, name, wo);
+}
+static void
+json_spit_http_listener(const mtev_http_listener_stats_t *stats,
+                        void *closure) {
+  struct json_object *doc = closure, *lo;
+  lo = json_object_new_object();
+  json_object_object_add(lo, "idle_timeout",
+                         json_object_new_int(stats->idle_timeout));
+  json_object_object_add(lo, "max_connections",
+                         json_object_new_int(stats->max_connections));
+  json_add_counter(lo, "connections", stats->connections);
+  json_add_counter(lo, "idle", stats->idle);
+  json_add_counter(lo, "accepted", stats->accepted);
+  json_add_counter(lo, "idle_timeouts", stats->idle_timeouts);
+  json_add_counter(lo, "shed", stats->shed);
+  json_add_counter(lo, "refused", stats->refused);
+  json_object_object_add(doc, stats->name, lo);
+}
+static int
+mtev_rest_http_connections(mtev_http_rest_closure_t *restc, int n, char **p) {
+  const char *jsonstr;
+  struct json_object *doc, *lo, *bo;
+  int64_t bytes, chains;
+
+  doc = json_object_new_object();
+  lo = json_object_new_object();
+  mtev_http_foreach_listener(json_spit_http_listener, lo);
+  json_object_object_add(doc, "listeners", lo);
+  mtev_http_buffer_usage(&bytes, &chains);
+  bo = json_object_new_object();
+  json_add_counter(bo, "bytes", bytes);
+  json_add_counter(bo, "chains", chains);
+  json_object_object_add(doc, "buffers", bo);
+
+  mtev_http_response_ok(restc->http_ctx, "application/json");
+  jsonstr = json_object_to_json_string(doc);
+  mtev_http_response_append(restc->http_ctx, jsonstr, strlen(jsonstr));
+  mtev_http_response_append(restc->http_ctx, "\n", 1);
+  json_object_put(doc);
+  mtev_http_response_end(restc->http_ctx);
+  return 0;
+}
+
+static void
+json_spit_rest_endpoint(const mtev_http_rest_endpoint_stats_t *stats,
+                        void *closure) {
+  struct json_object *doc = closure, *eo;
+  static const char *priorities[] = { "critical", "normal", "bulk" };
+  eo = json_object_new_object();
+  json_object_object_add(eo, "method", json_object_new_string(stats->method));
+  json_object_object_add(eo, "base", json_object_new_string(stats->base));
+  json_object_object_add(eo, "expression",
+                         json_object_new_string(stats->expression));
+  json_object_object_add(eo, "priority",
+                         json_object_new_string(priorities[stats->priority]));
+  json_add_counter(eo, "inflight", stats->inflight);
+  json_add_counter(eo, "admitted", stats->admitted);
+  json_add_counter(eo, "rejected", stats->rejected);
+  json_object_object_add(eo, "queue_delay_us",
+                         json_object_new_int(stats->queue_delay_us));
+  json_object_array_add(doc, eo);
+}
+static int
+mtev_rest_http_endpoints(mtev_http_rest_closure_t *restc, int n, char **p) {
+  const char *jsonstr;
+  struct json_object *doc;
+
+  doc = json_object_new_array();
+  mtev_http_rest_foreach_endpoint(json_spit_rest_endpoint, doc);
+
+  mtev_http_response_ok(restc->http_ctx, "application/json");
+  jsonstr = json_object_to_json_string(doc);
+  mtev_http_response_append(restc->http_ctx, jsonstr, strlen(jsonstr));
+  mtev_http_response_append(restc->http_ctx, "\n", 1);
+  json_object_put(doc);
+  mtev_http_response_end(restc->http_ctx);
+  return 0;
+}
+
 static int
 json_spit_log(u_int64_t idx, const struct timeval *whence,
               const char *log, size_t len, void *closure) {
@@ -280,4 +384,26 @@ mtev_events_rest_init() {
     "GET", "/eventer/", "^logs/(.+)\\.json$",
     mtev_rest_eventer_logs, mtev_http_rest_client_cert_auth
   ) == 0);
+  assert(mtev_http_rest_register_auth(
+    "GET", "/http/", "^connections\\.json$",
+    mtev_rest_http_connections, mtev_http_rest_client_cert_auth
+  ) == 0);
+  assert(mtev_http_rest_register_auth(
+    "GET", "/http/", "^endpoints\\.json$",
+    mtev_rest_http_endpoints, mtev_http_rest_client_cert_auth
+  ) == 0);
+
+  /* introspection has to keep working when everything else is shed */
+  assert(mtev_http_rest_set_priority("GET", "/eventer/", "^sockets\\.json$",
+                                     MTEV_REST_PRIORITY_CRITICAL) == 0);
+  assert(mtev_http_rest_set_priority("GET", "/eventer/", "^timers\\.json$",
+                                     MTEV_REST_PRIORITY_CRITICAL) == 0);
+  assert(mtev_http_rest_set_priority("GET", "/eventer/", "^jobq\\.json$",
+                                     MTEV_REST_PRIORITY_CRITICAL) == 0);
+  assert(mtev_http_rest_set_priority("GET", "/eventer/", "^logs/(.+)\\.json$",
+                                     MTEV_REST_PRIORITY_CRITICAL) == 0);
+  assert(mtev_http_rest_set_priority("GET", "/http/", "^connections\\.json$",
+                                     MTEV_REST_PRIORITY_CRITICAL) == 0);
+  assert(mtev_http_rest_set_priority("GET", "/http/", "^endpoints\\.json$",
+                                     MTEV_REST_PRIORITY_CRITICAL) == 0);
 }
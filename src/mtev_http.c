@@ -33,19 +33,24 @@
 
 #include "mtev_defines.h"
 #include "mtev_http.h"
+#include "mtev_http_private.h"
 #include "mtev_str.h"
+#include "mtev_memscan.h"
 
+#include <unistd.h>
 #include <errno.h>
 #include <ctype.h>
 #include <assert.h>
-#include <zlib.h>
 #include <sys/mman.h>
 #include <libxml/tree.h>
 #include <pthread.h>
 
 #define DEFAULT_MAXWRITE 1<<14 /* 32k */
-#define DEFAULT_BCHAINSIZE ((1 << 15)-(offsetof(struct bchain, _buff)))
-/* 64k - delta */
+#define MAX_WRITEV 16 /* well under any IOV_MAX */
+#define MAX_SENDFILE 1<<20
+#define DEFAULT_COMPRESSION_MIN_SIZE 1024
+#define MAX_ENCODERS 12 /* bits in MTEV_HTTP_ENCODINGS */
+#define ARENA_BLOCKSIZE 4096
 #define DEFAULT_BCHAINMINREAD (DEFAULT_BCHAINSIZE/4)
 #define BCHAIN_SPACE(a) ((a)->allocd - (a)->size - (a)->start)
 
@@ -61,89 +66,180 @@ MTEV_HOOK_IMPL(http_request_log,
   (void *closure, mtev_http_session_ctx *ctx),
   (closure,ctx))
 
-struct mtev_http_connection {
-  eventer_t e;
-  int needs_close;
-};
-
-struct mtev_http_request {
-  struct bchain *first_input; /* The start of the input chain */
-  struct bchain *last_input;  /* The end of the input chain */
-  struct bchain *current_input;  /* The point of the input where we */
-  size_t         current_offset; /* analyzing. */
-
-  enum { MTEV_HTTP_REQ_HEADERS = 0,
-         MTEV_HTTP_REQ_EXPECT,
-         MTEV_HTTP_REQ_PAYLOAD } state;
-  struct bchain *current_request_chain;
-  mtev_boolean has_payload;
-  mtev_boolean payload_chunked;
-  struct {
-    int64_t size;
-    void *data;
-    void (*freefunc)(void *data, int64_t size, void *closure);
-    void *freeclosure;
-  } upload;  /* This is optionally set */
-  int64_t content_length;
-  int64_t content_length_read;
-  int32_t next_chunk;
-  int32_t next_chunk_read;
-  char *method_str;
-  char *uri_str;
-  char *protocol_str;
-  mtev_hash_table querystring;
-  u_int32_t opts;
-  mtev_http_method method;
-  mtev_http_protocol protocol;
-  mtev_hash_table headers;
-  mtev_boolean complete;
-  struct timeval start_time;
-  char *orig_qs;
-};
-
-struct mtev_http_response {
-  mtev_http_protocol protocol;
-  int status_code;
-  char *status_reason;
-
-  mtev_hash_table headers;
-  struct bchain *leader; /* serialization of status line and headers */
-
-  u_int32_t output_options;
-  struct bchain *output;       /* data is pushed in here */
-  struct bchain *output_raw;   /* internally transcoded here for output */
-  size_t output_raw_offset;    /* tracks our offset */
-  mtev_boolean output_started; /* locks the options and leader */
-                               /*   and possibly output. */
-  mtev_boolean closed;         /* set by _end() */
-  mtev_boolean complete;       /* complete, drained and disposable */
-  size_t bytes_written;        /* tracks total bytes written */
-  z_stream *gzip;
-};
-
-struct mtev_http_session_ctx {
-  mtev_atomic32_t ref_cnt;
-  int64_t drainage;
-  pthread_mutex_t write_lock;
-  int max_write;
-  mtev_http_connection conn;
-  mtev_http_request req;
-  mtev_http_response res;
-  mtev_http_dispatch_func dispatcher;
-  void *dispatcher_closure;
-  acceptor_closure_t *ac;
-};
-
 static mtev_log_stream_t http_debug = NULL;
 static mtev_log_stream_t http_io = NULL;
-static mtev_log_stream_t http_access = NULL;
 
-static const char gzip_header[10] =
-  { '\037', '\213', Z_DEFLATED, 0, 0, 0, 0, 0, 0, 0x03 };
+/* Registered content encodings, in order of preference. */
+static mtev_http_encoder_t *encoders[MAX_ENCODERS];
+static int nencoders;
+
+u_int32_t
+mtev_http_encoder_register(mtev_http_encoder_t *enc) {
+  u_int32_t used = 0, bit;
+  int i;
+  if(nencoders >= MAX_ENCODERS) return 0;
+  for(i=0; i<nencoders; i++) {
+    if(!strcasecmp(encoders[i]->name, enc->name)) return 0;
+    used |= encoders[i]->option;
+  }
+  if(enc->option == 0) {
+    for(bit = 0x10; bit & MTEV_HTTP_ENCODINGS; bit <<= 1)
+      if(!(used & bit)) break;
+    enc->option = bit;
+  }
+  if(!(enc->option & MTEV_HTTP_ENCODINGS) || (enc->option & used) ||
+     (enc->option & (enc->option - 1))) return 0;
+  encoders[nencoders++] = enc;
+  return enc->option;
+}
+mtev_http_encoder_t *
+mtev_http_encoder_find(const char *name) {
+  int i;
+  for(i=0; i<nencoders; i++)
+    if(!strcasecmp(encoders[i]->name, name)) return encoders[i];
+  return NULL;
+}
+mtev_http_encoder_t *
+mtev_http_encoder_by_option(u_int32_t opt) {
+  int i;
+  for(i=0; i<nencoders; i++)
+    if(encoders[i]->option & opt) return encoders[i];
+  return NULL;
+}
+
+/* Accept-Encoding: token[;q=x], ...  Everything with q > 0 goes in opts,
+ * the best of them (ties to our order) in encoding_pref.
+ */
+void
+mtev_http_request_parse_accept_encoding(mtev_http_request *req, const char *value) {
+  double q[MAX_ENCODERS], star = -1.0, best = 0.0;
+  const char *cp = value;
+  int i;
+
+  for(i=0; i<nencoders; i++) q[i] = -1.0;
+  while(*cp) {
+    const char *tok, *end;
+    size_t toklen;
+    double tq = 1.0;
+    while(*cp == ' ' || *cp == '\t' || *cp == ',') cp++;
+    if(!*cp) break;
+    tok = cp;
+    while(*cp && *cp != ',' && *cp != ';' && *cp != ' ' && *cp != '\t') cp++;
+    toklen = cp - tok;
+    end = strchr(cp, ',');
+    if(!end) end = cp + strlen(cp);
+    while(cp < end) {
+      if(*cp == ';') {
+        cp++;
+        while(*cp == ' ' || *cp == '\t') cp++;
+        if((*cp == 'q' || *cp == 'Q') && cp[1] == '=') tq = strtod(cp+2, NULL);
+      }
+      else cp++;
+    }
+    if(toklen == 1 && *tok == '*') star = tq;
+    for(i=0; i<nencoders; i++) {
+      if(strlen(encoders[i]->name) == toklen &&
+         !strncasecmp(encoders[i]->name, tok, toklen)) q[i] = tq;
+    }
+  }
+  for(i=0; i<nencoders; i++) {
+    if(q[i] < 0) q[i] = star;
+    if(q[i] <= 0) continue;
+    req->opts |= encoders[i]->option;
+    if(q[i] > best) {
+      best = q[i];
+      req->encoding_pref = encoders[i]->option;
+    }
+  }
+}
+
+static void *
+_http_arena_alloc(struct http_arena *arena, size_t size) {
+  struct http_arena_block *b = arena->head;
+  size = (size + 7) & ~(size_t)7;
+  if(!b || b->size - b->used < size) {
+    size_t bsize = MAX(size, ARENA_BLOCKSIZE);
+    b = malloc(offsetof(struct http_arena_block, data) + bsize);
+    if(!b) return NULL;
+    b->size = bsize;
+    b->used = 0;
+    b->next = arena->head;
+    arena->head = b;
+    if(!arena->first) arena->first = b;
+  }
+  b->used += size;
+  return b->data + b->used - size;
+}
+static char *
+_http_arena_strdup(struct http_arena *arena, const char *str) {
+  size_t len = strlen(str) + 1;
+  char *dup = _http_arena_alloc(arena, len);
+  if(dup) memcpy(dup, str, len);
+  return dup;
+}
+static void
+_http_arena_reset(struct http_arena *arena, mtev_boolean all) {
+  struct http_arena_block *b;
+  while((b = arena->head) != NULL && (all || b != arena->first)) {
+    arena->head = b->next;
+    free(b);
+  }
+  if(all) arena->first = NULL;
+  else if(arena->first) arena->first->used = 0;
+}
+void *
+mtev_http_session_alloc(mtev_http_session_ctx *ctx, size_t size) {
+  return _http_arena_alloc(&ctx->arena, size);
+}
+char *
+mtev_http_session_strdup(mtev_http_session_ctx *ctx, const char *str) {
+  return _http_arena_strdup(&ctx->arena, str);
+}
 
+/* Neither name nor value is copied; both must outlive the response. */
+static void
+_http_header_put(mtev_http_session_ctx *ctx, const char *name, size_t nlen,
+                 const char *value, size_t vlen) {
+  struct http_header *h;
+  int i;
+  for(i=0; i<ctx->res.nheaders; i++) {
+    h = &ctx->res.headers[i];
+    if(h->nlen == nlen && !strncasecmp(h->name, name, nlen)) {
+      h->value = value;
+      h->vlen = vlen;
+      return;
+    }
+  }
+  if(ctx->res.nheaders == ctx->res.aheaders) {
+    int nalloc = ctx->res.aheaders ? ctx->res.aheaders * 2 : 16;
+    h = _http_arena_alloc(&ctx->arena, nalloc * sizeof(*h));
+    if(!h) return;
+    if(ctx->res.nheaders)
+      memcpy(h, ctx->res.headers, ctx->res.nheaders * sizeof(*h));
+    ctx->res.headers = h;
+    ctx->res.aheaders = nalloc;
+  }
+  h = &ctx->res.headers[ctx->res.nheaders++];
+  h->name = name;
+  h->nlen = nlen;
+  h->value = value;
+  h->vlen = vlen;
+}
+static void
+_http_header_del(mtev_http_session_ctx *ctx, const char *name, size_t nlen) {
+  int i;
+  for(i=0; i<ctx->res.nheaders; i++) {
+    struct http_header *h = &ctx->res.headers[i];
+    if(h->nlen == nlen && !strncasecmp(h->name, name, nlen)) {
+      memmove(h, h + 1, (--ctx->res.nheaders - i) * sizeof(*h));
+      return;
+    }
+  }
+}
+/* For the headers we set ourselves: string literals, lengths for free. */
 #define CTX_ADD_HEADER(a,b) \
-    mtev_hash_replace(&ctx->res.headers, \
-                      strdup(a), strlen(a), strdup(b), free, free)
+    _http_header_put(ctx, a, sizeof(a)-1, b, sizeof(b)-1)
+#define CTX_DEL_HEADER(a) _http_header_del(ctx, a, sizeof(a)-1)
 static const char _hexchars[16] =
   {'0','1','2','3','4','5','6','7','8','9','a','b','c','d','e','f'};
 static void inplace_urldecode(char *c) {
@@ -168,16 +264,115 @@ static void inplace_urldecode(char *c) {
   *o = '\0';
 }
 
+/* Buffers (and so bchains) churn at a furious rate: a 32k input chain
+ * per request, one per output chunk, tiny ones for chunk framing.  Each
+ * thread keeps freelists of a few block sizes; blocks freed on another
+ * thread (offloaded encoding) simply join that thread's lists.
+ */
+#define BUFFER_POOL_CLASSES 6
+static const size_t buffer_pool_class_size[BUFFER_POOL_CLASSES] = {
+  256, 1024, 4096, 16384, 1 << 15, 1 << 16
+};
+struct buffer_pool_block { struct buffer_pool_block *next; };
+static __thread struct buffer_pool_block *buffer_pool[BUFFER_POOL_CLASSES];
+static __thread size_t buffer_pool_bytes;
+static __thread int buffer_pool_registered;
+static size_t buffer_pool_max = 2 * 1024 * 1024;
+static pthread_key_t buffer_pool_key;
+static pthread_once_t buffer_pool_once = PTHREAD_ONCE_INIT;
+
+static void
+buffer_pool_drain(void *unused) {
+  int i;
+  struct buffer_pool_block *b;
+  for(i=0; i<BUFFER_POOL_CLASSES; i++) {
+    while(NULL != (b = buffer_pool[i])) {
+      buffer_pool[i] = b->next;
+      free(b);
+    }
+  }
+  buffer_pool_bytes = 0;
+  buffer_pool_registered = 0;
+}
+static void
+buffer_pool_key_create() {
+  pthread_key_create(&buffer_pool_key, buffer_pool_drain);
+}
+static int
+buffer_pool_class(size_t len) {
+  int i;
+  for(i=0; i<BUFFER_POOL_CLASSES; i++)
+    if(len <= buffer_pool_class_size[i]) return i;
+  return -1;
+}
+void
+mtev_http_buffer_pool_limit(size_t max) {
+  buffer_pool_max = max;
+}
+void *
+mtev_http_buffer_alloc(size_t len, size_t *allocd) {
+  struct buffer_pool_block *b;
+  int c = buffer_pool_class(len);
+  if(c < 0) {
+    *allocd = len;
+    return malloc(len);
+  }
+  *allocd = buffer_pool_class_size[c];
+  if(NULL != (b = buffer_pool[c])) {
+    buffer_pool[c] = b->next;
+    buffer_pool_bytes -= *allocd;
+    return b;
+  }
+  return malloc(*allocd);
+}
+void
+mtev_http_buffer_free(void *buf, size_t allocd) {
+  struct buffer_pool_block *b = buf;
+  int c;
+  if(!buf) return;
+  c = buffer_pool_class(allocd);
+  if(c < 0 || buffer_pool_class_size[c] != allocd ||
+     buffer_pool_bytes + allocd > buffer_pool_max) {
+    free(buf);
+    return;
+  }
+  if(!buffer_pool_registered) {
+    /* so a departing thread gives its cache back */
+    pthread_once(&buffer_pool_once, buffer_pool_key_create);
+    pthread_setspecific(buffer_pool_key, (void *)1);
+    buffer_pool_registered = 1;
+  }
+  b->next = buffer_pool[c];
+  buffer_pool[c] = b;
+  buffer_pool_bytes += allocd;
+}
+
+/* what the bchains out there hold, for mtev_http_buffer_usage */
+static mtev_atomic64_t bchain_bytes;
+static mtev_atomic64_t bchain_count;
+
+void
+mtev_http_buffer_usage(int64_t *bytes, int64_t *chains) {
+  if(bytes) *bytes = bchain_bytes;
+  if(chains) *chains = bchain_count;
+}
+
 struct bchain *bchain_alloc(size_t size, int line) {
   struct bchain *n;
-  n = malloc(size + offsetof(struct bchain, _buff));
+  size_t blocksize;
+  n = mtev_http_buffer_alloc(size + offsetof(struct bchain, _buff),
+                             &blocksize);
   /*mtevL(mtev_error, "bchain_alloc(%p) : %d\n", n, line);*/
   if(!n) return NULL;
+  mtev_atomic_add64(&bchain_bytes, blocksize);
+  mtev_atomic_inc64(&bchain_count);
   n->type = BCHAIN_INLINE;
   n->prev = n->next = NULL;
   n->start = n->size = 0;
-  n->allocd = size;
+  n->allocd = blocksize - offsetof(struct bchain, _buff);
   n->buff = n->_buff;
+  n->fd = -1;
+  n->blocksize = blocksize;
   return n;
 }
 struct bchain *bchain_mmap(int fd, size_t len, int flags, off_t offset) {
@@ -192,23 +387,40 @@ struct bchain *bchain_mmap(int fd, size_t len, int flags, off_t offset) {
   n->allocd = len;
   return n;
 }
+struct bchain *bchain_sendfile(int fd, size_t len, off_t offset) {
+  struct bchain *n;
+  n = bchain_alloc(0, 0);
+  if(!n) return NULL;
+  n->type = BCHAIN_SENDFILE;
+  n->buff = NULL;
+  n->fd = fd;
+  n->start = offset;
+  n->size = len;
+  return n;
+}
+/* For when the bytes are needed in hand after all. */
+static struct bchain *bchain_sendfile_mmap(struct bchain *in) {
+  struct bchain *n;
+  off_t aligned = in->start & ~((off_t)sysconf(_SC_PAGESIZE) - 1);
+  n = bchain_mmap(in->fd, in->size + (in->start - aligned),
+                  MAP_SHARED, aligned);
+  if(!n) return NULL;
+  n->start = in->start - aligned;
+  n->size = in->size;
+  return n;
+}
 void bchain_free(struct bchain *b, int line) {
   /*mtevL(mtev_error, "bchain_free(%p) : %d\n", b, line);*/
   if(b->type == BCHAIN_MMAP) {
     munmap(b->buff, b->allocd);
   }
-  free(b);
-}
-#define ALLOC_BCHAIN(s) bchain_alloc(s, __LINE__)
-#define FREE_BCHAIN(a) bchain_free(a, __LINE__)
-#define RELEASE_BCHAIN(a) do { \
-  while(a) { \
-    struct bchain *__b; \
-    __b = a; \
-    a = __b->next; \
-    bchain_free(__b, __LINE__); \
-  } \
-} while(0)
+  else if(b->type == BCHAIN_SENDFILE) {
+    close(b->fd);
+  }
+  mtev_atomic_add64(&bchain_bytes, -(int64_t)b->blocksize);
+  mtev_atomic_dec64(&bchain_count);
+  mtev_http_buffer_free(b, b->blocksize);
+}
 struct bchain *bchain_from_data(const void *d, size_t size) {
   struct bchain *n;
   n = ALLOC_BCHAIN(size);
@@ -236,10 +448,19 @@ mtev_http_session_set_dispatcher(mtev_http_session_ctx *ctx,
   ctx->dispatcher = d;
   ctx->dispatcher_closure = dc;
 }
+void
+mtev_http_session_set_stream_closure(mtev_http_session_ctx *ctx,
+                                     void *(*alloc)(mtev_http_session_ctx *,
+                                                    void *),
+                                     void (*freefunc)(void *)) {
+  ctx->stream_closure_alloc = alloc;
+  ctx->stream_closure_free = freefunc;
+}
 void *mtev_http_session_dispatcher_closure(mtev_http_session_ctx *ctx) {
   return ctx->dispatcher_closure;
 }
 void mtev_http_session_trigger(mtev_http_session_ctx *ctx, int state) {
+  if(ctx->h2stream) mtev_http2_stream_kick(ctx);
   if(ctx->conn.e) eventer_trigger(ctx->conn.e, state);
 }
 uint32_t mtev_http_session_ref_cnt(mtev_http_session_ctx *ctx) {
@@ -265,6 +486,9 @@ eventer_t mtev_http_connection_event_float(mtev_http_connection *conn) {
 void mtev_http_request_start_time(mtev_http_request *req, struct timeval *t) {
   memcpy(t, &req->start_time, sizeof(*t));
 }
+void mtev_http_request_ready_time(mtev_http_request *req, struct timeval *t) {
+  memcpy(t, &req->ready_time, sizeof(*t));
+}
 const char *mtev_http_request_uri_str(mtev_http_request *req) {
   return req->uri_str;
 }
@@ -325,8 +549,8 @@ size_t mtev_http_response_bytes_written(mtev_http_response *res) {
   return res->bytes_written;
 }
 
-static mtev_http_method
-_method_enum(const char *s) {
+mtev_http_method
+mtev_http_method_from_str(const char *s) {
   switch(*s) {
    case 'G':
     if(!strcasecmp(s, "GET")) return MTEV_HTTP_GET;
@@ -345,6 +569,7 @@ _method_enum(const char *s) {
 static mtev_http_protocol
 _protocol_enum(const char *s) {
   if(!strcasecmp(s, "HTTP/1.1")) return MTEV_HTTP11;
+  if(!strcasecmp(s, "HTTP/2.0")) return MTEV_HTTP2;
   if(!strcasecmp(s, "HTTP/1.0")) return MTEV_HTTP10;
   return MTEV_HTTP09;
 }
@@ -352,99 +577,127 @@ static mtev_boolean
 _fixup_bchain(struct bchain *b) {
   /* make sure lines (CRLF terminated) don't cross chain boundaries */
   while(b) {
-    struct bchain *f;
-    int start_in_b, end_in_f;
-    size_t new_size;
+    struct bchain *f, *n;
+    size_t start_in_b, end_in_f, frag;
     const char *str_in_f;
 
-    start_in_b = b->start;
-    if(b->size > 2) {
-      if(memcmp(b->buff + b->start + b->size - 2, "\r\n", 2) == 0) {
-        b = b->next;
-        continue;
-      }
-      start_in_b = b->start + b->size - 3; /* we already checked -2 */
-      while(start_in_b >= b->start) {
-        if(b->buff[start_in_b] == '\r' && b->buff[start_in_b+1] == '\n') {
-          start_in_b += 2;
-          break;
-        }
-        start_in_b--;
-      }
+    if(b->size == 0 ||
+       (b->size >= 2 &&
+        memcmp(b->buff + b->start + b->size - 2, "\r\n", 2) == 0)) {
+      b = b->next;
+      continue;
     }
+    /* find the beginning of the unterminated line at the end of b */
+    start_in_b = b->start + b->size - 1;
+    while(start_in_b > b->start &&
+          !(b->buff[start_in_b - 1] == '\n' &&
+            start_in_b - 1 > b->start && b->buff[start_in_b - 2] == '\r'))
+      start_in_b--;
+    frag = b->start + b->size - start_in_b;
 
-    /* start_in_b points to the beginning of the string we need to build
-     * into a new buffer.
-     */
     f = b->next;
+    while(f && f->size == 0) f = f->next;
     if(!f) return mtev_false; /* Nothing left, can't complete the line */
-    str_in_f = strnstrn("\r\n", 2, f->buff + f->start, f->size);
-    if(!str_in_f) return mtev_false; /* nothing in next chain -- too long */
-    str_in_f += 2;
-    end_in_f = (str_in_f - f->buff - f->start);
-    new_size = end_in_f + (b->start + b->size - start_in_b);
-    if(new_size > DEFAULT_BCHAINSIZE) return mtev_false; /* string too long */
-    f = ALLOC_BCHAIN(new_size);
-    f->prev = b;
-    f->next = b->next;
-    f->start = 0;
-    f->size = new_size;
-    memcpy(f->buff, b->buff + start_in_b, b->start + b->size - start_in_b);
-    memcpy(f->buff + b->start + b->size - start_in_b,
-           f->buff + f->start, end_in_f);
-    f->next->prev = f;
-    f->prev->next = f;
-    f->prev->size -= start_in_b - b->start;
-    f->next->size -= end_in_f;
-    f->next->start += end_in_f;
-    b = f->next; /* skip f, we know it is right */
+    if(b->buff[b->start + b->size - 1] == '\r' && f->buff[f->start] == '\n')
+      str_in_f = f->buff + f->start - 1; /* the CRLF itself was split */
+    else
+      str_in_f = mtev_memscan_crlf(f->buff + f->start, f->size);
+    if(!str_in_f) {
+      /* the line runs through f; if it all fits in b, keep going there */
+      if(b->type == BCHAIN_INLINE &&
+         b->allocd - b->start - b->size >= f->size) {
+        memcpy(b->buff + b->start + b->size, f->buff + f->start, f->size);
+        b->size += f->size;
+        f->start += f->size;
+        f->size = 0;
+        continue;
+      }
+      return mtev_false; /* nothing in next chain -- too long */
+    }
+    end_in_f = str_in_f + 2 - (f->buff + f->start);
+
+    if(b->type == BCHAIN_INLINE &&
+       b->allocd - b->start - b->size >= end_in_f) {
+      /* finish the line where it started */
+      memcpy(b->buff + b->start + b->size, f->buff + f->start, end_in_f);
+      b->size += end_in_f;
+      f->start += end_in_f;
+      f->size -= end_in_f;
+      b = f;
+      continue;
+    }
+    if(f->type == BCHAIN_INLINE && f->start >= frag) {
+      /* or start it where it finishes */
+      memcpy(f->buff + f->start - frag, b->buff + start_in_b, frag);
+      f->start -= frag;
+      f->size += frag;
+      b->size -= frag;
+      b = f;
+      continue;
+    }
+    /* neither has room, so the line gets a chain of its own */
+    if(frag + end_in_f > DEFAULT_BCHAINSIZE) return mtev_false; /* too long */
+    n = ALLOC_BCHAIN(frag + end_in_f);
+    n->size = frag + end_in_f;
+    memcpy(n->buff, b->buff + start_in_b, frag);
+    memcpy(n->buff + frag, f->buff + f->start, end_in_f);
+    n->prev = b;
+    n->next = b->next;
+    b->next->prev = n;
+    b->next = n;
+    b->size -= frag;
+    f->size -= end_in_f;
+    f->start += end_in_f;
+    b = f; /* skip n, we know it is right */
   }
   return mtev_true;
 }
-static mtev_boolean
-_extract_header(char *l, const char **n, const char **v) {
+mtev_boolean
+mtev_http_extract_header(char *l, size_t colon, size_t len,
+                const char **n, const char **v) {
+  char *cp;
   *n = NULL;
   if(*l == ' ' || *l == '\t') {
     while(*l == ' ' || *l == '\t') l++;
     *v = l;
     return mtev_true;
   }
+  if(colon == len) return mtev_false;
   *n = l;
-  while(*l != ':' && *l) { *l = tolower(*l); l++; }
-  if(!*l) return mtev_false;
-  *v = l+1;
+  mtev_memscan_lower(l, colon);
+  *v = l + colon + 1;
   /* Right trim the name */
-  *l-- = '\0';
-  while(*l == ' ' || *l == '\t') *l-- = '\0';
+  cp = l + colon;
+  *cp-- = '\0';
+  while(cp >= l && (*cp == ' ' || *cp == '\t')) *cp-- = '\0';
   while(**v == ' ' || **v == '\t') (*v)++;
   return mtev_true;
 }
-static void
-mtev_http_log_request(mtev_http_session_ctx *ctx) {
-  char ip[64], timestr[64];
-  double time_ms;
-  struct tm *tm, tbuf;
-  time_t now;
-  struct timeval end_time, diff;
-
-  if(ctx->req.start_time.tv_sec == 0) return;
-  if(http_request_log_hook_invoke(ctx) != MTEV_HOOK_CONTINUE) return;
-
-  gettimeofday(&end_time, NULL);
-  now = end_time.tv_sec;
-  tm = gmtime_r(&now, &tbuf);
-  strftime(timestr, sizeof(timestr), "%d/%b/%Y:%H:%M:%S -0000", tm);
-  sub_timeval(end_time, ctx->req.start_time, &diff);
-  time_ms = diff.tv_sec * 1000 + (double)diff.tv_usec / 1000.0;
-  mtev_convert_sockaddr_to_buff(ip, sizeof(ip), &ctx->ac->remote.remote_addr);
-  mtevL(http_access, "%s - - [%s] \"%s %s%s%s %s\" %d %llu %.3f\n",
-        ip, timestr,
-        ctx->req.method_str, ctx->req.uri_str,
-        ctx->req.orig_qs ? "?" : "", ctx->req.orig_qs ? ctx->req.orig_qs : "",
-        ctx->req.protocol_str,
-        ctx->res.status_code,
-        (long long unsigned)ctx->res.bytes_written,
-        time_ms);
+/* Gather what is pending, the leader and then the body, starting at
+ * output_raw_offset into the first chain, up to max_len bytes.
+ */
+static int
+_http_gather_output(mtev_http_session_ctx *ctx, struct iovec *iov,
+                    int max_iov, size_t max_len) {
+  struct bchain *lists[2] = { ctx->res.leader, ctx->res.output_raw }, *b;
+  size_t offset = ctx->res.output_raw_offset, total = 0;
+  int i, cnt = 0;
+
+  for(i=0; i<2; i++) {
+    for(b = lists[i]; b && cnt < max_iov && total < max_len; b = b->next) {
+      size_t len;
+      if(b->type == BCHAIN_SENDFILE) return cnt;
+      len = MIN(b->size - offset, max_len - total);
+      if(len) {
+        iov[cnt].iov_base = b->buff + b->start + offset;
+        iov[cnt].iov_len = len;
+        total += len;
+        cnt++;
+      }
+      offset = 0;
+    }
+  }
+  return cnt;
 }
 
 static int
@@ -452,6 +705,8 @@ _http_perform_write(mtev_http_session_ctx *ctx, int *mask) {
   int len, tlen = 0;
   size_t attempt_write_len;
   struct bchain **head, *b;
+  struct iovec iov[MAX_WRITEV];
+  if(ctx->h2stream) return mtev_http2_stream_write(ctx, mask);
   pthread_mutex_lock(&ctx->write_lock);
  choose_bucket:
   head = ctx->res.leader ? &ctx->res.leader : &ctx->res.output_raw;
@@ -465,7 +720,8 @@ _http_perform_write(mtev_http_session_ctx *ctx, int *mask) {
   if(ctx->res.output_started == mtev_false) return EVENTER_EXCEPTION;
 #endif
   if(!b) {
-    if(ctx->res.closed) ctx->res.complete = mtev_true;
+    if(ctx->res.closed && !ctx->res.encoding_inflight)
+      ctx->res.complete = mtev_true;
     *mask = EVENTER_EXCEPTION;
     pthread_mutex_unlock(&ctx->write_lock);
     return tlen;
@@ -473,20 +729,37 @@ _http_perform_write(mtev_http_session_ctx *ctx, int *mask) {
 
   if(ctx->res.output_raw_offset >= b->size) {
     *head = b->next;
+    /* a vectored write may have run on into the following chains */
+    ctx->res.output_raw_offset -= b->size;
     FREE_BCHAIN(b);
     b = *head;
     if(b) b->prev = NULL;
-    ctx->res.output_raw_offset = 0;
     goto choose_bucket;
   }
 
-  attempt_write_len = b->size - ctx->res.output_raw_offset;
-  attempt_write_len = MIN(attempt_write_len, ctx->max_write);
+  if(b->type == BCHAIN_SENDFILE) {
+    /* only left as such if the opset has sendfile */
+    attempt_write_len = b->size - ctx->res.output_raw_offset;
+    attempt_write_len = MIN(attempt_write_len, MAX_SENDFILE);
+    len = ctx->conn.e->opset->
+            sendfile(ctx->conn.e->fd, b->fd,
+                     b->start + ctx->res.output_raw_offset,
+                     attempt_write_len, mask, ctx->conn.e);
+  }
+  else if(ctx->conn.e->opset->writev) {
+    int iovcnt = _http_gather_output(ctx, iov, MAX_WRITEV, ctx->max_write);
+    len = ctx->conn.e->opset->
+            writev(ctx->conn.e->fd, iov, iovcnt, mask, ctx->conn.e);
+  }
+  else {
+    attempt_write_len = b->size - ctx->res.output_raw_offset;
+    attempt_write_len = MIN(attempt_write_len, ctx->max_write);
 
-  len = ctx->conn.e->opset->
-          write(ctx->conn.e->fd,
-                b->buff + b->start + ctx->res.output_raw_offset,
-                attempt_write_len, mask, ctx->conn.e);
+    len = ctx->conn.e->opset->
+            write(ctx->conn.e->fd,
+                  b->buff + b->start + ctx->res.output_raw_offset,
+                  attempt_write_len, mask, ctx->conn.e);
+  }
   if(len == -1 && errno == EAGAIN) {
     *mask |= EVENTER_EXCEPTION;
     pthread_mutex_unlock(&ctx->write_lock);
@@ -501,13 +774,21 @@ _http_perform_write(mtev_http_session_ctx *ctx, int *mask) {
     pthread_mutex_unlock(&ctx->write_lock);
     return -1;
   }
-  mtevL(http_io, " http_write(%d) => %d [\n%.*s\n]\n", ctx->conn.e->fd,
-        len, len, b->buff + b->start + ctx->res.output_raw_offset);
+  if(b->type == BCHAIN_SENDFILE)
+    mtevL(http_io, " http_sendfile(%d) => %d\n", ctx->conn.e->fd, len);
+  else
+    mtevL(http_io, " http_write(%d) => %d [\n%.*s\n]\n", ctx->conn.e->fd,
+          len, (int)MIN((size_t)len, b->size - ctx->res.output_raw_offset),
+          b->buff + b->start + ctx->res.output_raw_offset);
   ctx->res.output_raw_offset += len;
   ctx->res.bytes_written += len;
   tlen += len;
   goto choose_bucket;
 }
+int
+mtev_http_session_write(mtev_http_session_ctx *ctx, int *mask) {
+  return _http_perform_write(ctx, mask);
+}
 static mtev_boolean
 mtev_http_request_finalize_headers(mtev_http_request *req, mtev_boolean *err) {
   int start;
@@ -538,10 +819,9 @@ mtev_http_request_finalize_headers(mtev_http_request *req, mtev_boolean *err) {
               REQ_PATSIZE - inset) == 0) goto match;
   }
   start = MAX(req->current_offset - REQ_PATSIZE, req->current_input->start);
-  mstr = strnstrn(REQ_PAT, REQ_PATSIZE,
-                  req->current_input->buff + start,
-                  req->current_input->size -
-                    (start - req->current_input->start));
+  mstr = mtev_memscan_crlfcrlf(req->current_input->buff + start,
+                               req->current_input->size -
+                                 (start - req->current_input->start));
   if(!mstr && req->current_input->next) {
     req->current_input = req->current_input->next;
     req->current_offset = req->current_input->start;
@@ -591,70 +871,68 @@ mtev_http_request_finalize_headers(mtev_http_request *req, mtev_boolean *err) {
   }
   /* Second step is to parse out the request itself */
   for(b = req->current_request_chain; b; b = b->next) {
-    char *curr_str, *next_str;
-    b->buff[b->start + b->size - 2] = '\0';
-    curr_str = b->buff + b->start;
+    mtev_memscan_line_t lines[32];
+    size_t off = 0, used;
+    int i, n;
     do {
-      next_str = strstr(curr_str, "\r\n");
-      if(next_str) {
-        *((char *)next_str) = '\0';
-        next_str += 2;
-      }
-      if(req->method_str && *curr_str == '\0')
-        break; /* our CRLFCRLF... end of req */
+      n = mtev_memscan_lines(b->buff + b->start + off, b->size - off, ':',
+                             lines, 32, &used);
+      for(i=0; i<n; i++) {
+        char *curr_str = b->buff + b->start + off + lines[i].start;
+        curr_str[lines[i].len] = '\0';
+        if(req->method_str && lines[i].len == 0)
+          goto headers_done; /* our CRLFCRLF... end of req */
 #define FAIL do { *err = mtev_true; return mtev_false; } while(0)
-      if(!req->method_str) { /* request line */
-        req->method_str = (char *)curr_str;
-        req->uri_str = strchr(curr_str, ' ');
-        if(!req->uri_str) FAIL;
-        *(req->uri_str) = '\0';
-        req->uri_str++;
-        req->protocol_str = strchr(req->uri_str, ' ');
-        if(!req->protocol_str) FAIL;
-        *(req->protocol_str) = '\0';
-        req->protocol_str++;
-        req->method = _method_enum(req->method_str);
-        req->protocol = _protocol_enum(req->protocol_str);
-        req->opts |= MTEV_HTTP_CLOSE;
-        if(req->protocol == MTEV_HTTP11) req->opts |= MTEV_HTTP_CHUNKED;
-      }
-      else { /* request headers */
-        const char *name, *value;
-        if(_extract_header(curr_str, &name, &value) == mtev_false) FAIL;
-        if(!name && !last_name) FAIL;
-        if(!strcmp(name ? name : last_name, "accept-encoding")) {
-          if(strstr(value, "gzip")) req->opts |= MTEV_HTTP_GZIP;
-          if(strstr(value, "deflate")) req->opts |= MTEV_HTTP_DEFLATE;
+        if(!req->method_str) { /* request line */
+          req->method_str = (char *)curr_str;
+          req->uri_str = strchr(curr_str, ' ');
+          if(!req->uri_str) FAIL;
+          *(req->uri_str) = '\0';
+          req->uri_str++;
+          req->protocol_str = strchr(req->uri_str, ' ');
+          if(!req->protocol_str) FAIL;
+          *(req->protocol_str) = '\0';
+          req->protocol_str++;
+          req->method = mtev_http_method_from_str(req->method_str);
+          req->protocol = _protocol_enum(req->protocol_str);
+          req->opts |= MTEV_HTTP_CLOSE;
+          if(req->protocol == MTEV_HTTP11) req->opts |= MTEV_HTTP_CHUNKED;
         }
-        if(name)
-          mtev_hash_replace(&req->headers, name, strlen(name), (void *)value,
-                            NULL, NULL);
-        else {
-          struct bchain *b;
-          const char *prefix = NULL;
-          int l1, l2;
-          mtev_hash_retr_str(&req->headers, last_name, strlen(last_name),
-                             &prefix);
-          if(!prefix) FAIL;
-          l1 = strlen(prefix);
-          l2 = strlen(value);
-          b = ALLOC_BCHAIN(l1 + l2 + 2);
-          b->next = req->current_request_chain;
-          b->next->prev = b;
-          req->current_request_chain = b;
-          b->size = l1 + l2 + 2;
-          memcpy(b->buff, prefix, l1);
-          b->buff[l1] = ' ';
-          memcpy(b->buff + l1 + 1, value, l2);
-          b->buff[l1 + 1 + l2] = '\0';
-          mtev_hash_replace(&req->headers, last_name, strlen(last_name),
-                            b->buff, NULL, NULL);
+        else { /* request headers */
+          const char *name, *value;
+          if(mtev_http_extract_header(curr_str, lines[i].delim, lines[i].len,
+                             &name, &value) == mtev_false) FAIL;
+          if(!name && !last_name) FAIL;
+          if(!strcmp(name ? name : last_name, "accept-encoding"))
+            mtev_http_request_parse_accept_encoding(req, value);
+          if(name)
+            mtev_hash_replace(&req->headers, name, strlen(name),
+                              (void *)value, NULL, NULL);
+          else {
+            char *joined;
+            const char *prefix = NULL;
+            int l1, l2;
+            mtev_hash_retr_str(&req->headers, last_name, strlen(last_name),
+                               &prefix);
+            if(!prefix) FAIL;
+            l1 = strlen(prefix);
+            l2 = strlen(value);
+            joined = _http_arena_alloc(req->arena, l1 + l2 + 2);
+            if(!joined) FAIL;
+            memcpy(joined, prefix, l1);
+            joined[l1] = ' ';
+            memcpy(joined + l1 + 1, value, l2);
+            joined[l1 + 1 + l2] = '\0';
+            mtev_hash_replace(&req->headers, last_name, strlen(last_name),
+                              joined, NULL, NULL);
+          }
+          if(name) last_name = name;
         }
-        if(name) last_name = name;
       }
-      curr_str = next_str;
-    } while(next_str);
+      off += used;
+    } while(n == 32);
   }
+ headers_done:
 
   /* headers are done... we could need to read a payload */
   if(mtev_hash_retrieve(&req->headers,
@@ -690,13 +968,19 @@ mtev_http_request_finalize_headers(mtev_http_request *req, mtev_boolean *err) {
   req->complete = mtev_true;
   return mtev_true;
 }
+/* Ready the request for dispatch */
+void
+mtev_http_request_start(mtev_http_request *req) {
+  mtev_http_process_querystring(req);
+  inplace_urldecode(req->uri_str);
+}
 void
 mtev_http_process_querystring(mtev_http_request *req) {
   char *cp, *interest, *brk = NULL;
   cp = strchr(req->uri_str, '?');
   if(!cp) return;
   *cp++ = '\0';
-  req->orig_qs = strdup(cp);
+  req->orig_qs = _http_arena_strdup(req->arena, cp);
   for (interest = strtok_r(cp, "&", &brk);
        interest;
        interest = strtok_r(NULL, "&", &brk)) {
@@ -774,7 +1058,14 @@ mtev_http_complete_request(mtev_http_session_ctx *ctx, int mask) {
       mtevL(http_io, " mtev_http:read(%d) => %d [\n%.*s\n]\n", ctx->conn.e->fd, len, len, in->buff + in->start + in->size);
     else
       mtevL(http_io, " mtev_http:read(%d) => %d\n", ctx->conn.e->fd, len);
-    if(len == -1 && errno == EAGAIN) return mask;
+    if(len == -1 && errno == EAGAIN) {
+      /* a keep-alive connection needn't hold 32k while it waits */
+      if(in->size == 0 && in == ctx->req.first_input) {
+        ctx->req.first_input = ctx->req.last_input = NULL;
+        FREE_BCHAIN(in);
+      }
+      return mask;
+    }
     if(len <= 0) goto full_error;
     if(len > 0) in->size += len;
     rv = mtev_http_request_finalize(&ctx->req, &err);
@@ -809,10 +1100,13 @@ mtev_http_session_prime_input(mtev_http_session_ctx *ctx,
 
 void
 mtev_http_request_release(mtev_http_session_ctx *ctx) {
-  mtev_hash_destroy(&ctx->req.querystring, NULL, NULL);
-  mtev_hash_destroy(&ctx->req.headers, NULL, NULL);
+  /* don't build a table just to tear it down */
+  if(ctx->req.querystring.ht.h)
+    mtev_hash_destroy(&ctx->req.querystring, NULL, NULL);
+  if(ctx->req.headers.ht.h)
+    mtev_hash_destroy(&ctx->req.headers, NULL, NULL);
   /* If we expected a payload, we expect a trailing \r\n */
-  if(ctx->req.has_payload) {
+  if(ctx->req.has_payload && !ctx->h2stream) {
     int drained, mask;
     ctx->drainage = ctx->req.content_length - ctx->req.content_length_read;
     /* best effort, we'll drain it before the next request anyway */
@@ -820,7 +1114,15 @@ mtev_http_request_release(mtev_http_session_ctx *ctx) {
     ctx->drainage -= drained;
   }
   RELEASE_BCHAIN(ctx->req.current_request_chain);
-  if(ctx->req.orig_qs) free(ctx->req.orig_qs);
+  /* a body view may have left an emptied chain ahead of the next request */
+  while(ctx->req.first_input && ctx->req.first_input->size == 0 &&
+        !ctx->h2stream) {
+    struct bchain *in = ctx->req.first_input;
+    ctx->req.first_input = in->next;
+    if(ctx->req.last_input == in) ctx->req.last_input = NULL;
+    in->next = NULL;
+    RELEASE_BCHAIN(in);
+  }
   /* If someone has jammed in a payload, clean that up too */
   if(ctx->req.upload.freefunc) {
     ctx->req.upload.freefunc(ctx->req.upload.data, ctx->req.upload.size,
@@ -829,17 +1131,14 @@ mtev_http_request_release(mtev_http_session_ctx *ctx) {
   memset(&ctx->req.state, 0,
          sizeof(ctx->req) - (unsigned long)&(((mtev_http_request *)0)->state));
 }
+static void _http_coalesce_disarm(mtev_http_session_ctx *);
 void
 mtev_http_response_release(mtev_http_session_ctx *ctx) {
-  mtev_hash_destroy(&ctx->res.headers, free, free);
-  if(ctx->res.status_reason) free(ctx->res.status_reason);
+  if(ctx->res.coalesce_timer) _http_coalesce_disarm(ctx);
   RELEASE_BCHAIN(ctx->res.leader);
   RELEASE_BCHAIN(ctx->res.output);
   RELEASE_BCHAIN(ctx->res.output_raw);
-  if(ctx->res.gzip) {
-    deflateEnd(ctx->res.gzip);
-    free(ctx->res.gzip);
-  }
+  if(ctx->res.encoder_state) ctx->res.encoder->destroy(ctx->res.encoder_state);
   memset(&ctx->res, 0, sizeof(ctx->res));
 }
 void
@@ -848,6 +1147,10 @@ mtev_http_ctx_session_release(mtev_http_session_ctx *ctx) {
     mtev_http_request_release(ctx);
     if(ctx->req.first_input) RELEASE_BCHAIN(ctx->req.first_input);
     mtev_http_response_release(ctx);
+    if(ctx->h2conn) mtev_http2_conn_free(ctx->h2conn);
+    if(ctx->h2stream) mtev_http2_stream_release(ctx);
+    if(ctx->ws) mtev_http_websocket_free(ctx);
+    _http_arena_reset(&ctx->arena, mtev_true);
     pthread_mutex_destroy(&ctx->write_lock);
     free(ctx);
   }
@@ -871,7 +1174,7 @@ mtev_http_session_req_consume_chunked(mtev_http_session_ctx *ctx,
       in = ctx->req.first_input = ctx->req.last_input =
           ALLOC_BCHAIN(DEFAULT_BCHAINSIZE);
     _fixup_bchain(in);
-    str_in_f = strnstrn("\r\n", 2, in->buff + in->start, in->size);
+    str_in_f = mtev_memscan_crlf(in->buff + in->start, in->size);
     if(str_in_f && ctx->req.next_chunk_read) {
       if(str_in_f != (in->buff + in->start)) {
         mtevL(http_debug, "HTTP chunked encoding error, no trailing CRLF.\n");
@@ -881,7 +1184,7 @@ mtev_http_session_req_consume_chunked(mtev_http_session_ctx *ctx,
       in->size -= 2;
       ctx->req.next_chunk_read = 0;
       ctx->req.next_chunk = 0;
-      str_in_f = strnstrn("\r\n", 2, in->buff + in->start, in->size);
+      str_in_f = mtev_memscan_crlf(in->buff + in->start, in->size);
     }
     if(str_in_f) {
       unsigned int clen = 0;
@@ -952,14 +1255,23 @@ mtev_http_session_req_consume_chunked(mtev_http_session_ctx *ctx,
 
   return next_chunk;
 }
-int
-mtev_http_session_req_consume(mtev_http_session_ctx *ctx,
-                              void *buf, size_t len, size_t blen,
-                              int *mask) {
+static int
+_http_req_consume(mtev_http_session_ctx *ctx,
+                  void *buf, size_t len, size_t blen,
+                  int *mask, const void **view) {
   size_t bytes_read = 0,
          expected = ctx->req.content_length - ctx->req.content_length_read;
   /* We attempt to consume from the first_input */
   struct bchain *in, *tofree;
+  if(ctx->h2stream)
+    return mtev_http2_stream_consume(ctx, buf, len, mask, view);
+  /* a view handed out last time leaves its chain empty, but in place */
+  while((in = ctx->req.first_input) != NULL && in->size == 0) {
+    ctx->req.first_input = in->next;
+    if(ctx->req.last_input == in) ctx->req.last_input = NULL;
+    in->next = NULL;
+    RELEASE_BCHAIN(in);
+  }
   if(ctx->req.payload_chunked) {
     if(ctx->req.next_chunk_read >= ctx->req.next_chunk) {
       int needed;
@@ -992,7 +1304,8 @@ mtev_http_session_req_consume(mtev_http_session_ctx *ctx,
     in = ctx->req.first_input;
     while(in && bytes_read < len) {
       int partial_len = MIN(in->size, len - bytes_read);
-      if(buf) memcpy((char *)buf+bytes_read, in->buff+in->start, partial_len);
+      if(view) *view = in->buff+in->start;
+      else if(buf) memcpy((char *)buf+bytes_read, in->buff+in->start, partial_len);
       bytes_read += partial_len;
       ctx->req.content_length_read += partial_len;
       if(ctx->req.payload_chunked) ctx->req.next_chunk_read += partial_len;
@@ -1001,6 +1314,7 @@ mtev_http_session_req_consume(mtev_http_session_ctx *ctx,
             (int)ctx->req.content_length);
       in->start += partial_len;
       in->size -= partial_len;
+      if(view && partial_len) return partial_len;
       if(in->size == 0) {
         tofree = in;
         ctx->req.first_input = in = in->next;
@@ -1051,6 +1365,272 @@ mtev_http_session_req_consume(mtev_http_session_ctx *ctx,
   /* NOT REACHED */
   return bytes_read;
 }
+int
+mtev_http_session_req_consume(mtev_http_session_ctx *ctx,
+                              void *buf, size_t len, size_t blen,
+                              int *mask) {
+  return _http_req_consume(ctx, buf, len, blen, mask, NULL);
+}
+int
+mtev_http_session_req_consume_view(mtev_http_session_ctx *ctx,
+                                   const void **data, size_t len,
+                                   int *mask) {
+  *data = NULL;
+  return _http_req_consume(ctx, NULL, len, len, mask, data);
+}
+
+/* Connections are counted per listener, found by its config table (the
+ * connections it accepts all share the one).  A keep-alive connection
+ * that waits idle_timeout ms for its next request is closed.  Past
+ * max_connections, a new connection closes the longest idle one to make
+ * room, or is refused if none is idle.  HTTP/2 and WebSocket connections
+ * count, but are never idle.
+ */
+struct http_listener {
+  mtev_hash_table *config;
+  char name[128];
+  unsigned int idle_timeout;
+  int max_connections;
+  pthread_mutex_t lock;  /* the idle list, kept only with a limit */
+  mtev_http_session_ctx *idle_head, *idle_tail;
+  mtev_atomic64_t connections;
+  mtev_atomic64_t idle;
+  mtev_atomic64_t accepted;
+  mtev_atomic64_t idle_timeouts;
+  mtev_atomic64_t shed;
+  mtev_atomic64_t refused;
+  struct http_listener *next;
+};
+static pthread_mutex_t http_listeners_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct http_listener *http_listeners;
+
+static uint64_t
+_http_now_ms() {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return (uint64_t)now.tv_sec * 1000 + now.tv_usec / 1000;
+}
+static struct http_listener *
+_http_listener_get(mtev_http_session_ctx *ctx) {
+  struct http_listener *lsn;
+  union {
+    struct sockaddr a;
+    struct sockaddr_in ip4;
+    struct sockaddr_in6 ip6;
+  } addr;
+  socklen_t addrlen = sizeof(addr);
+  const char *val;
+  size_t len;
+
+  pthread_mutex_lock(&http_listeners_lock);
+  for(lsn = http_listeners; lsn; lsn = lsn->next)
+    if(lsn->config == ctx->ac->config) break;
+  if(lsn) {
+    pthread_mutex_unlock(&http_listeners_lock);
+    return lsn;
+  }
+  lsn = calloc(1, sizeof(*lsn));
+  lsn->config = ctx->ac->config;
+  pthread_mutex_init(&lsn->lock, NULL);
+  if(mtev_hash_retr_str(lsn->config, "idle_timeout",
+                        strlen("idle_timeout"), &val))
+    lsn->idle_timeout = atoi(val);
+  if(mtev_hash_retr_str(lsn->config, "max_connections",
+                        strlen("max_connections"), &val))
+    lsn->max_connections = atoi(val);
+  strlcpy(lsn->name, "-", sizeof(lsn->name));
+  if(getsockname(ctx->conn.e->fd, &addr.a, &addrlen) == 0 &&
+     (len = mtev_convert_sockaddr_to_buff(lsn->name, sizeof(lsn->name),
+                                          &addr.a)) > 0) {
+    if(addr.a.sa_family == AF_INET)
+      snprintf(lsn->name + len, sizeof(lsn->name) - len, ":%d",
+               ntohs(addr.ip4.sin_port));
+    else if(addr.a.sa_family == AF_INET6)
+      snprintf(lsn->name + len, sizeof(lsn->name) - len, ":%d",
+               ntohs(addr.ip6.sin6_port));
+  }
+  lsn->next = http_listeners;
+  http_listeners = lsn;
+  pthread_mutex_unlock(&http_listeners_lock);
+  return lsn;
+}
+void
+mtev_http_foreach_listener(void (*f)(const mtev_http_listener_stats_t *,
+                                     void *), void *closure) {
+  struct http_listener *lsn;
+  mtev_http_listener_stats_t stats;
+  pthread_mutex_lock(&http_listeners_lock);
+  lsn = http_listeners;
+  pthread_mutex_unlock(&http_listeners_lock);
+  /* listeners are only ever prepended and never freed */
+  for(; lsn; lsn = lsn->next) {
+    stats.name = lsn->name;
+    stats.idle_timeout = lsn->idle_timeout;
+    stats.max_connections = lsn->max_connections;
+    stats.connections = lsn->connections;
+    stats.idle = lsn->idle;
+    stats.accepted = lsn->accepted;
+    stats.idle_timeouts = lsn->idle_timeouts;
+    stats.shed = lsn->shed;
+    stats.refused = lsn->refused;
+    f(&stats, closure);
+  }
+}
+static void
+_http_idle_unlist(struct http_listener *lsn, mtev_http_session_ctx *ctx) {
+  if(ctx->idle.prev) ctx->idle.prev->idle.next = ctx->idle.next;
+  else lsn->idle_head = ctx->idle.next;
+  if(ctx->idle.next) ctx->idle.next->idle.prev = ctx->idle.prev;
+  else lsn->idle_tail = ctx->idle.prev;
+  ctx->idle.prev = ctx->idle.next = NULL;
+  ctx->idle.listed = mtev_false;
+}
+/* Close a session from a timer on its own thread, by way of its driver,
+ * which is what releases everything attached to the connection. */
+static void
+_http_session_expire(mtev_http_session_ctx *ctx) {
+  ctx->idle.expired = mtev_true;
+  eventer_trigger(ctx->conn.e, EVENTER_READ | EVENTER_WRITE);
+}
+static int _http_idle_expired(eventer_t, int, void *, struct timeval *);
+static void
+_http_idle_arm(mtev_http_session_ctx *ctx, uint64_t when) {
+  eventer_t t = eventer_alloc();
+  t->whence.tv_sec = when / 1000;
+  t->whence.tv_usec = (when % 1000) * 1000;
+  t->mask = EVENTER_TIMER;
+  t->callback = _http_idle_expired;
+  t->closure = ctx;
+  t->thr_owner = ctx->conn.e->thr_owner;
+  mtev_http_session_ref_inc(ctx);
+  ctx->idle.timer = t;
+  eventer_add(t);
+}
+static void
+_http_idle_disarm(mtev_http_session_ctx *ctx) {
+  eventer_t t = ctx->idle.timer;
+  ctx->idle.timer = NULL;
+  if(eventer_remove(t)) {
+    eventer_free(t);
+    mtev_http_ctx_session_release(ctx);
+  }
+}
+static int
+_http_idle_expired(eventer_t e, int mask, void *closure,
+                   struct timeval *now) {
+  mtev_http_session_ctx *ctx = closure;
+  if(ctx->idle.timer == e) {
+    ctx->idle.timer = NULL;
+    /* busy now; it is armed again when it next goes idle */
+    if(ctx->idle.since && ctx->conn.e) {
+      uint64_t expires = ctx->idle.since + ctx->listener->idle_timeout;
+      if(_http_now_ms() < expires) _http_idle_arm(ctx, expires);
+      else {
+        mtev_atomic_inc64(&ctx->listener->idle_timeouts);
+        _http_session_expire(ctx);
+      }
+    }
+  }
+  mtev_http_ctx_session_release(ctx);
+  return 0;
+}
+/* Waiting on a request that hasn't begun: nothing read, nothing owed. */
+static mtev_boolean
+_http_session_idle(mtev_http_session_ctx *ctx) {
+  return ctx->conn.e && !ctx->h2conn && !ctx->ws && ctx->drainage == 0 &&
+         ctx->req.complete == mtev_false && ctx->req.first_input == NULL &&
+         ctx->res.output_started == mtev_false && ctx->res.leader == NULL;
+}
+static void
+_http_idle_enter(mtev_http_session_ctx *ctx) {
+  struct http_listener *lsn = ctx->listener;
+  if(!lsn || ctx->idle.since || !_http_session_idle(ctx)) return;
+  ctx->idle.since = _http_now_ms();
+  mtev_atomic_inc64(&lsn->idle);
+  if(lsn->max_connections) {
+    pthread_mutex_lock(&lsn->lock);
+    ctx->idle.prev = lsn->idle_tail;
+    if(lsn->idle_tail) lsn->idle_tail->idle.next = ctx;
+    else lsn->idle_head = ctx;
+    lsn->idle_tail = ctx;
+    ctx->idle.listed = mtev_true;
+    pthread_mutex_unlock(&lsn->lock);
+  }
+  if(lsn->idle_timeout && !ctx->idle.timer)
+    _http_idle_arm(ctx, ctx->idle.since + lsn->idle_timeout);
+}
+static void
+_http_idle_leave(mtev_http_session_ctx *ctx) {
+  struct http_listener *lsn = ctx->listener;
+  if(!ctx->idle.since) return;
+  ctx->idle.since = 0;
+  mtev_atomic_dec64(&lsn->idle);
+  if(lsn->max_connections) {
+    pthread_mutex_lock(&lsn->lock);
+    if(ctx->idle.listed) _http_idle_unlist(lsn, ctx);
+    ctx->idle.shed = mtev_false;
+    pthread_mutex_unlock(&lsn->lock);
+  }
+}
+static int
+_http_idle_shed(eventer_t e, int mask, void *closure, struct timeval *now) {
+  mtev_http_session_ctx *ctx = closure;
+  /* unless it has found something to do since it was picked */
+  if(ctx->idle.shed && ctx->idle.since && ctx->conn.e) {
+    mtev_atomic_inc64(&ctx->listener->shed);
+    _http_session_expire(ctx);
+  }
+  mtev_http_ctx_session_release(ctx);
+  return 0;
+}
+/* Make room for a connection; false if there is none to be had. */
+static mtev_boolean
+_http_listener_shed(struct http_listener *lsn) {
+  mtev_http_session_ctx *victim;
+  eventer_t t;
+
+  pthread_mutex_lock(&lsn->lock);
+  victim = lsn->idle_head;
+  if(victim) {
+    _http_idle_unlist(lsn, victim);
+    victim->idle.shed = mtev_true;
+    mtev_http_session_ref_inc(victim);
+    /* it is closed from its own thread; it can't leave before we're done
+     * here, as leaving idle takes this lock */
+    t = eventer_alloc();
+    t->mask = EVENTER_TIMER;
+    t->callback = _http_idle_shed;
+    t->closure = victim;
+    t->thr_owner = victim->conn.e->thr_owner;
+    gettimeofday(&t->whence, NULL);
+  }
+  pthread_mutex_unlock(&lsn->lock);
+  if(!victim) return mtev_false;
+  eventer_add(t);
+  return mtev_true;
+}
+static void
+_http_listener_attach(mtev_http_session_ctx *ctx) {
+  struct http_listener *lsn;
+  int64_t n;
+  if(!ctx->ac || !ctx->ac->config || !ctx->conn.e) return;
+  lsn = ctx->listener = _http_listener_get(ctx);
+  mtev_atomic_inc64(&lsn->accepted);
+  n = mtev_atomic_inc64(&lsn->connections);
+  if(lsn->max_connections && n > lsn->max_connections &&
+     !_http_listener_shed(lsn)) {
+    mtev_atomic_inc64(&lsn->refused);
+    ctx->idle.expired = mtev_true;
+  }
+}
+static void
+_http_listener_detach(mtev_http_session_ctx *ctx) {
+  if(!ctx->listener) return;
+  _http_idle_leave(ctx);
+  if(ctx->idle.timer) _http_idle_disarm(ctx);
+  mtev_atomic_dec64(&ctx->listener->connections);
+  ctx->listener = NULL;
+}
 
 int
 mtev_http_session_drive(eventer_t e, int origmask, void *closure,
@@ -1059,7 +1639,19 @@ mtev_http_session_drive(eventer_t e, int origmask, void *closure,
   int rv = 0;
   int mask = origmask;
 
-  if(origmask & EVENTER_EXCEPTION)
+  if(!ctx->listener) _http_listener_attach(ctx);
+  if(ctx->h2conn) {
+    rv = mtev_http2_session_drive(ctx, origmask);
+    if(ctx->conn.e == NULL) goto release;
+    return rv;
+  }
+  if(ctx->ws) {
+    rv = mtev_http_websocket_drive(ctx, origmask);
+    if(ctx->conn.e == NULL) goto release;
+    return rv;
+  }
+  _http_idle_leave(ctx);
+  if(origmask & EVENTER_EXCEPTION || ctx->idle.expired)
     goto abort_drive;
 
   /* Drainage -- this is as nasty as it sounds 
@@ -1089,23 +1681,46 @@ mtev_http_session_drive(eventer_t e, int origmask, void *closure,
     _http_perform_write(ctx, &maybe_write_mask);
     if(ctx->conn.e == NULL) goto release;
     if(ctx->req.complete != mtev_true) {
+      _http_idle_enter(ctx);
       mtevL(http_debug, " <- mtev_http_session_drive(%d) [%x]\n", e->fd,
             mask|maybe_write_mask);
       return mask | maybe_write_mask;
     }
+    if(ctx->req.protocol == MTEV_HTTP2) {
+      /* "PRI * HTTP/2.0", the start of the connection preface */
+      if(!ctx->http2 || strcmp(ctx->req.method_str, "PRI") ||
+         strcmp(ctx->req.uri_str, "*")) {
+        ctx->conn.needs_close = mtev_true;
+        goto abort_drive;
+      }
+      rv = mtev_http2_session_upgrade(ctx, origmask);
+      if(ctx->conn.e == NULL) goto release;
+      return rv;
+    }
     mtevL(http_debug, "HTTP start request (%s)\n", ctx->req.uri_str);
-    mtev_http_process_querystring(&ctx->req);
-    inplace_urldecode(ctx->req.uri_str);
+    /* now is when this readiness was dispatched to us; a pipelined
+     * request waiting on the one before it is counted from then. */
+    if(now) memcpy(&ctx->req.ready_time, now, sizeof(*now));
+    else gettimeofday(&ctx->req.ready_time, NULL);
+    mtev_http_request_start(&ctx->req);
   }
 
-  /* only dispatch if the response is not closed */
-  if(ctx->res.closed == mtev_false) {
+  /* only dispatch if the response is not closed (or held back) */
+ dispatch:
+  if(ctx->res.closed == mtev_false && ctx->res.suspended == mtev_false) {
     mtevL(http_debug, "   -> dispatch(%d)\n", e->fd);
     rv = ctx->dispatcher(ctx);
     mtevL(http_debug, "   <- dispatch(%d) = %d\n", e->fd, rv);
   }
 
   _http_perform_write(ctx, &mask);
+  if(mtev_http_response_drained(ctx)) goto dispatch;
+  if(ctx->ws) {
+    /* the handler upgraded; the 101 may not even be out yet */
+    rv = mtev_http_websocket_drive(ctx, origmask);
+    if(ctx->conn.e == NULL) goto release;
+    return rv;
+  }
   if(ctx->res.complete == mtev_true &&
      ctx->conn.e &&
      ctx->conn.needs_close == mtev_true) {
@@ -1121,6 +1736,7 @@ mtev_http_session_drive(eventer_t e, int origmask, void *closure,
     mtev_http_log_request(ctx);
     mtev_http_request_release(ctx);
     mtev_http_response_release(ctx);
+    _http_arena_reset(&ctx->arena, mtev_false);
   }
   if(ctx->req.complete == mtev_false) goto next_req;
   if(ctx->conn.e) {
@@ -1135,6 +1751,7 @@ mtev_http_session_drive(eventer_t e, int origmask, void *closure,
   /* We're about to release, unhook us from the acceptor_closure so we
    * don't get double freed */
   if(ctx->ac->service_ctx == ctx) ctx->ac->service_ctx = NULL;
+  _http_listener_detach(ctx);
   mtev_http_ctx_session_release(ctx);
   mtevL(http_debug, " <- mtev_http_session_drive(%d) [%x]\n", e->fd, 0);
   return 0;
@@ -1148,8 +1765,48 @@ mtev_http_session_ctx_new(mtev_http_dispatch_func f, void *c, eventer_t e,
   ctx->ref_cnt = 1;
   pthread_mutex_init(&ctx->write_lock, NULL);
   ctx->req.complete = mtev_false;
+  ctx->req.arena = &ctx->arena;
   ctx->conn.e = e;
   ctx->max_write = DEFAULT_MAXWRITE;
+  ctx->compress.min_size = DEFAULT_COMPRESSION_MIN_SIZE;
+  ctx->http2 = mtev_true;
+  if(ac && ac->config) {
+    const char *val;
+    if(mtev_hash_retr_str(ac->config, "http2", strlen("http2"), &val))
+      ctx->http2 = strcmp(val, "false") && strcmp(val, "off");
+    if(mtev_hash_retr_str(ac->config, "compression_level",
+                          strlen("compression_level"), &val)) {
+      ctx->compress.level = atoi(val);
+      ctx->compress.level_set = mtev_true;
+    }
+    if(mtev_hash_retr_str(ac->config, "compression_min_size",
+                          strlen("compression_min_size"), &val))
+      ctx->compress.min_size = strtoull(val, NULL, 10);
+    if(mtev_hash_retr_str(ac->config, "compression_offload_size",
+                          strlen("compression_offload_size"), &val))
+      ctx->compress.offload_size = strtoull(val, NULL, 10);
+    if(mtev_hash_retr_str(ac->config, "output_coalesce_size",
+                          strlen("output_coalesce_size"), &val))
+      ctx->coalesce.size = strtoull(val, NULL, 10);
+    if(mtev_hash_retr_str(ac->config, "output_coalesce_latency",
+                          strlen("output_coalesce_latency"), &val))
+      ctx->coalesce.latency = atoi(val);
+    if(mtev_hash_retr_str(ac->config, "output_high_water",
+                          strlen("output_high_water"), &val))
+      ctx->output_water.high = strtoull(val, NULL, 10);
+    ctx->output_water.low = ctx->output_water.high / 2;
+    if(mtev_hash_retr_str(ac->config, "output_low_water",
+                          strlen("output_low_water"), &val))
+      ctx->output_water.low = MIN(strtoull(val, NULL, 10),
+                                  ctx->output_water.high);
+    if(mtev_hash_retr_str(ac->config, "compression_jobq",
+                          strlen("compression_jobq"), &val)) {
+      ctx->compress.jobq = eventer_jobq_retrieve(val);
+      if(!ctx->compress.jobq)
+        mtevL(mtev_error, "http: no jobq '%s', compressing on default\n",
+              val);
+    }
+  }
   ctx->dispatcher = f;
   ctx->dispatcher_closure = c;
   ctx->ac = ac;
@@ -1163,32 +1820,46 @@ mtev_http_response_status_set(mtev_http_session_ctx *ctx,
   ctx->res.protocol = ctx->req.protocol;
   if(code < 100 || code > 999) return mtev_false;
   ctx->res.status_code = code;
-  if(ctx->res.status_reason) free(ctx->res.status_reason);
-  ctx->res.status_reason = strdup(reason);
+  ctx->res.status_reason = _http_arena_strdup(&ctx->arena, reason);
+  ctx->res.status_reason_len = strlen(ctx->res.status_reason);
   return mtev_true;
 }
 mtev_boolean
 mtev_http_response_header_set(mtev_http_session_ctx *ctx,
                               const char *name, const char *value) {
+  size_t nlen = strlen(name), vlen = strlen(value);
+  char *n, *v;
   if(ctx->res.output_started == mtev_true) return mtev_false;
-  mtev_hash_replace(&ctx->res.headers, strdup(name), strlen(name),
-                    strdup(value), free, free);
+  n = _http_arena_alloc(&ctx->arena, nlen + vlen + 2);
+  if(!n) return mtev_false;
+  v = n + nlen + 1;
+  memcpy(n, name, nlen + 1);
+  memcpy(v, value, vlen + 1);
+  _http_header_put(ctx, n, nlen, v, vlen);
   return mtev_true;
 }
 mtev_boolean
 mtev_http_response_option_set(mtev_http_session_ctx *ctx, u_int32_t opt) {
   if(ctx->res.output_started == mtev_true) return mtev_false;
+  /* An HTTP/2 body always runs to the end of its stream: whether asked to
+   * chunk or close, that is what it gets, without the headers for either.
+   */
+  if(ctx->res.protocol == MTEV_HTTP2 &&
+     (opt & (MTEV_HTTP_CHUNKED | MTEV_HTTP_CLOSE)))
+    opt = (opt & ~MTEV_HTTP_CHUNKED) | MTEV_HTTP_CLOSE;
   /* transfer and content encodings only allowed in HTTP/1.1 */
   if(ctx->res.protocol != MTEV_HTTP11 &&
      (opt & MTEV_HTTP_CHUNKED))
     return mtev_false;
-  if(ctx->res.protocol != MTEV_HTTP11 &&
-     (opt & (MTEV_HTTP_GZIP | MTEV_HTTP_DEFLATE)))
-    return mtev_false;
-  if(((ctx->res.output_options | opt) &
-      (MTEV_HTTP_GZIP | MTEV_HTTP_DEFLATE)) ==
-        (MTEV_HTTP_GZIP | MTEV_HTTP_DEFLATE))
+  if(ctx->res.protocol < MTEV_HTTP11 &&
+     (opt & MTEV_HTTP_ENCODINGS))
     return mtev_false;
+  /* only one content encoding, and only one we know */
+  if(opt & MTEV_HTTP_ENCODINGS) {
+    u_int32_t encs = (ctx->res.output_options | opt) & MTEV_HTTP_ENCODINGS;
+    if(encs & (encs - 1)) return mtev_false;
+    if(!mtev_http_encoder_by_option(encs)) return mtev_false;
+  }
 
   /* Check out "accept" set */
   if(!(opt & ctx->req.opts)) return mtev_false;
@@ -1196,20 +1867,58 @@ mtev_http_response_option_set(mtev_http_session_ctx *ctx, u_int32_t opt) {
   ctx->res.output_options |= opt;
   if(ctx->res.output_options & MTEV_HTTP_CHUNKED)
     CTX_ADD_HEADER("Transfer-Encoding", "chunked");
-  if(ctx->res.output_options & (MTEV_HTTP_GZIP | MTEV_HTTP_DEFLATE)) {
+  if(ctx->res.output_options & MTEV_HTTP_ENCODINGS) {
+    ctx->res.encoder =
+      mtev_http_encoder_by_option(ctx->res.output_options & MTEV_HTTP_ENCODINGS);
     CTX_ADD_HEADER("Vary", "Accept-Encoding");
-    if(ctx->res.output_options & MTEV_HTTP_GZIP)
-      CTX_ADD_HEADER("Content-Encoding", "gzip");
-    else if(ctx->res.output_options & MTEV_HTTP_DEFLATE)
-      CTX_ADD_HEADER("Content-Encoding", "deflate");
+    _http_header_put(ctx, "Content-Encoding", sizeof("Content-Encoding")-1,
+                     ctx->res.encoder->name, strlen(ctx->res.encoder->name));
   }
-  if(ctx->res.output_options & MTEV_HTTP_CLOSE) {
+  if((ctx->res.output_options & MTEV_HTTP_CLOSE) &&
+     ctx->res.protocol != MTEV_HTTP2) {
     CTX_ADD_HEADER("Connection", "close");
     ctx->conn.needs_close = mtev_true;
   }
   return mtev_true;
 }
 mtev_boolean
+mtev_http_response_encoding_negotiate(mtev_http_session_ctx *ctx) {
+  if(!ctx->req.encoding_pref) return mtev_false;
+  return mtev_http_response_option_set(ctx, ctx->req.encoding_pref);
+}
+mtev_boolean
+mtev_http_response_encoding_preset(mtev_http_session_ctx *ctx,
+                                   u_int32_t opt) {
+  mtev_http_encoder_t *enc = NULL;
+  if(ctx->res.output_started == mtev_true) return mtev_false;
+  if(opt) {
+    if(ctx->res.protocol < MTEV_HTTP11) return mtev_false;
+    if((opt & ~MTEV_HTTP_ENCODINGS) || (opt & (opt - 1))) return mtev_false;
+    if(!(opt & ctx->req.opts)) return mtev_false;
+    if((enc = mtev_http_encoder_by_option(opt)) == NULL) return mtev_false;
+  }
+  if(ctx->res.encoder_state) ctx->res.encoder->destroy(ctx->res.encoder_state);
+  ctx->res.encoder_state = NULL;
+  ctx->res.encoder = NULL;
+  ctx->res.output_options &= ~MTEV_HTTP_ENCODINGS;
+  if(enc) {
+    CTX_ADD_HEADER("Vary", "Accept-Encoding");
+    _http_header_put(ctx, "Content-Encoding", sizeof("Content-Encoding")-1,
+                     enc->name, strlen(enc->name));
+  }
+  else {
+    CTX_DEL_HEADER("Content-Encoding");
+  }
+  return mtev_true;
+}
+mtev_boolean
+mtev_http_response_compression_set(mtev_http_session_ctx *ctx, int level) {
+  if(ctx->res.output_started == mtev_true) return mtev_false;
+  ctx->res.compression_level = level;
+  ctx->res.compression_level_set = mtev_true;
+  return mtev_true;
+}
+mtev_boolean
 mtev_http_response_append(mtev_http_session_ctx *ctx,
                           const void *b, size_t l) {
   struct bchain *o;
@@ -1218,16 +1927,17 @@ mtev_http_response_append(mtev_http_session_ctx *ctx,
   if(ctx->res.output_started == mtev_true &&
      !(ctx->res.output_options & (MTEV_HTTP_CLOSE | MTEV_HTTP_CHUNKED)))
     return mtev_false;
+  pthread_mutex_lock(&ctx->write_lock);
   if(!ctx->res.output)
     ctx->res.output = ALLOC_BCHAIN(DEFAULT_BCHAINSIZE);
   assert(ctx->res.output != NULL);
   o = ctx->res.output;
   while(o->next) o = o->next;
   while(l > 0) {
-    if(o->allocd == o->start + o->size) {
-      /* Filled up, need another */
+    if(o->type != BCHAIN_INLINE || o->allocd == o->start + o->size) {
+      /* Filled up (or not ours to fill), need another */
       o->next = ALLOC_BCHAIN(DEFAULT_BCHAINSIZE);
-      o->next->prev = o->next;
+      o->next->prev = o;
       o = o->next;
     }
     if(o->allocd > o->start + o->size) {
@@ -1238,6 +1948,7 @@ mtev_http_response_append(mtev_http_session_ctx *ctx,
       l -= tocopy;
     }
   }
+  pthread_mutex_unlock(&ctx->write_lock);
   return mtev_true;
 }
 mtev_boolean
@@ -1248,6 +1959,7 @@ mtev_http_response_append_bchain(mtev_http_session_ctx *ctx,
   if(ctx->res.output_started == mtev_true &&
      !(ctx->res.output_options & (MTEV_HTTP_CHUNKED | MTEV_HTTP_CLOSE)))
     return mtev_false;
+  pthread_mutex_lock(&ctx->write_lock);
   if(!ctx->res.output)
     ctx->res.output = b;
   else {
@@ -1257,6 +1969,7 @@ mtev_http_response_append_bchain(mtev_http_session_ctx *ctx,
     o->next = b;
     b->prev = o;
   }
+  pthread_mutex_unlock(&ctx->write_lock);
   return mtev_true;
 }
 mtev_boolean
@@ -1267,131 +1980,93 @@ mtev_http_response_append_mmap(mtev_http_session_ctx *ctx,
   if(n == NULL) return mtev_false;
   return mtev_http_response_append_bchain(ctx, n);
 }
-static int casesort(const void *a, const void *b) {
-  return strcasecmp(*((const char **)a), *((const char **)b));
+mtev_boolean
+mtev_http_response_append_sendfile(mtev_http_session_ctx *ctx,
+                                   int fd, size_t len, off_t offset) {
+  struct bchain *n;
+  n = bchain_sendfile(fd, len, offset);
+  if(n == NULL) return mtev_false;
+  if(!mtev_http_response_append_bchain(ctx, n)) {
+    n->fd = -1; /* the caller keeps it */
+    n->type = BCHAIN_INLINE;
+    FREE_BCHAIN(n);
+    return mtev_false;
+  }
+  return mtev_true;
+}
+u_int32_t
+mtev_http_response_options(mtev_http_response *res) {
+  return res->output_options;
 }
 static int
 _http_construct_leader(mtev_http_session_ctx *ctx) {
-  int len = 0, tlen, kcnt;
+  size_t len;
   struct bchain *b;
   const char *protocol_str;
-  const char *key, *value;
-  int klen, i;
-  const char **keys;
-  mtev_hash_iter iter = MTEV_HASH_ITER_ZERO;
+  const char *reason = "unknown";
+  size_t reason_len = sizeof("unknown")-1;
+  char *cp;
+  int i;
 
   assert(!ctx->res.leader);
-  ctx->res.leader = b = ALLOC_BCHAIN(DEFAULT_BCHAINSIZE);
-
+  if(ctx->h2stream) return mtev_http2_stream_leader(ctx);
+  if(ctx->res.status_reason) {
+    reason = ctx->res.status_reason;
+    reason_len = ctx->res.status_reason_len;
+  }
   protocol_str = ctx->res.protocol == MTEV_HTTP11 ?
                    "HTTP/1.1" :
                    (ctx->res.protocol == MTEV_HTTP10 ?
                      "HTTP/1.0" :
                      "HTTP/0.9");
-  tlen = snprintf(b->buff, b->allocd, "%s %03d %s\r\n",
-                  protocol_str, ctx->res.status_code,
-                  ctx->res.status_reason ? ctx->res.status_reason : "unknown");
-  if(tlen < 0) return -1;
-  len = b->size = tlen;
-
-#define CTX_LEADER_APPEND(s, slen) do { \
-  if(b->size + slen > DEFAULT_BCHAINSIZE) { \
-    b->next = ALLOC_BCHAIN(DEFAULT_BCHAINSIZE); \
-    assert(b->next); \
-    b->next->prev = b; \
-    b = b->next; \
-  } \
-  assert(DEFAULT_BCHAINSIZE >= b->size + slen); \
-  memcpy(b->buff + b->start + b->size, s, slen); \
-  b->size += slen; \
-} while(0)
-  keys = alloca(sizeof(*keys)*mtev_hash_size(&ctx->res.headers));
-  i = 0;
-  while(mtev_hash_next_str(&ctx->res.headers, &iter,
-                           &key, &klen, &value)) {
-    keys[i++] = key;
-  }
-  qsort(keys, i, sizeof(*keys), casesort);
-  kcnt = i;
-  for(i=0;i<kcnt;i++) {
-    int vlen;
-    key = keys[i];
-    klen = strlen(key);
-    (void)mtev_hash_retr_str(&ctx->res.headers, key, klen, &value);
-    vlen = strlen(value);
-    CTX_LEADER_APPEND(key, klen);
-    CTX_LEADER_APPEND(": ", 2);
-    CTX_LEADER_APPEND(value, vlen);
-    CTX_LEADER_APPEND("\r\n", 2);
-  }
-  CTX_LEADER_APPEND("\r\n", 2);
-  return len;
-}
-static int memgzip2(mtev_http_response *res, Bytef *dest, uLongf *destLen,
-                    const Bytef *source, uLong sourceLen, int level,
-                    int deflate_option, mtev_boolean *done) {
-  int err, skip=0, expect = Z_OK;
-  if(!res->gzip) {
-    res->gzip = calloc(1, sizeof(*res->gzip));
-    err = deflateInit2(res->gzip, level, Z_DEFLATED, -15, 8,
-                       Z_DEFAULT_STRATEGY);
-    if (err != Z_OK) {
-      mtevL(mtev_error, "memgzip2() -> deflateInit2: %d\n", err);
-      return err;
-    }
 
-    memcpy(dest, gzip_header, sizeof(gzip_header));
-    skip = sizeof(gzip_header);
-    *destLen -= skip;
+  /* Size it, then copy it: "HTTP/1.x ddd reason\r\n", headers, "\r\n" */
+  len = 8 + 5 + reason_len + 2 + 2;
+  for(i=0; i<ctx->res.nheaders; i++)
+    len += ctx->res.headers[i].nlen + 2 + ctx->res.headers[i].vlen + 2;
+  ctx->res.leader = b = ALLOC_BCHAIN(len);
+  if(!b) return -1;
+
+  cp = b->buff;
+  memcpy(cp, protocol_str, 8); cp += 8;
+  *cp++ = ' ';
+  *cp++ = '0' + (ctx->res.status_code / 100) % 10;
+  *cp++ = '0' + (ctx->res.status_code / 10) % 10;
+  *cp++ = '0' + ctx->res.status_code % 10;
+  *cp++ = ' ';
+  memcpy(cp, reason, reason_len); cp += reason_len;
+  *cp++ = '\r'; *cp++ = '\n';
+  for(i=0; i<ctx->res.nheaders; i++) {
+    struct http_header *h = &ctx->res.headers[i];
+    memcpy(cp, h->name, h->nlen); cp += h->nlen;
+    *cp++ = ':'; *cp++ = ' ';
+    memcpy(cp, h->value, h->vlen); cp += h->vlen;
+    *cp++ = '\r'; *cp++ = '\n';
   }
-  res->gzip->next_in = (Bytef*)source;
-  res->gzip->avail_in = (uInt)sourceLen;
-  res->gzip->next_out = dest + skip;
-  res->gzip->avail_out = (uInt)*destLen;
-  if ((uLong)res->gzip->avail_out != *destLen) return Z_BUF_ERROR;
-
-  err = deflate(res->gzip, deflate_option);
-
-  if(deflate_option == Z_FINISH) expect = Z_STREAM_END;
-  if (err != Z_OK && err != expect) {
-    mtevL(mtev_error, "memgzip2() -> deflate: got %d, need %d\n", err, expect);
-    deflateEnd(res->gzip);
-    free(res->gzip);
-    res->gzip = NULL;
-    return err == Z_OK ? Z_BUF_ERROR : err;
-  }
-  if(done) *done = (err == Z_STREAM_END) ? mtev_true : mtev_false;
-  *destLen = (*destLen - res->gzip->avail_out) + skip;
-
-  return Z_OK;
+  *cp++ = '\r'; *cp++ = '\n';
+  b->size = cp - b->buff;
+  assert(b->size == len);
+  return len;
 }
 static mtev_boolean
 _http_encode_chain(mtev_http_response *res,
                    struct bchain *out, void *inbuff, int inlen,
                    mtev_boolean final, mtev_boolean *done) {
   int opts = res->output_options;
-  /* implement gzip and deflate! */
   if(done && final) *done = mtev_true;
-  if(opts & MTEV_HTTP_GZIP) {
-    uLongf olen;
-    int err;
-    olen = out->allocd - out->start - 2; /* leave 2 for the \r\n */
-    err = memgzip2(res, (Bytef *)(out->buff + out->start), &olen,
-                   (Bytef *)(inbuff), (uLong)inlen,
-                   9, final ? Z_FINISH : Z_NO_FLUSH, done);
-    if(Z_OK != err) {
-      mtevL(mtev_error, "zlib compress2 error %d\n", err);
+  if((opts & MTEV_HTTP_ENCODINGS) && res->encoder) {
+    mtev_http_encoder_t *enc = res->encoder;
+    size_t olen;
+    if(!res->encoder_state &&
+       (res->encoder_state = enc->create(res->compression_level)) == NULL) {
+      mtevL(mtev_error, "%s encoder creation failed\n", enc->name);
       return mtev_false;
     }
-    out->size += olen;
-  }
-  else if(opts & MTEV_HTTP_DEFLATE) {
-    uLongf olen;
     olen = out->allocd - out->start - 2; /* leave 2 for the \r\n */
-    if(Z_OK != compress2((Bytef *)(out->buff + out->start), &olen,
-                         (Bytef *)(inbuff), (uLong)inlen,
-                         9)) {
-      mtevL(mtev_error, "zlib compress2 error\n");
+    if(enc->encode(res->encoder_state, inbuff, inlen,
+                   out->buff + out->start, &olen, final, done) != 0) {
+      enc->destroy(res->encoder_state);
+      res->encoder_state = NULL;
       return mtev_false;
     }
     out->size += olen;
@@ -1411,11 +2086,45 @@ mtev_http_process_output_bchain(mtev_http_session_ctx *ctx,
   int ilen, maxlen = in->size, hexlen;
   int opts = ctx->res.output_options;
 
+  if(in->type == BCHAIN_SENDFILE) {
+    struct bchain *m;
+    if(0 == (opts & MTEV_HTTP_ENCODINGS) && !ctx->h2stream &&
+       ctx->conn.e && ctx->conn.e->opset->sendfile) {
+      out = ALLOC_BCHAIN(0);
+      out->buff = NULL;
+      out->type = in->type;
+      out->fd = in->fd;
+      out->start = in->start;
+      out->size = in->size;
+      in->type = BCHAIN_INLINE;
+      in->fd = -1;
+      if(out->size > 0 && (opts & MTEV_HTTP_CHUNKED)) {
+        /* frame it in chains of its own rather than copy it */
+        char hex[20];
+        struct bchain *head, *tail;
+        snprintf(hex, sizeof(hex), "%llx\r\n", (unsigned long long)out->size);
+        head = bchain_from_data(hex, strlen(hex));
+        tail = bchain_from_data("\r\n", 2);
+        head->next = out;
+        out->prev = head;
+        out->next = tail;
+        tail->prev = out;
+        out = head;
+      }
+      return out;
+    }
+    /* Encoding (or TLS) needs the bytes, map them in and carry on. */
+    if((m = bchain_sendfile_mmap(in)) == NULL) return NULL;
+    out = mtev_http_process_output_bchain(ctx, m);
+    FREE_BCHAIN(m);
+    return out;
+  }
   if(in->type == BCHAIN_MMAP &&
-     0 == (opts & (MTEV_HTTP_GZIP | MTEV_HTTP_DEFLATE | MTEV_HTTP_CHUNKED))) {
+     0 == (opts & (MTEV_HTTP_ENCODINGS | MTEV_HTTP_CHUNKED))) {
     out = ALLOC_BCHAIN(0);
     out->buff = in->buff;
     out->type = in->type;
+    out->start = in->start;
     out->size = in->size;
     out->allocd = in->allocd;
     in->type = BCHAIN_INLINE;
@@ -1423,8 +2132,8 @@ mtev_http_process_output_bchain(mtev_http_session_ctx *ctx,
   }
   /* a chunked header looks like: hex*\r\ndata\r\n */
   /* let's assume that content never gets "larger" */
-  if(opts & MTEV_HTTP_GZIP) maxlen = deflateBound(NULL, in->size);
-  else if(opts & MTEV_HTTP_DEFLATE) maxlen = compressBound(in->size);
+  if((opts & MTEV_HTTP_ENCODINGS) && ctx->res.encoder)
+    maxlen = ctx->res.encoder->bound(in->size);
 
   /* So, the link size is the len(data) + 4 + ceil(log(len(data))/log(16)) */
   ilen = maxlen;
@@ -1437,7 +2146,7 @@ mtev_http_process_output_bchain(mtev_http_session_ctx *ctx,
   if(opts & MTEV_HTTP_CHUNKED) out->start = hexlen + 2;
   if(_http_encode_chain(&ctx->res, out,in->buff + in->start, in->size,
                         mtev_false, NULL) == mtev_false) {
-    free(out);
+    FREE_BCHAIN(out);
     return NULL;
   }
   if(out->size == 0) {
@@ -1468,11 +2177,11 @@ mtev_http_process_output_bchain(mtev_http_session_ctx *ctx,
   }
   return out;
 }
-void
-raw_finalize_encoding(mtev_http_response *res) {
-  if(res->output_options & MTEV_HTTP_GZIP) {
+static void
+_http_finalize_encoding(mtev_http_response *res, struct bchain **head) {
+  if(res->encoder_state) {
     mtev_boolean finished = mtev_false;
-    struct bchain *r = res->output_raw;
+    struct bchain *r = *head;
     while(r && r->next) r = r->next;
     while(finished == mtev_false) {
       int hexlen, ilen;
@@ -1484,12 +2193,19 @@ raw_finalize_encoding(mtev_http_response *res) {
       while(ilen) { ilen >>= 4; hexlen++; }
       if(hexlen == 0) hexlen = 1;
 
-      out->start += hexlen + 2;
+      if(!(res->output_options & MTEV_HTTP_CHUNKED)) hexlen = 0;
+      else out->start += hexlen + 2;
       if(_http_encode_chain(res, out, "", 0, mtev_true,
                             &finished) == mtev_false) {
         FREE_BCHAIN(out);
         break;
       }
+      if(out->size == 0) {
+        /* an empty chunk would end the response */
+        FREE_BCHAIN(out);
+        continue;
+      }
+      if(hexlen == 0) goto link;
 
       ilen = out->size;
       assert(out->start+out->size+2 <= out->allocd);
@@ -1511,8 +2227,9 @@ raw_finalize_encoding(mtev_http_response *res) {
         out->start++;
         out->size--;
       }
+     link:
       if(r == NULL)
-        res->output_raw = out;
+        *head = out;
       else {
         r->next = out;
         out->prev = r;
@@ -1520,23 +2237,332 @@ raw_finalize_encoding(mtev_http_response *res) {
       r = out;
     }
 
-    deflateEnd(res->gzip);
-    free(res->gzip);
-    res->gzip = NULL;
+    if(res->encoder_state) res->encoder->destroy(res->encoder_state);
+    res->encoder_state = NULL;
+  }
+}
+void
+raw_finalize_encoding(mtev_http_response *res) {
+  _http_finalize_encoding(res, &res->output_raw);
+}
+/* Encoding a large, complete body on a jobq so the loop isn't held up. */
+struct http_encode_job {
+  mtev_http_session_ctx *ctx;
+  u_int32_t options;
+  int level;
+  mtev_http_encoder_t *encoder;
+  struct bchain *in;
+  struct bchain *out;
+  mtev_boolean failed;
+};
+
+static int
+_http_encode_asynch(eventer_t e, int mask, void *closure,
+                    struct timeval *now) {
+  struct http_encode_job *job = closure;
+  mtev_http_session_ctx *ctx = job->ctx;
+
+  if(mask == EVENTER_ASYNCH_WORK) {
+    /* Work against a private session so nothing live is touched. */
+    mtev_http_session_ctx shadow;
+    struct bchain *o, *n, *r = NULL;
+    memset(&shadow, 0, sizeof(shadow));
+    shadow.res.output_options = job->options;
+    shadow.res.compression_level = job->level;
+    shadow.res.encoder = job->encoder;
+    for(o = job->in; o; o = o->next) {
+      n = mtev_http_process_output_bchain(&shadow, o);
+      if(!n) {
+        mtevL(mtev_error, "mtev_http_process_output_bchain: NULL\n");
+        job->failed = mtev_true;
+        break;
+      }
+      if(r) {
+        r->next = n;
+        n->prev = r;
+      }
+      else job->out = n;
+      for(r = n; r->next; r = r->next);
+    }
+    if(!job->failed) _http_finalize_encoding(&shadow.res, &job->out);
+    if(shadow.res.encoder_state)
+      shadow.res.encoder->destroy(shadow.res.encoder_state);
+  }
+  if(mask == EVENTER_ASYNCH) {
+    RELEASE_BCHAIN(job->in);
+    if(ctx->conn.e && ctx->res.encoding_inflight) {
+      struct bchain *r, *n = NULL;
+      if(job->failed) {
+        /* A partial body must not look complete: send nothing more and
+         * close once what is already queued (the leader) is out. */
+        RELEASE_BCHAIN(job->out);
+        ctx->conn.needs_close = mtev_true;
+      }
+      else if(job->options & MTEV_HTTP_CHUNKED)
+        n = bchain_from_data("0\r\n\r\n", 5);
+      if(job->out) {
+        for(r = job->out; r->next; r = r->next);
+        r->next = n;
+        if(n) n->prev = r;
+      }
+      else job->out = n;
+      pthread_mutex_lock(&ctx->write_lock);
+      for(r = ctx->res.output_raw; r && r->next; r = r->next);
+      if(r) {
+        r->next = job->out;
+        if(job->out) job->out->prev = r;
+      }
+      else ctx->res.output_raw = job->out;
+      ctx->res.encoding_inflight = mtev_false;
+      pthread_mutex_unlock(&ctx->write_lock);
+      mtev_http_session_trigger(ctx, EVENTER_WRITE);
+    }
+    else {
+      RELEASE_BCHAIN(job->out);
+    }
+    mtev_http_ctx_session_release(ctx);
+    free(job);
+  }
+  return 0;
+}
+
+static void
+_http_encode_offload(mtev_http_session_ctx *ctx) {
+  struct http_encode_job *job;
+  eventer_t e;
+
+  job = calloc(1, sizeof(*job));
+  job->ctx = ctx;
+  job->options = ctx->res.output_options;
+  job->level = ctx->res.compression_level;
+  job->encoder = ctx->res.encoder;
+  job->in = ctx->res.output;
+  ctx->res.output = NULL;
+  ctx->res.closed = mtev_true;
+  ctx->res.encoding_inflight = mtev_true;
+  mtev_http_session_ref_inc(ctx);
+
+  e = eventer_alloc();
+  e->mask = EVENTER_ASYNCH;
+  e->callback = _http_encode_asynch;
+  e->closure = job;
+  if(ctx->conn.e) e->thr_owner = ctx->conn.e->thr_owner;
+  eventer_add_asynch(ctx->compress.jobq, e);
+}
+
+static size_t
+_http_response_buffered(mtev_http_session_ctx *ctx) {
+  struct bchain *b;
+  size_t n = 0;
+  pthread_mutex_lock(&ctx->write_lock);
+  for(b = ctx->res.output; b; b = b->next) n += b->size;
+  for(b = ctx->res.leader; b; b = b->next) n += b->size;
+  for(b = ctx->res.output_raw; b; b = b->next) n += b->size;
+  n -= MIN(n, ctx->res.output_raw_offset);
+  pthread_mutex_unlock(&ctx->write_lock);
+  return n;
+}
+size_t
+mtev_http_response_buffered(mtev_http_session_ctx *ctx) {
+  return _http_response_buffered(ctx);
+}
+void
+mtev_http_response_watermarks(mtev_http_session_ctx *ctx,
+                              size_t high, size_t low,
+                              mtev_http_response_watermark_func f,
+                              void *closure) {
+  ctx->res.high_water = high;
+  ctx->res.low_water = MIN(low, high);
+  ctx->res.watermark = f;
+  ctx->res.watermark_closure = closure;
+}
+mtev_boolean
+mtev_http_response_suspended(mtev_http_session_ctx *ctx) {
+  return ctx->res.suspended;
+}
+static void
+_http_response_check_high(mtev_http_session_ctx *ctx) {
+  size_t high = ctx->res.high_water ? ctx->res.high_water
+                                    : ctx->output_water.high;
+  if(!high || ctx->res.suspended || ctx->res.closed) return;
+  if(_http_response_buffered(ctx) <= high) return;
+  ctx->res.suspended = mtev_true;
+  if(ctx->res.watermark)
+    ctx->res.watermark(ctx, mtev_true, ctx->res.watermark_closure);
+}
+/* A suspended response that has written its way down to the low
+ * watermark resumes; true if its dispatcher should be called. */
+mtev_boolean
+mtev_http_response_drained(mtev_http_session_ctx *ctx) {
+  size_t low = ctx->res.high_water ? ctx->res.low_water
+                                   : ctx->output_water.low;
+  if(!ctx->res.suspended) return mtev_false;
+  if(_http_response_buffered(ctx) > low) return mtev_false;
+  ctx->res.suspended = mtev_false;
+  if(ctx->res.watermark)
+    ctx->res.watermark(ctx, mtev_false, ctx->res.watermark_closure);
+  return !ctx->res.closed && ctx->conn.e != NULL;
+}
+
+void
+mtev_http_response_coalesce(mtev_http_session_ctx *ctx, size_t size,
+                            unsigned int latency_ms) {
+  ctx->res.coalesce_set = mtev_true;
+  ctx->res.coalesce_size = size;
+  ctx->res.coalesce_latency = latency_ms;
+}
+static void
+_http_coalesce_disarm(mtev_http_session_ctx *ctx) {
+  eventer_t t = ctx->res.coalesce_timer;
+  ctx->res.coalesce_timer = NULL;
+  if(eventer_remove(t)) {
+    eventer_free(t);
+    mtev_http_ctx_session_release(ctx);
+  }
+}
+static mtev_boolean _mtev_http_response_flush(mtev_http_session_ctx *,
+                                              mtev_boolean, mtev_boolean,
+                                              mtev_boolean);
+static int
+_http_coalesce_expired(eventer_t e, int mask, void *closure,
+                       struct timeval *now) {
+  mtev_http_session_ctx *ctx = closure;
+  mtev_boolean due = mtev_false;
+  pthread_mutex_lock(&ctx->write_lock);
+  if(ctx->res.coalesce_timer == e) {
+    ctx->res.coalesce_timer = NULL;
+    due = ctx->res.output != NULL;
   }
+  pthread_mutex_unlock(&ctx->write_lock);
+  /* A producer may flush (or end) first; the flush rechecks. */
+  if(due) _mtev_http_response_flush(ctx, mtev_false, mtev_true, mtev_false);
+  mtev_http_ctx_session_release(ctx);
+  return 0;
 }
+/* Whether output may be held now; the latency bound is armed if so.
+ * Must hold write_lock. */
+static mtev_boolean
+_http_coalesce_hold(mtev_http_session_ctx *ctx) {
+  size_t size = ctx->res.coalesce_set ? ctx->res.coalesce_size
+                                      : ctx->coalesce.size;
+  unsigned int latency = ctx->res.coalesce_set ? ctx->res.coalesce_latency
+                                               : ctx->coalesce.latency;
+  size_t pending = 0;
+  struct bchain *o;
+  eventer_t t;
+  struct timeval now, diff;
+
+  if(!size) return mtev_false;
+  for(o = ctx->res.output; o && pending < size; o = o->next)
+    pending += o->size;
+  if(pending >= size) return mtev_false;
+  if(!latency || ctx->res.coalesce_timer || !pending) return mtev_true;
+  /* the timer has to run where the socket is written */
+  if(!ctx->conn.e) return mtev_false;
+  t = eventer_alloc();
+  gettimeofday(&now, NULL);
+  diff.tv_sec = latency / 1000;
+  diff.tv_usec = (latency % 1000) * 1000;
+  add_timeval(now, diff, &t->whence);
+  t->mask = EVENTER_TIMER;
+  t->callback = _http_coalesce_expired;
+  t->closure = ctx;
+  t->thr_owner = ctx->conn.e->thr_owner;
+  mtev_http_session_ref_inc(ctx);
+  ctx->res.coalesce_timer = t;
+  eventer_add(t);
+  return mtev_true;
+}
+/* Runs of plain appended links become one, so they're encoded (and
+ * chunked) in one go. */
+static void
+_http_coalesce_output(mtev_http_response *res) {
+  struct bchain *o, *n, *run, *m;
+  size_t size;
+  for(o = res->output; o; o = o->next) {
+    if(o->type != BCHAIN_INLINE || !o->next ||
+       o->next->type != BCHAIN_INLINE) continue;
+    size = 0;
+    for(run = o; run && run->type == BCHAIN_INLINE; run = run->next)
+      size += run->size;
+    m = ALLOC_BCHAIN(size);
+    if(!m) return;
+    for(n = o; n != run; ) {
+      struct bchain *tofree = n;
+      memcpy(m->buff + m->size, n->buff + n->start, n->size);
+      m->size += n->size;
+      n = n->next;
+      FREE_BCHAIN(tofree);
+    }
+    m->prev = NULL;
+    m->next = run;
+    if(run) run->prev = m;
+    /* o was the first of the run; m takes its place */
+    if(res->output == o) res->output = m;
+    else {
+      struct bchain *p;
+      for(p = res->output; p->next != o; p = p->next);
+      p->next = m;
+      m->prev = p;
+    }
+    o = m;
+  }
+}
+
 static mtev_boolean
 _mtev_http_response_flush(mtev_http_session_ctx *ctx,
                           mtev_boolean final,
-                          mtev_boolean update_eventer) {
+                          mtev_boolean update_eventer,
+                          mtev_boolean may_hold) {
   struct bchain *o, *r;
   int mask, rv;
+  mtev_boolean offload = mtev_false, failed = mtev_false;
 
   if(ctx->res.closed == mtev_true) return mtev_false;
+  /* The output chain is shared with the coalescing timer, which runs on
+   * the owning loop while a producer may be on a jobq; see mtev_http.h. */
+  pthread_mutex_lock(&ctx->write_lock);
+  if(ctx->res.closed == mtev_true) {
+    pthread_mutex_unlock(&ctx->write_lock);
+    return mtev_false;
+  }
   if(ctx->res.output_started == mtev_false) {
+    /* The response's own level wins, then the listener's, and failing
+     * both the encoder knows best. */
+    if(!ctx->res.compression_level_set && ctx->res.encoder)
+      ctx->res.compression_level = ctx->compress.level_set ?
+        ctx->compress.level : ctx->res.encoder->default_level;
+    /* With the whole body in hand, we can judge whether encoding it is
+     * worthwhile, and whether it is big enough to do elsewhere. */
+    if(final && (ctx->res.output_options & MTEV_HTTP_ENCODINGS)) {
+      size_t size = 0;
+      for(o = ctx->res.output; o; o = o->next) size += o->size;
+      if(size < ctx->compress.min_size) {
+        ctx->res.output_options &= ~MTEV_HTTP_ENCODINGS;
+        ctx->res.encoder = NULL;
+        CTX_DEL_HEADER("Content-Encoding");
+      }
+      else if(ctx->compress.offload_size &&
+              size >= ctx->compress.offload_size) {
+        offload = mtev_true;
+      }
+    }
     _http_construct_leader(ctx);
     ctx->res.output_started = mtev_true;
   }
+  if(offload) {
+    _http_encode_offload(ctx);
+    pthread_mutex_unlock(&ctx->write_lock);
+    /* the leader can go out in the meantime */
+    goto write;
+  }
+  if(!final && may_hold && _http_coalesce_hold(ctx)) {
+    pthread_mutex_unlock(&ctx->write_lock);
+    goto write;
+  }
+  if(ctx->res.coalesce_timer) _http_coalesce_disarm(ctx);
+  if(ctx->res.coalesce_set ? ctx->res.coalesce_size : ctx->coalesce.size)
+    _http_coalesce_output(&ctx->res);
   /* encode output to output_raw */
   r = ctx->res.output_raw;
   while(r && r->next) r = r->next;
@@ -1547,10 +2573,13 @@ _mtev_http_response_flush(mtev_http_session_ctx *ctx,
     struct bchain *tofree, *n;
     n = mtev_http_process_output_bchain(ctx, o);
     if(!n) {
-      /* Bad, response stops here! */
+      /* Bad, response stops here!  Don't terminate it as if it were
+       * whole; the connection is closed after what we have is sent. */
       mtevL(mtev_error, "mtev_http_process_output_bchain: NULL\n");
-      while(o) { tofree = o; o = o->next; free(tofree); }
+      while(o) { tofree = o; o = o->next; FREE_BCHAIN(tofree); }
+      ctx->conn.needs_close = mtev_true;
       final = mtev_true;
+      failed = mtev_true;
       break;
     }
     if(r) {
@@ -1561,19 +2590,20 @@ _mtev_http_response_flush(mtev_http_session_ctx *ctx,
     else {
       r = ctx->res.output_raw = n;
     }
+    while(r->next) r = r->next; /* n may be several links */
     tofree = o; o = o->next; FREE_BCHAIN(tofree); /* advance and free */
   }
   ctx->res.output = NULL;
   if(final) {
     struct bchain *n;
     ctx->res.closed = mtev_true;
-    raw_finalize_encoding(&ctx->res);
+    if(!failed) raw_finalize_encoding(&ctx->res);
     /* We could have just pushed in the only block */
     if(!r) r = ctx->res.output_raw;
     /* Advance to the end to append out ending */
     if(r) while(r->next) r = r->next;
     /* Create an ending */
-    if(ctx->res.output_options & MTEV_HTTP_CHUNKED)
+    if(!failed && (ctx->res.output_options & MTEV_HTTP_CHUNKED))
       n = bchain_from_data("0\r\n\r\n", 5);
     else
       n = NULL;
@@ -1586,13 +2616,16 @@ _mtev_http_response_flush(mtev_http_session_ctx *ctx,
       ctx->res.output_raw = n;
     }
   }
+  pthread_mutex_unlock(&ctx->write_lock);
 
+ write:
   rv = _http_perform_write(ctx, &mask);
   if(update_eventer && ctx->conn.e &&
      eventer_find_fd(ctx->conn.e->fd) == ctx->conn.e) {
       eventer_update(ctx->conn.e, mask);
   }
   if(rv < 0) return mtev_false;
+  _http_response_check_high(ctx);
   /* If the write fails completely, the event will not be closed,
    * the following should not trigger the false case.
    */
@@ -1602,12 +2635,16 @@ _mtev_http_response_flush(mtev_http_session_ctx *ctx,
 mtev_boolean
 mtev_http_response_flush(mtev_http_session_ctx *ctx,
                          mtev_boolean final) {
-  return _mtev_http_response_flush(ctx, final, mtev_true);
+  return _mtev_http_response_flush(ctx, final, mtev_true, mtev_true);
 }
 mtev_boolean
 mtev_http_response_flush_asynch(mtev_http_session_ctx *ctx,
                                 mtev_boolean final) {
-  return _mtev_http_response_flush(ctx, final, mtev_false);
+  return _mtev_http_response_flush(ctx, final, mtev_false, mtev_true);
+}
+mtev_boolean
+mtev_http_response_flush_now(mtev_http_session_ctx *ctx) {
+  return _mtev_http_response_flush(ctx, mtev_false, mtev_true, mtev_false);
 }
 
 mtev_boolean
@@ -1646,6 +2683,8 @@ mtev_http_response_xml(mtev_http_session_ctx *ctx, xmlDocPtr doc) {
 void
 mtev_http_init() {
   http_debug = mtev_log_stream_find("debug/http");
-  http_access = mtev_log_stream_find("http/access");
   http_io = mtev_log_stream_find("http/io");
+  mtev_http_register_default_encoders();
+  mtev_http_access_init();
+  mtev_http_client_init();
 }
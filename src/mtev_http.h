@@ -46,17 +46,38 @@ typedef enum {
   MTEV_HTTP_OTHER, MTEV_HTTP_GET, MTEV_HTTP_HEAD, MTEV_HTTP_POST
 } mtev_http_method;
 typedef enum {
-  MTEV_HTTP09, MTEV_HTTP10, MTEV_HTTP11
+  MTEV_HTTP09, MTEV_HTTP10, MTEV_HTTP11, MTEV_HTTP2
 } mtev_http_protocol;
 
 #define MTEV_HTTP_CHUNKED 0x0001
 #define MTEV_HTTP_CLOSE   0x0002
 #define MTEV_HTTP_GZIP    0x0010
 #define MTEV_HTTP_DEFLATE 0x0020
+#define MTEV_HTTP_ZSTD    0x0040
+/* Content encodings each own a bit from this range */
+#define MTEV_HTTP_ENCODINGS 0xfff0
+
+/* A content encoding.  State is per response, created on first use with
+ * the level in force for it; encode consumes all of in (given at least
+ * bound(inlen) of out) and on final flushes as much as fits, setting
+ * *done once the stream has ended.  encode returns 0, or -1 on error.
+ */
+typedef struct mtev_http_encoder {
+  const char *name;   /* as in Accept-Encoding/Content-Encoding */
+  int default_level;
+  void *(*create)(int level);
+  size_t (*bound)(size_t inlen);
+  int (*encode)(void *state, const void *in, size_t inlen,
+                void *out, size_t *outlen, mtev_boolean final,
+                mtev_boolean *done);
+  void (*destroy)(void *state);
+  u_int32_t option;   /* MTEV_HTTP_ bit; 0 to have one assigned */
+} mtev_http_encoder_t;
 
 typedef enum {
   BCHAIN_INLINE = 0,
-  BCHAIN_MMAP
+  BCHAIN_MMAP,
+  BCHAIN_SENDFILE /* no buff: size bytes at offset start of fd */
 } bchain_type_t;
 
 struct bchain;
@@ -75,12 +96,17 @@ struct bchain {
   size_t size;  /* data length (past start) */
   size_t allocd;/* total allocation */
   char *buff;
+  int fd;       /* BCHAIN_SENDFILE, owned */
+  size_t blocksize; /* size of this allocation, for the buffer pool */
   char _buff[1]; /* over allocate as needed */
 };
 
 struct mtev_http_session_ctx;
 typedef struct mtev_http_session_ctx mtev_http_session_ctx;
 typedef int (*mtev_http_dispatch_func) (mtev_http_session_ctx *);
+typedef void (*mtev_http_response_watermark_func) (mtev_http_session_ctx *,
+                                                  mtev_boolean over,
+                                                  void *closure);
 
 API_EXPORT(mtev_http_session_ctx *)
   mtev_http_session_ctx_new(mtev_http_dispatch_func, void *, eventer_t,
@@ -103,11 +129,29 @@ API_EXPORT(mtev_http_response *)
 API_EXPORT(mtev_http_connection *)
   mtev_http_session_connection(mtev_http_session_ctx *);
 
+/* Memory that lasts until the current request/response is released; it
+ * is never freed individually.
+ */
+API_EXPORT(void *)
+  mtev_http_session_alloc(mtev_http_session_ctx *, size_t);
+API_EXPORT(char *)
+  mtev_http_session_strdup(mtev_http_session_ctx *, const char *);
+
 API_EXPORT(void *)
   mtev_http_session_dispatcher_closure(mtev_http_session_ctx *);
 API_EXPORT(void)
   mtev_http_session_set_dispatcher(mtev_http_session_ctx *,
                                    int (*)(mtev_http_session_ctx *), void *);
+/* An HTTP/2 connection runs many requests at once, each on a session of
+ * its own dispatched like any other.  Their dispatcher closures are made
+ * by alloc (given the new session and the connection's closure) and freed
+ * with freefunc; without these, streams share the connection's.
+ */
+API_EXPORT(void)
+  mtev_http_session_set_stream_closure(mtev_http_session_ctx *,
+                                       void *(*alloc)(mtev_http_session_ctx *,
+                                                      void *),
+                                       void (*freefunc)(void *));
 
 API_EXPORT(eventer_t)
   mtev_http_connection_event(mtev_http_connection *);
@@ -118,6 +162,12 @@ API_EXPORT(eventer_t)
 
 API_EXPORT(void)
   mtev_http_request_start_time(mtev_http_request *, struct timeval *);
+/* When the request was ready to run: the time the event loop picked up
+ * the readiness that completed its headers.  Unlike the start time, this
+ * doesn't include the client's time sending them.
+ */
+API_EXPORT(void)
+  mtev_http_request_ready_time(mtev_http_request *, struct timeval *);
 API_EXPORT(const char *)
   mtev_http_request_uri_str(mtev_http_request *);
 API_EXPORT(const char *)
@@ -166,6 +216,14 @@ API_EXPORT(mtev_boolean)
 API_EXPORT(int)
   mtev_http_session_req_consume(mtev_http_session_ctx *ctx,
                                 void *buf, size_t len, size_t blen, int *mask);
+/* Like mtev_http_session_req_consume, but without the copy: *data is
+ * pointed at up to len bytes of body in the session's own input buffers.
+ * They stay valid until the next consume call on the session.
+ */
+API_EXPORT(int)
+  mtev_http_session_req_consume_view(mtev_http_session_ctx *ctx,
+                                     const void **data, size_t len,
+                                     int *mask);
 API_EXPORT(mtev_boolean)
   mtev_http_response_status_set(mtev_http_session_ctx *, int, const char *);
 API_EXPORT(mtev_boolean)
@@ -173,6 +231,21 @@ API_EXPORT(mtev_boolean)
                                 const char *, const char *);
 API_EXPORT(mtev_boolean)
   mtev_http_response_option_set(mtev_http_session_ctx *, u_int32_t);
+/* Apply the content encoding the client prefers (by Accept-Encoding
+ * q-value, then registration order) among those registered.
+ */
+API_EXPORT(mtev_boolean)
+  mtev_http_response_encoding_negotiate(mtev_http_session_ctx *);
+/* The body to be appended is already encoded with the given encoding
+ * option (or 0 for none); label the response so and encode nothing.
+ */
+API_EXPORT(mtev_boolean)
+  mtev_http_response_encoding_preset(mtev_http_session_ctx *, u_int32_t);
+/* Level, on the encoder's own scale, for this response's encoding,
+ * overriding the listener's compression_level.
+ */
+API_EXPORT(mtev_boolean)
+  mtev_http_response_compression_set(mtev_http_session_ctx *, int);
 API_EXPORT(mtev_boolean)
   mtev_http_response_append(mtev_http_session_ctx *, const void *, size_t);
 API_EXPORT(mtev_boolean)
@@ -180,12 +253,56 @@ API_EXPORT(mtev_boolean)
 API_EXPORT(mtev_boolean)
   mtev_http_response_append_mmap(mtev_http_session_ctx *,
                                  int fd, size_t len, int flags, off_t offset);
+/* Takes ownership of fd; its contents are written straight from the file
+ * when no content encoding is applied and the connection allows it.
+ */
+API_EXPORT(mtev_boolean)
+  mtev_http_response_append_sendfile(mtev_http_session_ctx *,
+                                     int fd, size_t len, off_t offset);
+API_EXPORT(u_int32_t)
+  mtev_http_response_options(mtev_http_response *);
 API_EXPORT(mtev_boolean)
   mtev_http_response_flush(mtev_http_session_ctx *, mtev_boolean);
 API_EXPORT(mtev_boolean)
   mtev_http_response_flush_asynch(mtev_http_session_ctx *, mtev_boolean);
 API_EXPORT(mtev_boolean) mtev_http_response_end(mtev_http_session_ctx *);
 
+/* Output coalescing.  A non-final flush holds appended output back
+ * until at least size bytes are waiting or the oldest of them has
+ * waited latency_ms, then encodes and chunks it all as one.  size 0
+ * turns it off; the listener's output_coalesce_size and
+ * output_coalesce_latency are the default.  flush_now always sends what
+ * there is.  The latency timer fires on the connection's loop even while
+ * the response is being produced (flush_asynch) on a jobq, so appends,
+ * flushes and the timer all change the output chain under the session's
+ * write lock.
+ */
+API_EXPORT(void)
+  mtev_http_response_coalesce(mtev_http_session_ctx *, size_t size,
+                              unsigned int latency_ms);
+API_EXPORT(mtev_boolean)
+  mtev_http_response_flush_now(mtev_http_session_ctx *);
+
+/* Output backpressure.  Once a flush leaves more than high bytes of the
+ * response buffered but unwritten, the response is suspended: the
+ * dispatcher isn't called for it again until the socket has drained it
+ * to low bytes.  f, if given, hears of both edges (over is true going
+ * above high) so producers outside the dispatcher (those using
+ * mtev_http_response_flush_asynch) can pause and resume too.  A high of
+ * 0 takes the listener's output_high_water (and output_low_water),
+ * which default to off.
+ */
+API_EXPORT(void)
+  mtev_http_response_watermarks(mtev_http_session_ctx *,
+                                size_t high, size_t low,
+                                mtev_http_response_watermark_func f,
+                                void *closure);
+API_EXPORT(mtev_boolean)
+  mtev_http_response_suspended(mtev_http_session_ctx *);
+/* Bytes appended to the response but not yet written to the socket */
+API_EXPORT(size_t)
+  mtev_http_response_buffered(mtev_http_session_ctx *);
+
 #define mtev_http_response_server_error(ctx, type) \
   mtev_http_response_standard(ctx, 500, "ERROR", type)
 #define mtev_http_response_ok(ctx, type) \
@@ -200,12 +317,106 @@ API_EXPORT(mtev_boolean) mtev_http_response_end(mtev_http_session_ctx *);
   mtev_http_response_header_set(ctx, "Content-Type", type); \
   if(mtev_http_response_option_set(ctx, MTEV_HTTP_CHUNKED) == mtev_false) \
     mtev_http_response_option_set(ctx, MTEV_HTTP_CLOSE); \
-  mtev_http_response_option_set(ctx, MTEV_HTTP_GZIP); \
+  mtev_http_response_encoding_negotiate(ctx); \
 } while(0)
 
 API_EXPORT(void)
   mtev_http_response_xml(mtev_http_session_ctx *, xmlDocPtr);
 
+/* WebSocket (RFC 6455) opcodes */
+#define MTEV_WS_TEXT   0x1
+#define MTEV_WS_BINARY 0x2
+#define MTEV_WS_CLOSE  0x8
+#define MTEV_WS_PING   0x9
+#define MTEV_WS_PONG   0xA
+
+/* Called with each complete message (text is valid UTF-8, compression
+ * is already undone).  The message is only valid during the call.
+ * Returning non-zero closes the connection.  Exactly once, when the
+ * connection ends, it is called with MTEV_WS_CLOSE and the peer's close
+ * payload, if any; free the closure then.
+ */
+typedef int (*mtev_http_websocket_func)(mtev_http_session_ctx *, int opcode,
+                                        const unsigned char *msg, size_t len,
+                                        void *closure);
+
+/* Answer a "Connection: Upgrade" request with a 101 and take over the
+ * connection.  protocol, if not NULL, must be one the client offered.
+ * Returns false (having sent nothing) if the request isn't a valid
+ * WebSocket handshake; respond to it as you normally would.
+ */
+API_EXPORT(mtev_boolean)
+  mtev_http_websocket_upgrade(mtev_http_session_ctx *, const char *protocol,
+                              mtev_http_websocket_func, void *closure);
+/* Safe from any thread (hold a session reference).  Text, binary and
+ * ping/pong messages are accepted; data is refused while more than
+ * websocket_max_queue bytes are waiting to be written.
+ */
+API_EXPORT(mtev_boolean)
+  mtev_http_websocket_send(mtev_http_session_ctx *, int opcode,
+                           const void *msg, size_t len);
+/* As above for a text or binary message, without copying it: the
+ * frame's header goes in a link of its own ahead of msg.  On success
+ * the session owns msg (as with mtev_http_response_append_bchain);
+ * otherwise it is still the caller's.  The message is sent
+ * uncompressed, and bchain_sendfile links aren't accepted.
+ */
+API_EXPORT(mtev_boolean)
+  mtev_http_websocket_send_bchain(mtev_http_session_ctx *, int opcode,
+                                  struct bchain *msg);
+/* Start the closing handshake; code 0 sends no status. */
+API_EXPORT(mtev_boolean)
+  mtev_http_websocket_close(mtev_http_session_ctx *, int code,
+                            const char *reason);
+/* Bytes of frames not yet written to the socket */
+API_EXPORT(size_t)
+  mtev_http_websocket_queued(mtev_http_session_ctx *);
+
+/* Returns the option bit for the encoder, or 0 if it can't be added. */
+API_EXPORT(u_int32_t)
+  mtev_http_encoder_register(mtev_http_encoder_t *);
+API_EXPORT(mtev_http_encoder_t *)
+  mtev_http_encoder_find(const char *name);
+API_EXPORT(mtev_http_encoder_t *)
+  mtev_http_encoder_by_option(u_int32_t opt);
+API_EXPORT(void)
+  mtev_http_register_default_encoders();
+
+/* Per-thread, size-classed buffer freelists (bchains are carved from
+ * these).  The returned block holds at least len bytes; *allocd is set to
+ * its real size, which must be handed back on free.  Blocks may be
+ * realloc'd in between; they are then simply free'd if no class fits.
+ */
+API_EXPORT(void *)
+  mtev_http_buffer_alloc(size_t len, size_t *allocd);
+API_EXPORT(void)
+  mtev_http_buffer_free(void *buf, size_t allocd);
+/* Bytes each thread may keep cached (default 2MB, 0 disables) */
+API_EXPORT(void)
+  mtev_http_buffer_pool_limit(size_t);
+/* Bytes (and bchains) currently held by sessions, caches excluded */
+API_EXPORT(void)
+  mtev_http_buffer_usage(int64_t *bytes, int64_t *chains);
+
+/* Connections as counted per listener (see idle_timeout and
+ * max_connections); a snapshot, the counters move underneath.
+ */
+typedef struct {
+  const char *name;          /* local address:port */
+  unsigned int idle_timeout; /* ms, 0 is none */
+  int max_connections;       /* 0 is no limit */
+  int64_t connections;       /* open now */
+  int64_t idle;              /* of those, waiting between requests */
+  int64_t accepted;
+  int64_t idle_timeouts;     /* closed for idling */
+  int64_t shed;              /* idle, closed to make room */
+  int64_t refused;           /* over the limit with none idle */
+} mtev_http_listener_stats_t;
+
+API_EXPORT(void)
+  mtev_http_foreach_listener(void (*f)(const mtev_http_listener_stats_t *,
+                                       void *), void *closure);
+
 API_EXPORT(void)
   mtev_http_init();
 
@@ -0,0 +1,1145 @@
+/*
+ * Copyright (c) 2014-2015, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *    * Neither the name Circonus, Inc. nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* HTTP/2 (RFC 7540) for mtev_http.
+ *
+ * The connection's own session reads frames and owns the socket; each
+ * stream is a session of its own, built from the stream's headers and
+ * handed to the same dispatcher an HTTP/1.x request would get.  Streams
+ * never touch the socket: their responses are framed onto the
+ * connection's output as flow control allows.
+ */
+
+#include "mtev_defines.h"
+#include "mtev_http.h"
+#include "mtev_http_private.h"
+#include "mtev_hpack.h"
+
+#include <errno.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define H2_FRAME_HEADER 9
+#define H2_MAX_FRAME 16384          /* we never raise SETTINGS_MAX_FRAME_SIZE */
+#define H2_DEFAULT_WINDOW 65535
+#define H2_MAX_WINDOW 0x7fffffff
+#define H2_MAX_HEADER_LIST (64 * 1024)
+#define H2_OUTPUT_HIGHWATER (64 * 1024) /* stop framing while this much waits */
+#define DEFAULT_H2_MAX_STREAMS 100
+#define DEFAULT_H2_WINDOW (1024 * 1024)
+
+#define H2_PREFACE_TAIL "SM\r\n\r\n"
+
+enum {
+  H2_DATA = 0, H2_HEADERS, H2_PRIORITY, H2_RST_STREAM, H2_SETTINGS,
+  H2_PUSH_PROMISE, H2_PING, H2_GOAWAY, H2_WINDOW_UPDATE, H2_CONTINUATION
+};
+#define H2_FLAG_END_STREAM  0x01
+#define H2_FLAG_ACK         0x01
+#define H2_FLAG_END_HEADERS 0x04
+#define H2_FLAG_PADDED      0x08
+#define H2_FLAG_PRIORITY    0x20
+
+enum {
+  H2_NO_ERROR = 0, H2_PROTOCOL_ERROR, H2_INTERNAL_ERROR,
+  H2_FLOW_CONTROL_ERROR, H2_SETTINGS_TIMEOUT, H2_STREAM_CLOSED,
+  H2_FRAME_SIZE_ERROR, H2_REFUSED_STREAM, H2_CANCEL,
+  H2_COMPRESSION_ERROR, H2_CONNECT_ERROR, H2_ENHANCE_YOUR_CALM
+};
+enum {
+  H2_SETTINGS_HEADER_TABLE_SIZE = 1, H2_SETTINGS_ENABLE_PUSH,
+  H2_SETTINGS_MAX_CONCURRENT_STREAMS, H2_SETTINGS_INITIAL_WINDOW_SIZE,
+  H2_SETTINGS_MAX_FRAME_SIZE, H2_SETTINGS_MAX_HEADER_LIST_SIZE
+};
+
+struct mtev_http2_stream {
+  uint32_t id;
+  struct mtev_http2_conn *conn;  /* NULL once the stream is detached */
+  mtev_http_session_ctx *ctx;
+  struct mtev_http2_stream *next;
+  void (*closure_free)(void *);
+  int64_t send_window;
+  int64_t recv_window;
+  uint32_t recv_unacked;         /* consumed, not yet given back */
+  size_t buffered;               /* received, not yet consumed */
+  int64_t content_length;        /* as declared, -1 if not */
+  int64_t content_received;
+  mtev_boolean remote_closed;    /* END_STREAM (or reset) from the peer */
+  mtev_boolean end_sent;         /* our END_STREAM is queued */
+  mtev_boolean reset;
+  mtev_boolean dispatch;         /* new input, or kicked */
+};
+
+struct mtev_http2_conn {
+  mtev_http_session_ctx *ctx;    /* the connection's session */
+  unsigned char *in;
+  size_t inlen, inalloc;
+  mtev_boolean preface;          /* all of the client preface is in */
+  mtev_hpack_decoder_t *hpack;
+
+  /* a header block arriving in CONTINUATIONs */
+  uint32_t hb_stream;
+  uint8_t hb_flags;
+  unsigned char *hb;
+  size_t hblen, hballoc;
+
+  /* theirs */
+  uint32_t peer_max_frame;
+  int64_t peer_initial_window;
+  int64_t send_window;
+
+  /* ours */
+  uint32_t max_streams;
+  int64_t window;                /* per stream and for the connection */
+  int64_t recv_window;
+  uint32_t recv_unacked;
+
+  struct mtev_http2_stream *streams;
+  int nstreams;
+  uint32_t last_stream_id;
+  struct bchain *out_tail;       /* last link of ctx->res.output_raw */
+  mtev_boolean goaway;           /* no new streams */
+  mtev_boolean closing;          /* close once the output is gone */
+};
+
+static inline uint32_t
+h2_get32(const unsigned char *p) {
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+         ((uint32_t)p[2] << 8) | p[3];
+}
+static inline void
+h2_put32(unsigned char *p, uint32_t v) {
+  p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+static struct bchain *
+h2_frame(uint8_t type, uint8_t flags, uint32_t id, size_t len) {
+  struct bchain *b;
+  unsigned char *p;
+  b = ALLOC_BCHAIN(H2_FRAME_HEADER + len);
+  if(!b) return NULL;
+  p = (unsigned char *)b->buff;
+  p[0] = len >> 16; p[1] = len >> 8; p[2] = len;
+  p[3] = type;
+  p[4] = flags;
+  h2_put32(p + 5, id & H2_MAX_WINDOW);
+  b->size = H2_FRAME_HEADER + len;
+  return b;
+}
+#define H2_PAYLOAD(b) ((unsigned char *)(b)->buff + H2_FRAME_HEADER)
+
+/* Frames go out through the connection session's ordinary output. */
+static void
+h2_queue(struct mtev_http2_conn *c, struct bchain *b) {
+  mtev_http_session_ctx *ctx = c->ctx;
+  if(!b) return;
+  pthread_mutex_lock(&ctx->write_lock);
+  if(!ctx->res.output_raw) ctx->res.output_raw = b;
+  else {
+    c->out_tail->next = b;
+    b->prev = c->out_tail;
+  }
+  while(b->next) b = b->next;
+  c->out_tail = b;
+  pthread_mutex_unlock(&ctx->write_lock);
+}
+static size_t
+h2_pending(struct mtev_http2_conn *c) {
+  mtev_http_session_ctx *ctx = c->ctx;
+  struct bchain *b;
+  size_t pending = 0;
+  pthread_mutex_lock(&ctx->write_lock);
+  for(b = ctx->res.output_raw; b; b = b->next) pending += b->size;
+  pending -= MIN(pending, ctx->res.output_raw_offset);
+  pthread_mutex_unlock(&ctx->write_lock);
+  return pending;
+}
+
+static void
+h2_send_rst(struct mtev_http2_conn *c, uint32_t id, uint32_t code) {
+  struct bchain *b = h2_frame(H2_RST_STREAM, 0, id, 4);
+  if(b) h2_put32(H2_PAYLOAD(b), code);
+  h2_queue(c, b);
+}
+static void
+h2_send_window_update(struct mtev_http2_conn *c, uint32_t id, uint32_t inc) {
+  struct bchain *b = h2_frame(H2_WINDOW_UPDATE, 0, id, 4);
+  if(b) h2_put32(H2_PAYLOAD(b), inc);
+  h2_queue(c, b);
+}
+static int
+h2_conn_error(struct mtev_http2_conn *c, uint32_t code) {
+  struct bchain *b = h2_frame(H2_GOAWAY, 0, 0, 8);
+  if(b) {
+    h2_put32(H2_PAYLOAD(b), c->last_stream_id);
+    h2_put32(H2_PAYLOAD(b) + 4, code);
+  }
+  h2_queue(c, b);
+  mtevL(mtev_debug, "http2: connection error %u\n", code);
+  c->goaway = c->closing = mtev_true;
+  return -1;
+}
+static void
+h2_stream_error(struct mtev_http2_conn *c, struct mtev_http2_stream *s,
+                uint32_t code) {
+  h2_send_rst(c, s->id, code);
+  s->reset = s->remote_closed = mtev_true;
+}
+
+/* Give back receive window: bytes consumed (or discarded) are credited
+ * to the connection and, while it can still send, the stream. */
+static void
+h2_credit(struct mtev_http2_conn *c, struct mtev_http2_stream *s,
+          size_t len) {
+  if(!len) return;
+  c->recv_unacked += len;
+  if(c->recv_unacked >= c->window / 2) {
+    h2_send_window_update(c, 0, c->recv_unacked);
+    c->recv_window += c->recv_unacked;
+    c->recv_unacked = 0;
+  }
+  if(s && !s->remote_closed) {
+    s->recv_unacked += len;
+    if(s->recv_unacked >= c->window / 2) {
+      h2_send_window_update(c, s->id, s->recv_unacked);
+      s->recv_window += s->recv_unacked;
+      s->recv_unacked = 0;
+    }
+  }
+}
+
+static struct mtev_http2_stream *
+h2_stream_find(struct mtev_http2_conn *c, uint32_t id) {
+  struct mtev_http2_stream *s;
+  for(s = c->streams; s; s = s->next)
+    if(s->id == id) return s;
+  return NULL;
+}
+static struct mtev_http2_stream *
+h2_stream_new(struct mtev_http2_conn *c, uint32_t id) {
+  mtev_http_session_ctx *parent = c->ctx, *ctx;
+  struct mtev_http2_stream *s, **tail;
+
+  ctx = mtev_http_session_ctx_new(parent->dispatcher, NULL,
+                                  parent->conn.e, parent->ac);
+  ctx->http2 = mtev_false;
+  s = calloc(1, sizeof(*s));
+  s->id = id;
+  s->conn = c;
+  s->ctx = ctx;
+  s->send_window = c->peer_initial_window;
+  s->recv_window = c->window;
+  s->content_length = -1;
+  ctx->h2stream = s;
+  /* Dispatchers keep per-request state in their closure; a stream
+   * needs one of its own if the connection knows how to make it. */
+  if(parent->stream_closure_alloc) {
+    ctx->dispatcher_closure =
+      parent->stream_closure_alloc(ctx, parent->dispatcher_closure);
+    s->closure_free = parent->stream_closure_free;
+  }
+  else ctx->dispatcher_closure = parent->dispatcher_closure;
+
+  ctx->req.protocol = MTEV_HTTP2;
+  ctx->req.protocol_str = "HTTP/2.0";
+  ctx->req.opts = MTEV_HTTP_CLOSE | MTEV_HTTP_CHUNKED;
+  gettimeofday(&ctx->req.start_time, NULL);
+
+  for(tail = &c->streams; *tail; tail = &(*tail)->next);
+  *tail = s;
+  c->nstreams++;
+  return s;
+}
+/* Unhook a stream from the connection and drop the connection's
+ * reference.  Anyone else holding the session finds it disconnected. */
+static void
+h2_stream_close(struct mtev_http2_conn *c, struct mtev_http2_stream *s) {
+  struct mtev_http2_stream **sp;
+  mtev_http_session_ctx *ctx = s->ctx;
+  for(sp = &c->streams; *sp; sp = &(*sp)->next) {
+    if(*sp == s) {
+      *sp = s->next;
+      break;
+    }
+  }
+  c->nstreams--;
+  /* whatever the handler never read still counts against the connection */
+  if(s->buffered) h2_credit(c, NULL, s->buffered);
+  s->buffered = 0;
+  if(ctx->res.output_started) mtev_http_log_request(ctx);
+  s->conn = NULL;
+  s->next = NULL;
+  ctx->conn.e = NULL;
+  ctx->ac = NULL;
+  mtev_http_ctx_session_release(ctx);
+}
+
+static void
+h2_close(struct mtev_http2_conn *c) {
+  mtev_http_session_ctx *ctx = c->ctx;
+  int mask;
+  while(c->streams) h2_stream_close(c, c->streams);
+  if(ctx->conn.e) {
+    ctx->conn.e->opset->close(ctx->conn.e->fd, &mask, ctx->conn.e);
+    ctx->conn.e = NULL;
+  }
+}
+
+/* Request headers */
+
+struct h2_headers {
+  mtev_http_session_ctx *ctx;  /* NULL if only keeping HPACK in step */
+  struct mtev_http2_stream *s;
+  mtev_boolean trailers;
+  mtev_boolean regular;        /* past the pseudo-headers */
+  mtev_boolean malformed;
+  size_t list_size;
+  const char *authority;
+};
+
+static char *
+h2_strndup(mtev_http_session_ctx *ctx, const char *str, size_t len) {
+  char *dup = mtev_http_session_alloc(ctx, len + 1);
+  if(dup) {
+    memcpy(dup, str, len);
+    dup[len] = '\0';
+  }
+  return dup;
+}
+static mtev_boolean
+h2_connection_specific(const char *name, size_t nlen) {
+#define IS(str) (nlen == sizeof(str)-1 && !memcmp(name, str, nlen))
+  return IS("connection") || IS("keep-alive") || IS("proxy-connection") ||
+         IS("transfer-encoding") || IS("upgrade");
+}
+static int
+h2_header(void *closure, const char *name, size_t nlen,
+          const char *value, size_t vlen) {
+  struct h2_headers *h = closure;
+  mtev_http_request *req;
+  const char *prior;
+  char *n, *v;
+  size_t i;
+
+  if(!h->ctx || h->malformed) return 0;
+  h->list_size += nlen + vlen + 32;
+  if(h->list_size > H2_MAX_HEADER_LIST) {
+    h->malformed = mtev_true;
+    return 0;
+  }
+  req = &h->ctx->req;
+  if(nlen && name[0] == ':') {
+    if(h->regular || h->trailers) {
+      h->malformed = mtev_true;
+      return 0;
+    }
+    v = h2_strndup(h->ctx, value, vlen);
+    if(IS(":method") && !req->method_str) req->method_str = v;
+    else if(IS(":path") && !req->uri_str) req->uri_str = v;
+    else if(IS(":authority") && !h->authority) h->authority = v;
+    else if(!IS(":scheme")) h->malformed = mtev_true;
+    return 0;
+  }
+  h->regular = mtev_true;
+  if(h->trailers) return 0; /* read, and dropped */
+  for(i=0; i<nlen; i++) {
+    if(isupper((unsigned char)name[i])) {
+      h->malformed = mtev_true;
+      return 0;
+    }
+  }
+  if(h2_connection_specific(name, nlen)) {
+    h->malformed = mtev_true;
+    return 0;
+  }
+  n = h2_strndup(h->ctx, name, nlen);
+  if(mtev_hash_retr_str(&req->headers, name, nlen, &prior)) {
+    /* repeats fold into one, as they would on the wire in HTTP/1.1 */
+    size_t plen = strlen(prior);
+    v = mtev_http_session_alloc(h->ctx, plen + vlen + 3);
+    memcpy(v, prior, plen);
+    memcpy(v + plen, IS("cookie") ? "; " : ", ", 2);
+    memcpy(v + plen + 2, value, vlen);
+    v[plen + 2 + vlen] = '\0';
+  }
+  else v = h2_strndup(h->ctx, value, vlen);
+  mtev_hash_replace(&req->headers, n, nlen, v, NULL, NULL);
+  if(IS("content-length")) {
+    char *endptr;
+    h->s->content_length = strtoll(v, &endptr, 10);
+    if(!*v || *endptr || h->s->content_length < 0) h->malformed = mtev_true;
+  }
+  else if(IS("accept-encoding"))
+    mtev_http_request_parse_accept_encoding(req, v);
+  return 0;
+#undef IS
+}
+
+static void
+h2_stream_remote_end(struct mtev_http2_conn *c, struct mtev_http2_stream *s) {
+  s->remote_closed = mtev_true;
+  s->dispatch = mtev_true;
+  if(s->content_length >= 0 && s->content_received != s->content_length)
+    h2_stream_error(c, s, H2_PROTOCOL_ERROR);
+}
+
+static int
+h2_headers_done(struct mtev_http2_conn *c, uint32_t id, uint8_t flags,
+                const unsigned char *block, size_t len) {
+  struct mtev_http2_stream *s;
+  mtev_http_request *req;
+  struct h2_headers h;
+
+  memset(&h, 0, sizeof(h));
+  s = h2_stream_find(c, id);
+  if(s) {
+    /* trailers: the end of a request body */
+    h.ctx = s->ctx;
+    h.s = s;
+    h.trailers = mtev_true;
+    if(mtev_hpack_decode(c->hpack, block, len, h2_header, &h))
+      return h2_conn_error(c, H2_COMPRESSION_ERROR);
+    if(s->remote_closed) {
+      if(!s->reset) h2_stream_error(c, s, H2_STREAM_CLOSED);
+    }
+    else if(!(flags & H2_FLAG_END_STREAM) || h.malformed)
+      h2_stream_error(c, s, H2_PROTOCOL_ERROR);
+    else
+      h2_stream_remote_end(c, s);
+    return 0;
+  }
+  /* Whether or not we want the stream, the block goes through the
+   * decoder or the peer's table and ours part ways. */
+  if(id <= c->last_stream_id ||
+     c->goaway || c->nstreams >= (int)c->max_streams) {
+    if(mtev_hpack_decode(c->hpack, block, len, h2_header, &h))
+      return h2_conn_error(c, H2_COMPRESSION_ERROR);
+    if(id > c->last_stream_id) {
+      c->last_stream_id = id;
+      h2_send_rst(c, id, H2_REFUSED_STREAM);
+    }
+    return 0;
+  }
+  c->last_stream_id = id;
+  s = h2_stream_new(c, id);
+  h.ctx = s->ctx;
+  h.s = s;
+  if(mtev_hpack_decode(c->hpack, block, len, h2_header, &h))
+    return h2_conn_error(c, H2_COMPRESSION_ERROR);
+  req = &s->ctx->req;
+  if(h.malformed || !req->method_str || !req->uri_str || !*req->uri_str) {
+    h2_stream_error(c, s, H2_PROTOCOL_ERROR);
+    return 0;
+  }
+  if(h.authority &&
+     !mtev_hash_retrieve(&req->headers, "host", 4, NULL))
+    mtev_hash_replace(&req->headers, "host", 4, (void *)h.authority,
+                      NULL, NULL);
+  req->method = mtev_http_method_from_str(req->method_str);
+  if(flags & H2_FLAG_END_STREAM) {
+    s->remote_closed = mtev_true;
+    if(s->content_length > 0) {
+      h2_stream_error(c, s, H2_PROTOCOL_ERROR);
+      return 0;
+    }
+  }
+  else {
+    /* a body without a length reads like a chunked one */
+    req->has_payload = mtev_true;
+    if(s->content_length >= 0) req->content_length = s->content_length;
+    else req->payload_chunked = mtev_true;
+  }
+  req->complete = mtev_true;
+  gettimeofday(&req->ready_time, NULL);
+  mtev_http_request_start(req);
+  s->dispatch = mtev_true;
+  return 0;
+}
+
+static int
+h2_collect_headers(struct mtev_http2_conn *c, uint32_t id, uint8_t flags,
+                   const unsigned char *frag, size_t len) {
+  if(c->hblen + len > H2_MAX_HEADER_LIST)
+    return h2_conn_error(c, H2_ENHANCE_YOUR_CALM);
+  if(c->hblen + len > c->hballoc) {
+    c->hballoc = MAX(c->hblen + len, c->hballoc * 2);
+    c->hb = realloc(c->hb, c->hballoc);
+  }
+  memcpy(c->hb + c->hblen, frag, len);
+  c->hblen += len;
+  if(!c->hb_stream) {
+    c->hb_stream = id;
+    c->hb_flags = flags;
+  }
+  if(flags & H2_FLAG_END_HEADERS) {
+    int rv;
+    rv = h2_headers_done(c, c->hb_stream, c->hb_flags, c->hb, c->hblen);
+    c->hb_stream = 0;
+    c->hblen = 0;
+    return rv;
+  }
+  return 0;
+}
+
+/* Strip padding (and priority) from a DATA or HEADERS payload. */
+static int
+h2_unpad(uint8_t flags, const unsigned char **p, size_t *len,
+         size_t *padding) {
+  size_t pad = 0;
+  *padding = 0;
+  if(flags & H2_FLAG_PADDED) {
+    if(*len < 1) return -1;
+    pad = (*p)[0];
+    (*p)++; (*len)--;
+    *padding = pad + 1;
+  }
+  if(pad > *len) return -1;
+  *len -= pad;
+  return 0;
+}
+
+static int
+h2_settings(struct mtev_http2_conn *c, uint8_t flags,
+            const unsigned char *p, size_t len) {
+  size_t i;
+  if(flags & H2_FLAG_ACK) {
+    if(len) return h2_conn_error(c, H2_FRAME_SIZE_ERROR);
+    return 0;
+  }
+  if(len % 6) return h2_conn_error(c, H2_FRAME_SIZE_ERROR);
+  for(i=0; i<len; i+=6) {
+    uint16_t id = (p[i] << 8) | p[i+1];
+    uint32_t val = h2_get32(p + i + 2);
+    struct mtev_http2_stream *s;
+    switch(id) {
+      case H2_SETTINGS_ENABLE_PUSH:
+        if(val > 1) return h2_conn_error(c, H2_PROTOCOL_ERROR);
+        break;
+      case H2_SETTINGS_INITIAL_WINDOW_SIZE:
+        if(val > H2_MAX_WINDOW) return h2_conn_error(c, H2_FLOW_CONTROL_ERROR);
+        for(s = c->streams; s; s = s->next) {
+          s->send_window += (int64_t)val - c->peer_initial_window;
+          if(s->send_window > H2_MAX_WINDOW)
+            return h2_conn_error(c, H2_FLOW_CONTROL_ERROR);
+        }
+        c->peer_initial_window = val;
+        break;
+      case H2_SETTINGS_MAX_FRAME_SIZE:
+        if(val < 16384 || val > 16777215)
+          return h2_conn_error(c, H2_PROTOCOL_ERROR);
+        c->peer_max_frame = val;
+        break;
+      default:
+        /* we don't index what we send, so the table size is moot */
+        break;
+    }
+  }
+  h2_queue(c, h2_frame(H2_SETTINGS, H2_FLAG_ACK, 0, 0));
+  return 0;
+}
+
+static int
+h2_data(struct mtev_http2_conn *c, uint32_t id, uint8_t flags,
+        const unsigned char *p, size_t len) {
+  struct mtev_http2_stream *s;
+  size_t flen = len, padding;
+  struct bchain *b;
+  mtev_http_request *req;
+
+  if(id == 0) return h2_conn_error(c, H2_PROTOCOL_ERROR);
+  if((int64_t)flen > c->recv_window)
+    return h2_conn_error(c, H2_FLOW_CONTROL_ERROR);
+  c->recv_window -= flen;
+  if(h2_unpad(flags, &p, &len, &padding))
+    return h2_conn_error(c, H2_PROTOCOL_ERROR);
+  s = h2_stream_find(c, id);
+  if(!s || s->remote_closed) {
+    h2_credit(c, NULL, flen);
+    if(!s && id > c->last_stream_id)
+      return h2_conn_error(c, H2_PROTOCOL_ERROR);
+    if(s && !s->reset) h2_stream_error(c, s, H2_STREAM_CLOSED);
+    return 0;
+  }
+  if((int64_t)flen > s->recv_window) {
+    h2_credit(c, NULL, flen);
+    h2_stream_error(c, s, H2_FLOW_CONTROL_ERROR);
+    return 0;
+  }
+  s->recv_window -= flen;
+  /* padding is nobody's to consume */
+  h2_credit(c, s, padding);
+  s->content_received += len;
+  if(s->content_length >= 0 && s->content_received > s->content_length) {
+    h2_credit(c, NULL, len);
+    h2_stream_error(c, s, H2_PROTOCOL_ERROR);
+    return 0;
+  }
+  if(len) {
+    req = &s->ctx->req;
+    b = ALLOC_BCHAIN(len);
+    if(!b) return h2_conn_error(c, H2_INTERNAL_ERROR);
+    memcpy(b->buff, p, len);
+    b->size = len;
+    pthread_mutex_lock(&s->ctx->write_lock);
+    if(req->last_input) {
+      req->last_input->next = b;
+      b->prev = req->last_input;
+    }
+    else req->first_input = b;
+    req->last_input = b;
+    pthread_mutex_unlock(&s->ctx->write_lock);
+    s->buffered += len;
+    s->dispatch = mtev_true;
+  }
+  if(flags & H2_FLAG_END_STREAM) h2_stream_remote_end(c, s);
+  return 0;
+}
+
+static int
+h2_frame_in(struct mtev_http2_conn *c, uint8_t type, uint8_t flags,
+            uint32_t id, const unsigned char *p, size_t len) {
+  struct mtev_http2_stream *s;
+  size_t padding;
+  uint32_t inc;
+
+  /* a header block is not to be interrupted */
+  if(c->hb_stream && (type != H2_CONTINUATION || id != c->hb_stream))
+    return h2_conn_error(c, H2_PROTOCOL_ERROR);
+
+  switch(type) {
+    case H2_DATA:
+      return h2_data(c, id, flags, p, len);
+    case H2_HEADERS:
+      if(id == 0 || !(id & 1)) return h2_conn_error(c, H2_PROTOCOL_ERROR);
+      if(h2_unpad(flags, &p, &len, &padding))
+        return h2_conn_error(c, H2_PROTOCOL_ERROR);
+      if(flags & H2_FLAG_PRIORITY) {
+        if(len < 5) return h2_conn_error(c, H2_FRAME_SIZE_ERROR);
+        p += 5; len -= 5;
+      }
+      return h2_collect_headers(c, id, flags, p, len);
+    case H2_CONTINUATION:
+      if(!c->hb_stream) return h2_conn_error(c, H2_PROTOCOL_ERROR);
+      return h2_collect_headers(c, id, flags, p, len);
+    case H2_PRIORITY:
+      if(id == 0) return h2_conn_error(c, H2_PROTOCOL_ERROR);
+      if(len != 5) return h2_conn_error(c, H2_FRAME_SIZE_ERROR);
+      return 0; /* we serve in arrival order */
+    case H2_RST_STREAM:
+      if(id == 0 || id > c->last_stream_id)
+        return h2_conn_error(c, H2_PROTOCOL_ERROR);
+      if(len != 4) return h2_conn_error(c, H2_FRAME_SIZE_ERROR);
+      if((s = h2_stream_find(c, id)) != NULL)
+        s->reset = s->remote_closed = mtev_true;
+      return 0;
+    case H2_SETTINGS:
+      if(id != 0) return h2_conn_error(c, H2_PROTOCOL_ERROR);
+      return h2_settings(c, flags, p, len);
+    case H2_PUSH_PROMISE:
+      return h2_conn_error(c, H2_PROTOCOL_ERROR);
+    case H2_PING:
+      if(id != 0) return h2_conn_error(c, H2_PROTOCOL_ERROR);
+      if(len != 8) return h2_conn_error(c, H2_FRAME_SIZE_ERROR);
+      if(!(flags & H2_FLAG_ACK)) {
+        struct bchain *b = h2_frame(H2_PING, H2_FLAG_ACK, 0, 8);
+        if(b) memcpy(H2_PAYLOAD(b), p, 8);
+        h2_queue(c, b);
+      }
+      return 0;
+    case H2_GOAWAY:
+      if(id != 0) return h2_conn_error(c, H2_PROTOCOL_ERROR);
+      if(len < 8) return h2_conn_error(c, H2_FRAME_SIZE_ERROR);
+      c->goaway = mtev_true;
+      return 0;
+    case H2_WINDOW_UPDATE:
+      if(len != 4) return h2_conn_error(c, H2_FRAME_SIZE_ERROR);
+      inc = h2_get32(p) & H2_MAX_WINDOW;
+      if(id == 0) {
+        if(inc == 0) return h2_conn_error(c, H2_PROTOCOL_ERROR);
+        c->send_window += inc;
+        if(c->send_window > H2_MAX_WINDOW)
+          return h2_conn_error(c, H2_FLOW_CONTROL_ERROR);
+        return 0;
+      }
+      if((s = h2_stream_find(c, id)) == NULL || s->reset) return 0;
+      if(inc == 0) h2_stream_error(c, s, H2_PROTOCOL_ERROR);
+      else if((s->send_window += inc) > H2_MAX_WINDOW)
+        h2_stream_error(c, s, H2_FLOW_CONTROL_ERROR);
+      return 0;
+    default:
+      return 0; /* extensions we don't speak are ignored */
+  }
+}
+
+static int
+h2_process(struct mtev_http2_conn *c) {
+  size_t off = 0;
+  int rv = 0;
+
+  if(!c->preface) {
+    if(c->inlen < sizeof(H2_PREFACE_TAIL)-1) return 0;
+    if(memcmp(c->in, H2_PREFACE_TAIL, sizeof(H2_PREFACE_TAIL)-1))
+      return h2_conn_error(c, H2_PROTOCOL_ERROR);
+    c->preface = mtev_true;
+    off = sizeof(H2_PREFACE_TAIL)-1;
+  }
+  while(c->inlen - off >= H2_FRAME_HEADER) {
+    const unsigned char *f = c->in + off;
+    size_t len = (f[0] << 16) | (f[1] << 8) | f[2];
+    if(len > H2_MAX_FRAME) {
+      rv = h2_conn_error(c, H2_FRAME_SIZE_ERROR);
+      break;
+    }
+    if(c->inlen - off < H2_FRAME_HEADER + len) break;
+    rv = h2_frame_in(c, f[3], f[4], h2_get32(f + 5) & H2_MAX_WINDOW,
+                     f + H2_FRAME_HEADER, len);
+    off += H2_FRAME_HEADER + len;
+    if(rv < 0) break;
+  }
+  memmove(c->in, c->in + off, c->inlen - off);
+  c->inlen -= off;
+  return rv;
+}
+
+/* Stream output */
+
+static inline mtev_boolean
+h2_body_done(mtev_http_session_ctx *ctx) {
+  return ctx->res.closed && !ctx->res.encoding_inflight;
+}
+/* Frame up to limit (0 for all) frames of a stream's pending output onto
+ * the connection, as flow control allows. */
+static int
+h2_stream_output(struct mtev_http2_conn *c, struct mtev_http2_stream *s,
+                 int limit) {
+  mtev_http_session_ctx *ctx = s->ctx;
+  mtev_http_response *res = &ctx->res;
+  int queued = 0;
+
+  if(s->end_sent || s->reset) return 0;
+  pthread_mutex_lock(&ctx->write_lock);
+  if(res->leader) {
+    struct bchain *leader = res->leader;
+    res->leader = NULL;
+    if(!res->output_raw && h2_body_done(ctx)) {
+      leader->buff[4] |= H2_FLAG_END_STREAM;
+      s->end_sent = mtev_true;
+    }
+    h2_queue(c, leader);
+    queued++;
+  }
+  while(!s->end_sent && res->output_started && (!limit || queued < limit)) {
+    struct bchain *b, *f;
+    int64_t avail;
+    size_t pending = 0, n, off;
+
+    while((b = res->output_raw) != NULL && res->output_raw_offset >= b->size) {
+      res->output_raw = b->next;
+      if(b->next) b->next->prev = NULL;
+      res->output_raw_offset -= b->size;
+      FREE_BCHAIN(b);
+    }
+    if(!res->output_raw) {
+      if(h2_body_done(ctx)) {
+        h2_queue(c, h2_frame(H2_DATA, H2_FLAG_END_STREAM, s->id, 0));
+        s->end_sent = mtev_true;
+        queued++;
+      }
+      break;
+    }
+    avail = MIN(s->send_window, c->send_window);
+    avail = MIN(avail, (int64_t)c->peer_max_frame);
+    if(avail <= 0) break;
+    for(b = res->output_raw; b && (int64_t)pending < avail; b = b->next)
+      pending += b->size;
+    pending -= res->output_raw_offset;
+    n = MIN((size_t)avail, pending);
+    f = h2_frame(H2_DATA, 0, s->id, n);
+    if(!f) break;
+    for(off = 0; off < n; ) {
+      size_t chunk;
+      b = res->output_raw;
+      chunk = MIN(n - off, b->size - res->output_raw_offset);
+      memcpy(H2_PAYLOAD(f) + off, b->buff + b->start + res->output_raw_offset,
+             chunk);
+      off += chunk;
+      res->output_raw_offset += chunk;
+      if(res->output_raw_offset >= b->size) {
+        res->output_raw = b->next;
+        if(b->next) b->next->prev = NULL;
+        res->output_raw_offset = 0;
+        FREE_BCHAIN(b);
+      }
+    }
+    if(!res->output_raw && h2_body_done(ctx)) {
+      f->buff[4] |= H2_FLAG_END_STREAM;
+      s->end_sent = mtev_true;
+    }
+    s->send_window -= n;
+    c->send_window -= n;
+    res->bytes_written += n;
+    h2_queue(c, f);
+    queued++;
+  }
+  if(s->end_sent) res->complete = mtev_true;
+  pthread_mutex_unlock(&ctx->write_lock);
+  return queued;
+}
+
+/* Round-robin the streams a frame at a time while the socket keeps up,
+ * then reap the finished ones. */
+static int
+h2_pump(struct mtev_http2_conn *c) {
+  struct mtev_http2_stream *s, *next;
+  int mask = EVENTER_EXCEPTION, framed, n, written;
+
+  do {
+    framed = 0;
+    do {
+      n = 0;
+      for(s = c->streams; s && h2_pending(c) < H2_OUTPUT_HIGHWATER;
+          s = s->next)
+        n += h2_stream_output(c, s, 1);
+      framed += n;
+    } while(n);
+    /* nothing may have fit until this write made room */
+    if((written = mtev_http_session_write(c->ctx, &mask)) < 0) {
+      h2_close(c);
+      return 0;
+    }
+  } while((framed || written) && !c->ctx->res.output_raw);
+
+  /* Responses held back for buffering too much may have framed their way
+   * down; they get to produce more. */
+  for(s = c->streams; s; s = s->next)
+    if(!s->reset && mtev_http_response_drained(s->ctx))
+      s->ctx->dispatcher(s->ctx);
+
+  for(s = c->streams; s; s = next) {
+    next = s->next;
+    if(s->end_sent && !s->remote_closed) {
+      /* We've answered; the rest of the request is of no use. */
+      h2_send_rst(c, s->id, H2_NO_ERROR);
+      s->remote_closed = mtev_true;
+    }
+    if(s->reset || (s->end_sent && s->remote_closed))
+      h2_stream_close(c, s);
+  }
+
+  if(mtev_http_session_write(c->ctx, &mask) < 0) {
+    h2_close(c);
+    return 0;
+  }
+  if(!c->ctx->res.output_raw &&
+     (c->closing || (c->goaway && c->nstreams == 0))) {
+    h2_close(c);
+    return 0;
+  }
+  return EVENTER_READ | EVENTER_EXCEPTION |
+         (mask & (EVENTER_READ | EVENTER_WRITE));
+}
+
+static void
+h2_dispatch(struct mtev_http2_conn *c) {
+  struct mtev_http2_stream *s;
+  /* Nothing unlinks streams during dispatch; they're reaped in h2_pump. */
+  for(s = c->streams; s; s = s->next) {
+    mtev_http_session_ctx *ctx = s->ctx;
+    if(!s->dispatch) continue;
+    s->dispatch = mtev_false;
+    if(s->reset || !ctx->req.complete || ctx->res.closed ||
+       ctx->res.suspended) continue;
+    ctx->dispatcher(ctx);
+  }
+}
+
+int
+mtev_http2_session_drive(mtev_http_session_ctx *ctx, int mask) {
+  struct mtev_http2_conn *c = ctx->h2conn;
+  eventer_t e = ctx->conn.e;
+  int rmask = 0;
+
+  if(mask & EVENTER_EXCEPTION) {
+    h2_close(c);
+    return 0;
+  }
+  while(!c->closing) {
+    int len;
+    if(c->inalloc - c->inlen < H2_FRAME_HEADER + H2_MAX_FRAME) {
+      c->inalloc = c->inlen + H2_FRAME_HEADER + H2_MAX_FRAME;
+      c->in = realloc(c->in, c->inalloc);
+    }
+    len = e->opset->read(e->fd, c->in + c->inlen, c->inalloc - c->inlen,
+                         &rmask, e);
+    if(len == -1 && errno == EAGAIN) break;
+    if(len <= 0) {
+      h2_close(c);
+      return 0;
+    }
+    c->inlen += len;
+    h2_process(c);
+  }
+  h2_dispatch(c);
+  return h2_pump(c) | (rmask & (EVENTER_READ | EVENTER_WRITE));
+}
+
+int
+mtev_http2_session_upgrade(mtev_http_session_ctx *ctx, int mask) {
+  struct mtev_http2_conn *c;
+  struct bchain *b;
+  const char *val;
+  unsigned char *p;
+  int one = 1;
+
+  c = calloc(1, sizeof(*c));
+  c->ctx = ctx;
+  c->peer_max_frame = H2_MAX_FRAME;
+  c->peer_initial_window = H2_DEFAULT_WINDOW;
+  c->send_window = H2_DEFAULT_WINDOW;
+  c->max_streams = DEFAULT_H2_MAX_STREAMS;
+  c->window = DEFAULT_H2_WINDOW;
+  if(ctx->ac && ctx->ac->config) {
+    if(mtev_hash_retr_str(ctx->ac->config, "http2_max_streams",
+                          strlen("http2_max_streams"), &val))
+      c->max_streams = MAX(1, atoi(val));
+    if(mtev_hash_retr_str(ctx->ac->config, "http2_window_size",
+                          strlen("http2_window_size"), &val))
+      c->window = MIN(MAX(H2_DEFAULT_WINDOW, atoll(val)), H2_MAX_WINDOW);
+  }
+  c->recv_window = c->window;
+  c->hpack = mtev_hpack_decoder_new(4096);
+  /* Frames are small and interleaved; holding them for Nagle stalls
+   * every stream on the connection. */
+  if(ctx->conn.e)
+    setsockopt(ctx->conn.e->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  ctx->h2conn = c;
+
+  /* Whatever followed "PRI * HTTP/2.0\r\n\r\n" is ours. */
+  for(b = ctx->req.first_input; b; b = b->next) c->inlen += b->size;
+  c->inalloc = c->inlen + H2_FRAME_HEADER + H2_MAX_FRAME;
+  c->in = malloc(c->inalloc);
+  c->inlen = 0;
+  for(b = ctx->req.first_input; b; b = b->next) {
+    memcpy(c->in + c->inlen, b->buff + b->start, b->size);
+    c->inlen += b->size;
+  }
+  RELEASE_BCHAIN(ctx->req.first_input);
+  ctx->req.last_input = NULL;
+  mtev_http_request_release(ctx);
+  mtev_http_response_release(ctx);
+
+  b = h2_frame(H2_SETTINGS, 0, 0, 18);
+  if(b) {
+    p = H2_PAYLOAD(b);
+    p[0] = 0; p[1] = H2_SETTINGS_MAX_CONCURRENT_STREAMS;
+    h2_put32(p + 2, c->max_streams);
+    p[6] = 0; p[7] = H2_SETTINGS_INITIAL_WINDOW_SIZE;
+    h2_put32(p + 8, c->window);
+    p[12] = 0; p[13] = H2_SETTINGS_MAX_HEADER_LIST_SIZE;
+    h2_put32(p + 14, H2_MAX_HEADER_LIST);
+  }
+  h2_queue(c, b);
+  if(c->window > H2_DEFAULT_WINDOW)
+    h2_send_window_update(c, 0, c->window - H2_DEFAULT_WINDOW);
+
+  h2_process(c);
+  return mtev_http2_session_drive(ctx, mask);
+}
+
+void
+mtev_http2_conn_free(struct mtev_http2_conn *c) {
+  while(c->streams) h2_stream_close(c, c->streams);
+  if(c->hpack) mtev_hpack_decoder_free(c->hpack);
+  free(c->in);
+  free(c->hb);
+  free(c);
+}
+
+/* The stream side: what mtev_http.c calls on a stream's session */
+
+void
+mtev_http2_stream_release(mtev_http_session_ctx *ctx) {
+  struct mtev_http2_stream *s = ctx->h2stream;
+  if(s->closure_free && ctx->dispatcher_closure)
+    s->closure_free(ctx->dispatcher_closure);
+  ctx->h2stream = NULL;
+  free(s);
+}
+
+void
+mtev_http2_stream_kick(mtev_http_session_ctx *ctx) {
+  ctx->h2stream->dispatch = mtev_true;
+}
+
+int
+mtev_http2_stream_leader(mtev_http_session_ctx *ctx) {
+  struct mtev_http2_stream *s = ctx->h2stream;
+  struct mtev_http2_conn *c = s->conn;
+  mtev_http_response *res = &ctx->res;
+  unsigned char *block;
+  size_t bound, len = 0, off, nframes;
+  struct bchain *b;
+  int i, status;
+
+  if(!c) return -1;
+  bound = MTEV_HPACK_ENCODE_BOUND(7, 3);
+  for(i=0; i<res->nheaders; i++)
+    bound += MTEV_HPACK_ENCODE_BOUND(res->headers[i].nlen,
+                                     res->headers[i].vlen);
+  block = malloc(bound);
+  if(!block) return -1;
+  status = res->status_code;
+  if(status < 100 || status > 999) status = 500;
+  len += mtev_hpack_encode_status(block, status);
+  for(i=0; i<res->nheaders; i++) {
+    struct http_header *h = &res->headers[i];
+    char lname[32];
+    size_t j;
+    /* hop-by-hop headers have no place in HTTP/2 */
+    if(h->nlen < sizeof(lname)) {
+      for(j=0; j<h->nlen; j++) lname[j] = tolower((unsigned char)h->name[j]);
+      if(h2_connection_specific(lname, h->nlen)) continue;
+    }
+    len += mtev_hpack_encode_header(block + len, h->name, h->nlen,
+                                    h->value, h->vlen);
+  }
+
+  nframes = len ? (len + c->peer_max_frame - 1) / c->peer_max_frame : 1;
+  b = ALLOC_BCHAIN(len + nframes * H2_FRAME_HEADER);
+  if(!b) {
+    free(block);
+    return -1;
+  }
+  for(off = 0; off < len || off == 0; ) {
+    unsigned char *p = (unsigned char *)b->buff + b->size;
+    size_t flen = MIN(len - off, c->peer_max_frame);
+    p[0] = flen >> 16; p[1] = flen >> 8; p[2] = flen;
+    p[3] = off ? H2_CONTINUATION : H2_HEADERS;
+    p[4] = (off + flen == len) ? H2_FLAG_END_HEADERS : 0;
+    h2_put32(p + 5, s->id);
+    memcpy(p + H2_FRAME_HEADER, block + off, flen);
+    b->size += H2_FRAME_HEADER + flen;
+    off += flen;
+    if(!flen) break;
+  }
+  free(block);
+  res->leader = b;
+  return len;
+}
+
+int
+mtev_http2_stream_write(mtev_http_session_ctx *ctx, int *mask) {
+  struct mtev_http2_stream *s = ctx->h2stream;
+  struct mtev_http2_conn *c = s->conn;
+  eventer_t e;
+  int rv, framed, total = 0;
+
+  if(!c || s->reset) {
+    /* No one to hear it. */
+    pthread_mutex_lock(&ctx->write_lock);
+    RELEASE_BCHAIN(ctx->res.leader);
+    RELEASE_BCHAIN(ctx->res.output_raw);
+    ctx->res.output_raw_offset = 0;
+    if(h2_body_done(ctx)) ctx->res.complete = mtev_true;
+    pthread_mutex_unlock(&ctx->write_lock);
+    *mask = EVENTER_EXCEPTION;
+    return -1;
+  }
+  e = c->ctx->conn.e;
+  /* The connection's state belongs to its event's thread; from anywhere
+   * else, just wake it to do the framing. */
+  if(e && !pthread_equal(pthread_self(), e->thr_owner)) {
+    eventer_trigger(e, EVENTER_WRITE);
+    *mask = EVENTER_READ | EVENTER_EXCEPTION;
+    return 0;
+  }
+  do {
+    framed = 0;
+    while(h2_pending(c) < H2_OUTPUT_HIGHWATER && h2_stream_output(c, s, 1))
+      framed++;
+    if((rv = mtev_http_session_write(c->ctx, mask)) < 0) break;
+    total += rv;
+  } while(framed && !c->ctx->res.output_raw);
+  *mask |= EVENTER_READ | EVENTER_EXCEPTION;
+  return rv < 0 ? rv : total;
+}
+
+int
+mtev_http2_stream_consume(mtev_http_session_ctx *ctx, void *buf,
+                          size_t len, int *mask, const void **view) {
+  struct mtev_http2_stream *s = ctx->h2stream;
+  struct mtev_http2_conn *c = s->conn;
+  mtev_http_request *req = &ctx->req;
+  size_t copied = 0;
+
+  pthread_mutex_lock(&ctx->write_lock);
+  /* drop the chain a previous view was left pointing into */
+  while(req->first_input && req->first_input->size == 0) {
+    struct bchain *in = req->first_input;
+    req->first_input = in->next;
+    if(in->next) in->next->prev = NULL;
+    else req->last_input = NULL;
+    FREE_BCHAIN(in);
+  }
+  while(copied < len && req->first_input) {
+    struct bchain *in = req->first_input;
+    size_t n = MIN(len - copied, in->size);
+    if(view) *view = in->buff + in->start;
+    else if(buf) memcpy((char *)buf + copied, in->buff + in->start, n);
+    in->start += n;
+    in->size -= n;
+    copied += n;
+    if(view) break;
+    if(in->size == 0) {
+      req->first_input = in->next;
+      if(in->next) in->next->prev = NULL;
+      else req->last_input = NULL;
+      FREE_BCHAIN(in);
+    }
+  }
+  pthread_mutex_unlock(&ctx->write_lock);
+  if(copied == 0) {
+    if(!c || s->reset) return -1;
+    if(s->remote_closed) {
+      if(req->payload_chunked) req->content_length = req->content_length_read;
+      return 0;
+    }
+    *mask = EVENTER_READ | EVENTER_EXCEPTION;
+    errno = EAGAIN;
+    return -1;
+  }
+  req->content_length_read += copied;
+  s->buffered -= copied;
+  if(c) h2_credit(c, s, copied);
+  return copied;
+}
@@ -0,0 +1,373 @@
+/*
+ * Copyright (c) 2014-2015, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *    * Neither the name Circonus, Inc. nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Access logging for mtev_http.
+ *
+ * Finishing a request costs a clock read and a few copies: a fixed
+ * record goes into a ring belonging to the thread that served it.  A
+ * single writer thread drains every ring in batches and does the rest
+ * (times, addresses, formatting) off the event loops.  A ring that
+ * fills drops records rather than hold up its thread.
+ *
+ * The http/access log's <config> picks:
+ *   format     combined (the default) or json, one object per line
+ *   sample     log one in this many requests; server errors always are
+ *   ring_size  records each thread can have waiting (default 1024)
+ */
+
+#include "mtev_defines.h"
+#include "mtev_http.h"
+#include "mtev_http_private.h"
+
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <ck_pr.h>
+
+#define ACCESS_TEXT_MAX 256        /* method, uri, query and protocol */
+#define DEFAULT_RING_SIZE 1024
+#define ACCESS_BATCH_MAX 1000      /* per ring, per pass */
+
+struct access_record {
+  struct timeval end;
+  u_int64_t elapsed_us;
+  u_int64_t bytes;
+  union {
+    struct sockaddr a;
+    struct sockaddr_in ip4;
+    struct sockaddr_in6 ip6;
+  } remote;
+  int status;
+  u_int16_t method_len;
+  u_int16_t uri_len;
+  u_int16_t qs_len;
+  u_int16_t protocol_len;
+  mtev_boolean has_remote;
+  mtev_boolean has_qs;
+  char text[ACCESS_TEXT_MAX];
+};
+
+/* One producer (its thread) and one consumer (the writer); head and
+ * tail run free and are masked into the ring. */
+struct access_ring {
+  struct access_record *records;
+  unsigned int mask;
+  unsigned int head;
+  unsigned int tail;
+  mtev_atomic64_t dropped;
+  int dead;                     /* its thread is gone; free once drained */
+  struct access_ring *next;
+};
+
+static mtev_log_stream_t http_access = NULL;
+static pthread_mutex_t access_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct access_ring *access_rings;
+static pthread_key_t access_ring_key;
+static pthread_once_t access_once = PTHREAD_ONCE_INIT;
+static unsigned int access_ring_size = DEFAULT_RING_SIZE;
+static volatile unsigned int access_sample = 1;
+static volatile mtev_boolean access_json = mtev_false;
+static __thread struct access_ring *access_ring;
+static __thread unsigned int access_skipped;
+
+static void
+access_config() {
+  const char *v;
+  v = mtev_log_stream_get_property(http_access, "format");
+  access_json = (v && !strcmp(v, "json"));
+  v = mtev_log_stream_get_property(http_access, "sample");
+  access_sample = (v && atoi(v) > 1) ? atoi(v) : 1;
+}
+
+static void
+access_ring_release(void *vring) {
+  struct access_ring *ring = vring;
+  ck_pr_store_int(&ring->dead, 1);
+}
+
+/* One line of the combined format, less the referer and user-agent it
+ * has never had here. */
+static int
+access_format_combined(const struct access_record *rec, const char *ip,
+                       const char *timestr, char *buf, size_t len) {
+  return snprintf(buf, len, "%s - - [%s] \"%.*s %.*s%s%.*s %.*s\" %d %llu "
+                  "%.3f\n", ip, timestr,
+                  rec->method_len, rec->text,
+                  rec->uri_len, rec->text + rec->method_len,
+                  rec->has_qs ? "?" : "",
+                  rec->qs_len, rec->text + rec->method_len + rec->uri_len,
+                  rec->protocol_len,
+                  rec->text + rec->method_len + rec->uri_len + rec->qs_len,
+                  rec->status, (long long unsigned)rec->bytes,
+                  (double)rec->elapsed_us / 1000.0);
+}
+
+static size_t
+access_json_string(char *buf, size_t len, const char *s, size_t slen) {
+  static const char hex[] = "0123456789abcdef";
+  size_t i, o = 0;
+  if(o < len) buf[o++] = '"';
+  for(i=0; i<slen && o + 6 < len; i++) {
+    unsigned char c = s[i];
+    if(c == '"' || c == '\\') {
+      buf[o++] = '\\';
+      buf[o++] = c;
+    }
+    else if(c < 0x20 || c >= 0x7f) {
+      /* bytes, not characters: a request line needn't be UTF-8 */
+      memcpy(buf + o, "\\u00", 4);
+      buf[o+4] = hex[c >> 4];
+      buf[o+5] = hex[c & 0xf];
+      o += 6;
+    }
+    else buf[o++] = c;
+  }
+  if(o < len) buf[o++] = '"';
+  return o;
+}
+
+static int
+access_format_json(const struct access_record *rec, const char *ip,
+                   const char *timestr, char *buf, size_t len) {
+  const char *t = rec->text;
+  size_t o;
+#define JSON_LIT(lit) do { \
+  if(o < len) o += strlcpy(buf + o, lit, len - o); \
+  if(o > len) o = len; \
+} while(0)
+#define JSON_STR(name, s, slen) do { \
+  JSON_LIT(",\"" name "\":"); \
+  o += access_json_string(buf + o, len - o, s, slen); \
+} while(0)
+  o = 0;
+  JSON_LIT("{\"time\":\"");
+  JSON_LIT(timestr);
+  JSON_LIT("\"");
+  JSON_STR("remote", ip, strlen(ip));
+  JSON_STR("method", t, rec->method_len);
+  t += rec->method_len;
+  JSON_STR("uri", t, rec->uri_len);
+  t += rec->uri_len;
+  if(rec->has_qs) JSON_STR("query", t, rec->qs_len);
+  t += rec->qs_len;
+  JSON_STR("protocol", t, rec->protocol_len);
+  if(o < len)
+    o += snprintf(buf + o, len - o,
+                  ",\"status\":%d,\"bytes\":%llu,\"duration_ms\":%.3f}\n",
+                  rec->status, (long long unsigned)rec->bytes,
+                  (double)rec->elapsed_us / 1000.0);
+  return o < len ? o : len;
+#undef JSON_STR
+#undef JSON_LIT
+}
+
+/* Times are formatted once a second, not once a line. */
+struct access_clock {
+  time_t sec;
+  char combined[64];
+  char iso[64];
+};
+
+static void
+access_write(const struct access_record *rec, struct access_clock *clock) {
+  char ip[128], line[(ACCESS_TEXT_MAX + 128) * 6 + 256], timestr[80];
+  int len;
+  if(rec->end.tv_sec != clock->sec) {
+    struct tm tbuf, *tm;
+    time_t sec = rec->end.tv_sec;
+    tm = gmtime_r(&sec, &tbuf);
+    strftime(clock->combined, sizeof(clock->combined),
+             "%d/%b/%Y:%H:%M:%S -0000", tm);
+    strftime(clock->iso, sizeof(clock->iso), "%Y-%m-%dT%H:%M:%S", tm);
+    clock->sec = sec;
+  }
+  if(!rec->has_remote ||
+     !mtev_convert_sockaddr_to_buff(ip, sizeof(ip), (struct sockaddr *)&rec->remote.a))
+    strlcpy(ip, "-", sizeof(ip));
+  if(access_json) {
+    snprintf(timestr, sizeof(timestr), "%s.%03dZ", clock->iso,
+             (int)(rec->end.tv_usec / 1000));
+    len = access_format_json(rec, ip, timestr, line, sizeof(line));
+  }
+  else len = access_format_combined(rec, ip, clock->combined,
+                                    line, sizeof(line));
+  if(len > (int)sizeof(line) - 1) len = sizeof(line) - 1;
+  mtevLT(http_access, (struct timeval *)&rec->end, "%.*s", len, line);
+}
+
+static int
+access_drain(struct access_ring *ring, struct access_clock *clock) {
+  unsigned int head, tail, n = 0;
+  head = ck_pr_load_uint(&ring->head);
+  ck_pr_fence_load();
+  for(tail = ring->tail; tail != head && n < ACCESS_BATCH_MAX; tail++, n++)
+    access_write(&ring->records[tail & ring->mask], clock);
+  /* the records are read before they're handed back */
+  ck_pr_fence_memory();
+  ck_pr_store_uint(&ring->tail, tail);
+  return n;
+}
+
+static void *
+access_writer(void *unused) {
+  struct access_clock clock = { 0 };
+  int64_t dropped = 0;
+  mtevL(mtev_debug, "starting http access log writer\n");
+  while(1) {
+    struct access_ring *ring, **prev;
+    int64_t lost = 0;
+    int n = 0;
+    access_config();
+    pthread_mutex_lock(&access_rings_lock);
+    for(prev = &access_rings; (ring = *prev) != NULL; ) {
+      int dead = ck_pr_load_int(&ring->dead);
+      n += access_drain(ring, &clock);
+      lost += ring->dropped;
+      if(dead && ring->tail == ck_pr_load_uint(&ring->head)) {
+        *prev = ring->next;
+        dropped -= ring->dropped;
+        free(ring->records);
+        free(ring);
+        continue;
+      }
+      prev = &ring->next;
+    }
+    pthread_mutex_unlock(&access_rings_lock);
+    if(lost > dropped) {
+      mtevL(mtev_error, "http/access: %lld records dropped, rings full\n",
+            (long long)(lost - dropped));
+      dropped = lost;
+    }
+    /* 200ms if there was nothing, 10ms otherwise */
+    if(n < ACCESS_BATCH_MAX) usleep(n ? 10000 : 200000);
+  }
+  return NULL;
+}
+
+static void
+access_start() {
+  pthread_t tid;
+  pthread_attr_t tattr;
+  const char *v;
+  v = mtev_log_stream_get_property(http_access, "ring_size");
+  if(v && atoi(v) > 0) {
+    /* a power of two, so positions can be masked */
+    access_ring_size = 1;
+    while(access_ring_size < (unsigned int)atoi(v)) access_ring_size <<= 1;
+  }
+  access_config();
+  pthread_key_create(&access_ring_key, access_ring_release);
+  pthread_attr_init(&tattr);
+  pthread_attr_setdetachstate(&tattr, PTHREAD_CREATE_DETACHED);
+  if(pthread_create(&tid, &tattr, access_writer, NULL) != 0)
+    mtevL(mtev_error, "http/access: cannot start the writer\n");
+}
+
+static struct access_ring *
+access_ring_get() {
+  struct access_ring *ring;
+  if(access_ring) return access_ring;
+  pthread_once(&access_once, access_start);
+  ring = calloc(1, sizeof(*ring));
+  ring->records = calloc(access_ring_size, sizeof(*ring->records));
+  ring->mask = access_ring_size - 1;
+  pthread_setspecific(access_ring_key, ring);
+  pthread_mutex_lock(&access_rings_lock);
+  ring->next = access_rings;
+  access_rings = ring;
+  pthread_mutex_unlock(&access_rings_lock);
+  return access_ring = ring;
+}
+
+static void
+access_text(struct access_record *rec, const char *method,
+            const char *uri, const char *qs, const char *protocol) {
+  size_t room = ACCESS_TEXT_MAX, ml, ul, ql = 0, pl;
+  ml = MIN(strlen(method), 32);
+  pl = MIN(strlen(protocol), 32);
+  room -= ml + pl;
+  ul = MIN(strlen(uri), room);
+  room -= ul;
+  if(qs) ql = MIN(strlen(qs), room);
+  memcpy(rec->text, method, ml);
+  memcpy(rec->text + ml, uri, ul);
+  if(ql) memcpy(rec->text + ml + ul, qs, ql);
+  memcpy(rec->text + ml + ul + ql, protocol, pl);
+  rec->method_len = ml;
+  rec->uri_len = ul;
+  rec->qs_len = ql;
+  rec->protocol_len = pl;
+  rec->has_qs = qs != NULL;
+}
+
+void
+mtev_http_log_request(mtev_http_session_ctx *ctx) {
+  struct access_ring *ring;
+  struct access_record *rec;
+  struct timeval diff;
+  unsigned int head;
+
+  if(ctx->req.start_time.tv_sec == 0) return;
+  if(http_request_log_hook_invoke(ctx) != MTEV_HOOK_CONTINUE) return;
+  if(!http_access ||
+     !(mtev_log_global_enabled() || N_L_S_ON(http_access))) return;
+  if(access_sample > 1 && ctx->res.status_code < 500 &&
+     ++access_skipped < access_sample) return;
+  access_skipped = 0;
+
+  ring = access_ring_get();
+  head = ring->head;
+  if(head - ck_pr_load_uint(&ring->tail) > ring->mask) {
+    mtev_atomic_inc64(&ring->dropped);
+    return;
+  }
+  rec = &ring->records[head & ring->mask];
+  gettimeofday(&rec->end, NULL);
+  sub_timeval(rec->end, ctx->req.start_time, &diff);
+  rec->elapsed_us = (u_int64_t)diff.tv_sec * 1000000 + diff.tv_usec;
+  rec->bytes = ctx->res.bytes_written;
+  rec->status = ctx->res.status_code;
+  rec->has_remote = ctx->ac != NULL;
+  if(ctx->ac) memcpy(&rec->remote, &ctx->ac->remote, sizeof(rec->remote));
+  access_text(rec, ctx->req.method_str ? ctx->req.method_str : "-",
+              ctx->req.uri_str ? ctx->req.uri_str : "-",
+              ctx->req.orig_qs,
+              ctx->req.protocol_str ? ctx->req.protocol_str : "-");
+  /* the record is complete before the writer can see it */
+  ck_pr_fence_store();
+  ck_pr_store_uint(&ring->head, head + 1);
+}
+
+void
+mtev_http_access_init() {
+  http_access = mtev_log_stream_find("http/access");
+  if(http_access) access_config();
+}
@@ -0,0 +1,1292 @@
+/*
+ * Copyright (c) 2014-2015, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *    * Neither the name Circonus, Inc. nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* An HTTP/1.1 client for the eventer.
+ *
+ * Connections are grouped per eventer thread (a shard) and, within it,
+ * per scheme://host:port.  A shard is only ever touched by its own
+ * thread, so hosts, connections and queues need no locks; the pool's
+ * lock covers only the table of shards.  Responses are read into a
+ * single bchain per connection: the header block is parsed where it
+ * lies and body data is handed to the caller straight from the buffer.
+ */
+
+#include "mtev_defines.h"
+#include "mtev_http.h"
+#include "mtev_http_private.h"
+#include "mtev_http_client.h"
+#include "mtev_memscan.h"
+
+#include <errno.h>
+#include <ctype.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define DEFAULT_MAX_PER_HOST 8
+#define DEFAULT_PIPELINE_DEPTH 1
+#define DEFAULT_CONNECT_TIMEOUT 5000
+#define DEFAULT_REQUEST_TIMEOUT 30000
+#define DEFAULT_IDLE_TIMEOUT 60000
+#define MAX_HEADER_BLOCK (1024 * 64)
+#define MAX_CHUNK_LINE 1024
+#define MAX_ATTEMPTS 2
+#define MIN_RESOLVE_BACKOFF 1000
+#define MAX_RESOLVE_BACKOFF 30000
+
+static mtev_log_stream_t client_debug = NULL;
+
+typedef enum { BODY_NONE, BODY_LENGTH, BODY_CHUNKED, BODY_EOF } body_mode_t;
+typedef enum { CHUNK_SIZE, CHUNK_DATA, CHUNK_CRLF, CHUNK_TRAILER } chunk_state_t;
+typedef enum { CONN_CONNECTING, CONN_HANDSHAKE, CONN_READY } conn_state_t;
+
+struct client_shard;
+struct client_host;
+struct client_conn;
+
+struct mtev_http_client_request {
+  mtev_http_client_pool_t *pool;
+  char *method;
+  char *key;                /* scheme://host:port */
+  char *name;               /* host, as resolved */
+  char *authority;          /* host[:port], as sent */
+  unsigned short port;
+  mtev_boolean ssl;
+  char *path;
+  char *headers;            /* "name: value\r\n"... */
+  size_t headers_len;
+  struct bchain *body;
+  size_t body_len;
+  mtev_boolean idempotent;  /* may be pipelined and retried */
+  unsigned int timeout_ms;
+  struct timeval deadline;
+  int attempts;
+  mtev_http_client_func cb;
+  void *closure;
+
+  struct bchain *out;       /* the leader, then the body */
+  size_t written;
+  mtev_http_client_request_t *next;
+
+  mtev_boolean started;     /* some of the response has arrived */
+  mtev_boolean headers_done;
+  int status;
+  char *header_block;
+  mtev_hash_table response_headers;
+  mtev_boolean keepalive;
+  body_mode_t mode;
+  chunk_state_t chunk;
+  size_t remaining;
+  char *error;
+};
+
+struct client_conn {
+  struct client_host *host;
+  eventer_t e;
+  eventer_t timer;
+  conn_state_t state;
+  mtev_boolean busy;        /* inside conn_drive */
+  mtev_boolean closing;     /* takes no more requests */
+  mtev_boolean expired;     /* the timer (or the pool) wants it gone */
+  mtev_boolean session_saved;
+  int completed;            /* responses read; pipelining waits for one */
+  int depth;
+  int unsafe;               /* requests in flight that can't be pipelined */
+  struct timeval connect_deadline;
+  struct timeval idle_since;
+  mtev_http_client_request_t *head, *tail, *writing;
+  struct bchain *in;
+  struct client_conn *next;
+};
+
+struct client_host {
+  struct client_shard *shard;
+  char *key;
+  char *name;
+  unsigned short port;
+  mtev_boolean ssl;
+  int resolved;             /* 1, 0 if not yet, -1 if the name didn't */
+  mtev_boolean resolving;   /* a lookup is out on the jobq */
+  struct timeval retry_at;  /* a failed name isn't looked up before this */
+  unsigned int backoff_ms;
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  SSL_SESSION *session;     /* offered to the next TLS connection */
+  int nconns;
+  struct client_conn *conns;
+  mtev_http_client_request_t *queue, *queue_tail;
+  mtev_boolean pumping, repump;
+};
+
+struct client_shard {
+  pthread_t owner;
+  mtev_http_client_pool_t *pool;
+  mtev_hash_table hosts;
+};
+
+struct mtev_http_client_pool {
+  pthread_mutex_t lock;     /* guards shards */
+  mtev_hash_table shards;
+  mtev_hash_table config;
+  int max_per_host;
+  int pipeline_depth;
+  unsigned int connect_timeout;
+  unsigned int request_timeout;
+  unsigned int idle_timeout;
+  eventer_jobq_t *resolve_jobq;
+  mtev_atomic32_t refcnt;   /* the owner, requests, connections */
+  mtev_boolean closing;
+};
+
+static mtev_atomic32_t submit_rr = 0;
+
+static void host_pump(struct client_host *);
+static int conn_expired(eventer_t, int, void *, struct timeval *);
+
+static void
+ms_from_now(struct timeval *out, unsigned int ms) {
+  struct timeval now, diff;
+  gettimeofday(&now, NULL);
+  diff.tv_sec = ms / 1000;
+  diff.tv_usec = (ms % 1000) * 1000;
+  add_timeval(now, diff, out);
+}
+static unsigned int
+config_uint(mtev_hash_table *config, const char *key, unsigned int dflt) {
+  const char *str;
+  if(!mtev_hash_retr_str(config, key, strlen(key), &str)) return dflt;
+  return strtoul(str, NULL, 10);
+}
+
+static void
+pool_destroy(mtev_http_client_pool_t *pool) {
+  mtev_hash_iter iter = MTEV_HASH_ITER_ZERO;
+  const char *k;
+  int klen;
+  void *data;
+  while(mtev_hash_next(&pool->shards, &iter, &k, &klen, &data)) {
+    struct client_shard *shard = data;
+    mtev_hash_iter hiter = MTEV_HASH_ITER_ZERO;
+    while(mtev_hash_next(&shard->hosts, &hiter, &k, &klen, &data)) {
+      struct client_host *host = data;
+      if(host->session) SSL_SESSION_free(host->session);
+      free(host->key);
+      free(host->name);
+      free(host);
+    }
+    mtev_hash_destroy(&shard->hosts, NULL, NULL);
+    free(shard);
+  }
+  mtev_hash_destroy(&pool->shards, NULL, NULL);
+  mtev_hash_destroy(&pool->config, free, free);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool);
+}
+static void
+pool_release(mtev_http_client_pool_t *pool) {
+  if(mtev_atomic_dec32(&pool->refcnt) == 0) pool_destroy(pool);
+}
+
+mtev_http_client_pool_t *
+mtev_http_client_pool_new(mtev_hash_table *config) {
+  mtev_http_client_pool_t *pool = calloc(1, sizeof(*pool));
+  const char *val;
+  pthread_mutex_init(&pool->lock, NULL);
+  mtev_hash_init(&pool->shards);
+  mtev_hash_init(&pool->config);
+  mtev_hash_merge_as_dict(&pool->config, config);
+  pool->max_per_host = config_uint(&pool->config, "max_connections_per_host",
+                                   DEFAULT_MAX_PER_HOST);
+  if(pool->max_per_host < 1) pool->max_per_host = 1;
+  pool->pipeline_depth = config_uint(&pool->config, "pipeline_depth",
+                                     DEFAULT_PIPELINE_DEPTH);
+  if(pool->pipeline_depth < 1) pool->pipeline_depth = 1;
+  pool->connect_timeout = config_uint(&pool->config, "connect_timeout",
+                                      DEFAULT_CONNECT_TIMEOUT);
+  pool->request_timeout = config_uint(&pool->config, "request_timeout",
+                                      DEFAULT_REQUEST_TIMEOUT);
+  pool->idle_timeout = config_uint(&pool->config, "idle_timeout",
+                                   DEFAULT_IDLE_TIMEOUT);
+  if(mtev_hash_retr_str(&pool->config, "resolve_jobq",
+                        strlen("resolve_jobq"), &val)) {
+    pool->resolve_jobq = eventer_jobq_retrieve(val);
+    if(!pool->resolve_jobq)
+      mtevL(mtev_error, "http client: no jobq '%s', resolving on default\n",
+            val);
+  }
+  pool->refcnt = 1;
+  return pool;
+}
+
+/* Close whatever is idle on the shard's thread. */
+static int
+shard_reap(eventer_t e, int mask, void *closure, struct timeval *now) {
+  struct client_shard *shard = closure;
+  mtev_http_client_pool_t *pool = shard->pool;
+  mtev_hash_iter iter = MTEV_HASH_ITER_ZERO;
+  const char *k;
+  int klen;
+  void *data;
+  while(mtev_hash_next(&shard->hosts, &iter, &k, &klen, &data)) {
+    struct client_host *host = data;
+    struct client_conn *conn, *next;
+    for(conn = host->conns; conn; conn = next) {
+      next = conn->next;
+      if(conn->head || !conn->e) continue;
+      conn->expired = mtev_true;
+      eventer_trigger(conn->e, EVENTER_EXCEPTION);
+    }
+  }
+  pool_release(pool);
+  return 0;
+}
+void
+mtev_http_client_pool_free(mtev_http_client_pool_t *pool) {
+  mtev_hash_iter iter = MTEV_HASH_ITER_ZERO;
+  const char *k;
+  int klen;
+  void *data;
+  pool->closing = mtev_true;
+  pthread_mutex_lock(&pool->lock);
+  while(mtev_hash_next(&pool->shards, &iter, &k, &klen, &data)) {
+    struct client_shard *shard = data;
+    eventer_t e = eventer_alloc();
+    e->mask = EVENTER_TIMER;
+    e->callback = shard_reap;
+    e->closure = shard;
+    e->thr_owner = shard->owner;
+    gettimeofday(&e->whence, NULL);
+    mtev_atomic_inc32(&pool->refcnt);
+    eventer_add(e);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  pool_release(pool);
+}
+
+static struct client_shard *
+shard_get(mtev_http_client_pool_t *pool) {
+  pthread_t self = pthread_self();
+  void *vshard;
+  struct client_shard *shard;
+  pthread_mutex_lock(&pool->lock);
+  if(mtev_hash_retrieve(&pool->shards, (const char *)&self, sizeof(self),
+                        &vshard)) {
+    pthread_mutex_unlock(&pool->lock);
+    return vshard;
+  }
+  shard = calloc(1, sizeof(*shard));
+  shard->owner = self;
+  shard->pool = pool;
+  mtev_hash_init(&shard->hosts);
+  mtev_hash_store(&pool->shards, (const char *)&shard->owner,
+                  sizeof(shard->owner), shard);
+  pthread_mutex_unlock(&pool->lock);
+  return shard;
+}
+/* Name lookups block, so they run on a jobq and report back to the
+ * shard's thread; requests wait in the host's queue meanwhile.
+ */
+struct resolve_job {
+  struct client_host *host;
+  char *name;
+  unsigned short port;
+  int ok;
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+};
+
+static void host_fail_queue(struct client_host *, const char *);
+
+static int
+host_resolve_asynch(eventer_t e, int mask, void *closure,
+                    struct timeval *now) {
+  struct resolve_job *job = closure;
+  struct client_host *host = job->host;
+  mtev_http_client_pool_t *pool = host->shard->pool;
+
+  if(mask == EVENTER_ASYNCH_WORK) {
+    struct addrinfo hints, *res = NULL;
+    char port[8];
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port, sizeof(port), "%u", job->port);
+    if(getaddrinfo(job->name, port, &hints, &res) == 0 && res &&
+       res->ai_addrlen <= sizeof(job->addr)) {
+      memcpy(&job->addr, res->ai_addr, res->ai_addrlen);
+      job->addrlen = res->ai_addrlen;
+      job->ok = 1;
+    }
+    if(res) freeaddrinfo(res);
+  }
+  if(mask == EVENTER_ASYNCH) {
+    host->resolving = mtev_false;
+    if(job->ok) {
+      memcpy(&host->addr, &job->addr, job->addrlen);
+      host->addrlen = job->addrlen;
+      host->resolved = 1;
+      host->backoff_ms = 0;
+      host_pump(host);
+    }
+    else {
+      host->backoff_ms = host->backoff_ms ?
+        MIN(host->backoff_ms * 2, MAX_RESOLVE_BACKOFF) : MIN_RESOLVE_BACKOFF;
+      mtevL(client_debug, "http client: cannot resolve %s, retry in %ums\n",
+            host->name, host->backoff_ms);
+      host->resolved = -1;
+      ms_from_now(&host->retry_at, host->backoff_ms);
+      host_fail_queue(host, "cannot resolve host");
+    }
+    free(job->name);
+    free(job);
+    pool_release(pool);
+  }
+  return 0;
+}
+static void
+host_resolve(struct client_host *host) {
+  mtev_http_client_pool_t *pool = host->shard->pool;
+  struct resolve_job *job;
+  eventer_t e;
+
+  if(host->resolving) return;
+  host->resolving = mtev_true;
+  job = calloc(1, sizeof(*job));
+  job->host = host;
+  job->name = strdup(host->name);
+  job->port = host->port;
+  mtev_atomic_inc32(&pool->refcnt);
+
+  e = eventer_alloc();
+  e->mask = EVENTER_ASYNCH;
+  e->callback = host_resolve_asynch;
+  e->closure = job;
+  e->thr_owner = host->shard->owner;
+  eventer_add_asynch(pool->resolve_jobq, e);
+}
+static struct client_host *
+host_get(struct client_shard *shard, mtev_http_client_request_t *req) {
+  void *vhost;
+  struct client_host *host;
+
+  if(mtev_hash_retrieve(&shard->hosts, req->key, strlen(req->key), &vhost))
+    return vhost;
+  host = calloc(1, sizeof(*host));
+  host->shard = shard;
+  host->key = strdup(req->key);
+  host->name = strdup(req->name);
+  host->port = req->port;
+  host->ssl = req->ssl;
+  mtev_hash_store(&shard->hosts, host->key, strlen(host->key), host);
+  return host;
+}
+
+static void
+request_response_reset(mtev_http_client_request_t *req) {
+  if(req->response_headers.ht.h)
+    mtev_hash_destroy(&req->response_headers, NULL, NULL);
+  memset(&req->response_headers, 0, sizeof(req->response_headers));
+  free(req->header_block);
+  req->header_block = NULL;
+  req->headers_done = mtev_false;
+  req->status = 0;
+  req->mode = BODY_NONE;
+  req->chunk = CHUNK_SIZE;
+  req->remaining = 0;
+}
+static mtev_boolean
+request_deliver(mtev_http_client_request_t *req, mtev_http_client_event_t ev,
+                const void *data, size_t len) {
+  if(!req->cb) return mtev_true;
+  return req->cb(req, ev, data, len, req->closure);
+}
+static void
+request_finish(mtev_http_client_request_t *req, mtev_http_client_event_t ev) {
+  mtev_http_client_pool_t *pool = req->pool;
+  request_deliver(req, ev, NULL, 0);
+  mtev_http_client_request_free(req);
+  pool_release(pool);
+}
+static void
+request_fail(mtev_http_client_request_t *req, const char *error) {
+  if(!req->error) req->error = strdup(error);
+  mtevL(client_debug, "http client: %s %s%s failed: %s\n", req->method,
+        req->key, req->path, req->error);
+  request_finish(req, MTEV_HTTP_CLIENT_ERROR);
+}
+
+/* Is token one of the comma separated values? */
+static mtev_boolean
+header_has_token(const char *value, const char *token) {
+  size_t tlen = strlen(token);
+  while(*value) {
+    size_t len;
+    while(*value == ' ' || *value == '\t' || *value == ',') value++;
+    len = strcspn(value, ", \t");
+    if(len == tlen && !strncasecmp(value, token, tlen)) return mtev_true;
+    value += len;
+  }
+  return mtev_false;
+}
+
+/* Parse the status line and headers; block is ours and NUL terminated. */
+static mtev_boolean
+response_parse(mtev_http_client_request_t *req, char *block, size_t blen) {
+  const char *connection, *te, *cl;
+  char *last_end = NULL;
+  size_t off = 0;
+  mtev_boolean first = mtev_true;
+
+  req->header_block = block;
+  while(1) {
+    mtev_memscan_line_t lines[32];
+    size_t used;
+    int i, n;
+    n = mtev_memscan_lines(block + off, blen - off, ':', lines, 32, &used);
+    for(i=0; i<n; i++) {
+      char *line = block + off + lines[i].start;
+      const char *name, *value;
+      line[lines[i].len] = '\0';
+      if(first) {
+        /* HTTP/1.x SSS reason */
+        if(lines[i].len < 12 || memcmp(line, "HTTP/1.", 7) ||
+           line[8] != ' ' || !isdigit((unsigned char)line[9]) ||
+           !isdigit((unsigned char)line[10]) ||
+           !isdigit((unsigned char)line[11])) return mtev_false;
+        req->status = (line[9] - '0') * 100 + (line[10] - '0') * 10 +
+                      (line[11] - '0');
+        req->keepalive = (line[7] != '0');
+        first = mtev_false;
+        continue;
+      }
+      if(lines[i].len == 0) goto headers_done;
+      if(!mtev_http_extract_header(line, lines[i].delim, lines[i].len,
+                                   &name, &value)) return mtev_false;
+      if(!name) {
+        /* a folded line continues the previous value */
+        if(!last_end) return mtev_false;
+        memset(last_end, ' ', value - last_end);
+      }
+      else
+        mtev_hash_replace(&req->response_headers, name, strlen(name),
+                          (void *)value, NULL, NULL);
+      last_end = line + lines[i].len;
+    }
+    if(n < 32) break;
+    off += used;
+  }
+  return mtev_false; /* no blank line */
+
+ headers_done:
+  if(mtev_hash_retr_str(&req->response_headers, "connection",
+                        strlen("connection"), &connection)) {
+    if(header_has_token(connection, "close")) req->keepalive = mtev_false;
+    else if(header_has_token(connection, "keep-alive"))
+      req->keepalive = mtev_true;
+  }
+  if(!strcmp(req->method, "HEAD") || req->status == 204 ||
+     req->status == 304 || req->status < 200)
+    req->mode = BODY_NONE;
+  else if(mtev_hash_retr_str(&req->response_headers, "transfer-encoding",
+                             strlen("transfer-encoding"), &te) &&
+          header_has_token(te, "chunked")) {
+    req->mode = BODY_CHUNKED;
+    req->chunk = CHUNK_SIZE;
+  }
+  else if(mtev_hash_retr_str(&req->response_headers, "content-length",
+                             strlen("content-length"), &cl)) {
+    char *end;
+    unsigned long long len = strtoull(cl, &end, 10);
+    if(end == cl || *end != '\0' || *cl == '-') return mtev_false;
+    req->mode = BODY_LENGTH;
+    req->remaining = len;
+  }
+  else {
+    req->mode = BODY_EOF;
+    req->keepalive = mtev_false;
+  }
+  return mtev_true;
+}
+
+static void
+conn_arm(struct client_conn *conn) {
+  mtev_http_client_pool_t *pool = conn->host->shard->pool;
+  struct timeval when;
+  if(conn->state != CONN_READY) when = conn->connect_deadline;
+  else if(conn->head) {
+    mtev_http_client_request_t *req;
+    when = conn->head->deadline;
+    for(req = conn->head->next; req; req = req->next)
+      if(compare_timeval(req->deadline, when) < 0) when = req->deadline;
+  }
+  else {
+    struct timeval idle;
+    idle.tv_sec = pool->idle_timeout / 1000;
+    idle.tv_usec = (pool->idle_timeout % 1000) * 1000;
+    add_timeval(conn->idle_since, idle, &when);
+  }
+  if(conn->timer) {
+    if(compare_timeval(conn->timer->whence, when) == 0) return;
+    conn->timer->whence = when;
+    eventer_update(conn->timer, EVENTER_TIMER);
+    return;
+  }
+  conn->timer = eventer_alloc();
+  conn->timer->mask = EVENTER_TIMER;
+  conn->timer->callback = conn_expired;
+  conn->timer->closure = conn;
+  conn->timer->whence = when;
+  eventer_add(conn->timer);
+}
+static int
+conn_expired(eventer_t e, int mask, void *closure, struct timeval *now) {
+  struct client_conn *conn = closure;
+  conn->timer = NULL;
+  conn->expired = mtev_true;
+  if(conn->e) eventer_trigger(conn->e, EVENTER_EXCEPTION);
+  return 0;
+}
+
+static mtev_boolean
+conn_ssl_attach(struct client_conn *conn) {
+  struct client_host *host = conn->host;
+  mtev_hash_table *config = &host->shard->pool->config;
+  const char *layer, *cert, *key, *ca, *ciphers, *crl;
+  eventer_ssl_ctx_t *sslctx;
+  struct in6_addr a6;
+
+#define SSLCONFGET(var,name) do { \
+  if(!mtev_hash_retr_str(config, name, strlen(name), &var)) var = NULL; \
+} while(0)
+  SSLCONFGET(layer, "layer");
+  SSLCONFGET(cert, "certificate_file");
+  SSLCONFGET(key, "key_file");
+  SSLCONFGET(ca, "ca_chain");
+  SSLCONFGET(ciphers, "ciphers");
+  SSLCONFGET(crl, "crl");
+
+  sslctx = eventer_ssl_ctx_new(SSL_CLIENT, layer, cert, key, ca, ciphers);
+  if(!sslctx) return mtev_false;
+  if(crl && !eventer_ssl_use_crl(sslctx, crl)) {
+    mtevL(mtev_error, "http client: failed to load CRL from %s\n", crl);
+    eventer_ssl_ctx_free(sslctx);
+    return mtev_false;
+  }
+  eventer_ssl_ctx_set_verify(sslctx, eventer_ssl_verify_cert, config);
+  if(inet_pton(AF_INET, host->name, &a6) != 1 &&
+     inet_pton(AF_INET6, host->name, &a6) != 1)
+    eventer_ssl_ctx_set_sni(sslctx, host->name);
+  eventer_ssl_ctx_set_session(sslctx, host->session);
+  EVENTER_ATTACH_SSL(conn->e, sslctx);
+  return mtev_true;
+}
+
+static int conn_drive(eventer_t, int, void *, struct timeval *);
+
+static struct client_conn *
+conn_open(struct client_host *host) {
+  mtev_http_client_pool_t *pool = host->shard->pool;
+  struct client_conn *conn;
+  eventer_t e;
+  int fd, on = 1;
+
+  fd = socket(host->addr.ss_family, NE_SOCK_CLOEXEC|SOCK_STREAM, 0);
+  if(fd < 0) return NULL;
+  if(eventer_set_fd_nonblocking(fd) ||
+     (connect(fd, (struct sockaddr *)&host->addr, host->addrlen) == -1 &&
+      errno != EINPROGRESS)) {
+    close(fd);
+    return NULL;
+  }
+  /* pipelined requests are small writes that shouldn't wait on acks */
+  (void)setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+  conn = calloc(1, sizeof(*conn));
+  conn->host = host;
+  conn->state = CONN_CONNECTING;
+  ms_from_now(&conn->connect_deadline, pool->connect_timeout);
+  e = eventer_alloc();
+  e->fd = fd;
+  e->mask = EVENTER_READ | EVENTER_WRITE | EVENTER_EXCEPTION;
+  e->callback = conn_drive;
+  e->closure = conn;
+  conn->e = e;
+  conn->next = host->conns;
+  host->conns = conn;
+  host->nconns++;
+  mtev_atomic_inc32(&pool->refcnt);
+  eventer_add(e);
+  conn_arm(conn);
+  mtevL(client_debug, "http client: connecting to %s (fd %d)\n",
+        host->key, fd);
+  return conn;
+}
+
+static void
+conn_assign(struct client_conn *conn, mtev_http_client_request_t *req) {
+  req->next = NULL;
+  req->written = 0;
+  req->started = mtev_false;
+  request_response_reset(req);
+  if(conn->tail) conn->tail->next = req;
+  else conn->head = req;
+  conn->tail = req;
+  if(!conn->writing) conn->writing = req;
+  conn->depth++;
+  if(!req->idempotent) conn->unsafe++;
+  /* a connection in its own callback will notice on its way out */
+  if(conn->busy) return;
+  if(conn->state == CONN_READY) eventer_trigger(conn->e, EVENTER_WRITE);
+}
+
+static struct client_conn *
+host_pick(struct client_host *host, mtev_http_client_request_t *req,
+          mtev_boolean *failed) {
+  mtev_http_client_pool_t *pool = host->shard->pool;
+  struct client_conn *conn, *best = NULL;
+
+  *failed = mtev_false;
+  for(conn = host->conns; conn; conn = conn->next)
+    if(!conn->closing && conn->e && conn->depth == 0) return conn;
+  if(host->nconns < pool->max_per_host) {
+    if((conn = conn_open(host)) == NULL) *failed = mtev_true;
+    return conn;
+  }
+  if(!req->idempotent || pool->pipeline_depth <= 1) return NULL;
+  for(conn = host->conns; conn; conn = conn->next) {
+    if(conn->closing || !conn->e || conn->unsafe || !conn->completed ||
+       conn->depth >= pool->pipeline_depth) continue;
+    if(!best || conn->depth < best->depth) best = conn;
+  }
+  return best;
+}
+
+/* Hand queued requests to connections.  Callbacks made from here can
+ * submit more, so a nested pump only asks the outer one to go again.
+ */
+static void
+host_pump(struct client_host *host) {
+  if(host->pumping) {
+    host->repump = mtev_true;
+    return;
+  }
+  host->pumping = mtev_true;
+  do {
+    mtev_http_client_request_t *req;
+    struct timeval now;
+    host->repump = mtev_false;
+    gettimeofday(&now, NULL);
+    while((req = host->queue) != NULL) {
+      struct client_conn *conn;
+      mtev_boolean failed;
+      if(compare_timeval(req->deadline, now) <= 0) {
+        host->queue = req->next;
+        if(!host->queue) host->queue_tail = NULL;
+        request_fail(req, "request timed out");
+        continue;
+      }
+      conn = host_pick(host, req, &failed);
+      if(!conn && !failed) break;
+      host->queue = req->next;
+      if(!host->queue) host->queue_tail = NULL;
+      if(failed) request_fail(req, strerror(errno));
+      else conn_assign(conn, req);
+    }
+  } while(host->repump);
+  host->pumping = mtev_false;
+}
+static void
+host_fail_queue(struct client_host *host, const char *error) {
+  mtev_http_client_request_t *req;
+  while((req = host->queue) != NULL) {
+    host->queue = req->next;
+    if(!host->queue) host->queue_tail = NULL;
+    request_fail(req, error);
+  }
+}
+
+/* 1 when everything is out, 0 when blocked (mask set), -1 on error */
+static int
+conn_write(struct client_conn *conn, int *mask) {
+  eventer_t e = conn->e;
+  while(conn->writing) {
+    mtev_http_client_request_t *req = conn->writing;
+    struct bchain *b;
+    size_t off = req->written;
+    int len;
+    for(b = req->out; b && off >= b->size; b = b->next) off -= b->size;
+    if(!b) {
+      conn->writing = req->next;
+      continue;
+    }
+    len = e->opset->write(e->fd, b->buff + b->start + off, b->size - off,
+                          mask, e);
+    if(len == -1 && errno == EAGAIN) return 0;
+    if(len <= 0) return -1;
+    if(req->written == 0) req->attempts++;
+    req->written += len;
+  }
+  *mask = 0;
+  return 1;
+}
+
+static void
+conn_complete(struct client_conn *conn) {
+  struct client_host *host = conn->host;
+  mtev_http_client_request_t *req = conn->head;
+
+  conn->head = req->next;
+  if(!conn->head) conn->tail = NULL;
+  if(conn->writing == req) {
+    /* answered before we finished asking; the rest can't be sent */
+    conn->writing = req->next;
+    conn->closing = mtev_true;
+  }
+  conn->depth--;
+  if(!req->idempotent) conn->unsafe--;
+  conn->completed++;
+  if(host->ssl && !conn->session_saved) {
+    /* after a full exchange, so TLS 1.3 tickets have arrived */
+    eventer_ssl_ctx_t *sslctx = eventer_get_eventer_ssl_ctx(conn->e);
+    SSL_SESSION *session = sslctx ? eventer_ssl_get_session(sslctx) : NULL;
+    if(session) {
+      if(host->session) SSL_SESSION_free(host->session);
+      host->session = session;
+    }
+    conn->session_saved = mtev_true;
+  }
+  if(!conn->head) gettimeofday(&conn->idle_since, NULL);
+  request_finish(req, MTEV_HTTP_CLIENT_DONE);
+  if(!conn->closing) host_pump(host);
+}
+
+/* Work through what has been read: 0 to read more, -1 to close. */
+static int
+conn_process(struct client_conn *conn, const char **error) {
+  struct bchain *in = conn->in;
+  mtev_http_client_request_t *req;
+
+  while((req = conn->head) != NULL) {
+    char *data = in->buff + in->start;
+    const char *eol;
+    size_t n;
+
+    if(in->size) req->started = mtev_true;
+    if(!req->headers_done) {
+      char *block;
+      if(in->size == 0) return 0;
+      if((eol = mtev_memscan_crlfcrlf(data, in->size)) == NULL) return 0;
+      n = eol + 4 - data;
+      block = malloc(n + 1);
+      memcpy(block, data, n);
+      block[n] = '\0';
+      in->start += n;
+      in->size -= n;
+      if(!response_parse(req, block, n)) {
+        *error = "malformed response headers";
+        return -1;
+      }
+      if(req->status < 200) {
+        /* 100 Continue and friends precede the real response */
+        request_response_reset(req);
+        continue;
+      }
+      req->headers_done = mtev_true;
+      if(!req->keepalive) conn->closing = mtev_true;
+      if(!request_deliver(req, MTEV_HTTP_CLIENT_HEADERS, NULL, 0)) goto abandon;
+      if(req->mode == BODY_NONE ||
+         (req->mode == BODY_LENGTH && req->remaining == 0)) goto complete;
+      continue;
+    }
+
+    if(req->mode == BODY_CHUNKED && req->chunk != CHUNK_DATA) {
+      switch(req->chunk) {
+        case CHUNK_SIZE:
+        case CHUNK_TRAILER:
+          if((eol = mtev_memscan_crlf(data, in->size)) == NULL) {
+            if(in->size > MAX_CHUNK_LINE) goto malformed;
+            return 0;
+          }
+          n = eol + 2 - data;
+          if(req->chunk == CHUNK_TRAILER) {
+            in->start += n;
+            in->size -= n;
+            if(n == 2) goto complete;
+            continue;
+          }
+          else {
+            size_t clen = 0;
+            const char *cp;
+            for(cp = data; cp < eol && isxdigit((unsigned char)*cp); cp++) {
+              if(clen >> (sizeof(clen) * 8 - 4)) goto malformed;
+              clen = (clen << 4) |
+                     (isdigit((unsigned char)*cp) ? *cp - '0' :
+                                                    (tolower(*cp) - 'a' + 10));
+            }
+            if(cp == data || (cp < eol && *cp != ';' && *cp != ' ' &&
+                              *cp != '\t')) goto malformed;
+            in->start += n;
+            in->size -= n;
+            req->remaining = clen;
+            req->chunk = clen ? CHUNK_DATA : CHUNK_TRAILER;
+          }
+          continue;
+        case CHUNK_CRLF:
+          if(in->size < 2) return 0;
+          if(memcmp(data, "\r\n", 2)) goto malformed;
+          in->start += 2;
+          in->size -= 2;
+          req->chunk = CHUNK_SIZE;
+          continue;
+        default:
+          break;
+      }
+    }
+
+    /* body data, straight out of the buffer */
+    if(in->size == 0) return 0;
+    n = (req->mode == BODY_EOF) ? in->size : MIN(in->size, req->remaining);
+    in->start += n;
+    in->size -= n;
+    if(req->mode != BODY_EOF) req->remaining -= n;
+    if(!request_deliver(req, MTEV_HTTP_CLIENT_BODY, data, n)) goto abandon;
+    if(req->remaining == 0) {
+      if(req->mode == BODY_LENGTH) goto complete;
+      if(req->mode == BODY_CHUNKED) req->chunk = CHUNK_CRLF;
+    }
+    continue;
+
+   complete:
+    conn_complete(conn);
+    if(conn->closing) return -1;
+  }
+  if(in->size) {
+    *error = "unexpected data from server";
+    return -1;
+  }
+  return 0;
+
+ malformed:
+  *error = "malformed chunked encoding";
+  return -1;
+ abandon:
+  *error = "abandoned by caller";
+  return -1;
+}
+
+/* 1 if something was read, 0 when blocked (mask set), -1 to close */
+static int
+conn_read(struct client_conn *conn, int *mask, const char **error) {
+  eventer_t e = conn->e;
+  struct bchain *in = conn->in;
+  int len;
+
+  if(in && in->size == 0) {
+    in->start = 0;
+    if(in->allocd > DEFAULT_BCHAINSIZE) {
+      /* done with an outsized header block */
+      FREE_BCHAIN(in);
+      in = conn->in = NULL;
+    }
+  }
+  if(!in) in = conn->in = ALLOC_BCHAIN(DEFAULT_BCHAINSIZE);
+  if(in->start + in->size == in->allocd && in->start) {
+    memmove(in->buff, in->buff + in->start, in->size);
+    in->start = 0;
+  }
+  if(in->size == in->allocd) {
+    /* only a header block can fill the buffer without being consumed */
+    struct bchain *bigger;
+    if(in->allocd >= MAX_HEADER_BLOCK) {
+      *error = "response headers too large";
+      return -1;
+    }
+    bigger = ALLOC_BCHAIN(in->allocd * 2);
+    memcpy(bigger->buff, in->buff, in->size);
+    bigger->size = in->size;
+    FREE_BCHAIN(in);
+    in = conn->in = bigger;
+  }
+
+  len = e->opset->read(e->fd, in->buff + in->start + in->size,
+                       in->allocd - in->start - in->size, mask, e);
+  if(len == -1 && errno == EAGAIN) return 0;
+  if(len <= 0) {
+    mtev_http_client_request_t *req = conn->head;
+    if(req && req->headers_done && req->mode == BODY_EOF) {
+      /* this response runs to the end of the connection */
+      conn->closing = mtev_true;
+      conn_complete(conn);
+    }
+    if(len < 0) *error = strerror(errno);
+    else if(conn->head) *error = "connection closed by server";
+    return -1;
+  }
+  in->size += len;
+  return conn_process(conn, error) < 0 ? -1 : 1;
+}
+
+/* Close the connection, retry what can be retried, fail the rest. */
+static void
+conn_teardown(struct client_conn *conn, const char *error) {
+  struct client_host *host = conn->host;
+  mtev_http_client_pool_t *pool = host->shard->pool;
+  mtev_http_client_request_t *req, *next, *retry = NULL, *retry_tail = NULL;
+  struct client_conn **cp;
+  struct timeval now;
+  mtev_boolean timed_out;
+  int mask;
+
+  timed_out = conn->expired && conn->state == CONN_READY && conn->head;
+  gettimeofday(&now, NULL);
+  mtevL(client_debug, "http client: closing fd %d to %s%s%s\n", conn->e->fd,
+        host->key, error ? ": " : "", error ? error : "");
+  conn->e->opset->close(conn->e->fd, &mask, conn->e);
+  conn->e = NULL;
+  if(conn->timer) {
+    if(eventer_remove(conn->timer)) eventer_free(conn->timer);
+    conn->timer = NULL;
+  }
+  for(cp = &host->conns; *cp; cp = &(*cp)->next)
+    if(*cp == conn) {
+      *cp = conn->next;
+      break;
+    }
+  host->nconns--;
+  RELEASE_BCHAIN(conn->in);
+
+  req = conn->head;
+  conn->head = conn->tail = conn->writing = NULL;
+  for(; req; req = next) {
+    mtev_boolean expired;
+    next = req->next;
+    req->next = NULL;
+    expired = timed_out && compare_timeval(req->deadline, now) <= 0;
+    /* the server said it was closing; what it never answered isn't
+     * held against the request */
+    if(!error && !req->started && req->written) req->attempts--;
+    if(conn->state == CONN_READY && !expired &&
+       req->attempts < MAX_ATTEMPTS &&
+       (req->written == 0 || (req->idempotent && !req->started))) {
+      if(retry_tail) retry_tail->next = req;
+      else retry = req;
+      retry_tail = req;
+    }
+    else
+      request_fail(req, expired ? "request timed out" :
+                        error ? error : "connection closed");
+  }
+  if(retry) {
+    retry_tail->next = host->queue;
+    host->queue = retry;
+    if(!host->queue_tail) host->queue_tail = retry_tail;
+  }
+  free(conn);
+  host_pump(host);
+  pool_release(pool);
+}
+
+static int
+conn_drive(eventer_t e, int mask, void *closure, struct timeval *now) {
+  struct client_conn *conn = closure;
+  mtev_http_client_pool_t *pool = conn->host->shard->pool;
+  const char *error = NULL;
+  int rmask = 0, wmask = 0, rv;
+
+  conn->busy = mtev_true;
+  if(conn->expired) {
+    if(conn->state != CONN_READY) error = "connect timed out";
+    goto close;
+  }
+  if(conn->state == CONN_CONNECTING) {
+    int aerrno = 0;
+    socklen_t aerrno_len = sizeof(aerrno);
+    if(getsockopt(e->fd, SOL_SOCKET, SO_ERROR, &aerrno, &aerrno_len) == 0 &&
+       aerrno != 0) {
+      error = strerror(aerrno);
+      goto close;
+    }
+    if(mask & EVENTER_EXCEPTION) {
+      error = "connect failed";
+      goto close;
+    }
+    if(conn->host->ssl) {
+      if(!conn_ssl_attach(conn)) {
+        error = "TLS setup failed";
+        goto close;
+      }
+      conn->state = CONN_HANDSHAKE;
+    }
+    else conn->state = CONN_READY;
+  }
+  if(conn->state == CONN_HANDSHAKE) {
+    if(eventer_SSL_connect(e, &mask) <= 0) {
+      eventer_ssl_ctx_t *sslctx;
+      if(errno == EAGAIN) {
+        conn->busy = mtev_false;
+        return mask | EVENTER_EXCEPTION;
+      }
+      sslctx = eventer_get_eventer_ssl_ctx(e);
+      error = sslctx ? eventer_ssl_get_last_error(sslctx) : NULL;
+      if(!error) error = "TLS handshake failed";
+      goto close;
+    }
+    conn->state = CONN_READY;
+  }
+  if(conn->idle_since.tv_sec == 0) gettimeofday(&conn->idle_since, NULL);
+
+  do {
+    if((rv = conn_write(conn, &wmask)) < 0) {
+      error = strerror(errno);
+      goto close;
+    }
+    rv = conn_read(conn, &rmask, &error);
+    if(rv < 0) goto close;
+  } while(rv > 0);
+  /* a finished exchange may have left us with nothing to do */
+  if(!conn->head && (conn->closing || pool->closing)) goto close;
+  conn_arm(conn);
+  conn->busy = mtev_false;
+  return rmask | wmask | EVENTER_EXCEPTION;
+
+ close:
+  conn_teardown(conn, error);
+  return 0;
+}
+
+static void
+client_submit(mtev_http_client_request_t *req) {
+  struct client_shard *shard = shard_get(req->pool);
+  struct client_host *host = host_get(shard, req);
+  if(host->resolved < 0 && !host->resolving) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    if(compare_timeval(host->retry_at, now) > 0) {
+      request_fail(req, "cannot resolve host");
+      return;
+    }
+  }
+  if(host->queue_tail) host->queue_tail->next = req;
+  else host->queue = req;
+  host->queue_tail = req;
+  if(host->resolved != 1) host_resolve(host);
+  else host_pump(host);
+}
+static int
+client_submit_event(eventer_t e, int mask, void *closure,
+                    struct timeval *now) {
+  client_submit(closure);
+  return 0;
+}
+
+mtev_http_client_request_t *
+mtev_http_client_request_new(mtev_http_client_pool_t *pool,
+                             const char *method, const char *url) {
+  mtev_http_client_request_t *req;
+  const char *cp, *auth_end, *port_str = NULL, *name, *name_end;
+  unsigned long port;
+  mtev_boolean ssl;
+  char *key;
+  size_t klen;
+
+  if(!strncasecmp(url, "http://", 7)) {
+    ssl = mtev_false;
+    cp = url + 7;
+  }
+  else if(!strncasecmp(url, "https://", 8)) {
+    ssl = mtev_true;
+    cp = url + 8;
+  }
+  else return NULL;
+  auth_end = cp + strcspn(cp, "/?#");
+  if(auth_end == cp) return NULL;
+  name = cp;
+  if(*cp == '[') {
+    name = cp + 1;
+    name_end = memchr(cp, ']', auth_end - cp);
+    if(!name_end) return NULL;
+    if(name_end + 1 < auth_end) {
+      if(name_end[1] != ':') return NULL;
+      port_str = name_end + 2;
+    }
+  }
+  else {
+    name_end = memchr(cp, ':', auth_end - cp);
+    if(name_end) port_str = name_end + 1;
+    else name_end = auth_end;
+  }
+  if(name_end == name) return NULL;
+  port = ssl ? 443 : 80;
+  if(port_str) {
+    char *end;
+    port = strtoul(port_str, &end, 10);
+    if(end != auth_end || port == 0 || port > 65535) return NULL;
+  }
+
+  req = calloc(1, sizeof(*req));
+  req->pool = pool;
+  req->method = strdup(method);
+  req->idempotent = !strcmp(method, "GET") || !strcmp(method, "HEAD");
+  req->ssl = ssl;
+  req->port = port;
+  req->name = strndup(name, name_end - name);
+  req->authority = strndup(cp, auth_end - cp);
+  klen = strlen(req->name) + 16;
+  key = malloc(klen);
+  snprintf(key, klen, "%s://%s:%u", ssl ? "https" : "http", req->name,
+           req->port);
+  req->key = key;
+  if(*auth_end == '/') req->path = strndup(auth_end, strcspn(auth_end, "#"));
+  else {
+    size_t plen = strcspn(auth_end, "#");
+    req->path = malloc(plen + 2);
+    req->path[0] = '/';
+    memcpy(req->path + 1, auth_end, plen);
+    req->path[plen + 1] = '\0';
+  }
+  req->timeout_ms = pool->request_timeout;
+  return req;
+}
+void
+mtev_http_client_request_header(mtev_http_client_request_t *req,
+                                const char *name, const char *value) {
+  size_t nlen = strlen(name), vlen = strlen(value);
+  req->headers = realloc(req->headers, req->headers_len + nlen + vlen + 5);
+  memcpy(req->headers + req->headers_len, name, nlen);
+  memcpy(req->headers + req->headers_len + nlen, ": ", 2);
+  memcpy(req->headers + req->headers_len + nlen + 2, value, vlen);
+  memcpy(req->headers + req->headers_len + nlen + 2 + vlen, "\r\n", 2);
+  req->headers_len += nlen + vlen + 4;
+  req->headers[req->headers_len] = '\0';
+}
+void
+mtev_http_client_request_body(mtev_http_client_request_t *req,
+                              const void *data, size_t len) {
+  struct bchain *b, *last;
+  if(len == 0) return;
+  b = bchain_from_data(data, len);
+  for(last = req->body; last && last->next; last = last->next);
+  if(last) {
+    last->next = b;
+    b->prev = last;
+  }
+  else req->body = b;
+  req->body_len += len;
+}
+void
+mtev_http_client_request_timeout(mtev_http_client_request_t *req,
+                                 unsigned int ms) {
+  req->timeout_ms = ms;
+}
+void
+mtev_http_client_request_submit(mtev_http_client_request_t *req,
+                                mtev_http_client_func f, void *closure) {
+  struct bchain *leader;
+  char clen[64] = "";
+  size_t len;
+
+  req->cb = f;
+  req->closure = closure;
+  if(req->body_len || !strcmp(req->method, "POST") ||
+     !strcmp(req->method, "PUT"))
+    snprintf(clen, sizeof(clen), "Content-Length: %zu\r\n", req->body_len);
+  len = strlen(req->method) + strlen(req->path) + strlen(req->authority) +
+        req->headers_len + strlen(clen) + 32;
+  leader = ALLOC_BCHAIN(len);
+  leader->size = snprintf(leader->buff, len, "%s %s HTTP/1.1\r\nHost: %s\r\n"
+                          "%s%s\r\n", req->method, req->path, req->authority,
+                          req->headers ? req->headers : "", clen);
+  leader->next = req->body;
+  if(req->body) req->body->prev = leader;
+  req->out = leader;
+  req->body = NULL;
+  ms_from_now(&req->deadline, req->timeout_ms);
+  mtev_atomic_inc32(&req->pool->refcnt);
+
+  if(eventer_is_loop(pthread_self())) client_submit(req);
+  else {
+    /* connections belong to event loops; give this one to a loop */
+    eventer_t e = eventer_alloc();
+    e->mask = EVENTER_TIMER;
+    e->callback = client_submit_event;
+    e->closure = req;
+    e->thr_owner = eventer_choose_owner(mtev_atomic_inc32(&submit_rr));
+    gettimeofday(&e->whence, NULL);
+    eventer_add(e);
+  }
+}
+void
+mtev_http_client_request_free(mtev_http_client_request_t *req) {
+  request_response_reset(req);
+  RELEASE_BCHAIN(req->out);
+  RELEASE_BCHAIN(req->body);
+  free(req->method);
+  free(req->key);
+  free(req->name);
+  free(req->authority);
+  free(req->path);
+  free(req->headers);
+  free(req->error);
+  free(req);
+}
+
+const char *
+mtev_http_client_request_error(mtev_http_client_request_t *req) {
+  return req->error;
+}
+int
+mtev_http_client_response_status(mtev_http_client_request_t *req) {
+  return req->status;
+}
+const char *
+mtev_http_client_response_header(mtev_http_client_request_t *req,
+                                 const char *name) {
+  char lname[128];
+  const char *value;
+  size_t i, len = strlen(name);
+  if(len >= sizeof(lname)) return NULL;
+  for(i=0; i<len; i++) lname[i] = tolower((unsigned char)name[i]);
+  if(!mtev_hash_retr_str(&req->response_headers, lname, len, &value))
+    return NULL;
+  return value;
+}
+mtev_hash_table *
+mtev_http_client_response_headers(mtev_http_client_request_t *req) {
+  return &req->response_headers;
+}
+
+void
+mtev_http_client_init() {
+  client_debug = mtev_log_stream_find("debug/http_client");
+}
@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2014-2015, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *    * Neither the name Circonus, Inc. nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _MTEV_HTTP_CLIENT_H
+#define _MTEV_HTTP_CLIENT_H
+
+#include "mtev_defines.h"
+#include "mtev_hash.h"
+
+/* An asynchronous HTTP/1.1 client on the eventer.
+ *
+ * A pool keeps keep-alive connections per scheme, host and port.  Each
+ * connection belongs to the eventer thread that opened it, and so do
+ * the callbacks for the requests it carries; limits apply per thread.
+ * Requests submitted from outside an eventer thread are handed to one.
+ *
+ * Pool configuration (all optional):
+ *   max_connections_per_host  connections to one host per thread (8)
+ *   pipeline_depth            requests in flight per connection (1);
+ *                             only GET and HEAD are pipelined
+ *   connect_timeout           ms to connect, TLS included (5000)
+ *   request_timeout           ms from submission to completion (30000)
+ *   idle_timeout              ms an idle connection is kept (60000)
+ *   resolve_jobq              jobq host names are looked up on (default)
+ *   certificate_file, key_file, ca_chain, ciphers, layer, crl,
+ *   optional_no_ca, ignore_dates  as for other TLS clients
+ *
+ * Host names are resolved off the event loop when first used on a
+ * thread; requests wait for the answer.  A name that doesn't resolve
+ * fails requests without another lookup for a while (1s, doubling to
+ * 30s).
+ */
+
+typedef struct mtev_http_client_pool mtev_http_client_pool_t;
+typedef struct mtev_http_client_request mtev_http_client_request_t;
+
+typedef enum {
+  MTEV_HTTP_CLIENT_HEADERS, /* status and headers are available */
+  MTEV_HTTP_CLIENT_BODY,    /* data/len is the next piece of the body */
+  MTEV_HTTP_CLIENT_DONE,    /* the response is complete */
+  MTEV_HTTP_CLIENT_ERROR    /* the request failed, see _request_error */
+} mtev_http_client_event_t;
+
+/* Body data is only valid for the duration of the call.  Returning
+ * mtev_false abandons the request (and its connection).  The request is
+ * freed after its DONE or ERROR callback returns.
+ */
+typedef mtev_boolean (*mtev_http_client_func)(mtev_http_client_request_t *,
+                                              mtev_http_client_event_t,
+                                              const void *data, size_t len,
+                                              void *closure);
+
+API_EXPORT(mtev_http_client_pool_t *)
+  mtev_http_client_pool_new(mtev_hash_table *config);
+/* Idle connections are closed; the pool is released once the last
+ * outstanding request has finished. */
+API_EXPORT(void)
+  mtev_http_client_pool_free(mtev_http_client_pool_t *);
+
+/* url is http://host[:port][/path] or https://...; NULL if it isn't. */
+API_EXPORT(mtev_http_client_request_t *)
+  mtev_http_client_request_new(mtev_http_client_pool_t *,
+                               const char *method, const char *url);
+API_EXPORT(void)
+  mtev_http_client_request_header(mtev_http_client_request_t *,
+                                  const char *name, const char *value);
+/* The body is copied; Content-Length is supplied. */
+API_EXPORT(void)
+  mtev_http_client_request_body(mtev_http_client_request_t *,
+                                const void *data, size_t len);
+API_EXPORT(void)
+  mtev_http_client_request_timeout(mtev_http_client_request_t *,
+                                   unsigned int ms);
+/* Hands the request to the pool; f hears about it from then on. */
+API_EXPORT(void)
+  mtev_http_client_request_submit(mtev_http_client_request_t *,
+                                  mtev_http_client_func f, void *closure);
+/* Free a request that was never submitted. */
+API_EXPORT(void)
+  mtev_http_client_request_free(mtev_http_client_request_t *);
+
+API_EXPORT(const char *)
+  mtev_http_client_request_error(mtev_http_client_request_t *);
+API_EXPORT(int)
+  mtev_http_client_response_status(mtev_http_client_request_t *);
+API_EXPORT(const char *)
+  mtev_http_client_response_header(mtev_http_client_request_t *,
+                                   const char *name);
+/* Lowercased names to values. */
+API_EXPORT(mtev_hash_table *)
+  mtev_http_client_response_headers(mtev_http_client_request_t *);
+
+#endif
@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) 2014-2015, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *    * Neither the name Circonus, Inc. nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "mtev_defines.h"
+#include "mtev_log.h"
+#include "mtev_http.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#if defined(HAVE_ZSTD_H) && defined(HAVE_LIBZSTD)
+#include <zstd.h>
+#define HAVE_ZSTD 1
+#endif
+
+/* The zlib family, differing only in framing: windowBits 15 is a zlib
+ * stream ("deflate" in HTTP parlance), +16 asks zlib for gzip framing.
+ */
+static void *
+zlib_create(int level, int window_bits) {
+  z_stream *z = calloc(1, sizeof(*z));
+  if(level < Z_DEFAULT_COMPRESSION || level > Z_BEST_COMPRESSION)
+    level = Z_DEFAULT_COMPRESSION;
+  if(deflateInit2(z, level, Z_DEFLATED, window_bits, 8,
+                  Z_DEFAULT_STRATEGY) != Z_OK) {
+    free(z);
+    return NULL;
+  }
+  return z;
+}
+static void *
+gzip_create(int level) {
+  return zlib_create(level, 15 + 16);
+}
+static void *
+deflate_create(int level) {
+  return zlib_create(level, 15);
+}
+static size_t
+zlib_bound(size_t len) {
+  /* deflateBound without a stream is the pessimistic bound, plus gzip's
+   * 18 bytes of framing. */
+  return deflateBound(NULL, len) + 18;
+}
+static int
+zlib_encode(void *state, const void *in, size_t inlen,
+            void *out, size_t *outlen, mtev_boolean final,
+            mtev_boolean *done) {
+  z_stream *z = state;
+  int err;
+  z->next_in = (Bytef *)in;
+  z->avail_in = inlen;
+  z->next_out = out;
+  z->avail_out = *outlen;
+  err = deflate(z, final ? Z_FINISH : Z_NO_FLUSH);
+  if(err != Z_OK && err != Z_STREAM_END && err != Z_BUF_ERROR) {
+    mtevL(mtev_error, "zlib deflate error %d\n", err);
+    return -1;
+  }
+  *outlen -= z->avail_out;
+  if(done) *done = (err == Z_STREAM_END) ? mtev_true : mtev_false;
+  return 0;
+}
+static void
+zlib_destroy(void *state) {
+  deflateEnd(state);
+  free(state);
+}
+
+static mtev_http_encoder_t gzip_encoder = {
+  "gzip", Z_DEFAULT_COMPRESSION,
+  gzip_create, zlib_bound, zlib_encode, zlib_destroy,
+  MTEV_HTTP_GZIP
+};
+static mtev_http_encoder_t deflate_encoder = {
+  "deflate", Z_DEFAULT_COMPRESSION,
+  deflate_create, zlib_bound, zlib_encode, zlib_destroy,
+  MTEV_HTTP_DEFLATE
+};
+
+#ifdef HAVE_ZSTD
+static void *
+zstd_create(int level) {
+  ZSTD_CCtx *cctx = ZSTD_createCCtx();
+  if(!cctx) return NULL;
+  if(level > ZSTD_maxCLevel()) level = ZSTD_maxCLevel();
+  if(ZSTD_isError(ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel,
+                                         level))) {
+    ZSTD_freeCCtx(cctx);
+    return NULL;
+  }
+  return cctx;
+}
+static size_t
+zstd_bound(size_t len) {
+  return ZSTD_compressBound(len);
+}
+static int
+zstd_encode(void *state, const void *in, size_t inlen,
+            void *out, size_t *outlen, mtev_boolean final,
+            mtev_boolean *done) {
+  ZSTD_inBuffer ib = { in, inlen, 0 };
+  ZSTD_outBuffer ob = { out, *outlen, 0 };
+  size_t rv;
+  do {
+    rv = ZSTD_compressStream2(state, &ob, &ib,
+                              final ? ZSTD_e_end : ZSTD_e_continue);
+    if(ZSTD_isError(rv)) {
+      mtevL(mtev_error, "zstd compress error: %s\n", ZSTD_getErrorName(rv));
+      return -1;
+    }
+  } while(ib.pos < ib.size && ob.pos < ob.size);
+  *outlen = ob.pos;
+  if(done) *done = (final && rv == 0) ? mtev_true : mtev_false;
+  return 0;
+}
+static void
+zstd_destroy(void *state) {
+  ZSTD_freeCCtx(state);
+}
+
+static mtev_http_encoder_t zstd_encoder = {
+  "zstd", 3,
+  zstd_create, zstd_bound, zstd_encode, zstd_destroy,
+  MTEV_HTTP_ZSTD
+};
+#endif
+
+void
+mtev_http_register_default_encoders() {
+  /* Registration order is our preference when the client's q-values tie */
+#ifdef HAVE_ZSTD
+  mtev_http_encoder_register(&zstd_encoder);
+#endif
+  mtev_http_encoder_register(&gzip_encoder);
+  mtev_http_encoder_register(&deflate_encoder);
+}
@@ -0,0 +1,239 @@
+/*
+ * Copyright (c) 2014-2015, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *    * Neither the name Circonus, Inc. nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _MTEV_HTTP_PRIVATE_H
+#define _MTEV_HTTP_PRIVATE_H
+
+#include "mtev_defines.h"
+#include "mtev_http.h"
+
+#include <pthread.h>
+
+/* Session internals, shared by mtev_http.c and mtev_http2.c */
+
+#define DEFAULT_BCHAINSIZE ((1 << 15)-(offsetof(struct bchain, _buff)))
+
+struct mtev_http_connection {
+  eventer_t e;
+  int needs_close;
+};
+
+/* Per-request allocations (response headers, the status reason, the
+ * query string, route parameters...) come from here and go all at once
+ * between requests.  The first block stays with the session.
+ */
+struct http_arena_block {
+  struct http_arena_block *next;
+  size_t size;
+  size_t used;
+  char data[1];
+};
+struct http_arena {
+  struct http_arena_block *head;
+  struct http_arena_block *first;
+};
+
+struct mtev_http_request {
+  struct bchain *first_input; /* The start of the input chain */
+  struct bchain *last_input;  /* The end of the input chain */
+  struct bchain *current_input;  /* The point of the input where we */
+  size_t         current_offset; /* analyzing. */
+  struct http_arena *arena;      /* the session's, survives release */
+
+  enum { MTEV_HTTP_REQ_HEADERS = 0,
+         MTEV_HTTP_REQ_EXPECT,
+         MTEV_HTTP_REQ_PAYLOAD } state;
+  struct bchain *current_request_chain;
+  mtev_boolean has_payload;
+  mtev_boolean payload_chunked;
+  struct {
+    int64_t size;
+    void *data;
+    void (*freefunc)(void *data, int64_t size, void *closure);
+    void *freeclosure;
+  } upload;  /* This is optionally set */
+  int64_t content_length;
+  int64_t content_length_read;
+  int32_t next_chunk;
+  int32_t next_chunk_read;
+  char *method_str;
+  char *uri_str;
+  char *protocol_str;
+  mtev_hash_table querystring;
+  u_int32_t opts;
+  mtev_http_method method;
+  mtev_http_protocol protocol;
+  mtev_hash_table headers;
+  mtev_boolean complete;
+  struct timeval start_time;
+  struct timeval ready_time;  /* when the loop saw it complete */
+  char *orig_qs;
+  u_int32_t encoding_pref;  /* the acceptable encoding with highest q */
+};
+
+/* Response headers are kept in the order they were first set, lengths
+ * in hand, so the leader is a straight copy.
+ */
+struct http_header {
+  const char *name;
+  const char *value;
+  size_t nlen;
+  size_t vlen;
+};
+
+struct mtev_http_response {
+  mtev_http_protocol protocol;
+  int status_code;
+  char *status_reason;
+  size_t status_reason_len;
+
+  struct http_header *headers; /* from the session arena */
+  int nheaders;
+  int aheaders;
+  struct bchain *leader; /* serialization of status line and headers */
+
+  u_int32_t output_options;
+  struct bchain *output;       /* data is pushed in here */
+  struct bchain *output_raw;   /* internally transcoded here for output */
+  size_t output_raw_offset;    /* tracks our offset */
+  mtev_boolean output_started; /* locks the options and leader */
+                               /*   and possibly output. */
+  mtev_boolean closed;         /* set by _end() */
+  mtev_boolean complete;       /* complete, drained and disposable */
+  size_t bytes_written;        /* tracks total bytes written */
+  mtev_http_encoder_t *encoder;
+  void *encoder_state;
+  int compression_level;
+  mtev_boolean compression_level_set;
+  mtev_boolean encoding_inflight; /* body being encoded on a jobq */
+  size_t high_water;           /* 0 is the listener's */
+  size_t low_water;
+  mtev_boolean suspended;      /* buffered past high_water; not dispatched */
+  mtev_http_response_watermark_func watermark;
+  void *watermark_closure;
+  mtev_boolean coalesce_set;   /* else the listener's */
+  size_t coalesce_size;        /* hold output until this much is appended */
+  unsigned int coalesce_latency; /* or it has waited this many ms */
+  eventer_t coalesce_timer;    /* under write_lock, as is output */
+};
+
+struct mtev_http_session_ctx {
+  mtev_atomic32_t ref_cnt;
+  int64_t drainage;
+  pthread_mutex_t write_lock;  /* res output chains, leader and timer */
+  int max_write;
+  struct {
+    int level;              /* unless set on the response */
+    mtev_boolean level_set; /* else the encoder's default */
+    size_t min_size;        /* complete bodies smaller go unencoded */
+    size_t offload_size;    /* complete bodies larger encode on jobq */
+    eventer_jobq_t *jobq;   /* NULL is the default queue */
+  } compress;
+  struct {
+    size_t high;            /* responses default to these watermarks */
+    size_t low;
+  } output_water;
+  struct {
+    size_t size;            /* responses default to this coalescing */
+    unsigned int latency;
+  } coalesce;
+  mtev_http_connection conn;
+  mtev_http_request req;
+  mtev_http_response res;
+  struct http_arena arena;
+  mtev_http_dispatch_func dispatcher;
+  void *dispatcher_closure;
+  acceptor_closure_t *ac;
+  mtev_boolean http2;                 /* willing to switch to HTTP/2 */
+  struct mtev_http2_conn *h2conn;     /* this connection speaks HTTP/2 */
+  struct mtev_http2_stream *h2stream; /* this session is one of its streams */
+  struct mtev_http_websocket *ws;     /* upgraded to a WebSocket */
+  void *(*stream_closure_alloc)(mtev_http_session_ctx *, void *);
+  void (*stream_closure_free)(void *);
+  struct http_listener *listener;     /* counted against, once driven */
+  struct {
+    uint64_t since;                   /* ms; 0 while a request is about */
+    eventer_t timer;                  /* idle_timeout */
+    mtev_boolean listed;              /* on the listener's idle list */
+    mtev_boolean shed;                /* picked to make room */
+    mtev_boolean expired;             /* close on the next drive */
+    mtev_http_session_ctx *prev, *next;
+  } idle;
+};
+
+struct bchain *bchain_alloc(size_t size, int line);
+void bchain_free(struct bchain *b, int line);
+struct bchain *bchain_from_data(const void *d, size_t size);
+#define ALLOC_BCHAIN(s) bchain_alloc(s, __LINE__)
+#define FREE_BCHAIN(a) bchain_free(a, __LINE__)
+#define RELEASE_BCHAIN(a) do { \
+  while(a) { \
+    struct bchain *__b; \
+    __b = a; \
+    a = __b->next; \
+    bchain_free(__b, __LINE__); \
+  } \
+} while(0)
+
+/* mtev_http.c */
+mtev_http_method mtev_http_method_from_str(const char *);
+void mtev_http_request_release(mtev_http_session_ctx *);
+void mtev_http_response_release(mtev_http_session_ctx *);
+void mtev_http_request_parse_accept_encoding(mtev_http_request *,
+                                             const char *);
+void mtev_http_request_start(mtev_http_request *);
+int mtev_http_session_write(mtev_http_session_ctx *, int *mask);
+mtev_boolean mtev_http_response_drained(mtev_http_session_ctx *);
+mtev_boolean mtev_http_extract_header(char *line, size_t colon, size_t len,
+                                      const char **name, const char **value);
+
+/* mtev_http2.c */
+int mtev_http2_session_upgrade(mtev_http_session_ctx *, int mask);
+int mtev_http2_session_drive(mtev_http_session_ctx *, int mask);
+void mtev_http2_conn_free(struct mtev_http2_conn *);
+void mtev_http2_stream_release(mtev_http_session_ctx *);
+void mtev_http2_stream_kick(mtev_http_session_ctx *);
+int mtev_http2_stream_leader(mtev_http_session_ctx *);
+int mtev_http2_stream_write(mtev_http_session_ctx *, int *mask);
+int mtev_http2_stream_consume(mtev_http_session_ctx *, void *buf,
+                              size_t len, int *mask, const void **view);
+
+/* mtev_http_websocket.c */
+int mtev_http_websocket_drive(mtev_http_session_ctx *, int mask);
+void mtev_http_websocket_free(mtev_http_session_ctx *);
+
+/* mtev_http_access.c */
+void mtev_http_log_request(mtev_http_session_ctx *);
+void mtev_http_access_init();
+
+/* mtev_http_client.c */
+void mtev_http_client_init();
+
+#endif
@@ -0,0 +1,849 @@
+/*
+ * Copyright (c) 2014-2015, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *    * Neither the name Circonus, Inc. nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* WebSocket (RFC 6455) for mtev_http.
+ *
+ * A handler upgrades its HTTP/1.1 session; once the 101 is on the wire
+ * the session's socket carries frames and the handler hears about whole
+ * messages.  Outbound frames are built into single bchains (or, for a
+ * caller's bchain, a header link ahead of it) and queued on the
+ * response's output, so the usual write path (and its lock) moves them.  permessage-deflate (RFC 7692) is offered without context
+ * takeover, so no compressor state outlives a message.
+ */
+
+#include "mtev_defines.h"
+#include "mtev_http.h"
+#include "mtev_http_private.h"
+#include "mtev_b64.h"
+
+#include <errno.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <openssl/sha.h>
+
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WS_MAX_HEADER 10      /* server frames are never masked */
+#define WS_READ_SIZE 16384
+#define WS_FIN 0x80
+#define WS_RSV1 0x40
+#define WS_RSV23 0x30
+#define WS_CONTINUATION 0
+#define DEFAULT_WS_MAX_MESSAGE (1024 * 1024)
+#define DEFAULT_WS_MAX_QUEUE (1024 * 1024)
+
+enum {
+  WS_CLOSE_NORMAL = 1000, WS_CLOSE_PROTOCOL = 1002,
+  WS_CLOSE_INVALID_DATA = 1007, WS_CLOSE_TOO_BIG = 1009,
+  WS_CLOSE_INTERNAL = 1011
+};
+
+struct mtev_http_websocket {
+  mtev_http_websocket_func handler;
+  void *closure;
+  mtev_boolean started;        /* the 101 is out; the socket is ours */
+  mtev_boolean close_sent;     /* nothing may follow our close */
+  mtev_boolean close_received;
+  mtev_boolean failed;         /* we gave up on the peer */
+  mtev_boolean notified;       /* the handler has seen its MTEV_WS_CLOSE */
+  unsigned char close_payload[125];
+  size_t close_len;
+  size_t max_message;
+  size_t max_queue;
+
+  unsigned char *in;           /* unparsed input */
+  size_t inlen, inalloc;
+
+  /* a fragmented message being reassembled */
+  int msg_opcode;              /* 0 when none is in progress */
+  mtev_boolean msg_compressed;
+  unsigned char *msg;
+  size_t msglen, msgalloc;
+
+  struct bchain *out_tail;     /* last frame we put on output_raw */
+  size_t appended;             /* frame bytes queued since the 101 */
+
+  mtev_boolean deflate;        /* permessage-deflate was negotiated */
+  mtev_boolean zin_init, zout_init;
+  z_stream zin, zout;
+  unsigned char *inflated;
+  size_t inflated_alloc;
+};
+
+static mtev_boolean
+ws_has_token(const char *list, const char *token) {
+  size_t tlen = strlen(token);
+  while(list && *list) {
+    const char *end;
+    size_t len;
+    while(*list == ' ' || *list == '\t' || *list == ',') list++;
+    end = list;
+    while(*end && *end != ',') end++;
+    len = end - list;
+    while(len && (list[len-1] == ' ' || list[len-1] == '\t')) len--;
+    if(len == tlen && !strncasecmp(list, token, tlen)) return mtev_true;
+    list = end;
+  }
+  return mtev_false;
+}
+
+static mtev_boolean
+ws_utf8_valid(const unsigned char *s, size_t len) {
+  size_t i = 0;
+  while(i < len) {
+    unsigned char c = s[i];
+    uint32_t cp;
+    size_t n, j;
+    if(c < 0x80) {
+      i++;
+      continue;
+    }
+    if(c >= 0xc2 && c <= 0xdf) { n = 1; cp = c & 0x1f; }
+    else if((c & 0xf0) == 0xe0) { n = 2; cp = c & 0x0f; }
+    else if(c >= 0xf0 && c <= 0xf4) { n = 3; cp = c & 0x07; }
+    else return mtev_false;
+    if(len - i <= n) return mtev_false;
+    for(j = 1; j <= n; j++) {
+      if((s[i+j] & 0xc0) != 0x80) return mtev_false;
+      cp = (cp << 6) | (s[i+j] & 0x3f);
+    }
+    /* overlongs, surrogates and anything past U+10FFFF */
+    if(n == 2 && (cp < 0x800 || (cp >= 0xd800 && cp <= 0xdfff)))
+      return mtev_false;
+    if(n == 3 && (cp < 0x10000 || cp > 0x10ffff)) return mtev_false;
+    i += n + 1;
+  }
+  return mtev_true;
+}
+
+static void
+ws_unmask(unsigned char *p, size_t len, const unsigned char *key) {
+  uint64_t k8, w;
+  size_t i = 0;
+  unsigned char k[8];
+  for(i = 0; i < 8; i++) k[i] = key[i & 3];
+  memcpy(&k8, k, 8);
+  for(i = 0; i + 8 <= len; i += 8) {
+    memcpy(&w, p + i, 8);
+    w ^= k8;
+    memcpy(p + i, &w, 8);
+  }
+  for(; i < len; i++) p[i] ^= key[i & 3];
+}
+
+static size_t
+ws_header_len(size_t len) {
+  return len < 126 ? 2 : len <= 0xffff ? 4 : 10;
+}
+
+static void
+ws_header(unsigned char *p, int b0, size_t len) {
+  int i;
+  p[0] = b0;
+  if(len < 126) p[1] = len;
+  else if(len <= 0xffff) {
+    p[1] = 126;
+    p[2] = len >> 8;
+    p[3] = len & 0xff;
+  }
+  else {
+    p[1] = 127;
+    for(i = 0; i < 8; i++) p[2+i] = ((uint64_t)len >> (56 - 8 * i)) & 0xff;
+  }
+}
+
+/* Compress a whole message into a frame.  The header's size depends on
+ * the compressed length, so the payload lands after the largest header
+ * and the real one is right-aligned against it.  NULL means "send it as
+ * is": deflate failed or didn't help.
+ */
+static struct bchain *
+ws_frame_deflate(mtev_http_session_ctx *ctx, int opcode,
+                 const unsigned char *msg, size_t len) {
+  struct mtev_http_websocket *ws = ctx->ws;
+  struct bchain *b;
+  size_t bound, clen, hlen;
+  int zrv;
+
+  if(!ws->zout_init) {
+    int level = ctx->compress.level_set ? ctx->compress.level
+                                        : Z_DEFAULT_COMPRESSION;
+    if(deflateInit2(&ws->zout, level, Z_DEFLATED, -15, 8,
+                    Z_DEFAULT_STRATEGY) != Z_OK)
+      return NULL;
+    ws->zout_init = mtev_true;
+  }
+  /* room for the sync flush's empty stored block */
+  bound = deflateBound(&ws->zout, len) + 16;
+  b = ALLOC_BCHAIN(WS_MAX_HEADER + bound);
+  if(!b) return NULL;
+  ws->zout.next_in = (Bytef *)msg;
+  ws->zout.avail_in = len;
+  ws->zout.next_out = (Bytef *)b->buff + WS_MAX_HEADER;
+  ws->zout.avail_out = bound;
+  zrv = deflate(&ws->zout, Z_SYNC_FLUSH);
+  clen = bound - ws->zout.avail_out;
+  if(zrv != Z_OK || ws->zout.avail_in || ws->zout.avail_out == 0 ||
+     clen < 4 || clen - 4 >= len) {
+    deflateReset(&ws->zout);
+    FREE_BCHAIN(b);
+    return NULL;
+  }
+  deflateReset(&ws->zout);
+  clen -= 4; /* the 00 00 ff ff the peer puts back */
+  hlen = ws_header_len(clen);
+  b->start = WS_MAX_HEADER - hlen;
+  ws_header((unsigned char *)b->buff + b->start, WS_FIN | WS_RSV1 | opcode,
+            clen);
+  b->size = hlen + clen;
+  return b;
+}
+
+static struct bchain *
+ws_frame(int opcode, const unsigned char *msg, size_t len) {
+  struct bchain *b;
+  size_t hlen = ws_header_len(len);
+  b = ALLOC_BCHAIN(hlen + len);
+  if(!b) return NULL;
+  ws_header((unsigned char *)b->buff, WS_FIN | opcode, len);
+  if(len) memcpy(b->buff + hlen, msg, len);
+  b->size = hlen + len;
+  return b;
+}
+
+static size_t
+ws_queued(mtev_http_session_ctx *ctx) {
+  struct mtev_http_websocket *ws = ctx->ws;
+  size_t written = ws->started ? ctx->res.bytes_written : 0;
+  return ws->appended > written ? ws->appended - written : 0;
+}
+
+/* Write what we can now, from the thread that owns the event; anywhere
+ * else just wakes it.  Called with the write_lock held. */
+static void
+ws_kick(mtev_http_session_ctx *ctx) {
+  eventer_t e = ctx->conn.e;
+  if(!e) return;
+  if(!pthread_equal(pthread_self(), e->thr_owner)) {
+    eventer_trigger(e, EVENTER_WRITE);
+  }
+}
+
+/* Put a frame (any number of links) on the output.  Called with the
+ * write_lock held; true if this thread should write it out itself. */
+static mtev_boolean
+ws_queue(mtev_http_session_ctx *ctx, struct bchain *b) {
+  struct mtev_http_websocket *ws = ctx->ws;
+  struct bchain *tail;
+
+  if(!ctx->res.output_raw) {
+    ctx->res.output_raw = b;
+  }
+  else {
+    if(!ws->out_tail)
+      for(ws->out_tail = ctx->res.output_raw; ws->out_tail->next;
+          ws->out_tail = ws->out_tail->next);
+    ws->out_tail->next = b;
+    b->prev = ws->out_tail;
+  }
+  for(tail = b; ; tail = tail->next) {
+    ws->appended += tail->size;
+    if(!tail->next) break;
+  }
+  ws->out_tail = tail;
+  ws_kick(ctx);
+  return ctx->conn.e && pthread_equal(pthread_self(), ctx->conn.e->thr_owner);
+}
+static void
+ws_write_now(mtev_http_session_ctx *ctx) {
+  eventer_t e = ctx->conn.e;
+  int mask = 0;
+  if(mtev_http_session_write(ctx, &mask) >= 0 && ctx->conn.e &&
+     eventer_find_fd(e->fd) == e)
+    eventer_update(e, mask | EVENTER_READ | EVENTER_EXCEPTION);
+}
+
+static mtev_boolean
+ws_send(mtev_http_session_ctx *ctx, int opcode,
+        const unsigned char *msg, size_t len) {
+  struct mtev_http_websocket *ws = ctx->ws;
+  struct bchain *b = NULL;
+  mtev_boolean owner;
+
+  if(!ws) return mtev_false;
+  if(opcode & 0x8) {
+    if(len > 125) return mtev_false;
+  }
+  else if(opcode != MTEV_WS_TEXT && opcode != MTEV_WS_BINARY) {
+    return mtev_false;
+  }
+
+  pthread_mutex_lock(&ctx->write_lock);
+  if(!ctx->conn.e || ws->close_sent ||
+     /* control frames jump the limit; they're tiny and keep the
+      * connection healthy */
+     (!(opcode & 0x8) && ws_queued(ctx) + len > ws->max_queue)) {
+    pthread_mutex_unlock(&ctx->write_lock);
+    return mtev_false;
+  }
+  if(ws->deflate && !(opcode & 0x8) && len >= ctx->compress.min_size)
+    b = ws_frame_deflate(ctx, opcode, msg, len);
+  if(!b) b = ws_frame(opcode, msg, len);
+  if(!b) {
+    pthread_mutex_unlock(&ctx->write_lock);
+    return mtev_false;
+  }
+  if(opcode == MTEV_WS_CLOSE) ws->close_sent = mtev_true;
+  owner = ws_queue(ctx, b);
+  pthread_mutex_unlock(&ctx->write_lock);
+
+  if(owner && ws->started) ws_write_now(ctx);
+  return mtev_true;
+}
+
+/* The payload links are queued as they are; only the header is built.
+ * Such messages go out uncompressed, which permessage-deflate allows. */
+static mtev_boolean
+ws_send_bchain(mtev_http_session_ctx *ctx, int opcode, struct bchain *msg) {
+  struct mtev_http_websocket *ws = ctx->ws;
+  struct bchain *b, *h;
+  size_t len = 0, hlen;
+  mtev_boolean owner;
+
+  if(!ws || !msg) return mtev_false;
+  if(opcode != MTEV_WS_TEXT && opcode != MTEV_WS_BINARY) return mtev_false;
+  for(b = msg; b; b = b->next) {
+    /* written straight from output_raw, which can't always sendfile */
+    if(b->type == BCHAIN_SENDFILE) return mtev_false;
+    len += b->size;
+  }
+
+  pthread_mutex_lock(&ctx->write_lock);
+  if(!ctx->conn.e || ws->close_sent ||
+     ws_queued(ctx) + len > ws->max_queue) {
+    pthread_mutex_unlock(&ctx->write_lock);
+    return mtev_false;
+  }
+  hlen = ws_header_len(len);
+  h = ALLOC_BCHAIN(hlen);
+  if(!h) {
+    pthread_mutex_unlock(&ctx->write_lock);
+    return mtev_false;
+  }
+  ws_header((unsigned char *)h->buff, WS_FIN | opcode, len);
+  h->size = hlen;
+  h->next = msg;
+  msg->prev = h;
+  owner = ws_queue(ctx, h);
+  pthread_mutex_unlock(&ctx->write_lock);
+
+  if(owner && ws->started) ws_write_now(ctx);
+  return mtev_true;
+}
+
+static void
+ws_fail(mtev_http_session_ctx *ctx, int code) {
+  unsigned char payload[2];
+  mtevL(mtev_debug, "websocket: failing connection (%d)\n", code);
+  payload[0] = code >> 8;
+  payload[1] = code & 0xff;
+  ctx->ws->failed = mtev_true;
+  ws_send(ctx, MTEV_WS_CLOSE, payload, 2);
+}
+
+static void
+ws_notify(mtev_http_session_ctx *ctx) {
+  struct mtev_http_websocket *ws = ctx->ws;
+  if(ws->notified) return;
+  ws->notified = mtev_true;
+  ws->handler(ctx, MTEV_WS_CLOSE, ws->close_payload, ws->close_len,
+              ws->closure);
+}
+
+static int
+ws_inflate(struct mtev_http_websocket *ws, const unsigned char *in,
+           size_t len, size_t *outlen) {
+  static const unsigned char tail[4] = { 0x00, 0x00, 0xff, 0xff };
+  int pass;
+
+  if(!ws->zin_init) {
+    if(inflateInit2(&ws->zin, -15) != Z_OK) return WS_CLOSE_INTERNAL;
+    ws->zin_init = mtev_true;
+  }
+  else inflateReset(&ws->zin);
+  *outlen = 0;
+  for(pass = 0; pass < 2; pass++) {
+    ws->zin.next_in = (Bytef *)(pass ? tail : in);
+    ws->zin.avail_in = pass ? sizeof(tail) : len;
+    while(1) {
+      int zrv;
+      if(*outlen == ws->inflated_alloc) {
+        if(ws->inflated_alloc >= ws->max_message) return WS_CLOSE_TOO_BIG;
+        ws->inflated_alloc = MIN(MAX(ws->inflated_alloc * 2, 4096),
+                                 ws->max_message);
+        ws->inflated = realloc(ws->inflated, ws->inflated_alloc);
+      }
+      ws->zin.next_out = ws->inflated + *outlen;
+      ws->zin.avail_out = ws->inflated_alloc - *outlen;
+      zrv = inflate(&ws->zin, Z_SYNC_FLUSH);
+      *outlen = ws->inflated_alloc - ws->zin.avail_out;
+      if(zrv == Z_STREAM_END) return 0;
+      if(zrv == Z_BUF_ERROR) {
+        if(ws->zin.avail_in) return WS_CLOSE_INVALID_DATA;
+        break;
+      }
+      if(zrv != Z_OK) return WS_CLOSE_INVALID_DATA;
+      if(!ws->zin.avail_in && ws->zin.avail_out) break;
+    }
+  }
+  return 0;
+}
+
+static void
+ws_deliver(mtev_http_session_ctx *ctx, int opcode, mtev_boolean compressed,
+           const unsigned char *msg, size_t len) {
+  struct mtev_http_websocket *ws = ctx->ws;
+  if(compressed) {
+    int code = ws_inflate(ws, msg, len, &len);
+    if(code) {
+      ws_fail(ctx, code);
+      return;
+    }
+    msg = ws->inflated;
+  }
+  if(opcode == MTEV_WS_TEXT && !ws_utf8_valid(msg, len)) {
+    ws_fail(ctx, WS_CLOSE_INVALID_DATA);
+    return;
+  }
+  if(ws->close_sent) return;
+  if(ws->handler(ctx, opcode, msg, len, ws->closure) != 0)
+    mtev_http_websocket_close(ctx, WS_CLOSE_NORMAL, NULL);
+}
+
+static mtev_boolean
+ws_close_code_valid(int code) {
+  return (code >= 1000 && code <= 1003) || (code >= 1007 && code <= 1011) ||
+         (code >= 3000 && code <= 4999);
+}
+
+static void
+ws_control(mtev_http_session_ctx *ctx, int opcode,
+           unsigned char *payload, size_t len) {
+  struct mtev_http_websocket *ws = ctx->ws;
+  switch(opcode) {
+    case MTEV_WS_PING:
+      ws_send(ctx, MTEV_WS_PONG, payload, len);
+      break;
+    case MTEV_WS_PONG:
+      break;
+    case MTEV_WS_CLOSE:
+      if(len == 1 ||
+         (len >= 2 && !ws_close_code_valid((payload[0] << 8) | payload[1]))) {
+        ws_fail(ctx, WS_CLOSE_PROTOCOL);
+        return;
+      }
+      if(len > 2 && !ws_utf8_valid(payload + 2, len - 2)) {
+        ws_fail(ctx, WS_CLOSE_INVALID_DATA);
+        return;
+      }
+      memcpy(ws->close_payload, payload, len);
+      ws->close_len = len;
+      ws->close_received = mtev_true;
+      /* echo the status; the connection ends once it's out */
+      ws_send(ctx, MTEV_WS_CLOSE, payload, MIN(len, 2));
+      break;
+    default:
+      ws_fail(ctx, WS_CLOSE_PROTOCOL);
+  }
+}
+
+static void
+ws_data(mtev_http_session_ctx *ctx, mtev_boolean fin, int rsv, int opcode,
+        unsigned char *payload, size_t len) {
+  struct mtev_http_websocket *ws = ctx->ws;
+
+  if(opcode == WS_CONTINUATION) {
+    if(!ws->msg_opcode || rsv) {
+      ws_fail(ctx, WS_CLOSE_PROTOCOL);
+      return;
+    }
+  }
+  else if(opcode == MTEV_WS_TEXT || opcode == MTEV_WS_BINARY) {
+    if(ws->msg_opcode) {
+      ws_fail(ctx, WS_CLOSE_PROTOCOL);
+      return;
+    }
+    if(fin) {
+      /* The common case: deliver straight out of the input buffer. */
+      ws_deliver(ctx, opcode, rsv != 0, payload, len);
+      return;
+    }
+    ws->msg_opcode = opcode;
+    ws->msg_compressed = rsv != 0;
+    ws->msglen = 0;
+  }
+  else {
+    ws_fail(ctx, WS_CLOSE_PROTOCOL);
+    return;
+  }
+
+  if(ws->msglen + len > ws->max_message) {
+    ws_fail(ctx, WS_CLOSE_TOO_BIG);
+    return;
+  }
+  if(ws->msglen + len > ws->msgalloc) {
+    ws->msgalloc = MIN(MAX(ws->msgalloc * 2, ws->msglen + len),
+                       ws->max_message);
+    ws->msg = realloc(ws->msg, ws->msgalloc);
+  }
+  memcpy(ws->msg + ws->msglen, payload, len);
+  ws->msglen += len;
+  if(fin) {
+    int msg_opcode = ws->msg_opcode;
+    ws->msg_opcode = 0;
+    ws_deliver(ctx, msg_opcode, ws->msg_compressed, ws->msg, ws->msglen);
+  }
+}
+
+static void
+ws_process(mtev_http_session_ctx *ctx) {
+  struct mtev_http_websocket *ws = ctx->ws;
+  size_t off = 0;
+
+  while(!ws->failed && !ws->close_received) {
+    unsigned char *p = ws->in + off;
+    size_t avail = ws->inlen - off, hlen = 2;
+    uint64_t len;
+    int fin, rsv, opcode, i;
+
+    if(avail < 2) break;
+    fin = p[0] & WS_FIN;
+    rsv = p[0] & (WS_RSV1 | WS_RSV23);
+    opcode = p[0] & 0x0f;
+    len = p[1] & 0x7f;
+    if(len == 126) {
+      if(avail < 4) break;
+      len = (p[2] << 8) | p[3];
+      hlen = 4;
+    }
+    else if(len == 127) {
+      if(avail < 10) break;
+      for(len = 0, i = 0; i < 8; i++) len = (len << 8) | p[2+i];
+      hlen = 10;
+    }
+    if(!(p[1] & 0x80) || (rsv & WS_RSV23) ||
+       ((rsv & WS_RSV1) && (!ws->deflate || (opcode & 0x8)))) {
+      ws_fail(ctx, WS_CLOSE_PROTOCOL);
+      break;
+    }
+    if((opcode & 0x8) && (!fin || len > 125)) {
+      ws_fail(ctx, WS_CLOSE_PROTOCOL);
+      break;
+    }
+    if(len > ws->max_message) {
+      ws_fail(ctx, WS_CLOSE_TOO_BIG);
+      break;
+    }
+    hlen += 4; /* the masking key */
+    if(avail < hlen + len) {
+      /* make sure the whole frame will fit */
+      if(ws->inalloc - off < hlen + len) {
+        if(off) {
+          memmove(ws->in, ws->in + off, avail);
+          ws->inlen = avail;
+          off = 0;
+        }
+        ws->inalloc = hlen + len;
+        ws->in = realloc(ws->in, ws->inalloc);
+      }
+      break;
+    }
+    ws_unmask(p + hlen, len, p + hlen - 4);
+    if(opcode & 0x8) ws_control(ctx, opcode, p + hlen, len);
+    else ws_data(ctx, fin != 0, rsv, opcode, p + hlen, len);
+    off += hlen + len;
+  }
+  if(off) {
+    memmove(ws->in, ws->in + off, ws->inlen - off);
+    ws->inlen -= off;
+  }
+}
+
+/* The 101 has gone out: the request is done with, and whatever followed
+ * it on the wire is the start of the frames. */
+static void
+ws_start(mtev_http_session_ctx *ctx) {
+  struct mtev_http_websocket *ws = ctx->ws;
+  struct bchain *b, *pending;
+  size_t offset;
+
+  mtev_http_log_request(ctx);
+  for(b = ctx->req.first_input; b; b = b->next) ws->inlen += b->size;
+  ws->inalloc = MAX(ws->inlen, WS_READ_SIZE);
+  ws->in = malloc(ws->inalloc);
+  ws->inlen = 0;
+  for(b = ctx->req.first_input; b; b = b->next) {
+    memcpy(ws->in + ws->inlen, b->buff + b->start, b->size);
+    ws->inlen += b->size;
+  }
+  RELEASE_BCHAIN(ctx->req.first_input);
+  ctx->req.last_input = NULL;
+
+  /* Frames sent ahead of this survive the response's release. */
+  pthread_mutex_lock(&ctx->write_lock);
+  pending = ctx->res.output_raw;
+  offset = ctx->res.output_raw_offset;
+  ctx->res.output_raw = NULL;
+  mtev_http_request_release(ctx);
+  mtev_http_response_release(ctx);
+  ctx->res.output_raw = pending;
+  ctx->res.output_raw_offset = offset;
+  ws->appended = 0;
+  for(b = pending; b; b = b->next) ws->appended += b->size;
+  ws->appended -= MIN(ws->appended, offset);
+  ws->started = mtev_true;
+  pthread_mutex_unlock(&ctx->write_lock);
+}
+
+static void
+ws_shutdown(mtev_http_session_ctx *ctx) {
+  int mask;
+  ws_notify(ctx);
+  pthread_mutex_lock(&ctx->write_lock);
+  if(ctx->conn.e) {
+    ctx->conn.e->opset->close(ctx->conn.e->fd, &mask, ctx->conn.e);
+    ctx->conn.e = NULL;
+  }
+  pthread_mutex_unlock(&ctx->write_lock);
+}
+
+int
+mtev_http_websocket_drive(mtev_http_session_ctx *ctx, int mask) {
+  struct mtev_http_websocket *ws = ctx->ws;
+  eventer_t e = ctx->conn.e;
+  int wmask = 0, rmask = 0;
+
+  if(mask & EVENTER_EXCEPTION) goto shutdown;
+  if(mtev_http_session_write(ctx, &wmask) < 0 || ctx->conn.needs_close)
+    goto shutdown;
+  if(!ws->started) {
+    /* Nothing is read until the handshake is fully out. */
+    if(!ctx->res.complete) return wmask | EVENTER_EXCEPTION;
+    ws_start(ctx);
+    ws_process(ctx);
+  }
+  while(!ws->failed && !ws->close_received) {
+    int len;
+    if(ws->inalloc - ws->inlen < WS_READ_SIZE &&
+       ws->inalloc < ws->inlen + WS_READ_SIZE) {
+      ws->inalloc = ws->inlen + WS_READ_SIZE;
+      ws->in = realloc(ws->in, ws->inalloc);
+    }
+    len = e->opset->read(e->fd, ws->in + ws->inlen, ws->inalloc - ws->inlen,
+                         &rmask, e);
+    if(len == -1 && errno == EAGAIN) break;
+    if(len <= 0) goto shutdown;
+    ws->inlen += len;
+    ws_process(ctx);
+  }
+  if(mtev_http_session_write(ctx, &wmask) < 0 || ctx->conn.needs_close)
+    goto shutdown;
+  if(ws->failed || ws->close_received) {
+    /* Once our close is out there is nothing left to say. */
+    if(!ctx->res.output_raw) goto shutdown;
+    return EVENTER_WRITE | EVENTER_EXCEPTION;
+  }
+  return EVENTER_READ | EVENTER_EXCEPTION |
+         (wmask & EVENTER_WRITE) | (rmask & (EVENTER_READ | EVENTER_WRITE));
+
+ shutdown:
+  ws_shutdown(ctx);
+  return 0;
+}
+
+void
+mtev_http_websocket_free(mtev_http_session_ctx *ctx) {
+  struct mtev_http_websocket *ws = ctx->ws;
+  ws_notify(ctx);
+  if(ws->zin_init) inflateEnd(&ws->zin);
+  if(ws->zout_init) deflateEnd(&ws->zout);
+  free(ws->inflated);
+  free(ws->msg);
+  free(ws->in);
+  free(ws);
+  ctx->ws = NULL;
+}
+
+/* Accept an offer of permessage-deflate we can honor: we never keep a
+ * window between messages and always use the full one. */
+static mtev_boolean
+ws_negotiate_deflate(const char *offers) {
+  char *copy, *offer, *olast;
+  mtev_boolean ok = mtev_false;
+  if(!offers) return mtev_false;
+  copy = strdup(offers);
+  for(offer = strtok_r(copy, ",", &olast); offer && !ok;
+      offer = strtok_r(NULL, ",", &olast)) {
+    char *param, *plast;
+    param = strtok_r(offer, ";", &plast);
+    while(param && isspace((unsigned char)*param)) param++;
+    if(!param || strncasecmp(param, "permessage-deflate", 18) ||
+       (param[18] && !isspace((unsigned char)param[18])))
+      continue;
+    ok = mtev_true;
+    while(ok && (param = strtok_r(NULL, ";", &plast)) != NULL) {
+      size_t len;
+      while(isspace((unsigned char)*param)) param++;
+      for(len = 0; param[len] && param[len] != '=' &&
+                   !isspace((unsigned char)param[len]); len++);
+      if(!(len == 26 && !strncasecmp(param, "server_no_context_takeover", len)) &&
+         !(len == 26 && !strncasecmp(param, "client_no_context_takeover", len)) &&
+         !(len == 22 && !strncasecmp(param, "client_max_window_bits", len)))
+        ok = mtev_false;
+    }
+  }
+  free(copy);
+  return ok;
+}
+
+static size_t
+ws_config_size(mtev_http_session_ctx *ctx, const char *key, size_t dflt) {
+  const char *val;
+  if(ctx->ac && ctx->ac->config &&
+     mtev_hash_retr_str(ctx->ac->config, key, strlen(key), &val))
+    return strtoull(val, NULL, 10);
+  return dflt;
+}
+
+mtev_boolean
+mtev_http_websocket_upgrade(mtev_http_session_ctx *ctx, const char *protocol,
+                            mtev_http_websocket_func handler, void *closure) {
+  mtev_http_request *req = &ctx->req;
+  struct mtev_http_websocket *ws;
+  const char *upgrade = NULL, *connection = NULL, *key = NULL,
+             *version = NULL, *offered = NULL, *extensions = NULL, *val;
+  char keybuf[128], accept[64];
+  unsigned char digest[SHA_DIGEST_LENGTH];
+  int alen;
+
+  if(ctx->h2stream || ctx->h2conn || ctx->ws || !handler ||
+     ctx->res.output_started || req->has_payload ||
+     req->method != MTEV_HTTP_GET || req->protocol != MTEV_HTTP11)
+    return mtev_false;
+  mtev_hash_retr_str(&req->headers, "upgrade", 7, &upgrade);
+  mtev_hash_retr_str(&req->headers, "connection", 10, &connection);
+  mtev_hash_retr_str(&req->headers, "sec-websocket-key", 17, &key);
+  mtev_hash_retr_str(&req->headers, "sec-websocket-version", 21, &version);
+  mtev_hash_retr_str(&req->headers, "sec-websocket-protocol", 22, &offered);
+  mtev_hash_retr_str(&req->headers, "sec-websocket-extensions", 24,
+                     &extensions);
+  if(!upgrade || !ws_has_token(upgrade, "websocket") ||
+     !connection || !ws_has_token(connection, "upgrade") ||
+     !key || strlen(key) != 24 || !version || strcmp(version, "13"))
+    return mtev_false;
+  if(protocol && (!offered || !ws_has_token(offered, protocol)))
+    return mtev_false;
+
+  snprintf(keybuf, sizeof(keybuf), "%s" WS_GUID, key);
+  SHA1((unsigned char *)keybuf, strlen(keybuf), digest);
+  alen = mtev_b64_encode(digest, sizeof(digest), accept, sizeof(accept) - 1);
+  if(alen <= 0) return mtev_false;
+  accept[alen] = '\0';
+
+  ws = calloc(1, sizeof(*ws));
+  ws->handler = handler;
+  ws->closure = closure;
+  ws->max_message = ws_config_size(ctx, "websocket_max_message",
+                                   DEFAULT_WS_MAX_MESSAGE);
+  ws->max_queue = ws_config_size(ctx, "websocket_max_queue",
+                                 DEFAULT_WS_MAX_QUEUE);
+  ws->deflate = mtev_true;
+  if(ctx->ac && ctx->ac->config &&
+     mtev_hash_retr_str(ctx->ac->config, "websocket_deflate",
+                        strlen("websocket_deflate"), &val))
+    ws->deflate = !strcmp(val, "true") || !strcmp(val, "on");
+  if(ws->deflate) ws->deflate = ws_negotiate_deflate(extensions);
+
+  mtev_http_response_status_set(ctx, 101, "Switching Protocols");
+  mtev_http_response_header_set(ctx, "Upgrade", "websocket");
+  mtev_http_response_header_set(ctx, "Connection", "Upgrade");
+  mtev_http_response_header_set(ctx, "Sec-WebSocket-Accept", accept);
+  if(protocol)
+    mtev_http_response_header_set(ctx, "Sec-WebSocket-Protocol", protocol);
+  if(ws->deflate)
+    mtev_http_response_header_set(ctx, "Sec-WebSocket-Extensions",
+                                  "permessage-deflate; "
+                                  "server_no_context_takeover; "
+                                  "client_no_context_takeover");
+  ctx->ws = ws;
+  mtev_http_response_end(ctx);
+  return mtev_true;
+}
+
+mtev_boolean
+mtev_http_websocket_send(mtev_http_session_ctx *ctx, int opcode,
+                         const void *msg, size_t len) {
+  if(opcode == MTEV_WS_CLOSE) return mtev_false;
+  return ws_send(ctx, opcode, msg, len);
+}
+
+mtev_boolean
+mtev_http_websocket_send_bchain(mtev_http_session_ctx *ctx, int opcode,
+                                struct bchain *msg) {
+  return ws_send_bchain(ctx, opcode, msg);
+}
+
+mtev_boolean
+mtev_http_websocket_close(mtev_http_session_ctx *ctx, int code,
+                          const char *reason) {
+  unsigned char payload[125];
+  size_t len = 0;
+  if(code) {
+    payload[0] = code >> 8;
+    payload[1] = code & 0xff;
+    len = 2;
+    if(reason) {
+      size_t rlen = MIN(strlen(reason), sizeof(payload) - 2);
+      memcpy(payload + 2, reason, rlen);
+      len += rlen;
+    }
+  }
+  return ws_send(ctx, MTEV_WS_CLOSE, payload, len);
+}
+
+size_t
+mtev_http_websocket_queued(mtev_http_session_ctx *ctx) {
+  size_t queued;
+  if(!ctx->ws) return 0;
+  pthread_mutex_lock(&ctx->write_lock);
+  queued = ws_queued(ctx);
+  pthread_mutex_unlock(&ctx->write_lock);
+  return queued;
+}
@@ -188,7 +188,7 @@ mtev_listener_acceptor(eventer_t e, int mask,
       newe->mask = EVENTER_READ | EVENTER_WRITE | EVENTER_EXCEPTION;
   
       if(mtev_hash_size(listener_closure->sslconfig)) {
-        const char *layer, *cert, *key, *ca, *ciphers, *crl;
+        const char *layer, *cert, *key, *ca, *ciphers, *crl, *alpn;
         eventer_ssl_ctx_t *ctx;
         /* We have an SSL configuration.  While our socket accept is
          * complete, we now have to SSL_accept, which could require
@@ -220,6 +220,9 @@ mtev_listener_acceptor(eventer_t e, int mask,
           }
         }
 
+        SSLCONFGET(alpn, "alpn");
+        if(alpn) eventer_ssl_ctx_set_alpn(ctx, alpn);
+
         eventer_ssl_ctx_set_verify(ctx, eventer_ssl_verify_cert,
                                    listener_closure->sslconfig);
         EVENTER_ATTACH_SSL(newe, ctx);
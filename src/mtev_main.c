@@ -69,9 +69,10 @@ mtev_main_disable_log(const char *name) {
 }
 static int
 configure_eventer(const char *appname) {
-  int rv = 0;
+  int rv = 0, i, cnt = 0;
   mtev_boolean rlim_found = mtev_false;
   mtev_hash_table *table;
+  mtev_conf_section_t *jobq_configs;
   char appscratch[1024];
 
   snprintf(appscratch, sizeof(appscratch), "/%s/eventer/config", appname);
@@ -105,6 +106,28 @@ configure_eventer(const char *appname) {
   if (!rlim_found) {
     eventer_propset("rlim_nofiles", "4194304");
   }
+
+  /* Named job queues: <jobq name="..." concurrency="4" shared="true"/> */
+  snprintf(appscratch, sizeof(appscratch), "/%s/eventer/jobq", appname);
+  jobq_configs = mtev_conf_get_sections(NULL, appscratch, &cnt);
+  for(i=0; i<cnt; i++) {
+    char name[256];
+    int concurrency = 1;
+    mtev_boolean shared = mtev_false;
+    if(!mtev_conf_get_stringbuf(jobq_configs[i], "@name",
+                                name, sizeof(name))) {
+      mtevL(mtev_error, "No name specified in jobq stanza %d\n", i+1);
+      rv = -1;
+      continue;
+    }
+    (void)mtev_conf_get_int(jobq_configs[i], "@concurrency", &concurrency);
+    (void)mtev_conf_get_boolean(jobq_configs[i], "@shared", &shared);
+    if(!eventer_jobq_create(name, concurrency, shared == mtev_true)) {
+      mtevL(mtev_error, "Cannot create jobq '%s'\n", name);
+      rv = -1;
+    }
+  }
+  if(jobq_configs) free(jobq_configs);
   return rv;
 }
 
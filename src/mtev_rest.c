@@ -41,40 +41,95 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <ctype.h>
+
+#ifdef PCRE_STUDY_JIT_COMPILE
+#define REST_PCRE_STUDY_FLAGS PCRE_STUDY_JIT_COMPILE
+#else
+#define REST_PCRE_STUDY_FLAGS 0
+#endif
 
 struct rest_xml_payload {
-  char *buffer;
+  xmlParserCtxtPtr parser;
   xmlDocPtr indoc;
-  int len;
-  int allocd;
   int complete;
 };
 
 struct rest_raw_payload {
   char *buffer;
-  int len;
-  int allocd;
+  size_t len;
+  size_t allocd;
+  size_t prealloc_max;
+  int complete;
+};
+
+struct rest_spill_payload {
+  rest_upload_t upload;
+  size_t allocd;
+  size_t spill_size;
+  const char *spill_dir;
   int complete;
 };
 
 struct rest_url_dispatcher {
   char *method;
+  char *expr;
   pcre *expression;
   pcre_extra *extra;
   rest_request_handler handler;
   rest_authorize_func_t auth;
+  /* admission */
+  mtev_rest_priority_t priority;
+  mtev_atomic32_t inflight;
+  mtev_atomic64_t admitted;
+  mtev_atomic64_t rejected;
+  mtev_atomic32_t queue_delay_us;
+  /* registration order within the base */
+  int order;
   /* Chain to the next one */
   struct rest_url_dispatcher *next;
+  /* Chain to the next expression for the same method */
+  struct rest_url_dispatcher *mnext;
+};
+
+/* Anchored expressions without metacharacters ("^sockets\\.json$") are
+ * looked up by the string they match; the rest are tried in order.
+ */
+struct rest_method_table {
+  char *method;
+  int nliterals;
+  mtev_hash_table literals;
+  struct rest_url_dispatcher *rules;
+  struct rest_url_dispatcher *rules_endptr;
+  struct rest_method_table *next;
 };
 
 struct rule_container {
   char *base;
+  int nrules;
   struct rest_url_dispatcher *rules;
   struct rest_url_dispatcher *rules_endptr;
+  struct rest_method_table *methods;
 };
 mtev_hash_table dispatch_points = MTEV_HASH_EMPTY;
 
+/* The bases, as a trie over their '/'-terminated pieces, so a URI is
+ * walked once to find the longest registered base.
+ */
+struct rest_route_node {
+  char *piece;
+  int len;
+  struct rule_container *cont;
+  struct rest_route_node *children;
+  struct rest_route_node *sibling;
+};
+static struct rest_route_node route_root;
+
 struct mtev_rest_acl_rule {
   mtev_boolean allow;
   pcre *url;
@@ -101,56 +156,209 @@ mtev_http_rest_permission_denied(mtev_http_rest_closure_t *restc,
   mtev_http_response_end(ctx);
   return 0;
 }
+/* A listener's admission limits, parsed from its config on first use and
+ * kept, like the file caches, by config. */
+struct rest_admission {
+  uint32_t max_inflight;
+  uint32_t target_us;
+  const char *retry_after;
+};
+static pthread_mutex_t admissions_lock = PTHREAD_MUTEX_INITIALIZER;
+static mtev_hash_table admissions = MTEV_HASH_EMPTY;
+
+static const struct rest_admission *
+rest_admission_get(mtev_hash_table *config) {
+  struct rest_admission *adm;
+  mtev_hash_table **key;
+  void *vadm;
+  const char *val;
+
+  pthread_mutex_lock(&admissions_lock);
+  if(mtev_hash_retrieve(&admissions, (const char *)&config,
+                        sizeof(config), &vadm)) {
+    pthread_mutex_unlock(&admissions_lock);
+    return vadm;
+  }
+  adm = calloc(1, sizeof(*adm));
+  adm->retry_after = "1";
+  if(mtev_hash_retr_str(config, "max_inflight",
+                        strlen("max_inflight"), &val))
+    adm->max_inflight = atoi(val);
+  if(mtev_hash_retr_str(config, "queue_delay_target",
+                        strlen("queue_delay_target"), &val))
+    adm->target_us = atoi(val) * 1000;
+  if(mtev_hash_retr_str(config, "retry_after",
+                        strlen("retry_after"), &val))
+    adm->retry_after = val;
+  key = malloc(sizeof(*key));
+  *key = config;
+  mtev_hash_store(&admissions, (const char *)key, sizeof(*key), adm);
+  pthread_mutex_unlock(&admissions_lock);
+  return adm;
+}
+static int
+mtev_http_rest_unavailable(mtev_http_rest_closure_t *restc,
+                           int npats, char **pats) {
+  mtev_http_session_ctx *ctx = restc->http_ctx;
+  const char *retry_after = "1";
+  if(restc->admission) retry_after = restc->admission->retry_after;
+  mtev_http_response_standard(ctx, 503, "SERVICE UNAVAILABLE", "text/plain");
+  mtev_http_response_header_set(ctx, "Retry-After", retry_after);
+  mtev_http_response_end(ctx);
+  return 0;
+}
+/* Admit a request to a matched route, or not.  Each route counts its own
+ * in-flight requests and keeps a moving average of how long requests
+ * wait between being ready (their headers in) and being dispatched.  A request is shed when
+ * the route is at the listener's max_inflight, or when both the average
+ * and the request's own wait exceed queue_delay_target (ms).
+ */
+static mtev_boolean
+mtev_http_rest_admit(mtev_http_rest_closure_t *restc,
+                     struct rest_url_dispatcher *rule) {
+  mtev_http_request *req = mtev_http_session_request(restc->http_ctx);
+  struct timeval ready, now, diff;
+  int64_t delay_us;
+  int32_t avg_us, old_us;
+  uint32_t max_inflight, target_us;
+
+  mtev_http_request_ready_time(req, &ready);
+  gettimeofday(&now, NULL);
+  sub_timeval(now, ready, &diff);
+  delay_us = diff.tv_sec * 1000000LL + diff.tv_usec;
+  if(delay_us < 0) delay_us = 0;
+  if(delay_us > INT32_MAX) delay_us = INT32_MAX;
+  /* shed requests count too, so the average recovers while we shed */
+  do {
+    old_us = rule->queue_delay_us;
+    avg_us = old_us - old_us / 8 + (int32_t)delay_us / 8;
+  } while(mtev_atomic_cas32(&rule->queue_delay_us, avg_us, old_us) != old_us);
+
+  if(!restc->admission && restc->ac && restc->ac->config)
+    restc->admission = rest_admission_get(restc->ac->config);
+  if(rule->priority != MTEV_REST_PRIORITY_CRITICAL && restc->admission) {
+    max_inflight = restc->admission->max_inflight;
+    target_us = restc->admission->target_us;
+    if(rule->priority == MTEV_REST_PRIORITY_BULK) {
+      if(max_inflight) max_inflight = max_inflight / 2 ? max_inflight / 2 : 1;
+      target_us /= 2;
+    }
+    if((max_inflight && (uint32_t)rule->inflight >= max_inflight) ||
+       (target_us && (uint32_t)avg_us > target_us && delay_us > target_us)) {
+      mtev_atomic_inc64(&rule->rejected);
+      return mtev_false;
+    }
+  }
+  mtev_atomic_inc32(&rule->inflight);
+  mtev_atomic_inc64(&rule->admitted);
+  restc->admitted = rule;
+  return mtev_true;
+}
+static struct rule_container *
+mtev_http_rest_find_base(const char *uri_str, const char *eoq,
+                         const char **eob) {
+  struct rest_route_node *node = &route_root, *child;
+  struct rule_container *cont = NULL;
+  const char *cp = uri_str, *slash;
+
+  while(cp < eoq && (slash = memchr(cp, '/', eoq - cp)) != NULL) {
+    int len = slash - cp + 1;
+    for(child = node->children; child; child = child->sibling)
+      if(child->len == len && !memcmp(child->piece, cp, len)) break;
+    if(!child) break;
+    node = child;
+    cp = slash + 1;
+    if(node->cont) {
+      cont = node->cont;
+      *eob = cp;
+    }
+  }
+  return cont;
+}
+static void
+mtev_http_rest_set_params(mtev_http_rest_closure_t *restc, const char *eob,
+                          int *ovector, int nparams) {
+  size_t need;
+  char *block;
+  int i;
+
+  restc->nparams = nparams;
+  if(!nparams) return;
+  /* views, pointers and NUL-terminated copies in one arena allocation */
+  need = nparams * (sizeof(*restc->param_views) + sizeof(*restc->params));
+  for(i = 0; i < nparams; i++)
+    if(ovector[(i+1)*2] >= 0)
+      need += ovector[(i+1)*2+1] - ovector[(i+1)*2];
+  need += nparams;
+  block = mtev_http_session_alloc(restc->http_ctx, need);
+  restc->param_views = (mtev_http_rest_param_t *)block;
+  block += nparams * sizeof(*restc->param_views);
+  restc->params = (char **)block;
+  block += nparams * sizeof(*restc->params);
+  for(i = 0; i < nparams; i++) {
+    int start = ovector[(i+1)*2];
+    int end = ovector[(i+1)*2+1];
+    if(start < 0) start = end = 0; /* unset group */
+    restc->param_views[i].ptr = eob + start;
+    restc->param_views[i].len = end - start;
+    restc->params[i] = block;
+    memcpy(block, eob + start, end - start);
+    block[end - start] = '\0';
+    block += end - start + 1;
+  }
+}
 static rest_request_handler
 mtev_http_get_handler(mtev_http_rest_closure_t *restc) {
-  struct rule_container *cont = NULL;
-  struct rest_url_dispatcher *rule;
+  struct rule_container *cont;
+  struct rest_method_table *mt;
+  struct rest_url_dispatcher *rule, *lit = NULL, *match = NULL;
   mtev_http_request *req = mtev_http_session_request(restc->http_ctx);
-  const char *uri_str;
-  const char *eoq, *eob;
+  const char *uri_str, *method;
+  const char *eoq, *eob = NULL;
+  int ovector[30];
+  int cnt = 1;
+  void *vrule;
+
   uri_str = mtev_http_request_uri_str(req);
   eoq = uri_str + strlen(uri_str);
-  eob = eoq - 1;
+  if((cont = mtev_http_rest_find_base(uri_str, eoq, &eob)) == NULL)
+    return NULL;
+  method = mtev_http_request_method_str(req);
+  for(mt = cont->methods; mt; mt = mt->next)
+    if(!strcmp(mt->method, method)) break;
+  if(!mt) return NULL;
 
-  /* find the right base */
-  while(1) {
-    void *vcont;
-    while(eob >= uri_str && *eob != '/') eob--;
-    if(eob < uri_str) break; /* off the front */
-    if(mtev_hash_retrieve(&dispatch_points, uri_str,
-                          eob - uri_str + 1, &vcont)) {
-      cont = vcont;
-      eob++; /* move past the determined base */
-      break;
-    }
-    eob--;
+  if(mt->nliterals) {
+    if(mtev_hash_retrieve(&mt->literals, eob, eoq - eob, &vrule))
+      lit = vrule;
+    /* '$' also matches ahead of a trailing newline */
+    else if(eoq > eob && eoq[-1] == '\n' &&
+            mtev_hash_retrieve(&mt->literals, eob, eoq - eob - 1, &vrule))
+      lit = vrule;
   }
-  if(!cont) return NULL;
-  for(rule = cont->rules; rule; rule = rule->next) {
-    int ovector[30];
-    int cnt;
-    if(strcmp(rule->method, mtev_http_request_method_str(req))) continue;
+  /* earlier registrations still win over a literal */
+  for(rule = mt->rules; rule && (!lit || rule->order < lit->order);
+      rule = rule->mnext) {
     if((cnt = pcre_exec(rule->expression, rule->extra, eob, eoq - eob, 0, 0,
                         ovector, sizeof(ovector)/sizeof(*ovector))) > 0) {
-      /* We match, set 'er up */
-      restc->fastpath = rule->handler;
-      restc->nparams = cnt - 1;
-      if(restc->nparams) {
-        restc->params = calloc(restc->nparams, sizeof(*restc->params));
-        for(cnt = 0; cnt < restc->nparams; cnt++) {
-          int start = ovector[(cnt+1)*2];
-          int end = ovector[(cnt+1)*2+1];
-          restc->params[cnt] = malloc(end - start + 1);
-          memcpy(restc->params[cnt], eob + start, end - start);
-          restc->params[cnt][end - start] = '\0';
-        }
-      }
-      if(rule->auth && !rule->auth(restc, restc->nparams, restc->params))
-        return mtev_http_rest_permission_denied;
-      return restc->fastpath;
+      match = rule;
+      break;
     }
   }
-  return NULL;
+  if(!match) {
+    if(!lit) return NULL;
+    match = lit;
+    cnt = 1;
+  }
+
+  /* We match, set 'er up */
+  if(!mtev_http_rest_admit(restc, match))
+    return mtev_http_rest_unavailable;
+  restc->fastpath = match->handler;
+  mtev_http_rest_set_params(restc, eob, ovector, cnt - 1);
+  if(match->auth && !match->auth(restc, restc->nparams, restc->params))
+    return mtev_http_rest_permission_denied;
+  return restc->fastpath;
 }
 mtev_boolean
 mtev_http_rest_client_cert_auth(mtev_http_rest_closure_t *restc,
@@ -184,6 +392,52 @@ mtev_http_rest_client_cert_auth(mtev_http_rest_closure_t *restc,
   }
   return mtev_false;
 }
+/* The string an anchored, metacharacter-free expression matches, or NULL */
+static char *
+mtev_http_rest_expr_literal(const char *expr) {
+  size_t len = strlen(expr), o = 0;
+  const char *cp, *end;
+  char *lit;
+
+  if(len < 2 || expr[0] != '^' || expr[len-1] != '$') return NULL;
+  end = expr + len - 1;
+  lit = malloc(len);
+  for(cp = expr + 1; cp < end; cp++) {
+    if(*cp == '\\') {
+      /* only escaped punctuation is literal; \d, \w, \1 and friends aren't */
+      if(++cp >= end || isalnum((unsigned char)*cp)) goto not_literal;
+    }
+    else if(strchr(".[]()*+?{}|^$", *cp)) goto not_literal;
+    lit[o++] = *cp;
+  }
+  lit[o] = '\0';
+  return lit;
+ not_literal:
+  free(lit);
+  return NULL;
+}
+static void
+mtev_http_rest_add_base(struct rule_container *cont) {
+  struct rest_route_node *node = &route_root, *child;
+  const char *cp = cont->base, *slash;
+
+  while((slash = strchr(cp, '/')) != NULL) {
+    int len = slash - cp + 1;
+    for(child = node->children; child; child = child->sibling)
+      if(child->len == len && !memcmp(child->piece, cp, len)) break;
+    if(!child) {
+      child = calloc(1, sizeof(*child));
+      child->piece = malloc(len);
+      memcpy(child->piece, cp, len);
+      child->len = len;
+      child->sibling = node->children;
+      node->children = child;
+    }
+    node = child;
+    cp = slash + 1;
+  }
+  node->cont = cont;
+}
 int
 mtev_http_rest_register(const char *method, const char *base,
                         const char *expr, rest_request_handler f) {
@@ -195,10 +449,12 @@ mtev_http_rest_register_auth(const char *method, const char *base,
                              rest_authorize_func_t auth) {
   void *vcont;
   struct rule_container *cont;
+  struct rest_method_table *mt;
   struct rest_url_dispatcher *rule;
   const char *error;
   int erroffset;
   pcre *pcre_expr;
+  char *literal;
   int blen = strlen(base);
   /* base must end in a /, 'cause I said so */
   if(blen == 0 || base[blen-1] != '/') return -1;
@@ -210,28 +466,101 @@ mtev_http_rest_register_auth(const char *method, const char *base,
   }
   rule = calloc(1, sizeof(*rule));
   rule->method = strdup(method);
+  rule->expr = strdup(expr);
   rule->expression = pcre_expr;
-  rule->extra = pcre_study(rule->expression, 0, &error);
+  literal = mtev_http_rest_expr_literal(expr);
+  if(!literal)
+    rule->extra = pcre_study(rule->expression, REST_PCRE_STUDY_FLAGS, &error);
   rule->handler = f;
   rule->auth = auth;
+  rule->priority = MTEV_REST_PRIORITY_NORMAL;
 
   /* Make sure we have a container */
   if(!mtev_hash_retrieve(&dispatch_points, base, strlen(base), &vcont)) {
     cont = calloc(1, sizeof(*cont));
     cont->base = strdup(base);
     mtev_hash_store(&dispatch_points, cont->base, strlen(cont->base), cont);
+    mtev_http_rest_add_base(cont);
   }
   else cont = vcont;
 
   /* Append the rule */
+  rule->order = cont->nrules++;
   if(cont->rules_endptr) {
     cont->rules_endptr->next = rule;
     cont->rules_endptr = cont->rules_endptr->next;
   }
   else
     cont->rules = cont->rules_endptr = rule;
+
+  /* ... and file it under its method */
+  for(mt = cont->methods; mt; mt = mt->next)
+    if(!strcmp(mt->method, method)) break;
+  if(!mt) {
+    mt = calloc(1, sizeof(*mt));
+    mt->method = strdup(method);
+    mt->next = cont->methods;
+    cont->methods = mt;
+  }
+  if(literal) {
+    /* the first registration for a string keeps it */
+    if(mtev_hash_store(&mt->literals, literal, strlen(literal), rule))
+      mt->nliterals++;
+    else
+      free(literal);
+  }
+  else if(mt->rules_endptr) {
+    mt->rules_endptr->mnext = rule;
+    mt->rules_endptr = rule;
+  }
+  else
+    mt->rules = mt->rules_endptr = rule;
   return 0;
 }
+int
+mtev_http_rest_set_priority(const char *method, const char *base,
+                            const char *expr, mtev_rest_priority_t priority) {
+  void *vcont;
+  struct rule_container *cont;
+  struct rest_url_dispatcher *rule;
+  int found = 0;
+
+  if(!mtev_hash_retrieve(&dispatch_points, base, strlen(base), &vcont))
+    return -1;
+  cont = vcont;
+  for(rule = cont->rules; rule; rule = rule->next) {
+    if(strcmp(rule->method, method) || strcmp(rule->expr, expr)) continue;
+    rule->priority = priority;
+    found++;
+  }
+  return found ? 0 : -1;
+}
+void
+mtev_http_rest_foreach_endpoint(
+    void (*f)(const mtev_http_rest_endpoint_stats_t *, void *),
+    void *closure) {
+  mtev_hash_iter iter = MTEV_HASH_ITER_ZERO;
+  const char *k;
+  int klen;
+  void *vcont;
+  struct rest_url_dispatcher *rule;
+  mtev_http_rest_endpoint_stats_t stats;
+
+  while(mtev_hash_next(&dispatch_points, &iter, &k, &klen, &vcont)) {
+    struct rule_container *cont = vcont;
+    for(rule = cont->rules; rule; rule = rule->next) {
+      stats.method = rule->method;
+      stats.base = cont->base;
+      stats.expression = rule->expr;
+      stats.priority = rule->priority;
+      stats.inflight = rule->inflight;
+      stats.admitted = rule->admitted;
+      stats.rejected = rule->rejected;
+      stats.queue_delay_us = (uint32_t)rule->queue_delay_us;
+      f(&stats, closure);
+    }
+  }
+}
 
 static mtev_http_rest_closure_t *
 mtev_http_rest_closure_alloc() {
@@ -241,16 +570,15 @@ mtev_http_rest_closure_alloc() {
 }
 void
 mtev_http_rest_clean_request(mtev_http_rest_closure_t *restc) {
-  int i;
-  if(restc->nparams) {
-    for(i=0;i<restc->nparams;i++) free(restc->params[i]);
-    free(restc->params);
-  }
+  /* params live in the session's per-request arena */
+  if(restc->admitted) mtev_atomic_dec32(&restc->admitted->inflight);
+  restc->admitted = NULL;
   if(restc->call_closure_free) restc->call_closure_free(restc->call_closure);
   restc->call_closure_free = NULL;
   restc->call_closure = NULL;
   restc->nparams = 0;
   restc->params = NULL;
+  restc->param_views = NULL;
   restc->fastpath = NULL;
 }
 void
@@ -261,6 +589,17 @@ mtev_http_rest_closure_free(void *v) {
   free(restc);
 }
 
+/* Each HTTP/2 stream gets its own, as though it had its own connection */
+static void *
+mtev_http_rest_stream_closure(mtev_http_session_ctx *ctx, void *vparent) {
+  mtev_http_rest_closure_t *parent = vparent, *restc;
+  restc = mtev_http_rest_closure_alloc();
+  restc->ac = parent->ac;
+  if(parent->remote_cn) restc->remote_cn = strdup(parent->remote_cn);
+  restc->http_ctx = ctx;
+  return restc;
+}
+
 int
 mtev_rest_request_dispatcher(mtev_http_session_ctx *ctx) {
   mtev_http_rest_closure_t *restc = mtev_http_session_dispatcher_closure(ctx);
@@ -296,6 +635,13 @@ mtev_http_rest_handler(eventer_t e, int mask, void *closure,
   mtev_http_rest_closure_t *restc = ac->service_ctx;
 
   if(mask & EVENTER_EXCEPTION || (restc && restc->wants_shutdown)) {
+    if(restc && restc->http_ctx) {
+      /* the session closes itself, and lets go of what it holds */
+      mtev_http_session_drive(e, EVENTER_EXCEPTION, restc->http_ctx, now,
+                              &done);
+      acceptor_closure_free(ac);
+      return 0;
+    }
 socket_error:
     /* Exceptions cause us to simply snip the connection */
     eventer_remove_fd(e->fd);
@@ -313,6 +659,9 @@ socket_error:
     restc->http_ctx =
         mtev_http_session_ctx_new(mtev_rest_request_dispatcher,
                                   restc, e, ac);
+    mtev_http_session_set_stream_closure(restc->http_ctx,
+                                         mtev_http_rest_stream_closure,
+                                         mtev_http_rest_closure_free);
     
     switch(ac->cmd) {
       case MTEV_CONTROL_DELETE:
@@ -353,6 +702,13 @@ mtev_http_rest_raw_handler(eventer_t e, int mask, void *closure,
   mtev_http_rest_closure_t *restc = ac->service_ctx;
 
   if(mask & EVENTER_EXCEPTION || (restc && restc->wants_shutdown)) {
+    if(restc && restc->http_ctx) {
+      /* the session closes itself, and lets go of what it holds */
+      mtev_http_session_drive(e, EVENTER_EXCEPTION, restc->http_ctx, now,
+                              &done);
+      acceptor_closure_free(ac);
+      return 0;
+    }
     /* Exceptions cause us to simply snip the connection */
     eventer_remove_fd(e->fd);
     e->opset->close(e->fd, &newmask, e);
@@ -366,6 +722,9 @@ mtev_http_rest_raw_handler(eventer_t e, int mask, void *closure,
     restc->http_ctx =
         mtev_http_session_ctx_new(mtev_rest_request_dispatcher,
                                   restc, e, ac);
+    mtev_http_session_set_stream_closure(restc->http_ctx,
+                                         mtev_http_rest_stream_closure,
+                                         mtev_http_rest_closure_free);
   }
   rv = mtev_http_session_drive(e, mask, restc->http_ctx, now, &done);
   if(done) {
@@ -374,107 +733,869 @@ mtev_http_rest_raw_handler(eventer_t e, int mask, void *closure,
   return rv;
 }
 
+/* Hand each piece of the body to f, straight out of the session's input.
+ * Nothing more is read off the socket than f is given, so a slow
+ * consumer simply leaves the rest in the kernel.
+ */
+mtev_boolean
+rest_stream_upload(mtev_http_rest_closure_t *restc, int *mask, int *complete,
+                   rest_upload_func f, void *closure) {
+  *complete = 0;
+  while(1) {
+    const void *data;
+    int len;
+    len = mtev_http_session_req_consume_view(restc->http_ctx, &data,
+                                             INT_MAX, mask);
+    if(len < 0 && errno == EAGAIN) return mtev_true;
+    if(len < 0) {
+      *complete = 1;
+      return mtev_false;
+    }
+    if(f(restc, len ? data : NULL, len, closure) != 0) {
+      *complete = 1;
+      return mtev_false;
+    }
+    if(len == 0) {
+      *complete = 1;
+      return mtev_true;
+    }
+  }
+}
+
 static void
 rest_xml_payload_free(void *f) {
   struct rest_xml_payload *xmlin = f;
-  if(xmlin->buffer) free(xmlin->buffer);
+  if(xmlin->parser) {
+    if(xmlin->parser->myDoc) xmlFreeDoc(xmlin->parser->myDoc);
+    xmlFreeParserCtxt(xmlin->parser);
+  }
   if(xmlin->indoc) xmlFreeDoc(xmlin->indoc);
+  free(xmlin);
+}
+
+static int
+rest_xml_payload_chunk(mtev_http_rest_closure_t *restc,
+                       const void *data, size_t len, void *closure) {
+  struct rest_xml_payload *rxc = closure;
+  if(!rxc->parser) {
+    if(!data) return -1; /* empty */
+    rxc->parser = xmlCreatePushParserCtxt(NULL, NULL, NULL, 0, NULL);
+    if(!rxc->parser) return -1;
+  }
+  if(xmlParseChunk(rxc->parser, data, len, data == NULL) != 0) return -1;
+  if(!data) {
+    if(rxc->parser->wellFormed) rxc->indoc = rxc->parser->myDoc;
+    else xmlFreeDoc(rxc->parser->myDoc);
+    rxc->parser->myDoc = NULL;
+    xmlFreeParserCtxt(rxc->parser);
+    rxc->parser = NULL;
+  }
+  return 0;
 }
 
 xmlDocPtr
 rest_get_xml_upload(mtev_http_rest_closure_t *restc,
                     int *mask, int *complete) {
   struct rest_xml_payload *rxc;
-  mtev_http_request *req = mtev_http_session_request(restc->http_ctx);
 
   if(restc->call_closure == NULL) {
     restc->call_closure = calloc(1, sizeof(*rxc));
     restc->call_closure_free = rest_xml_payload_free;
   }
   rxc = restc->call_closure;
-  while(!rxc->complete) {
-    int len;
-    if(rxc->len == rxc->allocd) {
-      char *b;
-      rxc->allocd += 32768;
-      b = rxc->buffer ? realloc(rxc->buffer, rxc->allocd) :
-                        malloc(rxc->allocd);
-      if(!b) {
-        *complete = 1;
-        return NULL;
-      }
-      rxc->buffer = b;
-    }
-    len = mtev_http_session_req_consume(restc->http_ctx,
-                                        rxc->buffer + rxc->len,
-                                        rxc->allocd - rxc->len,
-                                        rxc->allocd - rxc->len,
-                                        mask);
-    if(len > 0) rxc->len += len;
-    if(len < 0 && errno == EAGAIN) return NULL;
-    else if(len < 0) {
-      *complete = 1;
-      return NULL;
-    }
-    if(rxc->len == mtev_http_request_content_length(req)) {
-      rxc->indoc = xmlParseMemory(rxc->buffer, rxc->len);
-      rxc->complete = 1;
-    }
+  /* The document is built as the body arrives; the body itself is
+   * never held. */
+  if(!rxc->complete) {
+    rest_stream_upload(restc, mask, complete, rest_xml_payload_chunk, rxc);
+    if(!*complete) return NULL;
+    rxc->complete = 1;
   }
 
   *complete = 1;
   return rxc->indoc;
 }
 
+/* Uploads past upload_spill_size bytes go to an unlinked file in
+ * upload_spill_dir, so they're held in constant memory. */
+#define UPLOAD_DEFAULT_SPILL_SIZE (16 * 1024 * 1024)
+
+static size_t
+rest_upload_spill_size(mtev_http_rest_closure_t *restc) {
+  const char *val;
+  if(restc->ac && restc->ac->config &&
+     mtev_hash_retr_str(restc->ac->config, "upload_spill_size",
+                        strlen("upload_spill_size"), &val))
+    return strtoull(val, NULL, 10);
+  return UPLOAD_DEFAULT_SPILL_SIZE;
+}
+
 static void
 rest_raw_payload_free(void *f) {
-  free(f);
+  struct rest_raw_payload *rxc = f;
+  if(rxc->buffer) mtev_http_buffer_free(rxc->buffer, rxc->allocd);
+  free(rxc);
+}
+
+static int
+rest_raw_payload_chunk(mtev_http_rest_closure_t *restc,
+                       const void *data, size_t len, void *closure) {
+  struct rest_raw_payload *rxc = closure;
+  if(!data && !rxc->buffer) {
+    /* an empty body is still a body */
+    rxc->buffer = mtev_http_buffer_alloc(1, &rxc->allocd);
+    return rxc->buffer ? 0 : -1;
+  }
+  if(rxc->len + len > rxc->allocd) {
+    mtev_http_request *req = mtev_http_session_request(restc->http_ctx);
+    size_t want = MAX(rxc->len + len, rxc->allocd * 2);
+    char *b;
+    /* A declared length is allocated up front, but only so much of it
+     * is taken on the client's word; past that we double as it comes. */
+    if(!mtev_http_request_payload_chunked(req))
+      want = MAX(want, MIN((size_t)mtev_http_request_content_length(req),
+                           rxc->prealloc_max));
+    if(rxc->buffer) {
+      b = realloc(rxc->buffer, want);
+      if(b) rxc->allocd = want;
+    }
+    else {
+      b = mtev_http_buffer_alloc(want, &rxc->allocd);
+    }
+    if(!b) return -1;
+    rxc->buffer = b;
+  }
+  if(len) memcpy(rxc->buffer + rxc->len, data, len);
+  rxc->len += len;
+  return 0;
 }
 
 void *
 rest_get_raw_upload(mtev_http_rest_closure_t *restc,
                     int *mask, int *complete, int *size) {
   struct rest_raw_payload *rxc;
-  mtev_http_request *req = mtev_http_session_request(restc->http_ctx);
 
   *size = 0;
   if(restc->call_closure == NULL) {
-    restc->call_closure = calloc(1, sizeof(*rxc));
+    rxc = calloc(1, sizeof(*rxc));
+    rxc->prealloc_max = rest_upload_spill_size(restc);
+    restc->call_closure = rxc;
     restc->call_closure_free = rest_raw_payload_free;
   }
   rxc = restc->call_closure;
-  while(!rxc->complete) {
-    int len;
-    if(rxc->len == rxc->allocd) {
-      char *b;
-      rxc->allocd += 32768;
-      b = rxc->buffer ? realloc(rxc->buffer, rxc->allocd) :
-                        malloc(rxc->allocd);
-      if(!b) {
-        *complete = 1;
-        return NULL;
-      }
-      rxc->buffer = b;
-    }
-    len = mtev_http_session_req_consume(restc->http_ctx,
-                                        rxc->buffer + rxc->len,
-                                        rxc->allocd - rxc->len,
-                                        rxc->allocd - rxc->len,
-                                        mask);
-    if(len > 0) rxc->len += len;
-    if(len < 0 && errno == EAGAIN) return NULL;
-    else if(len < 0) {
-      *complete = 1;
+  if(!rxc->complete) {
+    if(!rest_stream_upload(restc, mask, complete,
+                           rest_raw_payload_chunk, rxc))
       return NULL;
+    if(!*complete) return NULL;
+    rxc->complete = 1;
+  }
+
+  *complete = 1;
+  *size = rxc->len;
+  return rxc->buffer;
+}
+
+static void
+rest_spill_payload_free(void *f) {
+  struct rest_spill_payload *rsp = f;
+  if(rsp->upload.data) mtev_http_buffer_free(rsp->upload.data, rsp->allocd);
+  if(rsp->upload.fd >= 0) close(rsp->upload.fd);
+  free(rsp);
+}
+
+static int
+rest_spill_write(int fd, const char *p, size_t len) {
+  while(len) {
+    ssize_t w = write(fd, p, len);
+    if(w < 0 && errno == EINTR) continue;
+    if(w < 0) {
+      mtevL(mtev_error, "upload spill failed: %s\n", strerror(errno));
+      return -1;
+    }
+    p += w;
+    len -= w;
+  }
+  return 0;
+}
+
+static int
+rest_spill_payload_chunk(mtev_http_rest_closure_t *restc,
+                         const void *data, size_t len, void *closure) {
+  struct rest_spill_payload *rsp = closure;
+
+  if(rsp->upload.fd < 0 && rsp->upload.size + len > rsp->spill_size) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/mtev_upload.XXXXXX", rsp->spill_dir);
+    rsp->upload.fd = mkstemp(path);
+    if(rsp->upload.fd < 0) {
+      mtevL(mtev_error, "upload spill to %s failed: %s\n",
+            path, strerror(errno));
+      return -1;
     }
-    if(rxc->len == mtev_http_request_content_length(req)) {
-      *size = rxc->len;
-      rxc->complete = 1;
+    unlink(path);
+    /* what we held so far goes first */
+    if(rsp->upload.data) {
+      if(rest_spill_write(rsp->upload.fd, rsp->upload.data,
+                          rsp->upload.size) != 0)
+        return -1;
+      mtev_http_buffer_free(rsp->upload.data, rsp->allocd);
+      rsp->upload.data = NULL;
+      rsp->allocd = 0;
     }
   }
+  if(rsp->upload.fd >= 0) {
+    if(rest_spill_write(rsp->upload.fd, data, len) != 0) return -1;
+    rsp->upload.size += len;
+    if(!data && lseek(rsp->upload.fd, 0, SEEK_SET) < 0) return -1;
+    return 0;
+  }
+  if(rsp->upload.size + len > rsp->allocd) {
+    mtev_http_request *req = mtev_http_session_request(restc->http_ctx);
+    size_t want = MAX(rsp->upload.size + len, rsp->allocd * 2);
+    void *b;
+    if(!mtev_http_request_payload_chunked(req))
+      want = MAX(want, (size_t)mtev_http_request_content_length(req));
+    want = MIN(want, rsp->spill_size);
+    if(rsp->upload.data) {
+      b = realloc(rsp->upload.data, want);
+      if(b) rsp->allocd = want;
+    }
+    else {
+      b = mtev_http_buffer_alloc(want, &rsp->allocd);
+    }
+    if(!b) return -1;
+    rsp->upload.data = b;
+  }
+  if(len) memcpy((char *)rsp->upload.data + rsp->upload.size, data, len);
+  rsp->upload.size += len;
+  return 0;
+}
+
+rest_upload_t *
+rest_get_upload(mtev_http_rest_closure_t *restc, int *mask, int *complete) {
+  struct rest_spill_payload *rsp;
+
+  if(restc->call_closure == NULL) {
+    const char *val;
+    rsp = calloc(1, sizeof(*rsp));
+    rsp->upload.fd = -1;
+    rsp->spill_size = rest_upload_spill_size(restc);
+    rsp->spill_dir = "/tmp";
+    if(restc->ac && restc->ac->config &&
+       mtev_hash_retr_str(restc->ac->config, "upload_spill_dir",
+                          strlen("upload_spill_dir"), &val))
+      rsp->spill_dir = val;
+    restc->call_closure = rsp;
+    restc->call_closure_free = rest_spill_payload_free;
+  }
+  rsp = restc->call_closure;
+  if(!rsp->complete) {
+    if(!rest_stream_upload(restc, mask, complete,
+                           rest_spill_payload_chunk, rsp))
+      return NULL;
+    if(!*complete) return NULL;
+    rsp->complete = 1;
+  }
 
   *complete = 1;
-  return rxc->buffer;
+  return &rsp->upload;
+}
+
+/* Static file cache.  Bodies (and their encoded variants) of files served
+ * by mtev_rest_simple_file_handler are kept in memory, per listener, keyed
+ * by the requested path.  A hit only resolves and stats the file when it
+ * hasn't been checked in file_cache_stat_interval ms.  Entries are evicted in LRU
+ * order once file_cache_size bytes are in use.
+ */
+#define FILE_CACHE_DEFAULT_SIZE (16 * 1024 * 1024)
+#define FILE_CACHE_DEFAULT_MAX_ENTRY (1024 * 1024)
+#define FILE_CACHE_DEFAULT_STAT_INTERVAL 1000
+#define FILE_CACHE_VARIANTS 4
+
+struct file_cache_variant {
+  u_int32_t option;
+  char *data;    /* NULL if encoding didn't make it smaller */
+  size_t len;
+  time_t mtime;  /* of the on-disk sibling it came from, or 0 */
+  char *sibling;
+};
+struct file_cache_entry {
+  char *key;
+  char *path;
+  const char *content_type;
+  dev_t dev;
+  ino_t ino;
+  time_t mtime;
+  size_t size;
+  char *data;
+  struct file_cache_variant variants[FILE_CACHE_VARIANTS];
+  int nvariants;
+  size_t memory;
+  u_int64_t checked;
+  int refcnt;
+  mtev_boolean cached;
+  struct file_cache_entry *prev, *next;
+};
+struct file_cache {
+  pthread_mutex_t lock;
+  mtev_hash_table entries;
+  struct file_cache_entry *head, *tail;
+  size_t memory;
+  size_t budget;
+  size_t max_entry;
+  u_int64_t stat_interval;
+  int level;
+  mtev_boolean level_set;
+};
+static struct {
+  const char *encoding;
+  const char *suffix;
+} file_cache_siblings[] = {
+  { "gzip", ".gz" },
+  { "zstd", ".zst" },
+  { NULL, NULL }
+};
+
+static pthread_mutex_t file_caches_lock = PTHREAD_MUTEX_INITIALIZER;
+static mtev_hash_table file_caches = MTEV_HASH_EMPTY;
+
+static u_int64_t
+file_cache_now_ms() {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return (u_int64_t)now.tv_sec * 1000 + now.tv_usec / 1000;
+}
+static struct file_cache *
+file_cache_get(mtev_hash_table *config) {
+  struct file_cache *cache;
+  mtev_hash_table **key;
+  void *vcache;
+  const char *val;
+
+  pthread_mutex_lock(&file_caches_lock);
+  if(mtev_hash_retrieve(&file_caches, (const char *)&config,
+                        sizeof(config), &vcache)) {
+    pthread_mutex_unlock(&file_caches_lock);
+    cache = vcache;
+    return cache->budget ? cache : NULL;
+  }
+  cache = calloc(1, sizeof(*cache));
+  pthread_mutex_init(&cache->lock, NULL);
+  mtev_hash_init(&cache->entries);
+  cache->budget = FILE_CACHE_DEFAULT_SIZE;
+  cache->max_entry = FILE_CACHE_DEFAULT_MAX_ENTRY;
+  cache->stat_interval = FILE_CACHE_DEFAULT_STAT_INTERVAL;
+  if(mtev_hash_retr_str(config, "file_cache_size",
+                        strlen("file_cache_size"), &val))
+    cache->budget = strtoull(val, NULL, 10);
+  if(mtev_hash_retr_str(config, "file_cache_max_entry",
+                        strlen("file_cache_max_entry"), &val))
+    cache->max_entry = strtoull(val, NULL, 10);
+  if(mtev_hash_retr_str(config, "file_cache_stat_interval",
+                        strlen("file_cache_stat_interval"), &val))
+    cache->stat_interval = strtoull(val, NULL, 10);
+  if(mtev_hash_retr_str(config, "compression_level",
+                        strlen("compression_level"), &val)) {
+    cache->level = atoi(val);
+    cache->level_set = mtev_true;
+  }
+  if(cache->max_entry > cache->budget) cache->max_entry = cache->budget;
+  key = malloc(sizeof(*key));
+  *key = config;
+  mtev_hash_store(&file_caches, (const char *)key, sizeof(*key), cache);
+  pthread_mutex_unlock(&file_caches_lock);
+  return cache->budget ? cache : NULL;
+}
+static void
+file_cache_entry_free(struct file_cache_entry *ent) {
+  int i;
+  for(i=0; i<ent->nvariants; i++) {
+    free(ent->variants[i].data);
+    free(ent->variants[i].sibling);
+  }
+  free(ent->data);
+  free(ent->path);
+  free(ent->key);
+  free(ent);
+}
+/* These two expect the cache lock held. */
+static void
+file_cache_unlink(struct file_cache *cache, struct file_cache_entry *ent) {
+  if(!ent->cached) return;
+  mtev_hash_delete(&cache->entries, ent->key, strlen(ent->key), NULL, NULL);
+  if(ent->prev) ent->prev->next = ent->next;
+  else cache->head = ent->next;
+  if(ent->next) ent->next->prev = ent->prev;
+  else cache->tail = ent->prev;
+  ent->prev = ent->next = NULL;
+  cache->memory -= ent->memory;
+  ent->cached = mtev_false;
+  if(ent->refcnt == 0) file_cache_entry_free(ent);
+}
+static void
+file_cache_evict(struct file_cache *cache) {
+  while(cache->memory > cache->budget && cache->tail)
+    file_cache_unlink(cache, cache->tail);
+}
+static void
+file_cache_release(struct file_cache *cache, struct file_cache_entry *ent) {
+  pthread_mutex_lock(&cache->lock);
+  if(--ent->refcnt == 0 && !ent->cached) file_cache_entry_free(ent);
+  pthread_mutex_unlock(&cache->lock);
+}
+static void
+file_cache_remove(struct file_cache *cache, struct file_cache_entry *ent) {
+  pthread_mutex_lock(&cache->lock);
+  file_cache_unlink(cache, ent);
+  pthread_mutex_unlock(&cache->lock);
+}
+static char *
+file_cache_read(const char *path, size_t size) {
+  char *buf;
+  size_t off = 0;
+  int fd, rv;
+  if((fd = open(path, O_RDONLY)) < 0) return NULL;
+  buf = malloc(size ? size : 1);
+  while(off < size) {
+    rv = read(fd, buf + off, size - off);
+    if(rv < 0 && errno == EINTR) continue;
+    if(rv <= 0) break;
+    off += rv;
+  }
+  close(fd);
+  if(off != size) {
+    free(buf);
+    return NULL;
+  }
+  return buf;
+}
+
+static mtev_boolean
+file_within_root(const char *rfile, const char *document_root, int drlen) {
+  if(strncmp(rfile, document_root, drlen)) return mtev_false;
+  if(rfile[drlen] != '/' && rfile[drlen + 1] != '/') return mtev_false;
+  return mtev_true;
+}
+/* Returns a referenced entry that is (recently enough) known to match the
+ * file on disk, or NULL.  Entries are keyed by the requested path, so the
+ * check resolves it again: a swapped symlink makes the entry stale.
+ */
+static struct file_cache_entry *
+file_cache_lookup(struct file_cache *cache, const char *key,
+                  const char *document_root) {
+  struct file_cache_entry *ent;
+  void *vent;
+  u_int64_t now = file_cache_now_ms();
+  mtev_boolean check = mtev_false;
+  char rfile[PATH_MAX];
+  struct stat st;
+  int i;
+
+  pthread_mutex_lock(&cache->lock);
+  if(!mtev_hash_retrieve(&cache->entries, key, strlen(key), &vent)) {
+    pthread_mutex_unlock(&cache->lock);
+    return NULL;
+  }
+  ent = vent;
+  ent->refcnt++;
+  if(now - ent->checked >= cache->stat_interval) {
+    ent->checked = now;
+    check = mtev_true;
+  }
+  if(ent != cache->head) {
+    ent->prev->next = ent->next;
+    if(ent->next) ent->next->prev = ent->prev;
+    else cache->tail = ent->prev;
+    ent->prev = NULL;
+    ent->next = cache->head;
+    cache->head->prev = ent;
+    cache->head = ent;
+  }
+  pthread_mutex_unlock(&cache->lock);
+
+  if(!check) return ent;
+  if(realpath(ent->key, rfile) == NULL || strcmp(rfile, ent->path) ||
+     !file_within_root(rfile, document_root, strlen(document_root)))
+    goto stale;
+  if(stat(ent->path, &st) != 0 || st.st_mtime != ent->mtime ||
+     st.st_ino != ent->ino || st.st_dev != ent->dev ||
+     (size_t)st.st_size != ent->size)
+    goto stale;
+  for(i=0; i<ent->nvariants; i++) {
+    if(!ent->variants[i].sibling) continue;
+    if(stat(ent->variants[i].sibling, &st) != 0 ||
+       st.st_mtime != ent->variants[i].mtime ||
+       (size_t)st.st_size != ent->variants[i].len)
+      goto stale;
+  }
+  return ent;
+
+ stale:
+  file_cache_remove(cache, ent);
+  file_cache_release(cache, ent);
+  return NULL;
+}
+static struct file_cache_entry *
+file_cache_load(struct file_cache *cache, const char *key, const char *path,
+                struct stat *st, const char *content_type) {
+  struct file_cache_entry *ent;
+  void *vent;
+
+  if(!S_ISREG(st->st_mode) || (size_t)st->st_size > cache->max_entry)
+    return NULL;
+  ent = calloc(1, sizeof(*ent));
+  ent->size = st->st_size;
+  if((ent->data = file_cache_read(path, ent->size)) == NULL) {
+    free(ent);
+    return NULL;
+  }
+  ent->key = strdup(key);
+  ent->path = strdup(path);
+  ent->content_type = content_type;
+  ent->dev = st->st_dev;
+  ent->ino = st->st_ino;
+  ent->mtime = st->st_mtime;
+  ent->memory = sizeof(*ent) + ent->size;
+  ent->checked = file_cache_now_ms();
+  ent->refcnt = 1;
+
+  pthread_mutex_lock(&cache->lock);
+  if(mtev_hash_retrieve(&cache->entries, key, strlen(key), &vent)) {
+    /* lost a race; replace what's there */
+    file_cache_unlink(cache, vent);
+  }
+  mtev_hash_store(&cache->entries, ent->key, strlen(ent->key), ent);
+  ent->cached = mtev_true;
+  ent->next = cache->head;
+  if(cache->head) cache->head->prev = ent;
+  cache->head = ent;
+  if(!cache->tail) cache->tail = ent;
+  cache->memory += ent->memory;
+  file_cache_evict(cache);
+  pthread_mutex_unlock(&cache->lock);
+  return ent;
+}
+/* Encode a whole body in one pass; NULL if it fails or doesn't help. */
+static char *
+file_cache_encode(struct file_cache *cache, mtev_http_encoder_t *enc,
+                  const char *in, size_t inlen, size_t *outlen) {
+  void *state;
+  char *out;
+  size_t allocd = enc->bound(inlen) + 64, len = 0, olen;
+  mtev_boolean done = mtev_false;
+  int rv = 0;
+
+  state = enc->create(cache->level_set ? cache->level : enc->default_level);
+  if(!state) return NULL;
+  out = malloc(allocd);
+  olen = allocd;
+  rv = enc->encode(state, in, inlen, out, &olen, mtev_true, &done);
+  len = olen;
+  while(rv == 0 && !done && len < inlen) {
+    olen = allocd - len;
+    rv = enc->encode(state, "", 0, out + len, &olen, mtev_true, &done);
+    len += olen;
+    if(olen == 0) break;
+  }
+  enc->destroy(state);
+  if(rv != 0 || !done || len >= inlen) {
+    free(out);
+    return NULL;
+  }
+  *outlen = len;
+  return out;
+}
+/* The entry's body encoded as opt, from an on-disk sibling if there is a
+ * fresh one, otherwise encoded here once.  NULL means send the identity.
+ */
+static struct file_cache_variant *
+file_cache_variant(struct file_cache *cache, struct file_cache_entry *ent,
+                   u_int32_t opt) {
+  struct file_cache_variant v, *found = NULL;
+  mtev_http_encoder_t *enc;
+  struct stat st;
+  int i;
+
+  pthread_mutex_lock(&cache->lock);
+  for(i=0; i<ent->nvariants; i++)
+    if(ent->variants[i].option == opt) found = &ent->variants[i];
+  pthread_mutex_unlock(&cache->lock);
+  if(found) return found->data ? found : NULL;
+
+  if((enc = mtev_http_encoder_by_option(opt)) == NULL) return NULL;
+  memset(&v, 0, sizeof(v));
+  v.option = opt;
+  for(i=0; file_cache_siblings[i].encoding; i++) {
+    char sibling[PATH_MAX];
+    if(strcmp(file_cache_siblings[i].encoding, enc->name)) continue;
+    snprintf(sibling, sizeof(sibling), "%s%s",
+             ent->path, file_cache_siblings[i].suffix);
+    if(stat(sibling, &st) == 0 && S_ISREG(st.st_mode) &&
+       st.st_mtime >= ent->mtime &&
+       (size_t)st.st_size <= cache->max_entry &&
+       (v.data = file_cache_read(sibling, st.st_size)) != NULL) {
+      v.len = st.st_size;
+      v.mtime = st.st_mtime;
+      v.sibling = strdup(sibling);
+    }
+    break;
+  }
+  if(!v.data) v.data = file_cache_encode(cache, enc, ent->data, ent->size,
+                                         &v.len);
+
+  pthread_mutex_lock(&cache->lock);
+  for(i=0; i<ent->nvariants; i++)
+    if(ent->variants[i].option == opt) found = &ent->variants[i];
+  if(!found && ent->nvariants < FILE_CACHE_VARIANTS) {
+    found = &ent->variants[ent->nvariants];
+    *found = v;
+    /* nvariants is only advanced once the slot is filled in */
+    ent->nvariants++;
+    ent->memory += v.len;
+    if(ent->cached) {
+      cache->memory += v.len;
+      file_cache_evict(cache);
+    }
+    v.data = v.sibling = NULL;
+  }
+  pthread_mutex_unlock(&cache->lock);
+  /* if someone beat us to it, or there's no room, this was for nothing */
+  free(v.data);
+  free(v.sibling);
+  return (found && found->data) ? found : NULL;
+}
+/* Conditional and partial GETs.  The validators are an ETag built from the
+ * inode, size and mtime, and Last-Modified.  The ETag is weak when the
+ * body goes out encoded.  If-Modified-Since and a dated If-Range must
+ * match Last-Modified exactly, as we would have sent it.  That is what
+ * clients echo back, and it spares us parsing three date formats.
+ */
+#define MAX_FILE_RANGES 16
+
+struct file_range {
+  size_t start;
+  size_t len;
+};
+
+static const char *
+file_request_header(mtev_http_session_ctx *ctx, const char *name) {
+  mtev_hash_table *headers;
+  const char *val;
+  headers = mtev_http_request_headers_table(mtev_http_session_request(ctx));
+  if(headers && mtev_hash_retr_str(headers, name, strlen(name), &val))
+    return val;
+  return NULL;
+}
+/* Does an If-None-Match list match (weakly) our tag? */
+static mtev_boolean
+file_etag_listed(const char *list, const char *etag) {
+  const char *cp = list, *tok, *end;
+  size_t elen = strlen(etag);
+  while(*cp) {
+    while(*cp == ' ' || *cp == '\t' || *cp == ',') cp++;
+    if(*cp == '*') return mtev_true;
+    if(!strncmp(cp, "W/", 2)) cp += 2;
+    tok = cp;
+    while(*cp && *cp != ',') cp++;
+    end = cp;
+    while(end > tok && (end[-1] == ' ' || end[-1] == '\t')) end--;
+    if((size_t)(end - tok) == elen && !memcmp(tok, etag, elen))
+      return mtev_true;
+  }
+  return mtev_false;
+}
+static mtev_boolean
+file_not_modified(mtev_http_session_ctx *ctx, const char *etag,
+                  const char *lastmod) {
+  const char *val;
+  if((val = file_request_header(ctx, "if-none-match")) != NULL)
+    return file_etag_listed(val, etag);
+  if((val = file_request_header(ctx, "if-modified-since")) != NULL)
+    return !strcmp(val, lastmod);
+  return mtev_false;
+}
+/* Returns the number of ranges; 0 means send it all, -1 that none of what
+ * was asked for exists.
+ */
+static int
+file_ranges(mtev_http_session_ctx *ctx, const char *etag,
+            const char *lastmod, size_t size, struct file_range *ranges) {
+  const char *val, *cp;
+  char *end;
+  int n = 0;
+
+  if((val = file_request_header(ctx, "range")) == NULL) return 0;
+  if(strncasecmp(val, "bytes=", 6)) return 0;
+  if((cp = file_request_header(ctx, "if-range")) != NULL) {
+    /* only a strong match will do */
+    if(*cp == '"' ? strcmp(cp, etag) : strcmp(cp, lastmod)) return 0;
+  }
+  cp = val + 6;
+  while(*cp) {
+    unsigned long long first, last;
+    while(*cp == ' ' || *cp == '\t' || *cp == ',') cp++;
+    if(!*cp) break;
+    if(*cp == '-') {
+      /* the last N bytes */
+      last = strtoull(cp + 1, &end, 10);
+      if(end == cp + 1) return 0;
+      if(last == 0) goto next;
+      if(last > size) last = size;
+      first = size - last;
+      last = size - 1;
+    }
+    else {
+      first = strtoull(cp, &end, 10);
+      if(end == cp || *end != '-') return 0;
+      cp = end + 1;
+      last = strtoull(cp, &end, 10);
+      if(end == cp) last = size - 1;
+      else if(last < first) return 0;
+      if(first >= size) goto next;
+      if(last >= size) last = size - 1;
+    }
+    /* this many pieces isn't worth serving piecemeal */
+    if(n == MAX_FILE_RANGES) return 0;
+    ranges[n].start = first;
+    ranges[n].len = last - first + 1;
+    n++;
+   next:
+    cp = end;
+    while(*cp == ' ' || *cp == '\t') cp++;
+    if(*cp && *cp != ',') return 0;
+  }
+  return n ? n : -1;
+}
+static void
+file_append_range(mtev_http_session_ctx *ctx, struct file_cache_entry *ent,
+                  int fd, size_t start, size_t len) {
+  int rfd;
+  if(ent) {
+    mtev_http_response_append(ctx, ent->data + start, len);
+    return;
+  }
+  /* each piece owns its descriptor */
+  if((rfd = dup(fd)) < 0) return;
+  if(!mtev_http_response_append_sendfile(ctx, rfd, len, start)) close(rfd);
+}
+static void
+file_serve_ranges(mtev_http_session_ctx *ctx, const char *content_type,
+                  size_t size, struct file_range *ranges, int n,
+                  struct file_cache_entry *ent, int fd) {
+  char hdr[512], boundary[20];
+  int i, len;
+
+  if(n == 1) {
+    mtev_http_response_standard(ctx, 206, "PARTIAL CONTENT", content_type);
+    mtev_http_response_encoding_preset(ctx, 0);
+    snprintf(hdr, sizeof(hdr), "bytes %zu-%zu/%zu", ranges[0].start,
+             ranges[0].start + ranges[0].len - 1, size);
+    mtev_http_response_header_set(ctx, "Content-Range", hdr);
+    file_append_range(ctx, ent, fd, ranges[0].start, ranges[0].len);
+    return;
+  }
+  snprintf(boundary, sizeof(boundary), "%08lx%08lx",
+           (unsigned long)random(), (unsigned long)random());
+  snprintf(hdr, sizeof(hdr), "multipart/byteranges; boundary=%s", boundary);
+  mtev_http_response_standard(ctx, 206, "PARTIAL CONTENT", hdr);
+  mtev_http_response_encoding_preset(ctx, 0);
+  for(i=0; i<n; i++) {
+    len = snprintf(hdr, sizeof(hdr),
+                   "\r\n--%s\r\nContent-Type: %s\r\n"
+                   "Content-Range: bytes %zu-%zu/%zu\r\n\r\n",
+                   boundary, content_type, ranges[i].start,
+                   ranges[i].start + ranges[i].len - 1, size);
+    if(len >= (int)sizeof(hdr)) len = sizeof(hdr) - 1;
+    mtev_http_response_append(ctx, hdr, len);
+    file_append_range(ctx, ent, fd, ranges[i].start, ranges[i].len);
+  }
+  len = snprintf(hdr, sizeof(hdr), "\r\n--%s--\r\n", boundary);
+  mtev_http_response_append(ctx, hdr, len);
+}
+/* Serve a file from the cache entry if there is one (it is released),
+ * otherwise from fd (which is closed).
+ */
+static void
+file_serve(mtev_http_session_ctx *ctx, const char *content_type,
+           ino_t ino, size_t size, time_t mtime,
+           struct file_cache *cache, struct file_cache_entry *ent, int fd) {
+  struct file_range ranges[MAX_FILE_RANGES];
+  char etag[80], lastmod[64];
+  mtev_boolean encoded = mtev_false;
+  struct tm tm;
+  int n;
+
+  snprintf(etag, sizeof(etag), "\"%llx-%llx-%llx\"",
+           (unsigned long long)ino, (unsigned long long)size,
+           (unsigned long long)mtime);
+  strftime(lastmod, sizeof(lastmod), "%a, %d %b %Y %H:%M:%S GMT",
+           gmtime_r(&mtime, &tm));
+
+  if(file_not_modified(ctx, etag, lastmod)) {
+    /* no body, so no framing, and the connection can stay up */
+    mtev_http_response_status_set(ctx, 304, "NOT MODIFIED");
+    goto validators;
+  }
+  n = size ? file_ranges(ctx, etag, lastmod, size, ranges) : 0;
+  if(n < 0) {
+    char crange[64];
+    snprintf(crange, sizeof(crange), "bytes */%zu", size);
+    mtev_http_response_standard(ctx, 416, "RANGE NOT SATISFIABLE",
+                                "text/html");
+    mtev_http_response_encoding_preset(ctx, 0);
+    mtev_http_response_header_set(ctx, "Content-Range", crange);
+    goto done;
+  }
+  if(n > 0) {
+    file_serve_ranges(ctx, content_type, size, ranges, n, ent, fd);
+    goto validators;
+  }
+
+  mtev_http_response_ok(ctx, content_type);
+  if(ent) {
+    struct file_cache_variant *v = NULL;
+    u_int32_t opt;
+    opt = mtev_http_response_options(mtev_http_session_response(ctx)) &
+          MTEV_HTTP_ENCODINGS;
+    if(opt) v = file_cache_variant(cache, ent, opt);
+    if(v && mtev_http_response_encoding_preset(ctx, opt)) {
+      mtev_http_response_append(ctx, v->data, v->len);
+      encoded = mtev_true;
+    }
+    else {
+      mtev_http_response_encoding_preset(ctx, 0);
+      if(ent->size) mtev_http_response_append(ctx, ent->data, ent->size);
+    }
+  }
+  else if(size > 0) {
+    if(mtev_http_response_options(mtev_http_session_response(ctx)) &
+       MTEV_HTTP_ENCODINGS) {
+      /* The encoder needs the bytes themselves */
+      void *contents = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+      if(contents != MAP_FAILED) {
+        mtev_http_response_append(ctx, contents, size);
+        munmap(contents, size);
+      }
+      encoded = mtev_true;
+    }
+    else if(mtev_http_response_append_sendfile(ctx, fd, size, 0)) {
+      fd = -1;
+    }
+  }
+  if(encoded) {
+    /* same content, but not byte-for-byte what a range would index */
+    memmove(etag + 2, etag, strlen(etag) + 1);
+    memcpy(etag, "W/", 2);
+  }
+
+ validators:
+  mtev_http_response_header_set(ctx, "ETag", etag);
+  mtev_http_response_header_set(ctx, "Last-Modified", lastmod);
+  mtev_http_response_header_set(ctx, "Accept-Ranges", "bytes");
+ done:
+  mtev_http_response_end(ctx);
+  if(ent) file_cache_release(cache, ent);
+  if(fd >= 0) close(fd);
 }
 
 int
@@ -485,9 +1606,10 @@ mtev_rest_simple_file_handler(mtev_http_rest_closure_t *restc,
   const char *index_file = NULL;
   mtev_http_session_ctx *ctx = restc->http_ctx;
   char file[PATH_MAX], rfile[PATH_MAX];
+  struct file_cache *cache;
+  struct file_cache_entry *ent;
   struct stat st;
-  int fd;
-  void *contents = MAP_FAILED;
+  int fd = -1;
   const char *dot = NULL, *slash;
   const char *content_type = "application/octet-stream";
 
@@ -508,11 +1630,17 @@ mtev_rest_simple_file_handler(mtev_http_rest_closure_t *restc,
     snprintf(file + strlen(file), sizeof(file) - strlen(file),
              "%s", index_file);
   }
+  cache = file_cache_get(restc->ac->config);
+  if(cache &&
+     (ent = file_cache_lookup(cache, file, document_root)) != NULL) {
+    file_serve(ctx, ent->content_type, ent->ino, ent->size, ent->mtime,
+               cache, ent, -1);
+    return 0;
+  }
   /* resolve */
   if(realpath(file, rfile) == NULL) goto not_found;
   /* restrict */
-  if(strncmp(rfile, document_root, drlen)) goto denied;
-  if(rfile[drlen] != '/' && rfile[drlen + 1] != '/') goto denied;
+  if(!file_within_root(rfile, document_root, drlen)) goto denied;
   /* stat */
   /* coverity[fs_check_call] */
   if(stat(rfile, &st) != 0) {
@@ -521,15 +1649,6 @@ mtev_rest_simple_file_handler(mtev_http_rest_closure_t *restc,
       default: goto not_found;
     }
   }
-  /* open */
-  if(st.st_size > 0) {
-    /* coverity[toctou] */
-    fd = open(rfile, O_RDONLY);
-    if(fd < 0) goto not_found;
-    contents = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
-    close(fd);
-    if(contents == MAP_FAILED) goto not_found;
-  }
   /* set content type */
   slash = strchr(rfile, '/');
   while(slash) {
@@ -558,13 +1677,21 @@ mtev_rest_simple_file_handler(mtev_http_rest_closure_t *restc,
       }
     }
   }
-  
-  mtev_http_response_ok(ctx, content_type);
+
+  if(cache &&
+     (ent = file_cache_load(cache, file, rfile, &st, content_type)) != NULL) {
+    file_serve(ctx, content_type, st.st_ino, st.st_size, st.st_mtime,
+               cache, ent, -1);
+    return 0;
+  }
+  /* open */
   if(st.st_size > 0) {
-    mtev_http_response_append(ctx, contents, st.st_size);
-    munmap(contents, st.st_size);
+    /* coverity[toctou] */
+    fd = open(rfile, O_RDONLY);
+    if(fd < 0) goto not_found;
   }
-  mtev_http_response_end(ctx);
+  file_serve(ctx, content_type, st.st_ino, st.st_size, st.st_mtime,
+             NULL, NULL, fd);
   return 0;
 
  denied:
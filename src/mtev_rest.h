@@ -51,6 +51,28 @@ typedef int (*rest_request_handler)(mtev_http_rest_closure_t *,
                                     int npats, char **pats);
 typedef mtev_boolean (*rest_authorize_func_t)(mtev_http_rest_closure_t *,
                                               int npats, char **pats);
+
+/* How a route fares when the listener is over its admission limits
+ * (max_inflight, queue_delay_target): critical routes are never shed,
+ * bulk ones are shed at half the limits.
+ */
+typedef enum {
+  MTEV_REST_PRIORITY_CRITICAL,
+  MTEV_REST_PRIORITY_NORMAL,
+  MTEV_REST_PRIORITY_BULK
+} mtev_rest_priority_t;
+
+struct rest_url_dispatcher;
+struct rest_admission;
+
+/* A capture from the route's expression, as a span of the (decoded)
+ * request URI; like params, it lives as long as the request.
+ */
+typedef struct {
+  const char *ptr;
+  size_t len;
+} mtev_http_rest_param_t;
+
 struct mtev_http_rest_closure {
   mtev_http_session_ctx *http_ctx;
   acceptor_closure_t *ac;
@@ -58,9 +80,12 @@ struct mtev_http_rest_closure {
   rest_request_handler fastpath;
   int nparams;
   char **params;
+  mtev_http_rest_param_t *param_views;
   int wants_shutdown;
   void *call_closure;
   void (*call_closure_free)(void *);
+  struct rest_url_dispatcher *admitted;
+  const struct rest_admission *admission; /* the listener's limits */
 };
 
 API_EXPORT(void) mtev_http_rest_init();
@@ -81,6 +106,41 @@ API_EXPORT(int)
                                const char *expression, rest_request_handler f,
                                rest_authorize_func_t auth);
 
+API_EXPORT(int)
+  mtev_http_rest_set_priority(const char *method, const char *base,
+                              const char *expression,
+                              mtev_rest_priority_t priority);
+
+typedef struct {
+  const char *method;
+  const char *base;
+  const char *expression;
+  mtev_rest_priority_t priority;
+  int64_t inflight;
+  int64_t admitted;
+  int64_t rejected;
+  uint32_t queue_delay_us; /* moving average, request ready to dispatch */
+} mtev_http_rest_endpoint_stats_t;
+
+API_EXPORT(void)
+  mtev_http_rest_foreach_endpoint(
+    void (*f)(const mtev_http_rest_endpoint_stats_t *, void *),
+    void *closure);
+
+/* Called with each piece of the request body as it arrives (valid only
+ * for the call), then once with NULL/0 at its end.  Non-zero stops the
+ * upload.
+ */
+typedef int (*rest_upload_func)(mtev_http_rest_closure_t *,
+                                const void *data, size_t len, void *closure);
+
+/* Like the rest_get_*_upload calls, return the handler's mask until
+ * *complete is set; false if the body couldn't be read or f refused it.
+ */
+API_EXPORT(mtev_boolean)
+  rest_stream_upload(mtev_http_rest_closure_t *restc, int *mask,
+                     int *complete, rest_upload_func f, void *closure);
+
 API_EXPORT(xmlDocPtr)
   rest_get_xml_upload(mtev_http_rest_closure_t *restc,
                       int *mask, int *complete);
@@ -89,6 +149,19 @@ API_EXPORT(void *)
   rest_get_raw_upload(mtev_http_rest_closure_t *restc,
                       int *mask, int *complete, int *size);
 
+/* The whole body, in memory (data) or, once it passes the listener's
+ * upload_spill_size, in an unlinked file under upload_spill_dir (fd,
+ * positioned at the start).  Both belong to the request.
+ */
+typedef struct {
+  void *data;
+  int fd;
+  size_t size;
+} rest_upload_t;
+
+API_EXPORT(rest_upload_t *)
+  rest_get_upload(mtev_http_rest_closure_t *restc, int *mask, int *complete);
+
 API_EXPORT(int)
   mtev_rest_simple_file_handler(mtev_http_rest_closure_t *restc,
                                 int npats, char **pats);
@@ -1827,6 +1827,8 @@ void mtev_reverse_socket_init(const char *prefix, const char **cn_prefixes) {
     "GET", "/reverse/", "^show$", rest_show_reverse,
              mtev_http_rest_client_cert_auth
   ) == 0);
+  assert(mtev_http_rest_set_priority("GET", "/reverse/", "^show$",
+                                     MTEV_REST_PRIORITY_CRITICAL) == 0);
 
   register_console_reverse_commands();
 }
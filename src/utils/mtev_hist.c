@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2014-2015, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *    * Neither the name Circonus, Inc. nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "mtev_defines.h"
+#include "mtev_hist.h"
+
+#include <string.h>
+
+static inline int
+mtev_hist_msb(uint64_t v) {
+#if defined(__GNUC__)
+  return 63 - __builtin_clzll(v);
+#else
+  int b = 0;
+  while(v >>= 1) b++;
+  return b;
+#endif
+}
+
+int
+mtev_hist_bucket_idx(uint64_t value) {
+  int exp;
+  if(value < MTEV_HIST_SUB_BUCKETS) return (int)value;
+  exp = mtev_hist_msb(value);
+  if(exp > MTEV_HIST_MAX_EXP) return MTEV_HIST_NBUCKETS - 1;
+  return MTEV_HIST_SUB_BUCKETS +
+         (exp - MTEV_HIST_SUB_BITS) * MTEV_HIST_SUB_BUCKETS +
+         (int)((value >> (exp - MTEV_HIST_SUB_BITS)) &
+               (MTEV_HIST_SUB_BUCKETS - 1));
+}
+
+uint64_t
+mtev_hist_bucket_lower(int idx) {
+  int shift, sub;
+  if(idx < MTEV_HIST_SUB_BUCKETS) return (uint64_t)idx;
+  shift = (idx - MTEV_HIST_SUB_BUCKETS) / MTEV_HIST_SUB_BUCKETS;
+  sub = (idx - MTEV_HIST_SUB_BUCKETS) % MTEV_HIST_SUB_BUCKETS;
+  return ((uint64_t)(MTEV_HIST_SUB_BUCKETS + sub)) << shift;
+}
+
+uint64_t
+mtev_hist_bucket_width(int idx) {
+  if(idx < MTEV_HIST_SUB_BUCKETS) return 1;
+  return 1ULL << ((idx - MTEV_HIST_SUB_BUCKETS) / MTEV_HIST_SUB_BUCKETS);
+}
+
+void
+mtev_hist_clear(mtev_hist_t *h) {
+  memset(h, 0, sizeof(*h));
+}
+
+void
+mtev_hist_record(mtev_hist_t *h, uint64_t value) {
+  h->buckets[mtev_hist_bucket_idx(value)]++;
+  h->sum += value;
+  if(value > h->max) h->max = value;
+  h->count++;
+}
+
+void
+mtev_hist_merge(mtev_hist_t *tgt, const mtev_hist_t *src) {
+  int i;
+  uint64_t cnt = 0;
+  /* src may be concurrently recorded into; derive the count from the
+   * buckets we actually read so quantiles stay self-consistent. */
+  for(i=0; i<MTEV_HIST_NBUCKETS; i++) {
+    uint64_t b = src->buckets[i];
+    tgt->buckets[i] += b;
+    cnt += b;
+  }
+  tgt->count += cnt;
+  tgt->sum += src->sum;
+  if(src->max > tgt->max) tgt->max = src->max;
+}
+
+uint64_t
+mtev_hist_quantile(const mtev_hist_t *h, double q) {
+  int i;
+  uint64_t rank, seen = 0, v;
+  if(h->count == 0) return 0;
+  if(q <= 0.0) q = 0.0;
+  if(q >= 1.0) return h->max;
+  rank = (uint64_t)(q * (double)h->count) + 1;
+  if(rank > h->count) rank = h->count;
+  for(i=0; i<MTEV_HIST_NBUCKETS; i++) {
+    seen += h->buckets[i];
+    if(seen >= rank) {
+      v = mtev_hist_bucket_lower(i) + mtev_hist_bucket_width(i) / 2;
+      return (v > h->max) ? h->max : v;
+    }
+  }
+  return h->max;
+}
+
+double
+mtev_hist_mean(const mtev_hist_t *h) {
+  if(h->count == 0) return 0.0;
+  return (double)h->sum / (double)h->count;
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2014-2015, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *    * Neither the name Circonus, Inc. nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _UTILS_MTEV_HIST_H
+#define _UTILS_MTEV_HIST_H
+
+#include "mtev_defines.h"
+#include <stdint.h>
+
+/* A log-linear histogram (in the spirit of HDR histograms).  Values below
+ * MTEV_HIST_SUB_BUCKETS are recorded exactly; above that, each power of two
+ * is split into MTEV_HIST_SUB_BUCKETS linear bins, so any recorded value is
+ * reported within ~6% of its true value.  Values at or beyond
+ * 2^(MTEV_HIST_MAX_EXP+1) land in the last bin (max is tracked exactly).
+ *
+ * Recording is single-writer and lock-free: callers wanting concurrent
+ * recording should keep one histogram per thread and merge them on read.
+ */
+#define MTEV_HIST_SUB_BITS 4
+#define MTEV_HIST_SUB_BUCKETS (1 << MTEV_HIST_SUB_BITS)
+#define MTEV_HIST_MAX_EXP 47
+#define MTEV_HIST_NBUCKETS \
+  (MTEV_HIST_SUB_BUCKETS * (MTEV_HIST_MAX_EXP - MTEV_HIST_SUB_BITS + 2))
+
+typedef struct {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+  uint64_t buckets[MTEV_HIST_NBUCKETS];
+} mtev_hist_t;
+
+API_EXPORT(void) mtev_hist_clear(mtev_hist_t *);
+API_EXPORT(void) mtev_hist_record(mtev_hist_t *, uint64_t value);
+API_EXPORT(void) mtev_hist_merge(mtev_hist_t *tgt, const mtev_hist_t *src);
+/* q in [0,1]; returns the midpoint of the bin holding that quantile
+ * (clamped to the observed max), or 0 for an empty histogram. */
+API_EXPORT(uint64_t) mtev_hist_quantile(const mtev_hist_t *, double q);
+API_EXPORT(double) mtev_hist_mean(const mtev_hist_t *);
+
+API_EXPORT(int) mtev_hist_bucket_idx(uint64_t value);
+API_EXPORT(uint64_t) mtev_hist_bucket_lower(int idx);
+API_EXPORT(uint64_t) mtev_hist_bucket_width(int idx);
+
+#endif
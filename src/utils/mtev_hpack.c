@@ -0,0 +1,489 @@
+/*
+ * Copyright (c) 2014-2015, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *    * Neither the name Circonus, Inc. nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "mtev_defines.h"
+#include "mtev_hpack.h"
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <pthread.h>
+
+#define HPACK_STATIC_ENTRIES 61
+#define HPACK_ENTRY_OVERHEAD 32
+#define HPACK_MAX_INT (1 << 28) /* nothing legitimate comes close */
+
+struct hpack_static_entry {
+  const char *name;
+  const char *value;
+  size_t nlen;
+  size_t vlen;
+};
+
+static const struct hpack_static_entry hpack_static[HPACK_STATIC_ENTRIES] = {
+  { ":authority", "", 10, 0 },
+  { ":method", "GET", 7, 3 },
+  { ":method", "POST", 7, 4 },
+  { ":path", "/", 5, 1 },
+  { ":path", "/index.html", 5, 11 },
+  { ":scheme", "http", 7, 4 },
+  { ":scheme", "https", 7, 5 },
+  { ":status", "200", 7, 3 },
+  { ":status", "204", 7, 3 },
+  { ":status", "206", 7, 3 },
+  { ":status", "304", 7, 3 },
+  { ":status", "400", 7, 3 },
+  { ":status", "404", 7, 3 },
+  { ":status", "500", 7, 3 },
+  { "accept-charset", "", 14, 0 },
+  { "accept-encoding", "gzip, deflate", 15, 13 },
+  { "accept-language", "", 15, 0 },
+  { "accept-ranges", "", 13, 0 },
+  { "accept", "", 6, 0 },
+  { "access-control-allow-origin", "", 27, 0 },
+  { "age", "", 3, 0 },
+  { "allow", "", 5, 0 },
+  { "authorization", "", 13, 0 },
+  { "cache-control", "", 13, 0 },
+  { "content-disposition", "", 19, 0 },
+  { "content-encoding", "", 16, 0 },
+  { "content-language", "", 16, 0 },
+  { "content-length", "", 14, 0 },
+  { "content-location", "", 16, 0 },
+  { "content-range", "", 13, 0 },
+  { "content-type", "", 12, 0 },
+  { "cookie", "", 6, 0 },
+  { "date", "", 4, 0 },
+  { "etag", "", 4, 0 },
+  { "expect", "", 6, 0 },
+  { "expires", "", 7, 0 },
+  { "from", "", 4, 0 },
+  { "host", "", 4, 0 },
+  { "if-match", "", 8, 0 },
+  { "if-modified-since", "", 17, 0 },
+  { "if-none-match", "", 13, 0 },
+  { "if-range", "", 8, 0 },
+  { "if-unmodified-since", "", 19, 0 },
+  { "last-modified", "", 13, 0 },
+  { "link", "", 4, 0 },
+  { "location", "", 8, 0 },
+  { "max-forwards", "", 12, 0 },
+  { "proxy-authenticate", "", 18, 0 },
+  { "proxy-authorization", "", 19, 0 },
+  { "range", "", 5, 0 },
+  { "referer", "", 7, 0 },
+  { "refresh", "", 7, 0 },
+  { "retry-after", "", 11, 0 },
+  { "server", "", 6, 0 },
+  { "set-cookie", "", 10, 0 },
+  { "strict-transport-security", "", 25, 0 },
+  { "transfer-encoding", "", 17, 0 },
+  { "user-agent", "", 10, 0 },
+  { "vary", "", 4, 0 },
+  { "via", "", 3, 0 },
+  { "www-authenticate", "", 16, 0 },
+};
+
+/* Appendix B; EOS (256) is 30 ones, which only ever appears as padding */
+static const uint32_t hpack_huff_code[256] = {
+  0x00001ff8, 0x007fffd8, 0x0fffffe2, 0x0fffffe3, 0x0fffffe4, 0x0fffffe5,
+  0x0fffffe6, 0x0fffffe7, 0x0fffffe8, 0x00ffffea, 0x3ffffffc, 0x0fffffe9,
+  0x0fffffea, 0x3ffffffd, 0x0fffffeb, 0x0fffffec, 0x0fffffed, 0x0fffffee,
+  0x0fffffef, 0x0ffffff0, 0x0ffffff1, 0x0ffffff2, 0x3ffffffe, 0x0ffffff3,
+  0x0ffffff4, 0x0ffffff5, 0x0ffffff6, 0x0ffffff7, 0x0ffffff8, 0x0ffffff9,
+  0x0ffffffa, 0x0ffffffb, 0x00000014, 0x000003f8, 0x000003f9, 0x00000ffa,
+  0x00001ff9, 0x00000015, 0x000000f8, 0x000007fa, 0x000003fa, 0x000003fb,
+  0x000000f9, 0x000007fb, 0x000000fa, 0x00000016, 0x00000017, 0x00000018,
+  0x00000000, 0x00000001, 0x00000002, 0x00000019, 0x0000001a, 0x0000001b,
+  0x0000001c, 0x0000001d, 0x0000001e, 0x0000001f, 0x0000005c, 0x000000fb,
+  0x00007ffc, 0x00000020, 0x00000ffb, 0x000003fc, 0x00001ffa, 0x00000021,
+  0x0000005d, 0x0000005e, 0x0000005f, 0x00000060, 0x00000061, 0x00000062,
+  0x00000063, 0x00000064, 0x00000065, 0x00000066, 0x00000067, 0x00000068,
+  0x00000069, 0x0000006a, 0x0000006b, 0x0000006c, 0x0000006d, 0x0000006e,
+  0x0000006f, 0x00000070, 0x00000071, 0x00000072, 0x000000fc, 0x00000073,
+  0x000000fd, 0x00001ffb, 0x0007fff0, 0x00001ffc, 0x00003ffc, 0x00000022,
+  0x00007ffd, 0x00000003, 0x00000023, 0x00000004, 0x00000024, 0x00000005,
+  0x00000025, 0x00000026, 0x00000027, 0x00000006, 0x00000074, 0x00000075,
+  0x00000028, 0x00000029, 0x0000002a, 0x00000007, 0x0000002b, 0x00000076,
+  0x0000002c, 0x00000008, 0x00000009, 0x0000002d, 0x00000077, 0x00000078,
+  0x00000079, 0x0000007a, 0x0000007b, 0x00007ffe, 0x000007fc, 0x00003ffd,
+  0x00001ffd, 0x0ffffffc, 0x000fffe6, 0x003fffd2, 0x000fffe7, 0x000fffe8,
+  0x003fffd3, 0x003fffd4, 0x003fffd5, 0x007fffd9, 0x003fffd6, 0x007fffda,
+  0x007fffdb, 0x007fffdc, 0x007fffdd, 0x007fffde, 0x00ffffeb, 0x007fffdf,
+  0x00ffffec, 0x00ffffed, 0x003fffd7, 0x007fffe0, 0x00ffffee, 0x007fffe1,
+  0x007fffe2, 0x007fffe3, 0x007fffe4, 0x001fffdc, 0x003fffd8, 0x007fffe5,
+  0x003fffd9, 0x007fffe6, 0x007fffe7, 0x00ffffef, 0x003fffda, 0x001fffdd,
+  0x000fffe9, 0x003fffdb, 0x003fffdc, 0x007fffe8, 0x007fffe9, 0x001fffde,
+  0x007fffea, 0x003fffdd, 0x003fffde, 0x00fffff0, 0x001fffdf, 0x003fffdf,
+  0x007fffeb, 0x007fffec, 0x001fffe0, 0x001fffe1, 0x003fffe0, 0x001fffe2,
+  0x007fffed, 0x003fffe1, 0x007fffee, 0x007fffef, 0x000fffea, 0x003fffe2,
+  0x003fffe3, 0x003fffe4, 0x007ffff0, 0x003fffe5, 0x003fffe6, 0x007ffff1,
+  0x03ffffe0, 0x03ffffe1, 0x000fffeb, 0x0007fff1, 0x003fffe7, 0x007ffff2,
+  0x003fffe8, 0x01ffffec, 0x03ffffe2, 0x03ffffe3, 0x03ffffe4, 0x07ffffde,
+  0x07ffffdf, 0x03ffffe5, 0x00fffff1, 0x01ffffed, 0x0007fff2, 0x001fffe3,
+  0x03ffffe6, 0x07ffffe0, 0x07ffffe1, 0x03ffffe7, 0x07ffffe2, 0x00fffff2,
+  0x001fffe4, 0x001fffe5, 0x03ffffe8, 0x03ffffe9, 0x0ffffffd, 0x07ffffe3,
+  0x07ffffe4, 0x07ffffe5, 0x000fffec, 0x00fffff3, 0x000fffed, 0x001fffe6,
+  0x003fffe9, 0x001fffe7, 0x001fffe8, 0x007ffff3, 0x003fffea, 0x003fffeb,
+  0x01ffffee, 0x01ffffef, 0x00fffff4, 0x00fffff5, 0x03ffffea, 0x007ffff4,
+  0x03ffffeb, 0x07ffffe6, 0x03ffffec, 0x03ffffed, 0x07ffffe7, 0x07ffffe8,
+  0x07ffffe9, 0x07ffffea, 0x07ffffeb, 0x0ffffffe, 0x07ffffec, 0x07ffffed,
+  0x07ffffee, 0x07ffffef, 0x07fffff0, 0x03ffffee,
+};
+static const uint8_t hpack_huff_len[256] = {
+  13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+  28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+  6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+  5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+  13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+  7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+  15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+  6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+  20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+  24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+  22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+  21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+  26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+  19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+  20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+  26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+};
+
+
+/* The Huffman code as a binary tree, built once: children of node n are
+ * huff_tree[n][0|1], a leaf being -(symbol + 1).
+ */
+static int16_t huff_tree[512][2];
+static pthread_once_t huff_tree_once = PTHREAD_ONCE_INIT;
+
+static void
+huff_tree_build() {
+  int sym, nnodes = 1;
+  for(sym=0; sym<256; sym++) {
+    int bit, node = 0;
+    for(bit = hpack_huff_len[sym] - 1; bit > 0; bit--) {
+      int b = (hpack_huff_code[sym] >> bit) & 1;
+      if(huff_tree[node][b] == 0) huff_tree[node][b] = nnodes++;
+      node = huff_tree[node][b];
+    }
+    huff_tree[node][hpack_huff_code[sym] & 1] = -(sym + 1);
+  }
+}
+
+/* Returns the decoded length, or -1 if the input isn't valid */
+static int
+huff_decode(const unsigned char *in, size_t len, char *out) {
+  int node = 0, pad_bits = 0, pad_ones = 1;
+  char *o = out;
+  size_t i;
+  for(i=0; i<len; i++) {
+    int bit;
+    for(bit=7; bit>=0; bit--) {
+      int b = (in[i] >> bit) & 1, next = huff_tree[node][b];
+      pad_bits++;
+      pad_ones &= b;
+      if(next < 0) {
+        *o++ = (char)(-next - 1);
+        node = 0;
+        pad_bits = 0;
+        pad_ones = 1;
+      }
+      else if(next == 0) return -1; /* EOS, or a code that doesn't exist */
+      else node = next;
+    }
+  }
+  /* a partial code at the end must be a short run of ones */
+  if(pad_bits > 7 || !pad_ones) return -1;
+  return o - out;
+}
+
+/* The dynamic table is a ring of entries, newest first. */
+struct hpack_entry {
+  size_t nlen;
+  size_t vlen;
+  char data[1]; /* name, then value */
+};
+
+struct mtev_hpack_decoder {
+  struct hpack_entry **ring;
+  int ring_size;
+  int first;
+  int cnt;
+  size_t size;          /* RFC accounting: strings plus 32 each */
+  size_t max_size;      /* as last set by the encoder */
+  size_t settings_max;  /* what we allow it to be set to */
+  char *scratch;        /* Huffman decoded strings */
+  size_t scratch_alloc;
+};
+
+mtev_hpack_decoder_t *
+mtev_hpack_decoder_new(size_t max_table_size) {
+  mtev_hpack_decoder_t *d;
+  pthread_once(&huff_tree_once, huff_tree_build);
+  d = calloc(1, sizeof(*d));
+  d->max_size = d->settings_max = max_table_size;
+  return d;
+}
+void
+mtev_hpack_decoder_free(mtev_hpack_decoder_t *d) {
+  int i;
+  if(!d) return;
+  for(i=0; i<d->cnt; i++) free(d->ring[(d->first + i) % d->ring_size]);
+  free(d->ring);
+  free(d->scratch);
+  free(d);
+}
+static void
+hpack_evict(mtev_hpack_decoder_t *d, size_t max) {
+  while(d->cnt && d->size > max) {
+    struct hpack_entry *e = d->ring[(d->first + d->cnt - 1) % d->ring_size];
+    d->size -= e->nlen + e->vlen + HPACK_ENTRY_OVERHEAD;
+    d->cnt--;
+    free(e);
+  }
+}
+static void
+hpack_insert(mtev_hpack_decoder_t *d, const char *name, size_t nlen,
+             const char *value, size_t vlen) {
+  struct hpack_entry *e;
+  size_t esize = nlen + vlen + HPACK_ENTRY_OVERHEAD;
+  /* an entry larger than the table empties it and isn't added */
+  if(esize > d->max_size) {
+    hpack_evict(d, 0);
+    return;
+  }
+  /* copy first: the name may belong to an entry about to be evicted */
+  e = malloc(offsetof(struct hpack_entry, data) + nlen + vlen);
+  if(!e) return;
+  e->nlen = nlen;
+  e->vlen = vlen;
+  memcpy(e->data, name, nlen);
+  memcpy(e->data + nlen, value, vlen);
+  hpack_evict(d, d->max_size - esize);
+  if(d->cnt == d->ring_size) {
+    int i, nsize = d->ring_size ? d->ring_size * 2 : 16;
+    struct hpack_entry **nring = malloc(nsize * sizeof(*nring));
+    for(i=0; i<d->cnt; i++) nring[i] = d->ring[(d->first + i) % d->ring_size];
+    free(d->ring);
+    d->ring = nring;
+    d->ring_size = nsize;
+    d->first = 0;
+  }
+  d->first = (d->first + d->ring_size - 1) % d->ring_size;
+  d->ring[d->first] = e;
+  d->cnt++;
+  d->size += esize;
+}
+static int
+hpack_lookup(mtev_hpack_decoder_t *d, size_t idx,
+             const char **name, size_t *nlen,
+             const char **value, size_t *vlen) {
+  if(idx == 0) return -1;
+  if(idx <= HPACK_STATIC_ENTRIES) {
+    const struct hpack_static_entry *s = &hpack_static[idx - 1];
+    *name = s->name; *nlen = s->nlen;
+    *value = s->value; *vlen = s->vlen;
+    return 0;
+  }
+  idx -= HPACK_STATIC_ENTRIES + 1;
+  if(idx >= (size_t)d->cnt) return -1;
+  {
+    struct hpack_entry *e = d->ring[(d->first + idx) % d->ring_size];
+    *name = e->data; *nlen = e->nlen;
+    *value = e->data + e->nlen; *vlen = e->vlen;
+  }
+  return 0;
+}
+static int
+hpack_decode_int(const unsigned char **cp, const unsigned char *end,
+                 int prefix, size_t *v) {
+  size_t mask = (1 << prefix) - 1, m = 0;
+  if(*cp >= end) return -1;
+  *v = **cp & mask;
+  (*cp)++;
+  if(*v < mask) return 0;
+  do {
+    if(*cp >= end || m > 21) return -1;
+    *v += (size_t)(**cp & 0x7f) << m;
+    m += 7;
+  } while(*(*cp)++ & 0x80);
+  return *v > HPACK_MAX_INT ? -1 : 0;
+}
+/* A string literal; Huffman coded ones land in scratch at *soff. */
+static int
+hpack_decode_str(mtev_hpack_decoder_t *d, const unsigned char **cp,
+                 const unsigned char *end, const char **str, size_t *len,
+                 size_t *soff) {
+  size_t slen;
+  int huff;
+  if(*cp >= end) return -1;
+  huff = **cp & 0x80;
+  if(hpack_decode_int(cp, end, 7, &slen) || slen > (size_t)(end - *cp))
+    return -1;
+  if(!huff) {
+    *str = (const char *)*cp;
+    *len = slen;
+  }
+  else {
+    /* 5 bits is the shortest code */
+    size_t need = *soff + (slen * 8) / 5 + 1;
+    int dlen;
+    if(need > d->scratch_alloc) {
+      char *n = realloc(d->scratch, need);
+      if(!n) return -1;
+      d->scratch = n;
+      d->scratch_alloc = need;
+    }
+    dlen = huff_decode(*cp, slen, d->scratch + *soff);
+    if(dlen < 0) return -1;
+    *str = NULL; /* in scratch, which may move */
+    *len = dlen;
+  }
+  *cp += slen;
+  return 0;
+}
+int
+mtev_hpack_decode(mtev_hpack_decoder_t *d, const unsigned char *block,
+                  size_t len, mtev_hpack_header_func_t f, void *closure) {
+  const unsigned char *cp = block, *end = block + len;
+  mtev_boolean fields_seen = mtev_false;
+  int rv;
+
+  while(cp < end) {
+    const char *name, *value;
+    size_t nlen, vlen, idx, soff = 0, noff = 0;
+    mtev_boolean index = mtev_false;
+
+    if(*cp & 0x80) { /* indexed field */
+      if(hpack_decode_int(&cp, end, 7, &idx) ||
+         hpack_lookup(d, idx, &name, &nlen, &value, &vlen)) return -1;
+      fields_seen = mtev_true;
+      if((rv = f(closure, name, nlen, value, vlen)) != 0) return rv;
+      continue;
+    }
+    if((*cp & 0xe0) == 0x20) { /* table size update */
+      size_t size;
+      if(fields_seen || hpack_decode_int(&cp, end, 5, &size) ||
+         size > d->settings_max) return -1;
+      d->max_size = size;
+      hpack_evict(d, size);
+      continue;
+    }
+    if((*cp & 0xc0) == 0x40) {
+      index = mtev_true;
+      if(hpack_decode_int(&cp, end, 6, &idx)) return -1;
+    }
+    else if(hpack_decode_int(&cp, end, 4, &idx)) return -1;
+    if(idx) {
+      const char *ignore;
+      size_t ignore_len;
+      if(hpack_lookup(d, idx, &name, &nlen, &ignore, &ignore_len)) return -1;
+    }
+    else {
+      if(hpack_decode_str(d, &cp, end, &name, &nlen, &soff)) return -1;
+      if(!name) soff += nlen;
+    }
+    noff = soff;
+    if(hpack_decode_str(d, &cp, end, &value, &vlen, &soff)) return -1;
+    /* now that scratch has stopped moving */
+    if(!idx && !name) name = d->scratch + noff - nlen;
+    if(!value) value = d->scratch + noff;
+    fields_seen = mtev_true;
+    if((rv = f(closure, name, nlen, value, vlen)) != 0) return rv;
+    /* after the callback: inserting can evict what name points to */
+    if(index) hpack_insert(d, name, nlen, value, vlen);
+  }
+  return 0;
+}
+
+static size_t
+hpack_encode_int(unsigned char *out, unsigned char first, int prefix,
+                 size_t v) {
+  size_t mask = (1 << prefix) - 1, n = 1;
+  if(v < mask) {
+    out[0] = first | v;
+    return 1;
+  }
+  out[0] = first | mask;
+  v -= mask;
+  while(v >= 0x80) {
+    out[n++] = (v & 0x7f) | 0x80;
+    v >>= 7;
+  }
+  out[n++] = v;
+  return n;
+}
+static int
+hpack_static_find(const char *name, size_t nlen,
+                  const char *value, size_t vlen, mtev_boolean *exact) {
+  int i, found = 0;
+  *exact = mtev_false;
+  for(i=0; i<HPACK_STATIC_ENTRIES; i++) {
+    const struct hpack_static_entry *s = &hpack_static[i];
+    if(s->nlen != nlen || strncasecmp(s->name, name, nlen)) {
+      if(found) break; /* same names are adjacent */
+      continue;
+    }
+    if(!found) found = i + 1;
+    if(s->vlen == vlen && !memcmp(s->value, value, vlen)) {
+      *exact = mtev_true;
+      return i + 1;
+    }
+  }
+  return found;
+}
+size_t
+mtev_hpack_encode_header(unsigned char *out, const char *name, size_t nlen,
+                         const char *value, size_t vlen) {
+  size_t n, i;
+  mtev_boolean exact;
+  int idx = hpack_static_find(name, nlen, value, vlen, &exact);
+  if(exact) return hpack_encode_int(out, 0x80, 7, idx);
+  /* literal without indexing: we keep no table of our own */
+  n = hpack_encode_int(out, 0x00, 4, idx);
+  if(!idx) {
+    n += hpack_encode_int(out + n, 0x00, 7, nlen);
+    for(i=0; i<nlen; i++) out[n++] = tolower((unsigned char)name[i]);
+  }
+  n += hpack_encode_int(out + n, 0x00, 7, vlen);
+  memcpy(out + n, value, vlen);
+  return n + vlen;
+}
+size_t
+mtev_hpack_encode_status(unsigned char *out, int status) {
+  char code[3];
+  code[0] = '0' + (status / 100) % 10;
+  code[1] = '0' + (status / 10) % 10;
+  code[2] = '0' + status % 10;
+  return mtev_hpack_encode_header(out, ":status", 7, code, 3);
+}
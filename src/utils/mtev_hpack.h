@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2014-2015, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *    * Neither the name Circonus, Inc. nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _UTILS_MTEV_HPACK_H
+#define _UTILS_MTEV_HPACK_H
+
+#include "mtev_defines.h"
+
+/* HPACK (RFC 7541) header compression for HTTP/2. */
+
+/*! \fn mtev_hpack_decoder_t *mtev_hpack_decoder_new(size_t max_table_size)
+    \brief creates a decoder (one per connection, it carries a dynamic table).
+    \param max_table_size the SETTINGS_HEADER_TABLE_SIZE we advertised
+    \return a new decoder
+ */
+/*! \fn void mtev_hpack_decoder_free(mtev_hpack_decoder_t *d)
+    \brief frees a decoder and its dynamic table.
+ */
+/*! \fn int mtev_hpack_decode(mtev_hpack_decoder_t *d, const unsigned char *block, size_t len, mtev_hpack_header_func_t f, void *closure)
+    \brief decodes a complete header block, calling f for each field in order.
+    \param d the connection's decoder
+    \param block the header block (HEADERS plus any CONTINUATION payloads)
+    \param len the length of block
+    \param f called with each name and value; these are not NUL terminated and only valid during the call.  A non-zero return stops decoding.
+    \param closure passed to f
+    \return 0 on success, -1 on a compression error (fatal to the connection), or what f returned
+ */
+/*! \fn size_t mtev_hpack_encode_header(unsigned char *out, const char *name, size_t nlen, const char *value, size_t vlen)
+    \brief encodes a field, lowercasing the name, without touching any dynamic table.
+    \param out where to write, at least MTEV_HPACK_ENCODE_BOUND(nlen, vlen) bytes
+    \return the number of bytes written
+ */
+/*! \fn size_t mtev_hpack_encode_status(unsigned char *out, int status)
+    \brief encodes a :status pseudo-header.
+    \param out where to write, at least MTEV_HPACK_ENCODE_BOUND(7, 3) bytes
+    \return the number of bytes written
+ */
+
+typedef struct mtev_hpack_decoder mtev_hpack_decoder_t;
+typedef int (*mtev_hpack_header_func_t)(void *closure,
+                                        const char *name, size_t nlen,
+                                        const char *value, size_t vlen);
+
+/* A field costs at most its strings plus two 5-byte integers and a byte */
+#define MTEV_HPACK_ENCODE_BOUND(nlen, vlen) ((nlen) + (vlen) + 11)
+
+API_EXPORT(mtev_hpack_decoder_t *) mtev_hpack_decoder_new(size_t);
+API_EXPORT(void) mtev_hpack_decoder_free(mtev_hpack_decoder_t *);
+API_EXPORT(int) mtev_hpack_decode(mtev_hpack_decoder_t *,
+                                  const unsigned char *, size_t,
+                                  mtev_hpack_header_func_t, void *);
+API_EXPORT(size_t) mtev_hpack_encode_header(unsigned char *,
+                                            const char *, size_t,
+                                            const char *, size_t);
+API_EXPORT(size_t) mtev_hpack_encode_status(unsigned char *, int);
+
+#endif
@@ -0,0 +1,285 @@
+/*
+ * Copyright (c) 2014-2015, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *    * Neither the name Circonus, Inc. nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "mtev_defines.h"
+#include "mtev_memscan.h"
+
+#include <string.h>
+
+/* Each scan is written once, over a "block" of W bytes for which we can
+ * get a bitmask of the positions holding a given byte: 16 at a time with
+ * SSE2, 32 with AVX2.  The tail of a buffer, too short for a block, is
+ * done a byte at a time, as is everything on other architectures.
+ */
+#if defined(__GNUC__) && defined(__x86_64__)
+#define MEMSCAN_X86 1
+#include <immintrin.h>
+#endif
+
+struct memscan_impl {
+  const char *name;
+  const char *(*crlf)(const char *, size_t);
+  const char *(*crlfcrlf)(const char *, size_t);
+  int (*lines)(const char *, size_t, char, mtev_memscan_line_t *, int,
+               size_t *);
+  void (*lower)(char *, size_t);
+};
+
+/* Scalar pieces, also used to finish the vector versions */
+static const char *
+scalar_crlf_from(const char *buf, size_t len, size_t i) {
+  for(; i + 1 < len; i++)
+    if(buf[i] == '\r' && buf[i+1] == '\n') return buf + i;
+  return NULL;
+}
+static const char *
+scalar_crlfcrlf_from(const char *buf, size_t len, size_t i) {
+  for(; i + 3 < len; i++)
+    if(buf[i] == '\r' && buf[i+1] == '\n' &&
+       buf[i+2] == '\r' && buf[i+3] == '\n') return buf + i;
+  return NULL;
+}
+static void
+scalar_lower_from(char *buf, size_t len, size_t i) {
+  for(; i < len; i++)
+    if(buf[i] >= 'A' && buf[i] <= 'Z') buf[i] |= 0x20;
+}
+
+/* The line splitter's state, carried from the blocks to the tail */
+struct lines_state {
+  size_t line_start;
+  size_t delim;
+  int n;
+};
+#define LINE_EMIT(st, pos, lines) do { \
+  (lines)[(st)->n].start = (st)->line_start; \
+  (lines)[(st)->n].len = (pos) - (st)->line_start; \
+  (lines)[(st)->n].delim = ((st)->delim == (size_t)-1) ? \
+    (pos) - (st)->line_start : (st)->delim - (st)->line_start; \
+  (st)->n++; \
+  (st)->line_start = (pos) + 2; \
+  (st)->delim = (size_t)-1; \
+} while(0)
+
+static int
+scalar_lines_from(const char *buf, size_t len, char delim,
+                  mtev_memscan_line_t *lines, int nlines, size_t *consumed,
+                  struct lines_state *st, size_t i) {
+  for(; i + 1 < len && st->n < nlines; i++) {
+    if(buf[i] == delim) {
+      if(st->delim == (size_t)-1 && i >= st->line_start) st->delim = i;
+    }
+    else if(buf[i] == '\r' && buf[i+1] == '\n') {
+      LINE_EMIT(st, i, lines);
+      i++;
+    }
+  }
+  if(consumed) *consumed = st->line_start;
+  return st->n;
+}
+
+static const char *
+scalar_crlf(const char *buf, size_t len) {
+  return scalar_crlf_from(buf, len, 0);
+}
+static const char *
+scalar_crlfcrlf(const char *buf, size_t len) {
+  return scalar_crlfcrlf_from(buf, len, 0);
+}
+static int
+scalar_lines(const char *buf, size_t len, char delim,
+             mtev_memscan_line_t *lines, int nlines, size_t *consumed) {
+  struct lines_state st = { 0, (size_t)-1, 0 };
+  return scalar_lines_from(buf, len, delim, lines, nlines, consumed, &st, 0);
+}
+static void
+scalar_lower(char *buf, size_t len) {
+  scalar_lower_from(buf, len, 0);
+}
+
+#ifdef MEMSCAN_X86
+/* One set of bodies, instantiated per vector width.  W is the block size,
+ * EQ(p, c) the mask of bytes at p equal to c, and LEAVE() whatever must
+ * happen before handing over to scalar code.  The loads at p+1..p+3 are
+ * unaligned, so a block is only taken whole while they stay in bounds.
+ */
+#define MEMSCAN_DEFINE(PFX, ATTR, W, EQ, LOWER_BLOCK, LEAVE) \
+ATTR static const char * \
+PFX##_crlf(const char *buf, size_t len) { \
+  size_t i = 0; \
+  for(; i + W + 1 <= len; i += W) { \
+    u_int32_t m = EQ(buf + i, '\r') & EQ(buf + i + 1, '\n'); \
+    if(m) return buf + i + __builtin_ctz(m); \
+  } \
+  LEAVE(); \
+  return scalar_crlf_from(buf, len, i); \
+} \
+ATTR static const char * \
+PFX##_crlfcrlf(const char *buf, size_t len) { \
+  size_t i = 0; \
+  for(; i + W + 3 <= len; i += W) { \
+    u_int32_t m = EQ(buf + i, '\r') & EQ(buf + i + 1, '\n') & \
+                  EQ(buf + i + 2, '\r') & EQ(buf + i + 3, '\n'); \
+    if(m) return buf + i + __builtin_ctz(m); \
+  } \
+  LEAVE(); \
+  return scalar_crlfcrlf_from(buf, len, i); \
+} \
+ATTR static int \
+PFX##_lines(const char *buf, size_t len, char delim, \
+            mtev_memscan_line_t *lines, int nlines, size_t *consumed) { \
+  struct lines_state st = { 0, (size_t)-1, 0 }; \
+  size_t i = 0; \
+  for(; i + W + 1 <= len && st.n < nlines; i += W) { \
+    u_int32_t crlf = EQ(buf + i, '\r') & EQ(buf + i + 1, '\n'); \
+    u_int32_t dm = EQ(buf + i, delim); \
+    /* only the first delim after each line start matters */ \
+    while(crlf | dm) { \
+      u_int32_t all = crlf | dm; \
+      size_t pos = i + __builtin_ctz(all); \
+      u_int32_t bit = all & -all; \
+      if(crlf & bit) { \
+        LINE_EMIT(&st, pos, lines); \
+        if(st.n == nlines) break; \
+        crlf &= ~bit; \
+      } \
+      else { \
+        if(st.delim == (size_t)-1 && pos >= st.line_start) st.delim = pos; \
+        dm &= ~bit; \
+      } \
+    } \
+  } \
+  if(st.n == nlines) { \
+    if(consumed) *consumed = st.line_start; \
+    return st.n; \
+  } \
+  LEAVE(); \
+  return scalar_lines_from(buf, len, delim, lines, nlines, consumed, &st, i); \
+} \
+ATTR static void \
+PFX##_lower(char *buf, size_t len) { \
+  size_t i = 0; \
+  for(; i + W <= len; i += W) LOWER_BLOCK(buf + i); \
+  LEAVE(); \
+  scalar_lower_from(buf, len, i); \
+}
+
+#define SSE2_EQ(p, c) \
+  ((u_int32_t)_mm_movemask_epi8(_mm_cmpeq_epi8( \
+    _mm_loadu_si128((const __m128i *)(p)), _mm_set1_epi8(c))))
+/* bytes >= 0x80 are negative as signed chars, so never in 'A'..'Z' */
+#define SSE2_LOWER_BLOCK(p) do { \
+  __m128i v = _mm_loadu_si128((const __m128i *)(p)); \
+  __m128i up = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)), \
+                             _mm_cmplt_epi8(v, _mm_set1_epi8('Z' + 1))); \
+  _mm_storeu_si128((__m128i *)(p), \
+    _mm_or_si128(v, _mm_and_si128(up, _mm_set1_epi8(0x20)))); \
+} while(0)
+#define SSE2_LEAVE()
+MEMSCAN_DEFINE(sse2, , 16, SSE2_EQ, SSE2_LOWER_BLOCK, SSE2_LEAVE)
+
+#define AVX2_EQ(p, c) \
+  ((u_int32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8( \
+    _mm256_loadu_si256((const __m256i *)(p)), _mm256_set1_epi8(c))))
+#define AVX2_LOWER_BLOCK(p) do { \
+  __m256i v = _mm256_loadu_si256((const __m256i *)(p)); \
+  __m256i up = _mm256_and_si256( \
+    _mm256_cmpgt_epi8(v, _mm256_set1_epi8('A' - 1)), \
+    _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), v)); \
+  _mm256_storeu_si256((__m256i *)(p), \
+    _mm256_or_si256(v, _mm256_and_si256(up, _mm256_set1_epi8(0x20)))); \
+} while(0)
+/* The compiler doesn't always clear the upper halves before the scalar
+ * tail, and the SSE/AVX transition that follows is costly. */
+#define AVX2_LEAVE() _mm256_zeroupper()
+MEMSCAN_DEFINE(avx2, __attribute__((target("avx2"))), 32, AVX2_EQ,
+               AVX2_LOWER_BLOCK, AVX2_LEAVE)
+#endif
+
+static const struct memscan_impl memscan_impls[] = {
+#ifdef MEMSCAN_X86
+  { "avx2", avx2_crlf, avx2_crlfcrlf, avx2_lines, avx2_lower },
+  { "sse2", sse2_crlf, sse2_crlfcrlf, sse2_lines, sse2_lower },
+#endif
+  { "scalar", scalar_crlf, scalar_crlfcrlf, scalar_lines, scalar_lower },
+};
+#define NIMPLS (sizeof(memscan_impls)/sizeof(*memscan_impls))
+
+static mtev_boolean
+memscan_impl_usable(const struct memscan_impl *impl) {
+#ifdef MEMSCAN_X86
+  if(!strcmp(impl->name, "avx2")) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") ? mtev_true : mtev_false;
+  }
+#endif
+  return mtev_true;
+}
+/* Settled on first use; a race here just picks the same answer twice. */
+static const struct memscan_impl *memscan = NULL;
+
+static const struct memscan_impl *
+memscan_get() {
+  if(!memscan) mtev_memscan_impl_set(NULL);
+  return memscan;
+}
+
+mtev_boolean
+mtev_memscan_impl_set(const char *name) {
+  int i;
+  for(i=0; i<NIMPLS; i++) {
+    if(name && strcmp(name, memscan_impls[i].name)) continue;
+    if(!memscan_impl_usable(&memscan_impls[i])) continue;
+    memscan = &memscan_impls[i];
+    return mtev_true;
+  }
+  return mtev_false;
+}
+const char *
+mtev_memscan_impl() {
+  return memscan_get()->name;
+}
+const char *
+mtev_memscan_crlf(const char *buf, size_t len) {
+  return memscan_get()->crlf(buf, len);
+}
+const char *
+mtev_memscan_crlfcrlf(const char *buf, size_t len) {
+  return memscan_get()->crlfcrlf(buf, len);
+}
+int
+mtev_memscan_lines(const char *buf, size_t len, char delim,
+                   mtev_memscan_line_t *lines, int nlines, size_t *consumed) {
+  return memscan_get()->lines(buf, len, delim, lines, nlines, consumed);
+}
+void
+mtev_memscan_lower(char *buf, size_t len) {
+  memscan_get()->lower(buf, len);
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2014-2015, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *    * Neither the name Circonus, Inc. nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _UTILS_MTEV_MEMSCAN_H
+#define _UTILS_MTEV_MEMSCAN_H
+
+#include "mtev_defines.h"
+
+/*! \fn const char *mtev_memscan_crlf(const char *buf, size_t len)
+    \brief finds the first CRLF in a buffer.
+    \param buf the buffer to search
+    \param len the number of bytes in buf
+    \return a pointer to the CR, or NULL if there is no CRLF
+ */
+/*! \fn const char *mtev_memscan_crlfcrlf(const char *buf, size_t len)
+    \brief finds the first CRLFCRLF (the end of a header block) in a buffer.
+    \param buf the buffer to search
+    \param len the number of bytes in buf
+    \return a pointer to the first CR, or NULL if there is none
+ */
+/*! \fn int mtev_memscan_lines(const char *buf, size_t len, char delim, mtev_memscan_line_t *lines, int nlines, size_t *consumed)
+    \brief splits a buffer into CRLF terminated lines, noting the first delim in each, in one pass.
+    \param buf the buffer to scan
+    \param len the number of bytes in buf
+    \param delim the byte to locate in each line (e.g. ':')
+    \param lines where to record the lines found
+    \param nlines how many lines fit in lines
+    \param consumed set to the offset just past the last CRLF recorded
+    \return the number of lines recorded
+ */
+/*! \fn void mtev_memscan_lower(char *buf, size_t len)
+    \brief lowercases the ASCII letters in a buffer in place.
+    \param buf the buffer to lowercase
+    \param len the number of bytes in buf
+ */
+/*! \fn const char *mtev_memscan_impl()
+    \brief reports which implementation is in use: "avx2", "sse2" or "scalar".
+ */
+/*! \fn mtev_boolean mtev_memscan_impl_set(const char *name)
+    \brief selects an implementation by name (NULL for the best available).
+    \return mtev_false if it isn't available on this machine
+ */
+
+typedef struct {
+  size_t start;  /* offset of the line in the buffer */
+  size_t len;    /* length, not counting the CRLF */
+  size_t delim;  /* offset of the first delim within the line, or len */
+} mtev_memscan_line_t;
+
+API_EXPORT(const char *) mtev_memscan_crlf(const char *, size_t);
+API_EXPORT(const char *) mtev_memscan_crlfcrlf(const char *, size_t);
+API_EXPORT(int) mtev_memscan_lines(const char *, size_t, char,
+                                   mtev_memscan_line_t *, int, size_t *);
+API_EXPORT(void) mtev_memscan_lower(char *, size_t);
+API_EXPORT(const char *) mtev_memscan_impl();
+API_EXPORT(mtev_boolean) mtev_memscan_impl_set(const char *);
+
+#endif
@@ -0,0 +1,579 @@
+/*
+ * Copyright (c) 2014-2015, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *    * Neither the name Circonus, Inc. nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* The HTTP client against the built-in server.
+ *
+ * Starts through mtev_main (in the foreground) with an http_rest_api
+ * listener on the loopback and points the client at it, one case after
+ * another on the event loop: keep-alive reuse, the per-host connection
+ * limit, pipelining (through the server, and to a bare peer that only
+ * answers once every request is in), a chunked body streamed in pieces,
+ * and the request and connect timeouts.
+ *
+ *   http_client_test
+ */
+
+#include "mtev_defines.h"
+#include "mtev_main.h"
+#include "mtev_memory.h"
+#include "mtev_listener.h"
+#include "mtev_rest.h"
+#include "mtev_http.h"
+#include "mtev_http_client.h"
+#include "eventer/eventer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define APPNAME "http_client_test"
+#define MAX_CALLS 16
+#define PIPELINED 4
+#define STREAM_CHUNKS 64
+#define STREAM_CHUNK 4096
+
+static const char *config_fmt =
+  "<?xml version=\"1.0\" encoding=\"utf8\" standalone=\"yes\"?>\n"
+  "<" APPNAME ">\n"
+  "  <logs>\n"
+  "    <console_output>\n"
+  "      <outlet name=\"stderr\"/>\n"
+  "      <log name=\"error\"/>\n"
+  "    </console_output>\n"
+  "  </logs>\n"
+  "  <eventer implementation=\"%s\">\n"
+  "    <config>\n"
+  "      <concurrency>1</concurrency>\n"
+  "    </config>\n"
+  "  </eventer>\n"
+  "  <listeners>\n"
+  "    <listener type=\"http_rest_api\" address=\"127.0.0.1\" port=\"%d\"/>\n"
+  "  </listeners>\n"
+  "</" APPNAME ">\n";
+
+struct call {
+  int status;
+  mtev_boolean chunked;
+  mtev_boolean pattern;     /* the body should be the stream pattern */
+  mtev_boolean mismatch;
+  int pieces;               /* BODY callbacks */
+  size_t len;
+  char body[64];            /* the start of it */
+  char error[64];
+  struct timeval submitted, finished;
+};
+
+struct test_case {
+  const char *name;
+  int (*step)(int round);   /* 0 once it has checked its results */
+};
+
+static char config_file[] = "/tmp/http_client_test.XXXXXX";
+static int server_port, peer_port, blackhole_port;
+static int outstanding, failures, current, round_no;
+static struct call calls[MAX_CALLS];
+static int ncalls;
+static mtev_http_client_pool_t *pool;
+
+static int peer_accepts, peer_most_waiting;
+
+static void
+check(int ok, const char *what) {
+  printf("%s - %s\n", ok ? "ok" : "not ok", what);
+  if(!ok) failures++;
+}
+
+/* A socket listening on the loopback, on a port of the kernel's choosing */
+static int
+listen_loopback(int backlog, int *port) {
+  struct sockaddr_in sin;
+  socklen_t len = sizeof(sin);
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if(fd < 0 ||
+     bind(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+     getsockname(fd, (struct sockaddr *)&sin, &len) < 0 ||
+     (backlog >= 0 && listen(fd, backlog) < 0)) {
+    perror("listen_loopback");
+    exit(2);
+  }
+  *port = ntohs(sin.sin_port);
+  return fd;
+}
+
+/* The server side: /t/port and /t/n/<n> answer with "<n> <client port>" */
+static int
+port_handler(mtev_http_rest_closure_t *restc, int npats, char **pats) {
+  mtev_http_session_ctx *ctx = restc->http_ctx;
+  char buf[64];
+
+  snprintf(buf, sizeof(buf), "%s %d", npats ? pats[0] : "-",
+           ntohs(restc->ac->remote.remote_addr4.sin_port));
+  mtev_http_response_ok(ctx, "text/plain");
+  mtev_http_response_append(ctx, buf, strlen(buf));
+  mtev_http_response_end(ctx);
+  return 0;
+}
+static int
+stream_handler(mtev_http_rest_closure_t *restc, int npats, char **pats) {
+  mtev_http_session_ctx *ctx = restc->http_ctx;
+  char chunk[STREAM_CHUNK];
+  int i, j;
+
+  mtev_http_response_ok(ctx, "application/octet-stream");
+  for(i=0; i<STREAM_CHUNKS; i++) {
+    for(j=0; j<STREAM_CHUNK; j++)
+      chunk[j] = 'a' + (i * STREAM_CHUNK + j) % 26;
+    mtev_http_response_append(ctx, chunk, sizeof(chunk));
+    mtev_http_response_flush(ctx, mtev_false);
+  }
+  mtev_http_response_end(ctx);
+  return 0;
+}
+/* Never answers */
+static int
+stall_handler(mtev_http_rest_closure_t *restc, int npats, char **pats) {
+  return EVENTER_EXCEPTION;
+}
+
+/* The bare peer answers the first request on a connection at once, and
+ * the PIPELINED after it only when it has read all of them. */
+struct peer_conn {
+  char buf[8192];            /* what it has read, terminated */
+  size_t len;
+  int answered;
+};
+static int
+peer_requests(struct peer_conn *pc) {
+  const char *cp = pc->buf;
+  int n = 0;
+  while((cp = strstr(cp, "\r\n\r\n")) != NULL) {
+    cp += 4;
+    n++;
+  }
+  return n;
+}
+static void
+peer_answer(int fd, struct peer_conn *pc, int upto) {
+  char out[1024];
+  int len = 0;
+  while(pc->answered < upto)
+    len += snprintf(out + len, sizeof(out) - len,
+                    "HTTP/1.1 200 OK\r\nContent-Length: 1\r\n\r\n%d",
+                    pc->answered++);
+  if(write(fd, out, len) != len) perror("peer write");
+}
+static int
+peer_read(eventer_t e, int mask, void *closure, struct timeval *now) {
+  struct peer_conn *pc = closure;
+  int len, n, newmask;
+
+  while((len = read(e->fd, pc->buf + pc->len,
+                    sizeof(pc->buf) - 1 - pc->len)) > 0) {
+    pc->len += len;
+    pc->buf[pc->len] = '\0';
+    n = peer_requests(pc);
+    if(n - pc->answered > peer_most_waiting)
+      peer_most_waiting = n - pc->answered;
+    if(pc->answered == 0 && n >= 1) peer_answer(e->fd, pc, 1);
+    if(pc->answered == 1 && n >= 1 + PIPELINED)
+      peer_answer(e->fd, pc, 1 + PIPELINED);
+  }
+  if(len < 0 && errno == EAGAIN) return EVENTER_READ | EVENTER_EXCEPTION;
+  eventer_remove_fd(e->fd);
+  e->opset->close(e->fd, &newmask, e);
+  free(pc);
+  return 0;
+}
+static int
+peer_accept(eventer_t e, int mask, void *closure, struct timeval *now) {
+  eventer_t newe;
+  int fd;
+
+  while((fd = accept(e->fd, NULL, NULL)) >= 0) {
+    eventer_set_fd_nonblocking(fd);
+    newe = eventer_alloc();
+    newe->fd = fd;
+    newe->mask = EVENTER_READ | EVENTER_EXCEPTION;
+    newe->callback = peer_read;
+    newe->closure = calloc(1, sizeof(struct peer_conn));
+    eventer_add(newe);
+    peer_accepts++;
+  }
+  return EVENTER_READ | EVENTER_EXCEPTION;
+}
+
+/* The client side */
+static void
+pool_start(const char *key, const char *value, ...) {
+  mtev_hash_table config;
+  va_list ap;
+
+  mtev_hash_init(&config);
+  va_start(ap, value);
+  while(key) {
+    mtev_hash_store(&config, key, strlen(key), (void *)value);
+    if((key = va_arg(ap, const char *)) != NULL)
+      value = va_arg(ap, const char *);
+  }
+  va_end(ap);
+  pool = mtev_http_client_pool_new(&config);
+  mtev_hash_destroy(&config, NULL, NULL);
+  ncalls = 0;
+}
+static void
+pool_stop() {
+  mtev_http_client_pool_free(pool);
+  pool = NULL;
+}
+
+static int next_round(eventer_t, int, void *, struct timeval *);
+
+static mtev_boolean
+call_done(mtev_http_client_request_t *req, mtev_http_client_event_t event,
+          const void *data, size_t len, void *closure) {
+  struct call *c = closure;
+  const char *te;
+  size_t i;
+
+  switch(event) {
+    case MTEV_HTTP_CLIENT_HEADERS:
+      c->status = mtev_http_client_response_status(req);
+      te = mtev_http_client_response_header(req, "Transfer-Encoding");
+      c->chunked = te && strstr(te, "chunked") != NULL;
+      return mtev_true;
+    case MTEV_HTTP_CLIENT_BODY:
+      if(c->len < sizeof(c->body) - 1)
+        memcpy(c->body + c->len, data,
+               MIN(len, sizeof(c->body) - 1 - c->len));
+      for(i=0; c->pattern && i<len; i++)
+        if(((const char *)data)[i] != 'a' + (c->len + i) % 26)
+          c->mismatch = mtev_true;
+      c->len += len;
+      c->pieces++;
+      return mtev_true;
+    case MTEV_HTTP_CLIENT_ERROR:
+      snprintf(c->error, sizeof(c->error), "%s",
+               mtev_http_client_request_error(req));
+      /* fall through */
+    case MTEV_HTTP_CLIENT_DONE:
+      gettimeofday(&c->finished, NULL);
+      /* the next round starts outside the client's callback */
+      if(--outstanding == 0) eventer_add_in_s_us(next_round, NULL, 0, 0);
+      break;
+  }
+  return mtev_true;
+}
+static struct call *
+submit(int port, const char *path) {
+  mtev_http_client_request_t *req;
+  struct call *c = &calls[ncalls++];
+  char url[128];
+
+  memset(c, 0, sizeof(*c));
+  snprintf(url, sizeof(url), "http://127.0.0.1:%d%s", port, path);
+  req = mtev_http_client_request_new(pool, "GET", url);
+  gettimeofday(&c->submitted, NULL);
+  outstanding++;
+  mtev_http_client_request_submit(req, call_done, c);
+  return c;
+}
+static int
+call_port(struct call *c) {
+  int port;
+  if(sscanf(c->body, "%*s %d", &port) != 1) return -1;
+  return port;
+}
+static long
+call_ms(struct call *c) {
+  struct timeval diff;
+  sub_timeval(c->finished, c->submitted, &diff);
+  return diff.tv_sec * 1000 + diff.tv_usec / 1000;
+}
+
+/* Requests one after another share one kept-alive connection. */
+static int
+reuse_step(int round) {
+  char what[128];
+  int i, ok = 1;
+
+  if(round == 0)
+    pool_start("max_connections_per_host", "2", NULL);
+  if(round < 5) {
+    submit(server_port, "/t/port");
+    return 1;
+  }
+  for(i=0; i<ncalls; i++)
+    ok = ok && calls[i].status == 200 &&
+         call_port(&calls[i]) == call_port(&calls[0]);
+  snprintf(what, sizeof(what), "%d sequential requests used one connection",
+           ncalls);
+  check(ok && call_port(&calls[0]) > 0, what);
+  pool_stop();
+  return 0;
+}
+/* A burst is queued behind max_connections_per_host. */
+static int
+limit_step(int round) {
+  char what[128];
+  int i, j, ports[MAX_CALLS], nports = 0, ok = 1;
+
+  if(round == 0) {
+    pool_start("max_connections_per_host", "2", NULL);
+    for(i=0; i<8; i++) submit(server_port, "/t/port");
+    return 1;
+  }
+  for(i=0; i<ncalls; i++) {
+    ok = ok && calls[i].status == 200 && call_port(&calls[i]) > 0;
+    for(j=0; j<nports && ports[j] != call_port(&calls[i]); j++);
+    if(j == nports) ports[nports++] = call_port(&calls[i]);
+  }
+  snprintf(what, sizeof(what),
+           "%d concurrent requests completed over %d connections (limit 2)",
+           ncalls, nports);
+  check(ok && nports <= 2, what);
+  pool_stop();
+  return 0;
+}
+/* Pipelined through the server, responses come back to the right
+ * requests, in order, on the one connection. */
+static int
+pipeline_step(int round) {
+  char what[128], path[32], expect[16];
+  int i, ok = 1;
+
+  if(round == 0) {
+    pool_start("max_connections_per_host", "1",
+               "pipeline_depth", "4", NULL);
+    submit(server_port, "/t/n/0");
+    return 1;
+  }
+  if(round == 1) {
+    for(i=1; i<=6; i++) {
+      snprintf(path, sizeof(path), "/t/n/%d", i);
+      submit(server_port, path);
+    }
+    return 1;
+  }
+  for(i=0; i<ncalls; i++) {
+    snprintf(expect, sizeof(expect), "%d ", i);
+    ok = ok && calls[i].status == 200 &&
+         !strncmp(calls[i].body, expect, strlen(expect)) &&
+         call_port(&calls[i]) == call_port(&calls[0]);
+  }
+  snprintf(what, sizeof(what),
+           "%d pipelined requests answered in order on one connection",
+           ncalls);
+  check(ok, what);
+  pool_stop();
+  return 0;
+}
+/* The peer holds its answers until all PIPELINED requests are in, so
+ * these only complete if the client really had them in flight at once. */
+static int
+peer_step(int round) {
+  char what[128], expect[4];
+  int i, ok = 1;
+
+  if(round == 0) {
+    pool_start("max_connections_per_host", "1",
+               "pipeline_depth", "4",
+               "request_timeout", "5000", NULL);
+    submit(peer_port, "/p");
+    return 1;
+  }
+  if(round == 1) {
+    for(i=0; i<PIPELINED; i++) submit(peer_port, "/p");
+    return 1;
+  }
+  for(i=0; i<ncalls; i++) {
+    snprintf(expect, sizeof(expect), "%d", i);
+    ok = ok && calls[i].status == 200 && !strcmp(calls[i].body, expect);
+  }
+  snprintf(what, sizeof(what),
+           "peer saw %d requests waiting at once over %d connection(s)",
+           peer_most_waiting, peer_accepts);
+  check(ok && peer_most_waiting == PIPELINED && peer_accepts == 1, what);
+  pool_stop();
+  return 0;
+}
+/* A chunked body arrives intact, and in pieces as it is read. */
+static int
+stream_step(int round) {
+  char what[128];
+  struct call *c;
+
+  if(round == 0) {
+    pool_start(NULL, NULL);
+    submit(server_port, "/t/stream")->pattern = mtev_true;
+    return 1;
+  }
+  c = &calls[0];
+  snprintf(what, sizeof(what), "chunked body of %d bytes in %d pieces",
+           (int)c->len, c->pieces);
+  check(c->status == 200 && c->chunked && !c->mismatch &&
+        c->len == STREAM_CHUNKS * STREAM_CHUNK && c->pieces > 1, what);
+  pool_stop();
+  return 0;
+}
+/* A server that never answers runs into request_timeout. */
+static int
+read_timeout_step(int round) {
+  char what[128];
+  struct call *c;
+
+  if(round == 0) {
+    pool_start("request_timeout", "300", NULL);
+    submit(server_port, "/t/stall");
+    return 1;
+  }
+  c = &calls[0];
+  snprintf(what, sizeof(what), "unanswered request failed (%s) after %ldms",
+           c->error, call_ms(c));
+  check(!strcmp(c->error, "request timed out") &&
+        call_ms(c) >= 250 && call_ms(c) < 5000, what);
+  pool_stop();
+  return 0;
+}
+/* A listener whose backlog is full never completes the handshake. */
+static int
+connect_timeout_step(int round) {
+  char what[128];
+  struct call *c;
+
+  if(round == 0) {
+    pool_start("connect_timeout", "300", NULL);
+    submit(blackhole_port, "/");
+    return 1;
+  }
+  c = &calls[0];
+  snprintf(what, sizeof(what), "unaccepted connect failed (%s) after %ldms",
+           c->error, call_ms(c));
+  check(!strcmp(c->error, "connect timed out") &&
+        call_ms(c) >= 250 && call_ms(c) < 5000, what);
+  pool_stop();
+  return 0;
+}
+
+static struct test_case cases[] = {
+  { "reuse", reuse_step },
+  { "limit", limit_step },
+  { "pipeline", pipeline_step },
+  { "peer", peer_step },
+  { "stream", stream_step },
+  { "read_timeout", read_timeout_step },
+  { "connect_timeout", connect_timeout_step },
+};
+#define NCASES (int)(sizeof(cases)/sizeof(*cases))
+
+static int
+next_round(eventer_t e, int mask, void *closure, struct timeval *now) {
+  while(current < NCASES) {
+    if(cases[current].step(round_no++)) return 0;
+    current++;
+    round_no = 0;
+  }
+  exit(failures ? 1 : 0);
+  return 0;
+}
+static int
+test_timeout(eventer_t e, int mask, void *closure, struct timeval *now) {
+  check(0, "all cases completed within 30s");
+  exit(1);
+  return 0;
+}
+
+static int
+child_main() {
+  struct sockaddr_in sin;
+  eventer_t e;
+  int fd, filler;
+
+  unlink(config_file); /* loaded by now */
+  eventer_init();
+  mtev_http_rest_init();
+  mtev_http_rest_register("GET", "/t/", "^port$", port_handler);
+  mtev_http_rest_register("GET", "/t/", "^n/(\\d+)$", port_handler);
+  mtev_http_rest_register("GET", "/t/", "^stream$", stream_handler);
+  mtev_http_rest_register("GET", "/t/", "^stall$", stall_handler);
+  mtev_listener_init(APPNAME);
+
+  fd = listen_loopback(16, &peer_port);
+  eventer_set_fd_nonblocking(fd);
+  e = eventer_alloc();
+  e->fd = fd;
+  e->mask = EVENTER_READ | EVENTER_EXCEPTION;
+  e->callback = peer_accept;
+  eventer_add(e);
+
+  /* one connection fills a backlog of 0; later SYNs go unanswered */
+  (void)listen_loopback(0, &blackhole_port);
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  sin.sin_port = htons(blackhole_port);
+  filler = socket(AF_INET, SOCK_STREAM, 0);
+  if(filler < 0 || connect(filler, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+    perror("connect");
+    exit(2);
+  }
+
+  eventer_add_in_s_us(next_round, NULL, 0, 0);
+  eventer_add_in_s_us(test_timeout, NULL, 30, 0);
+  eventer_loop();
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  FILE *fp;
+  int fd;
+
+  close(listen_loopback(-1, &server_port));
+  if((fd = mkstemp(config_file)) < 0 || (fp = fdopen(fd, "w")) == NULL) {
+    perror("mkstemp");
+    exit(2);
+  }
+  fprintf(fp, config_fmt, DEFAULT_EVENTER, server_port);
+  fclose(fp);
+
+  mtev_memory_init();
+  mtev_main(APPNAME, config_file, 0, 1, MTEV_LOCK_OP_NONE, NULL, NULL, NULL,
+            child_main);
+  return 1;
+}
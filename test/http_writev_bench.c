@@ -0,0 +1,236 @@
+/*
+ * Copyright (c) 2014-2015, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *    * Neither the name Circonus, Inc. nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Response write microbenchmark.
+ *
+ * Sends responses shaped like mtev_http's (a header leader followed by
+ * one or more body bchains) the way _http_perform_write used to, with
+ * one write(2) per chain, and the way it does now, gathering them into a
+ * single writev(2).  A reader thread drains the other end and checks the
+ * byte count.  Runs over an AF_UNIX socketpair and TCP loopback.
+ *
+ *   http_writev_bench [responses]
+ */
+
+#include "mtev_defines.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define MAX_SEGS 17 /* leader + the 16 chains _http_perform_write gathers */
+
+struct shape {
+  const char *name;
+  size_t leader;
+  int nchains;
+  size_t chain;
+};
+
+static const struct shape shapes[] = {
+  { "small",     180,  1,  120 },
+  { "json-4k",   220,  4, 1024 },
+  { "stream",    200, 16,  512 },
+};
+
+struct drain {
+  int fd;
+  size_t total;
+};
+
+static void *
+drain(void *vd) {
+  struct drain *d = vd;
+  char buf[65536];
+  ssize_t len;
+  while((len = read(d->fd, buf, sizeof(buf))) != 0) {
+    if(len < 0) {
+      if(errno == EINTR) continue;
+      break;
+    }
+    d->total += len;
+  }
+  return NULL;
+}
+
+static int
+write_all(int fd, const void *buf, size_t len) {
+  while(len > 0) {
+    ssize_t rv = write(fd, buf, len);
+    if(rv < 0) {
+      if(errno == EINTR) continue;
+      return -1;
+    }
+    buf = (const char *)buf + rv;
+    len -= rv;
+  }
+  return 0;
+}
+static int
+writev_all(int fd, struct iovec *iov, int cnt) {
+  while(cnt > 0) {
+    ssize_t rv = writev(fd, iov, cnt);
+    if(rv < 0) {
+      if(errno == EINTR) continue;
+      return -1;
+    }
+    while(cnt > 0 && (size_t)rv >= iov->iov_len) {
+      rv -= iov->iov_len;
+      iov++;
+      cnt--;
+    }
+    if(cnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + rv;
+      iov->iov_len -= rv;
+    }
+  }
+  return 0;
+}
+
+static int
+tcp_pair(int sv[2]) {
+  struct sockaddr_in sin;
+  socklen_t slen = sizeof(sin);
+  int on = 1, lfd;
+
+  lfd = socket(AF_INET, SOCK_STREAM, 0);
+  if(lfd < 0) return -1;
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if(bind(lfd, (struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+     getsockname(lfd, (struct sockaddr *)&sin, &slen) < 0 ||
+     listen(lfd, 1) < 0) {
+    close(lfd);
+    return -1;
+  }
+  sv[0] = socket(AF_INET, SOCK_STREAM, 0);
+  if(sv[0] < 0 || connect(sv[0], (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+    close(lfd);
+    return -1;
+  }
+  sv[1] = accept(lfd, NULL, NULL);
+  close(lfd);
+  if(sv[1] < 0) return -1;
+  /* mtev_http listeners run with Nagle off */
+  setsockopt(sv[0], IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  return 0;
+}
+
+static double
+elapsed(struct timeval *start) {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return (now.tv_sec - start->tv_sec) + (now.tv_usec - start->tv_usec) / 1e6;
+}
+
+static int
+run(const char *transport, const struct shape *s, int gather, long iters) {
+  char *leader, *chain;
+  struct iovec iov[MAX_SEGS];
+  struct timeval start;
+  struct drain d;
+  pthread_t tid;
+  size_t per = s->leader + s->nchains * s->chain;
+  int sv[2], i, rv = 0;
+  long n;
+  double t;
+
+  if(!strcmp(transport, "tcp") ? tcp_pair(sv) :
+     socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+    perror(transport);
+    return -1;
+  }
+  leader = malloc(s->leader);
+  chain = malloc(s->chain);
+  memset(leader, 'h', s->leader);
+  memset(chain, 'b', s->chain);
+  d.fd = sv[1];
+  d.total = 0;
+  pthread_create(&tid, NULL, drain, &d);
+
+  gettimeofday(&start, NULL);
+  for(n=0; n<iters && rv == 0; n++) {
+    if(gather) {
+      iov[0].iov_base = leader;
+      iov[0].iov_len = s->leader;
+      for(i=0; i<s->nchains; i++) {
+        iov[i+1].iov_base = chain;
+        iov[i+1].iov_len = s->chain;
+      }
+      rv = writev_all(sv[0], iov, s->nchains + 1);
+    }
+    else {
+      rv = write_all(sv[0], leader, s->leader);
+      for(i=0; i<s->nchains && rv == 0; i++)
+        rv = write_all(sv[0], chain, s->chain);
+    }
+  }
+  shutdown(sv[0], SHUT_WR);
+  pthread_join(tid, NULL);
+  t = elapsed(&start);
+  close(sv[0]);
+  close(sv[1]);
+  free(leader);
+  free(chain);
+  if(d.total != per * iters) {
+    fprintf(stderr, "%s %s: read %zu bytes, expected %zu\n",
+            transport, s->name, d.total, per * iters);
+    return -1;
+  }
+  printf("  %-6s %-10s %9.0f resp/s %8.1f MB/s\n", transport,
+         gather ? "writev" : "write", iters / t, per * iters / t / 1e6);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  const char *transports[] = { "unix", "tcp" };
+  long iters = argc > 1 ? atol(argv[1]) : 200000;
+  int s, tr, gather;
+
+  for(s=0; s<(int)(sizeof(shapes)/sizeof(*shapes)); s++) {
+    printf("%-8s %4zu byte leader + %2d x %4zu byte chains\n",
+           shapes[s].name, shapes[s].leader, shapes[s].nchains,
+           shapes[s].chain);
+    for(tr=0; tr<2; tr++)
+      for(gather=0; gather<2; gather++)
+        if(run(transports[tr], &shapes[s], gather, iters)) return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,201 @@
+/*
+ * Copyright (c) 2014-2015, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *    * Neither the name Circonus, Inc. nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Job queues declared in the eventer config.
+ *
+ * Starts through mtev_main (in the foreground) with a config declaring
+ * two shared queues and a dedicated one, then runs a burst of sleeping
+ * jobs on each and checks that no queue ever ran more of them at once
+ * than its concurrency, and the shared ones no more than the pool.
+ *
+ *   jobq_shared_test
+ */
+
+#include "mtev_defines.h"
+#include "mtev_main.h"
+#include "mtev_memory.h"
+#include "mtev_atomic.h"
+#include "eventer/eventer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define APPNAME "jobq_test"
+#define POOL_THREADS 3
+
+static const char *config_fmt =
+  "<?xml version=\"1.0\" encoding=\"utf8\" standalone=\"yes\"?>\n"
+  "<" APPNAME ">\n"
+  "  <logs>\n"
+  "    <console_output>\n"
+  "      <outlet name=\"stderr\"/>\n"
+  "      <log name=\"error\"/>\n"
+  "    </console_output>\n"
+  "  </logs>\n"
+  "  <eventer implementation=\"%s\">\n"
+  "    <config>\n"
+  "      <concurrency>1</concurrency>\n"
+  "      <shared_queue_threads>%d</shared_queue_threads>\n"
+  "    </config>\n"
+  "    <jobq name=\"test_shared_a\" concurrency=\"2\" shared=\"true\"/>\n"
+  "    <jobq name=\"test_shared_b\" concurrency=\"2\" shared=\"true\"/>\n"
+  "    <jobq name=\"test_shared_c\" concurrency=\"1\" shared=\"true\"/>\n"
+  "    <jobq name=\"test_dedicated\" concurrency=\"3\"/>\n"
+  "  </eventer>\n"
+  "</" APPNAME ">\n";
+
+struct test_queue {
+  const char *name;
+  int shared;
+  int concurrency;
+  int njobs;
+  eventer_jobq_t *jobq;
+  mtev_atomic32_t running;
+  mtev_atomic32_t max_running;
+};
+
+static struct test_queue queues[] = {
+  { "test_shared_a", 1, 2, 12 },
+  { "test_shared_b", 1, 2, 12 },
+  { "test_shared_c", 1, 1, 6 },
+  { "test_dedicated", 0, 3, 12 },
+};
+#define NQUEUES (int)(sizeof(queues)/sizeof(*queues))
+
+static char config_file[] = "/tmp/jobq_shared_test.XXXXXX";
+static mtev_atomic32_t pool_running, pool_max_running;
+static int outstanding, failures;
+
+static void
+note_max(mtev_atomic32_t *max, int32_t v) {
+  int32_t cur;
+  while((cur = *max) < v && mtev_atomic_cas32(max, v, cur) != cur);
+}
+
+static void
+check(int ok, const char *what) {
+  printf("%s - %s\n", ok ? "ok" : "not ok", what);
+  if(!ok) failures++;
+}
+
+static void
+finish() {
+  char what[128];
+  int i;
+  for(i=0; i<NQUEUES; i++) {
+    snprintf(what, sizeof(what), "%s ran at most %d jobs at once (saw %d)",
+             queues[i].name, queues[i].concurrency, queues[i].max_running);
+    check(queues[i].max_running >= 1 &&
+          queues[i].max_running <= queues[i].concurrency, what);
+  }
+  snprintf(what, sizeof(what), "shared pool ran at most %d jobs (saw %d)",
+           POOL_THREADS, pool_max_running);
+  check(pool_max_running <= POOL_THREADS, what);
+  exit(failures ? 1 : 0);
+}
+
+static int
+test_job(eventer_t e, int mask, void *closure, struct timeval *now) {
+  struct test_queue *q = closure;
+  if(mask == EVENTER_ASYNCH_WORK) {
+    note_max(&q->max_running, mtev_atomic_inc32(&q->running));
+    if(q->shared)
+      note_max(&pool_max_running, mtev_atomic_inc32(&pool_running));
+    usleep(20000);
+    if(q->shared) mtev_atomic_dec32(&pool_running);
+    mtev_atomic_dec32(&q->running);
+  }
+  if(mask == EVENTER_ASYNCH) {
+    if(--outstanding == 0) finish();
+  }
+  return 0;
+}
+
+static int
+test_timeout(eventer_t e, int mask, void *closure, struct timeval *now) {
+  check(0, "all jobs completed within 30s");
+  exit(1);
+  return 0;
+}
+
+static int
+child_main() {
+  char what[128];
+  int i, j;
+
+  unlink(config_file); /* loaded by now */
+  eventer_init();
+  for(i=0; i<NQUEUES; i++) {
+    struct test_queue *q = &queues[i];
+    q->jobq = eventer_jobq_retrieve(q->name);
+    snprintf(what, sizeof(what), "%s created from config", q->name);
+    check(q->jobq != NULL, what);
+    if(!q->jobq) exit(1);
+    snprintf(what, sizeof(what), "%s is %s with concurrency %d", q->name,
+             q->shared ? "shared" : "dedicated", q->concurrency);
+    check(q->jobq->shared == q->shared &&
+          q->jobq->desired_concurrency == q->concurrency, what);
+  }
+  check(eventer_jobq_create("test_shared_a", 1, 1) == NULL,
+        "duplicate queue names are refused");
+
+  for(i=0; i<NQUEUES; i++) {
+    for(j=0; j<queues[i].njobs; j++) {
+      eventer_t e = eventer_alloc();
+      e->mask = EVENTER_ASYNCH;
+      e->callback = test_job;
+      e->closure = &queues[i];
+      outstanding++;
+      eventer_add_asynch(queues[i].jobq, e);
+    }
+  }
+  eventer_add_in_s_us(test_timeout, NULL, 30, 0);
+  eventer_loop();
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  FILE *fp;
+  int fd;
+
+  if((fd = mkstemp(config_file)) < 0 || (fp = fdopen(fd, "w")) == NULL) {
+    perror("mkstemp");
+    exit(2);
+  }
+  fprintf(fp, config_fmt, DEFAULT_EVENTER, POOL_THREADS);
+  fclose(fp);
+
+  mtev_memory_init();
+  mtev_main(APPNAME, config_file, 0, 1, MTEV_LOCK_OP_NONE, NULL, NULL, NULL,
+            child_main);
+  return 1;
+}